@@ -647,6 +647,72 @@ static bool do_a_restart;
 
 static time_t when = 0;	// when the request occurred
 
+/* Client connections are read by the api thread and each complete request
+ * is handed to the worker pool, so a slow client or a large reply only
+ * holds up its own connection. A connection belongs to one worker at a
+ * time so pipelined commands are replied to in the order received */
+#define APICONNS 64
+
+// Longest request accepted, half the TMPBUFSIZ to allow for escaping
+#define APIREQSIZ (TMPBUFSIZ / 2 - 1)
+
+// Seconds before an idle --api-keepalive connection is closed
+#define APIIDLE 60
+
+struct api_conn {
+	struct list_head list;
+	SOCKETTYPE sock;
+	char *connectaddr;
+	char group;
+	bool http;	// --api-metrics-port connection
+	bool busy;	// queued or with a worker
+	bool eof;	// close once the buffered requests are done
+	time_t last;
+	size_t len;
+	char buf[APIREQSIZ + 1];
+};
+
+static struct api_conn *api_conns;
+static LIST_HEAD(api_queue);
+static pthread_mutex_t api_lock;
+static pthread_cond_t api_cond;
+static pthread_t *api_workers;
+static int api_nworkers;
+#ifndef WIN32
+static int api_wake[2] = { -1, -1 };
+#endif
+static SOCKETTYPE api_metrics_sock = INVSOCK;
+
+// Read only commands run concurrently, iswritemode ones run alone
+static cglock_t api_cmd_lock;
+
+/* With --api-cache, the reply section of a cacheable command is kept for
+ * that many ms and copied to every request for the same command/parameter,
+ * so many pollers cost one device walk per interval. Each snapshot has two
+ * buffers so one request can rebuild the spare while the others still copy
+ * the current one. The generation is bumped by every iswritemode command
+ * so changes show up at once */
+#define APISNAPS 64
+
+struct api_snap {
+	struct list_head list;
+	int cmd;
+	char *param;
+	bool isjson;
+	bool building;
+	int cur;	// buf being served, -1 until first built
+	uint64_t gen;
+	struct timeval built;
+	char *buf[2];
+	size_t siz[2];
+	bool close[2];
+};
+
+static LIST_HEAD(api_snaps);
+static int api_nsnaps;
+static pthread_mutex_t api_snap_lock;
+static uint64_t api_snap_gen;
+
 struct IPACCESS {
 	struct in6_addr ip;
 	struct in6_addr mask;
@@ -2535,6 +2601,7 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 	}
 
 	message(io_data, MSG_POOL, 0, NULL, isjson);
+	update_stats_totals();
 
 	if (isjson)
 		io_open = io_add(io_data, COMSTR JSON_POOLS);
@@ -2636,6 +2703,8 @@ static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __mayb
 	message(io_data, MSG_SUMM, 0, NULL, isjson);
 	io_open = io_add(io_data, isjson ? COMSTR JSON_SUMMARY : _SUMMARY COMSTR);
 
+	update_stats_totals();
+
 	// stop hashmeter() changing some while copying
 	mutex_lock(&hash_lock);
 
@@ -4098,58 +4167,59 @@ struct CMDS {
 	void (*func)(struct io_data *, SOCKETTYPE, char *, bool, char);
 	bool iswritemode;
 	bool joinable;
+	bool cacheable;
 } cmds[] = {
-	{ "version",		apiversion,	false,	true },
-	{ "config",		minerconfig,	false,	true },
-	{ "devs",		devstatus,	false,	true },
-	{ "edevs",		edevstatus,	false,	true },
-	{ "pools",		poolstatus,	false,	true },
-	{ "summary",		summary,	false,	true },
+	{ "version",		apiversion,	false,	true,	false },
+	{ "config",		minerconfig,	false,	true,	false },
+	{ "devs",		devstatus,	false,	true,	true },
+	{ "edevs",		edevstatus,	false,	true,	true },
+	{ "pools",		poolstatus,	false,	true,	true },
+	{ "summary",		summary,	false,	true,	true },
 #ifdef HAVE_AN_FPGA
-	{ "pga",		pgadev,		false,	false },
-	{ "pgaenable",		pgaenable,	true,	false },
-	{ "pgadisable",		pgadisable,	true,	false },
-	{ "pgaidentify",	pgaidentify,	true,	false },
+	{ "pga",		pgadev,		false,	false,	false },
+	{ "pgaenable",		pgaenable,	true,	false,	false },
+	{ "pgadisable",		pgadisable,	true,	false,	false },
+	{ "pgaidentify",	pgaidentify,	true,	false,	false },
 #endif
-	{ "pgacount",		pgacount,	false,	true },
-	{ "switchpool",		switchpool,	true,	false },
-	{ "addpool",		addpool,	true,	false },
-	{ "poolpriority",	poolpriority,	true,	false },
-	{ "poolquota",		poolquota,	true,	false },
-	{ "enablepool",		enablepool,	true,	false },
-	{ "disablepool",	disablepool,	true,	false },
-	{ "removepool",		removepool,	true,	false },
-	{ "save",		dosave,		true,	false },
-	{ "quit",		doquit,		true,	false },
-	{ "privileged",		privileged,	true,	false },
-	{ "notify",		notify,		false,	true },
-	{ "devdetails",		devdetails,	false,	true },
-	{ "restart",		dorestart,	true,	false },
-	{ "stats",		minerstats,	false,	true },
-	{ "dbgstats",		minerdebug,	false,	true },
-	{ "estats",		minerestats,	false,	true },
-	{ "check",		checkcommand,	false,	false },
-	{ "failover-only",	failoveronly,	true,	false },
-	{ "coin",		minecoin,	false,	true },
-	{ "debug",		debugstate,	true,	false },
-	{ "setconfig",		setconfig,	true,	false },
-	{ "usbstats",		usbstats,	false,	true },
+	{ "pgacount",		pgacount,	false,	true,	false },
+	{ "switchpool",		switchpool,	true,	false,	false },
+	{ "addpool",		addpool,	true,	false,	false },
+	{ "poolpriority",	poolpriority,	true,	false,	false },
+	{ "poolquota",		poolquota,	true,	false,	false },
+	{ "enablepool",		enablepool,	true,	false,	false },
+	{ "disablepool",	disablepool,	true,	false,	false },
+	{ "removepool",		removepool,	true,	false,	false },
+	{ "save",		dosave,		true,	false,	false },
+	{ "quit",		doquit,		true,	false,	false },
+	{ "privileged",		privileged,	true,	false,	false },
+	{ "notify",		notify,		false,	true,	true },
+	{ "devdetails",		devdetails,	false,	true,	true },
+	{ "restart",		dorestart,	true,	false,	false },
+	{ "stats",		minerstats,	false,	true,	true },
+	{ "dbgstats",		minerdebug,	false,	true,	false },
+	{ "estats",		minerestats,	false,	true,	true },
+	{ "check",		checkcommand,	false,	false,	false },
+	{ "failover-only",	failoveronly,	true,	false,	false },
+	{ "coin",		minecoin,	false,	true,	false },
+	{ "debug",		debugstate,	true,	false,	false },
+	{ "setconfig",		setconfig,	true,	false,	false },
+	{ "usbstats",		usbstats,	false,	true,	true },
 #ifdef HAVE_AN_FPGA
-	{ "pgaset",		pgaset,		true,	false },
+	{ "pgaset",		pgaset,		true,	false,	false },
 #endif
-	{ "zero",		dozero,		true,	false },
-	{ "hotplug",		dohotplug,	true,	false },
+	{ "zero",		dozero,		true,	false,	false },
+	{ "hotplug",		dohotplug,	true,	false,	false },
 #ifdef HAVE_AN_ASIC
-	{ "asc",		ascdev,		false,	false },
-	{ "ascenable",		ascenable,	true,	false },
-	{ "ascdisable",		ascdisable,	true,	false },
-	{ "ascidentify",	ascidentify,	true,	false },
-	{ "ascset",		ascset,		true,	false },
+	{ "asc",		ascdev,		false,	false,	false },
+	{ "ascenable",		ascenable,	true,	false,	false },
+	{ "ascdisable",		ascdisable,	true,	false,	false },
+	{ "ascidentify",	ascidentify,	true,	false,	false },
+	{ "ascset",		ascset,		true,	false,	false },
 #endif
-	{ "asccount",		asccount,	false,	true },
-	{ "lcd",		lcddata,	false,	true },
-	{ "lockstats",		lockstats,	true,	true },
-	{ NULL,			NULL,		false,	false }
+	{ "asccount",		asccount,	false,	true,	false },
+	{ "lcd",		lcddata,	false,	true,	false },
+	{ "lockstats",		lockstats,	true,	true,	false },
+	{ NULL,			NULL,		false,	false,	false }
 };
 
 static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, char group)
@@ -4233,24 +4303,11 @@ static void tail_join(struct io_data *io_data, bool isjson)
 	}
 }
 
-static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
+static void api_send(SOCKETTYPE c, char *buf, int tosend)
 {
-	int count, sendc, res, tosend, len, n;
-	char *buf = io_data->ptr;
-
-	//strcpy(buf, io_data->ptr);
-
-	if (io_data->close)
-		strcat(buf, JSON_CLOSE);
-
-	if (isjson)
-		strcat(buf, JSON_END);
-
-	len = strlen(buf);
-	tosend = len+1;
-
-	applog(LOG_DEBUG, "API: send reply: (%d) '%.10s%s'", tosend, buf, len > 10 ? "..." : BLANK);
+	int count, sendc, res, len, n;
 
+	len = tosend;
 	count = sendc = 0;
 	while (count < 5 && tosend > 0) {
 		// allow 50ms per attempt
@@ -4272,7 +4329,7 @@ static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
 			if (sock_blocks())
 				continue;
 
-			applog(LOG_WARNING, "API: send (%d:%d) failed: %s", len+1, (len+1 - tosend), SOCKERRMSG);
+			applog(LOG_WARNING, "API: send (%d:%d) failed: %s", len, (len - tosend), SOCKERRMSG);
 
 			return;
 		} else {
@@ -4297,6 +4354,102 @@ static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
 	}
 }
 
+static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
+{
+	char *buf = io_data->ptr;
+	int len;
+
+	//strcpy(buf, io_data->ptr);
+
+	if (io_data->close)
+		strcat(buf, JSON_CLOSE);
+
+	if (isjson)
+		strcat(buf, JSON_END);
+
+	len = strlen(buf);
+
+	applog(LOG_DEBUG, "API: send reply: (%d) '%.10s%s'", len+1, buf, len > 10 ? "..." : BLANK);
+
+	api_send(c, buf, len+1);
+}
+
+static void api_snap_free()
+{
+	struct api_snap *snap, *tmp;
+
+	list_for_each_entry_safe(snap, tmp, &api_snaps, list) {
+		list_del(&snap->list);
+		free(snap->param);
+		free(snap->buf[0]);
+		free(snap->buf[1]);
+		free(snap);
+	}
+	api_nsnaps = 0;
+}
+
+static void api_conn_close(struct api_conn *conn)
+{
+	CLOSESOCKET(conn->sock);
+	conn->sock = INVSOCK;
+	free(conn->connectaddr);
+	conn->connectaddr = NULL;
+	conn->http = conn->busy = conn->eof = false;
+	conn->len = 0;
+}
+
+static void api_wakeup()
+{
+#ifndef WIN32
+	char ch = 0;
+
+	if (write(api_wake[1], &ch, 1) < 0)
+		applog(LOG_DEBUG, "API: wakeup write failed (%s)", strerror(errno));
+#endif
+}
+
+/* Let the workers finish what they are sending then drop all the
+ * connections. The api thread never holds api_lock with cancel enabled
+ * so this is safe to call from tidyup() */
+static void api_stop()
+{
+	int i;
+
+	if (!api_conns)
+		return;
+
+	mutex_lock(&api_lock);
+	bye = true;
+	pthread_cond_broadcast(&api_cond);
+	mutex_unlock(&api_lock);
+
+	for (i = 0; i < api_nworkers; i++)
+		pthread_join(api_workers[i], NULL);
+	api_nworkers = 0;
+	free(api_workers);
+	api_workers = NULL;
+
+	for (i = 0; i < APICONNS; i++) {
+		if (api_conns[i].sock != INVSOCK)
+			api_conn_close(&(api_conns[i]));
+	}
+	free(api_conns);
+	api_conns = NULL;
+	INIT_LIST_HEAD(&api_queue);
+	api_snap_free();
+
+	if (api_metrics_sock != INVSOCK) {
+		CLOSESOCKET(api_metrics_sock);
+		api_metrics_sock = INVSOCK;
+	}
+
+#ifndef WIN32
+	close(api_wake[0]);
+	close(api_wake[1]);
+	api_wake[0] = api_wake[1] = -1;
+#endif
+}
+
 static void tidyup(__maybe_unused void *arg)
 {
 	mutex_lock(&quit_restart_lock);
@@ -4305,6 +4458,8 @@ static void tidyup(__maybe_unused void *arg)
 
 	bye = true;
 
+	api_stop();
+
 	if (*apisock != INVSOCK) {
 		shutdown(*apisock, SHUT_RDWR);
 		CLOSESOCKET(*apisock);
@@ -4907,90 +5062,347 @@ void reCalculateAVG()
 }
 #endif
 
-void api(int api_thr_id)
+static void api_cmd(struct io_data *io_data, int cmd, SOCKETTYPE c, char *param, bool isjson, char group)
+{
+	if (cmds[cmd].iswritemode) {
+		cg_wlock(&api_cmd_lock);
+		(cmds[cmd].func)(io_data, c, param, isjson, group);
+		cg_wunlock(&api_cmd_lock);
+
+		mutex_lock(&api_snap_lock);
+		api_snap_gen++;
+		mutex_unlock(&api_snap_lock);
+	} else {
+		cg_rlock(&api_cmd_lock);
+		(cmds[cmd].func)(io_data, c, param, isjson, group);
+		cg_runlock(&api_cmd_lock);
+	}
+}
+
+/* Must hold api_snap_lock. api_snaps is kept in least recently used order,
+ * when it's full the oldest one not being rebuilt is replaced. NULL if it's not
+ * cached and they're all being rebuilt */
+static struct api_snap *api_snap_find(int cmd, char *param, bool isjson)
+{
+	struct api_snap *snap;
+
+	if (!param)
+		param = (char *)BLANK;
+
+	list_for_each_entry(snap, &api_snaps, list) {
+		if (snap->cmd == cmd && snap->isjson == isjson && strcmp(snap->param, param) == 0) {
+			list_move_tail(&snap->list, &api_snaps);
+			return snap;
+		}
+	}
+
+	if (api_nsnaps >= APISNAPS) {
+		list_for_each_entry(snap, &api_snaps, list) {
+			if (!snap->building)
+				break;
+		}
+		if (&snap->list == &api_snaps)
+			return NULL;
+		free(snap->param);
+		free(snap->buf[0]);
+		free(snap->buf[1]);
+		snap->buf[0] = snap->buf[1] = NULL;
+		snap->siz[0] = snap->siz[1] = 0;
+		list_move_tail(&snap->list, &api_snaps);
+	} else {
+		snap = cgcalloc(1, sizeof(*snap));
+		list_add_tail(&snap->list, &api_snaps);
+		api_nsnaps++;
+	}
+	snap->cmd = cmd;
+	snap->param = strdup(param);
+	snap->isjson = isjson;
+	snap->cur = -1;
+
+	return snap;
+}
+
+static void api_cached(struct io_data *io_data, int cmd, SOCKETTYPE c, char *param, bool isjson, char group)
+{
+	struct api_snap *snap;
+	struct timeval now;
+	uint64_t gen;
+	size_t start, len;
+	char *ptr;
+	int spare;
+
+	cgtime(&now);
+
+	mutex_lock(&api_snap_lock);
+	gen = api_snap_gen;
+	snap = api_snap_find(cmd, param, isjson);
+	if (snap && !snap->building && (snap->cur < 0 || snap->gen != gen ||
+	    ms_tdiff(&now, &(snap->built)) >= opt_api_cache))
+		snap->building = true;
+	else if (snap && snap->cur >= 0) {
+		// Fresh, or someone else is rebuilding it
+		io_add(io_data, snap->buf[snap->cur]);
+		if (snap->close[snap->cur])
+			io_close(io_data);
+		mutex_unlock(&api_snap_lock);
+		return;
+	} else
+		snap = NULL;
+	mutex_unlock(&api_snap_lock);
+
+	start = io_data->cur - io_data->ptr;
+	api_cmd(io_data, cmd, c, param, isjson, group);
+	if (!snap)
+		return;
+
+	// The spare buffer is only touched by the one building
+	spare = snap->cur < 0 ? 0 : 1 - snap->cur;
+	ptr = io_data->ptr + start;
+	len = io_data->cur - ptr;
+	if (snap->siz[spare] < len + 1) {
+		snap->siz[spare] = len + 1;
+		snap->buf[spare] = cgrealloc(snap->buf[spare], snap->siz[spare]);
+	}
+	memcpy(snap->buf[spare], ptr, len + 1);
+	snap->close[spare] = io_data->close;
+
+	mutex_lock(&api_snap_lock);
+	snap->cur = spare;
+	snap->gen = gen;
+	copy_time(&(snap->built), &now);
+	snap->building = false;
+	mutex_unlock(&api_snap_lock);
+}
+
+/* Process one request read from the connection c and send the reply(s) */
+static void api_request(struct io_data *io_data, SOCKETTYPE c, char *buf, int n, char *connectaddr, char group)
 {
-	struct io_data *io_data;
-	struct thr_info bye_thr;
-	char buf[TMPBUFSIZ];
 	char param_buf[TMPBUFSIZ];
-	SOCKETTYPE c;
-	int n, bound;
-	char *connectaddr;
-	char *binderror;
-	time_t bindstart;
-	short int port = opt_api_port;
-	char port_s[10];
-	struct sockaddr_storage cli;
-	socklen_t clisiz;
 	char cmdbuf[100];
 	char *cmd = NULL;
 	char *param;
-	bool addrok;
-	char group;
 	json_error_t json_err;
 	json_t *json_config;
 	json_t *json_val;
 	bool isjson;
 	bool did, isjoin, firstjoin;
 	int i;
-	struct addrinfo hints, *res, *host;
-	SOCKETTYPE *apisock;
 
-	apisock = cgmalloc(sizeof(*apisock));
-	*apisock = INVSOCK;
 	json_config = NULL;
 	isjoin = false;
 
-	if (!opt_api_listen) {
-		applog(LOG_DEBUG, "API not running%s", UNAVAILABLE);
-		free(apisock);
-		return;
-	}
+	if (opt_debug)
+		applog(LOG_DEBUG, "API: recv command: (%d) '%s'", n, buf);
 
-	io_data = sock_io_new();
+	// the time of the request in now
+	when = time(NULL);
+	io_reinit(io_data);
 
-	mutex_init(&quit_restart_lock);
+	did = false;
 
-	pthread_cleanup_push(tidyup, (void *)apisock);
-	my_thr_id = api_thr_id;
+	if (*buf != ISJSON) {
+		isjson = false;
 
-	setup_groups();
+		param = strchr(buf, SEPARATOR);
+		if (param != NULL)
+			*(param++) = '\0';
 
-	if (opt_api_allow) {
-		setup_ipaccess();
+		cmd = buf;
+	}
+	else {
+		isjson = true;
 
-		if (ips == 0) {
-			applog(LOG_WARNING, "API not running (no valid IPs specified)%s", UNAVAILABLE);
-			free(apisock);
-			return;
+		param = NULL;
+
+		json_config = json_loadb(buf, n, 0, &json_err);
+
+		if (!json_is_object(json_config)) {
+			message(io_data, MSG_INVJSON, 0, NULL, isjson);
+			send_result(io_data, c, isjson);
+			did = true;
+		} else {
+			json_val = json_object_get(json_config, JSON_COMMAND);
+			if (json_val == NULL) {
+				message(io_data, MSG_MISCMD, 0, NULL, isjson);
+				send_result(io_data, c, isjson);
+				did = true;
+			} else {
+				if (!json_is_string(json_val)) {
+					message(io_data, MSG_INVCMD, 0, NULL, isjson);
+					send_result(io_data, c, isjson);
+					did = true;
+				} else {
+					cmd = (char *)json_string_value(json_val);
+					json_val = json_object_get(json_config, JSON_PARAMETER);
+					if (json_is_string(json_val))
+						param = (char *)json_string_value(json_val);
+					else if (json_is_integer(json_val)) {
+						snprintf(param_buf, sizeof(param_buf),
+							"%d", (int)json_integer_value(json_val));
+						param = param_buf;
+					} else if (json_is_real(json_val)) {
+						snprintf(param_buf, sizeof(param_buf),
+							"%f", (double)json_real_value(json_val));
+						param = param_buf;
+					}
+				}
+			}
 		}
 	}
 
-	/* This should be done before curl in needed
-	 * to ensure curl has already called WSAStartup() in windows */
-	cgsleep_ms(opt_log_interval*1000);
+	if (!did) {
+		char *cmdptr, *cmdsbuf = NULL;
+
+		if (strchr(cmd, CMDJOIN)) {
+			firstjoin = isjoin = true;
+			// cmd + leading+tailing '|' + '\0'
+			cmdsbuf = cgmalloc(strlen(cmd) + 3);
+			strcpy(cmdsbuf, "|");
+			param = NULL;
+		} else
+			firstjoin = isjoin = false;
+
+		cmdptr = cmd;
+		do {
+			did = false;
+			if (isjoin) {
+				cmd = strchr(cmdptr, CMDJOIN);
+				if (cmd)
+					*(cmd++) = '\0';
+				if (!*cmdptr)
+					goto inochi;
+			}
+
+			for (i = 0; cmds[i].name != NULL; i++) {
+				if (strcmp(cmdptr, cmds[i].name) == 0) {
+					snprintf(cmdbuf, sizeof(cmdbuf), "|%s|", cmdptr);
+					if (isjoin) {
+						if (strstr(cmdsbuf, cmdbuf)) {
+							did = true;
+							break;
+						}
+						strcat(cmdsbuf, cmdptr);
+						strcat(cmdsbuf, "|");
+						head_join(io_data, cmdptr, isjson, &firstjoin);
+						if (!cmds[i].joinable) {
+							message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
+							did = true;
+							tail_join(io_data, isjson);
+							break;
+						}
+					}
+					if (ISPRIVGROUP(group) || strstr(COMMANDS(group), cmdbuf)) {
+						if (cmds[i].cacheable && opt_api_cache)
+							api_cached(io_data, i, c, param, isjson, group);
+						else
+							api_cmd(io_data, i, c, param, isjson, group);
+					} else {
+						message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
+						applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", connectaddr, cmds[i].name);
+					}
+
+					did = true;
+					if (!isjoin)
+						send_result(io_data, c, isjson);
+					else
+						tail_join(io_data, isjson);
+					break;
+				}
+			}
+
+			if (!did) {
+				if (isjoin)
+					head_join(io_data, cmdptr, isjson, &firstjoin);
+				message(io_data, MSG_INVCMD, 0, NULL, isjson);
+				if (isjoin)
+					tail_join(io_data, isjson);
+				else
+					send_result(io_data, c, isjson);
+			}
+inochi:
+			if (isjoin)
+				cmdptr = cmd;
+		} while (isjoin && cmdptr);
+
+		free(cmdsbuf);
+	}
+
+	if (isjoin)
+		send_result(io_data, c, isjson);
+
+	if (isjson && json_is_object(json_config))
+		json_decref(json_config);
+}
+
+/* A minimal HTTP/1.0 server for GET /metrics, one request per connection.
+ * It's read only, so any address allowed API access may use it */
+static void api_http(struct api_conn *conn)
+{
+	char head[256];
+	char *body, *path;
+	size_t len;
+	bool found;
+
+	path = NULL;
+	if (strncmp(conn->buf, "GET ", 4) == 0)
+		path = conn->buf + 4;
+
+	found = (path && strncmp(path, "/metrics", 8) == 0 &&
+		 (path[8] == ' ' || path[8] == '?' || path[8] == '\r' || path[8] == '\n'));
+
+	applog(LOG_DEBUG, "API: metrics request from %s '%.20s' %s",
+			  conn->connectaddr, conn->buf, found ? "OK" : "Not Found");
+
+	if (found) {
+		body = metrics_text(&len);
+		snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+			 "Content-Type: text/plain; version=0.0.4\r\n"
+			 "Content-Length: %d\r\nConnection: close\r\n\r\n", (int)len);
+	} else {
+		body = strdup("Not Found\n");
+		len = strlen(body);
+		snprintf(head, sizeof(head), "HTTP/1.0 %s\r\n"
+			 "Content-Type: text/plain\r\n"
+			 "Content-Length: %d\r\nConnection: close\r\n\r\n",
+			 path ? "404 Not Found" : "405 Method Not Allowed", (int)len);
+	}
+
+	api_send(conn->sock, head, strlen(head));
+	api_send(conn->sock, body, (int)len);
+	free(body);
+}
+
+/* Open a listening socket on opt_api_host:port, name prefixes the messages.
+ * With retry it keeps trying to bind for more than a minute in case the old
+ * one hasn't completely gone yet. Returns INVSOCK on failure */
+static SOCKETTYPE api_bind(const char *name, int port, bool retry, const char *unavail)
+{
+	struct addrinfo hints, *res, *host;
+	char port_s[10];
+	SOCKETTYPE sock = INVSOCK;
+	char *binderror;
+	time_t bindstart;
+	int bound;
 
 	snprintf(port_s, sizeof(port_s), "%d", port);
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_flags = AI_PASSIVE;
 	hints.ai_family = AF_UNSPEC;
 	if (getaddrinfo(opt_api_host, port_s, &hints, &res) != 0) {
-		applog(LOG_ERR, "API failed to resolve %s", opt_api_host);
-		free(apisock);
-		return;
+		applog(LOG_ERR, "%s failed to resolve %s", name, opt_api_host);
+		return INVSOCK;
 	}
 	host = res;
 	while (host) {
-		*apisock = socket(res->ai_family, SOCK_STREAM, 0);
-		if (*apisock > 0)
+		sock = socket(host->ai_family, SOCK_STREAM, 0);
+		if (sock != INVSOCK)
 			break;
 		host = host->ai_next;
 	}
-	if (*apisock == INVSOCK) {
-		applog(LOG_ERR, "API initialisation failed (%s)%s", SOCKERRMSG, UNAVAILABLE);
+	if (sock == INVSOCK) {
+		applog(LOG_ERR, "%s initialisation failed (%s)%s", name, SOCKERRMSG, unavail);
 		freeaddrinfo(res);
-		free(apisock);
-		return;
+		return INVSOCK;
 	}
 
 #ifndef WIN32
@@ -4999,24 +5411,23 @@ void api(int api_thr_id)
 	// another program has it open - which is what we want
 	int optval = 1;
 	// If it doesn't work, we don't really care - just show a debug message
-	if (SOCKETFAIL(setsockopt(*apisock, SOL_SOCKET, SO_REUSEADDR, (void *)(&optval), sizeof(optval))))
-		applog(LOG_DEBUG, "API setsockopt SO_REUSEADDR failed (ignored): %s", SOCKERRMSG);
+	if (SOCKETFAIL(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *)(&optval), sizeof(optval))))
+		applog(LOG_DEBUG, "%s setsockopt SO_REUSEADDR failed (ignored): %s", name, SOCKERRMSG);
 #else
 	// On windows a 2nd program can bind to a port>1024 already in use unless
 	// SO_EXCLUSIVEADDRUSE is used - however then the bind to a closed port
 	// in TIME_WAIT will fail until the timeout - so we leave the options alone
 #endif
 
-	// try for more than 1 minute ... in case the old one hasn't completely gone yet
 	bound = 0;
 	bindstart = time(NULL);
 	while (bound == 0) {
-		if (SOCKETFAIL(bind(*apisock, host->ai_addr, host->ai_addrlen))) {
+		if (SOCKETFAIL(bind(sock, host->ai_addr, host->ai_addrlen))) {
 			binderror = SOCKERRMSG;
-			if ((time(NULL) - bindstart) > 61)
+			if (!retry || (time(NULL) - bindstart) > 61)
 				break;
 			else {
-				applog(LOG_WARNING, "API bind to port %d failed - trying again in 30sec", port);
+				applog(LOG_WARNING, "%s bind to port %d failed - trying again in 30sec", name, port);
 				cgsleep_ms(30000);
 			}
 		} else
@@ -5025,196 +5436,417 @@ void api(int api_thr_id)
 	freeaddrinfo(res);
 
 	if (bound == 0) {
-		applog(LOG_ERR, "API bind to port %d failed (%s)%s", port, binderror, UNAVAILABLE);
-		free(apisock);
+		applog(LOG_ERR, "%s bind to port %d failed (%s)%s", name, port, binderror, unavail);
+		CLOSESOCKET(sock);
+		return INVSOCK;
+	}
+
+	if (SOCKETFAIL(listen(sock, QUEUE))) {
+		applog(LOG_ERR, "%s listen on port %d failed (%s)%s", name, port, SOCKERRMSG, unavail);
+		CLOSESOCKET(sock);
+		return INVSOCK;
+	}
+
+#ifndef WIN32
+	// api_poll() uses select()
+	if (sock >= FD_SETSIZE) {
+		applog(LOG_ERR, "%s socket %d is too high to use%s", name, (int)sock, unavail);
+		CLOSESOCKET(sock);
+		return INVSOCK;
+	}
+#endif
+
+	return sock;
+}
+
+// The metrics port is optional so failing to open it isn't fatal
+static void api_metrics_listen()
+{
+	SOCKETTYPE sock;
+
+	sock = api_bind("API metrics", opt_api_metrics_port, false, "");
+	if (sock == INVSOCK)
+		return;
+
+	api_metrics_sock = sock;
+	applog(LOG_WARNING, "API metrics on port %d (%d)", opt_api_metrics_port, (int)sock);
+}
+
+/* Without --api-keepalive the first recv is the whole request and the
+ * connection is closed after the reply, as it always was. With it, each
+ * newline terminated line is a request and replies are separated by the
+ * '\0' that already ends every reply */
+static void api_conn_service(struct io_data *io_data, struct api_conn *conn)
+{
+	char buf[TMPBUFSIZ];
+	char *eol;
+	size_t len, used;
+
+	if (conn->http) {
+		api_http(conn);
 		return;
 	}
 
-	if (SOCKETFAIL(listen(*apisock, QUEUE))) {
-		applog(LOG_ERR, "API3 initialisation failed (%s)%s", SOCKERRMSG, UNAVAILABLE);
-		CLOSESOCKET(*apisock);
-		free(apisock);
+	if (!opt_api_keepalive) {
+		memcpy(buf, conn->buf, conn->len + 1);
+		api_request(io_data, conn->sock, buf, (int)(conn->len), conn->connectaddr, conn->group);
 		return;
 	}
 
-	if (opt_api_allow)
-		applog(LOG_WARNING, "API running in IP access mode on port %d (%d)", port, (int)*apisock);
-	else {
-		if (opt_api_network)
-			applog(LOG_WARNING, "API running in UNRESTRICTED read access mode on port %d (%d)", port, (int)*apisock);
+	while (!bye && conn->len > 0) {
+		eol = memchr(conn->buf, '\n', conn->len);
+		if (eol)
+			used = (eol - conn->buf) + 1;
+		else if (conn->eof || conn->len >= APIREQSIZ)
+			used = conn->len;
 		else
-			applog(LOG_WARNING, "API running in local read access mode on port %d (%d)", port, (int)*apisock);
+			break;
+
+		len = eol ? used - 1 : used;
+		if (len > 0 && conn->buf[len - 1] == '\r')
+			len--;
+		memcpy(buf, conn->buf, len);
+		buf[len] = '\0';
+
+		conn->len -= used;
+		memmove(conn->buf, conn->buf + used, conn->len + 1);
+
+		if (len > 0)
+			api_request(io_data, conn->sock, buf, (int)len, conn->connectaddr, conn->group);
 	}
+}
 
-	if (opt_api_mcast)
-		mcast_init();
+static void *api_worker(void *userdata)
+{
+	struct io_data *io_data = (struct io_data *)userdata;
+	struct api_conn *conn;
 
-	strbufs = k_new_list("StrBufs", sizeof(SBITEM), ALLOC_SBITEMS, LIMIT_SBITEMS, false);
+	RenameThread("APIWorker");
 
-	while (!bye) {
-		clisiz = sizeof(cli);
-		if (SOCKETFAIL(c = accept(*apisock, (struct sockaddr *)(&cli), &clisiz))) {
-			applog(LOG_ERR, "API failed (%s)%s (%d)", SOCKERRMSG, UNAVAILABLE, (int)*apisock);
-			goto die;
-		}
+	mutex_lock(&api_lock);
+	while (42) {
+		while (!bye && list_empty(&api_queue))
+			pthread_cond_wait(&api_cond, &api_lock);
+		if (list_empty(&api_queue))
+			break;
 
-		addrok = check_connect((struct sockaddr_storage *)&cli, &connectaddr, &group);
-		applog(LOG_DEBUG, "API: connection from %s - %s",
-					connectaddr, addrok ? "Accepted" : "Ignored");
+		conn = list_entry(api_queue.next, struct api_conn, list);
+		list_del(&conn->list);
+		mutex_unlock(&api_lock);
 
-		if (addrok) {
-			/* Accept only half the TMPBUFSIZ to account for space
-			 * potentially used by escaping chars. */
-			n = recv(c, &buf[0], TMPBUFSIZ / 2 - 1, 0);
-			if (SOCKETFAIL(n))
-				buf[0] = '\0';
-			else
-				buf[n] = '\0';
+		if (!bye)
+			api_conn_service(io_data, conn);
 
-			if (opt_debug) {
-				if (SOCKETFAIL(n))
-					applog(LOG_DEBUG, "API: recv failed: %s", SOCKERRMSG);
-				else
-					applog(LOG_DEBUG, "API: recv command: (%d) '%s'", n, buf);
-			}
+		mutex_lock(&api_lock);
+		conn->busy = false;
+		conn->last = time(NULL);
+		if (!opt_api_keepalive || conn->http || bye)
+			conn->eof = true;
+		api_wakeup();
+	}
+	mutex_unlock(&api_lock);
 
-			if (!SOCKETFAIL(n)) {
-				// the time of the request in now
-				when = time(NULL);
-				io_reinit(io_data);
+	return NULL;
+}
 
-				did = false;
+static void api_start()
+{
+	struct io_data *io_data;
+	int i;
 
-				if (*buf != ISJSON) {
-					isjson = false;
+	mutex_init(&api_lock);
+	if (unlikely(pthread_cond_init(&api_cond, NULL)))
+		quit(1, "API failed to pthread_cond_init api_cond");
+	cglock_init(&api_cmd_lock);
+	mutex_init(&api_snap_lock);
+#ifndef WIN32
+	if (pipe(api_wake) == -1)
+		quit(1, "API failed to create wakeup pipe");
+#endif
 
-					param = strchr(buf, SEPARATOR);
-					if (param != NULL)
-						*(param++) = '\0';
+	api_conns = cgcalloc(APICONNS, sizeof(*api_conns));
+	for (i = 0; i < APICONNS; i++)
+		api_conns[i].sock = INVSOCK;
 
-					cmd = buf;
-				}
-				else {
-					isjson = true;
+	api_workers = cgcalloc(opt_api_threads, sizeof(*api_workers));
+	for (i = 0; i < opt_api_threads; i++) {
+		io_data = sock_io_new();
+		if (unlikely(pthread_create(&(api_workers[i]), NULL, api_worker, (void *)io_data)))
+			quit(1, "API failed to create worker thread");
+		api_nworkers++;
+	}
+}
 
-					param = NULL;
+/* The api thread can be cancelled at any time so it must never be
+ * cancelled holding api_lock, tidyup() needs it */
+static void api_thread_lock(int *state)
+{
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, state);
+	mutex_lock(&api_lock);
+}
 
-					json_config = json_loadb(buf, n, 0, &json_err);
+static void api_thread_unlock(int state)
+{
+	mutex_unlock(&api_lock);
+	pthread_setcancelstate(state, NULL);
+}
 
-					if (!json_is_object(json_config)) {
-						message(io_data, MSG_INVJSON, 0, NULL, isjson);
-						send_result(io_data, c, isjson);
-						did = true;
-					} else {
-						json_val = json_object_get(json_config, JSON_COMMAND);
-						if (json_val == NULL) {
-							message(io_data, MSG_MISCMD, 0, NULL, isjson);
-							send_result(io_data, c, isjson);
-							did = true;
-						} else {
-							if (!json_is_string(json_val)) {
-								message(io_data, MSG_INVCMD, 0, NULL, isjson);
-								send_result(io_data, c, isjson);
-								did = true;
-							} else {
-								cmd = (char *)json_string_value(json_val);
-								json_val = json_object_get(json_config, JSON_PARAMETER);
-								if (json_is_string(json_val))
-									param = (char *)json_string_value(json_val);
-								else if (json_is_integer(json_val)) {
-									snprintf(param_buf, sizeof(param_buf),
-										"%d", (int)json_integer_value(json_val));
-									param = param_buf;
-								} else if (json_is_real(json_val)) {
-									snprintf(param_buf, sizeof(param_buf),
-										"%f", (double)json_real_value(json_val));
-									param = param_buf;
-								}
-							}
-						}
-					}
-				}
+static void api_queue_conn(struct api_conn *conn)
+{
+	int state;
 
-				if (!did) {
-					char *cmdptr, *cmdsbuf = NULL;
-
-					if (strchr(cmd, CMDJOIN)) {
-						firstjoin = isjoin = true;
-						// cmd + leading+tailing '|' + '\0'
-						cmdsbuf = cgmalloc(strlen(cmd) + 3);
-						strcpy(cmdsbuf, "|");
-						param = NULL;
-					} else
-						firstjoin = isjoin = false;
-
-					cmdptr = cmd;
-					do {
-						did = false;
-						if (isjoin) {
-							cmd = strchr(cmdptr, CMDJOIN);
-							if (cmd)
-								*(cmd++) = '\0';
-							if (!*cmdptr)
-								goto inochi;
-						}
+	api_thread_lock(&state);
+	conn->busy = true;
+	list_add_tail(&conn->list, &api_queue);
+	pthread_cond_signal(&api_cond);
+	api_thread_unlock(state);
+}
 
-						for (i = 0; cmds[i].name != NULL; i++) {
-							if (strcmp(cmdptr, cmds[i].name) == 0) {
-								snprintf(cmdbuf, sizeof(cmdbuf), "|%s|", cmdptr);
-								if (isjoin) {
-									if (strstr(cmdsbuf, cmdbuf)) {
-										did = true;
-										break;
-									}
-									strcat(cmdsbuf, cmdptr);
-									strcat(cmdsbuf, "|");
-									head_join(io_data, cmdptr, isjson, &firstjoin);
-									if (!cmds[i].joinable) {
-										message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
-										did = true;
-										tail_join(io_data, isjson);
-										break;
-									}
-								}
-								if (ISPRIVGROUP(group) || strstr(COMMANDS(group), cmdbuf))
-									(cmds[i].func)(io_data, c, param, isjson, group);
-								else {
-									message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
-									applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", connectaddr, cmds[i].name);
-								}
-
-								did = true;
-								if (!isjoin)
-									send_result(io_data, c, isjson);
-								else
-									tail_join(io_data, isjson);
-								break;
-							}
-						}
+static void api_conn_read(struct api_conn *conn, time_t now)
+{
+	int n;
 
-						if (!did) {
-							if (isjoin)
-								head_join(io_data, cmdptr, isjson, &firstjoin);
-							message(io_data, MSG_INVCMD, 0, NULL, isjson);
-							if (isjoin)
-								tail_join(io_data, isjson);
-							else
-								send_result(io_data, c, isjson);
-						}
-inochi:
-						if (isjoin)
-							cmdptr = cmd;
-					} while (isjoin && cmdptr);
-				}
+	n = recv(conn->sock, conn->buf + conn->len, APIREQSIZ - conn->len, 0);
+	if (SOCKETFAIL(n)) {
+		applog(LOG_DEBUG, "API: recv failed: %s", SOCKERRMSG);
+		api_conn_close(conn);
+		return;
+	}
 
-				if (isjoin)
-					send_result(io_data, c, isjson);
+	conn->buf[conn->len += n] = '\0';
+	conn->last = now;
+
+	if (conn->http) {
+		// Only the request line matters, so wait for the end of the headers
+		if (n == 0 || conn->len >= APIREQSIZ || strstr(conn->buf, "\r\n\r\n") ||
+		    strstr(conn->buf, "\n\n"))
+			api_queue_conn(conn);
+		return;
+	}
+
+	if (!opt_api_keepalive) {
+		api_queue_conn(conn);
+		return;
+	}
+
+	if (n == 0) {
+		// Client is done sending, answer whatever is left then close
+		if (conn->len == 0) {
+			api_conn_close(conn);
+			return;
+		}
+		conn->eof = true;
+	}
+
+	if (conn->eof || conn->len >= APIREQSIZ || memchr(conn->buf, '\n', conn->len))
+		api_queue_conn(conn);
+}
+
+static void api_accept(SOCKETTYPE apisock, SOCKETTYPE c, struct sockaddr_storage *cli, time_t now, bool http)
+{
+	struct api_conn *conn = NULL;
+	char *connectaddr;
+	bool addrok;
+	char group;
+	int i;
+
+	addrok = check_connect(cli, &connectaddr, &group);
+	applog(LOG_DEBUG, "API: connection from %s - %s",
+				connectaddr, addrok ? "Accepted" : "Ignored");
 
-				if (isjson && json_is_object(json_config))
-					json_decref(json_config);
+	if (addrok) {
+		// Free slots are only ever touched by the api thread
+		for (i = 0; i < APICONNS; i++) {
+			if (api_conns[i].sock == INVSOCK) {
+				conn = &(api_conns[i]);
+				break;
 			}
 		}
+#ifndef WIN32
+		if (c >= FD_SETSIZE)
+			conn = NULL;
+#endif
+		if (!conn)
+			applog(LOG_WARNING, "API: too many connections, closed %s (%d)",
+						connectaddr, (int)apisock);
+	}
+
+	if (!conn) {
 		CLOSESOCKET(c);
+		free(connectaddr);
+		return;
+	}
+
+	conn->sock = c;
+	conn->connectaddr = connectaddr;
+	conn->group = group;
+	conn->http = http;
+	conn->busy = conn->eof = false;
+	conn->last = now;
+	conn->len = 0;
+	conn->buf[0] = '\0';
+}
+
+/* One pass of the event loop: wait for new connections or requests,
+ * returns false if the API can't continue */
+static bool api_poll(SOCKETTYPE apisock)
+{
+	struct sockaddr_storage cli;
+	socklen_t clisiz;
+	struct timeval timeout;
+	struct api_conn *conn;
+	SOCKETTYPE c, maxfd;
+	fd_set rd;
+	time_t now;
+	int i, n, state;
+
+	FD_ZERO(&rd);
+	FD_SET(apisock, &rd);
+	maxfd = apisock;
+	if (api_metrics_sock != INVSOCK) {
+		FD_SET(api_metrics_sock, &rd);
+		if (api_metrics_sock > maxfd)
+			maxfd = api_metrics_sock;
+	}
+#ifndef WIN32
+	FD_SET(api_wake[0], &rd);
+	if (api_wake[0] > maxfd)
+		maxfd = api_wake[0];
+	timeout.tv_sec = 1;
+	timeout.tv_usec = 0;
+#else
+	// No wakeup pipe, so recheck the finished connections often
+	timeout.tv_sec = 0;
+	timeout.tv_usec = 50000;
+#endif
+
+	now = time(NULL);
+	api_thread_lock(&state);
+	for (i = 0; i < APICONNS; i++) {
+		conn = &(api_conns[i]);
+		if (conn->sock == INVSOCK || conn->busy)
+			continue;
+		if (conn->eof || (now - conn->last) > APIIDLE) {
+			api_conn_close(conn);
+			continue;
+		}
+		FD_SET(conn->sock, &rd);
+		if (conn->sock > maxfd)
+			maxfd = conn->sock;
+	}
+	api_thread_unlock(state);
+
+	n = select(maxfd + 1, &rd, NULL, NULL, &timeout);
+	if (SOCKETFAIL(n)) {
+		if (interrupted())
+			return true;
+		applog(LOG_ERR, "API select failed (%s)%s (%d)", SOCKERRMSG, UNAVAILABLE, (int)apisock);
+		return false;
+	}
+	if (n == 0 || bye)
+		return true;
+
+	now = time(NULL);
+#ifndef WIN32
+	if (FD_ISSET(api_wake[0], &rd)) {
+		char drain[64];
+
+		if (read(api_wake[0], drain, sizeof(drain)) < 0)
+			applog(LOG_DEBUG, "API: wakeup read failed (%s)", strerror(errno));
+	}
+#endif
+
+	// Only connections that were idle were selected, and only this thread queues them
+	for (i = 0; i < APICONNS; i++) {
+		conn = &(api_conns[i]);
+		if (conn->sock != INVSOCK && !conn->busy && FD_ISSET(conn->sock, &rd))
+			api_conn_read(conn, now);
+	}
+
+	if (FD_ISSET(apisock, &rd)) {
+		clisiz = sizeof(cli);
+		if (SOCKETFAIL(c = accept(apisock, (struct sockaddr *)(&cli), &clisiz))) {
+			applog(LOG_ERR, "API failed (%s)%s (%d)", SOCKERRMSG, UNAVAILABLE, (int)apisock);
+			return false;
+		}
+		api_accept(apisock, c, &cli, now, false);
+	}
+
+	if (api_metrics_sock != INVSOCK && FD_ISSET(api_metrics_sock, &rd)) {
+		clisiz = sizeof(cli);
+		if (SOCKETFAIL(c = accept(api_metrics_sock, (struct sockaddr *)(&cli), &clisiz)))
+			applog(LOG_WARNING, "API metrics accept failed (%s)", SOCKERRMSG);
+		else
+			api_accept(api_metrics_sock, c, &cli, now, true);
+	}
+
+	return true;
+}
+
+void api(int api_thr_id)
+{
+	struct thr_info bye_thr;
+	short int port = opt_api_port;
+	SOCKETTYPE *apisock;
+
+	apisock = cgmalloc(sizeof(*apisock));
+	*apisock = INVSOCK;
+
+	if (!opt_api_listen) {
+		applog(LOG_DEBUG, "API not running%s", UNAVAILABLE);
+		free(apisock);
+		return;
+	}
+
+	mutex_init(&quit_restart_lock);
+
+	pthread_cleanup_push(tidyup, (void *)apisock);
+	my_thr_id = api_thr_id;
+
+	setup_groups();
+
+	if (opt_api_allow) {
+		setup_ipaccess();
+
+		if (ips == 0) {
+			applog(LOG_WARNING, "API not running (no valid IPs specified)%s", UNAVAILABLE);
+			free(apisock);
+			return;
+		}
+	}
+
+	/* This should be done before curl in needed
+	 * to ensure curl has already called WSAStartup() in windows */
+	cgsleep_ms(opt_log_interval*1000);
+
+	*apisock = api_bind("API", port, true, UNAVAILABLE);
+	if (*apisock == INVSOCK) {
+		free(apisock);
+		return;
+	}
+
+	if (opt_api_allow)
+		applog(LOG_WARNING, "API running in IP access mode on port %d (%d)", port, (int)*apisock);
+	else {
+		if (opt_api_network)
+			applog(LOG_WARNING, "API running in UNRESTRICTED read access mode on port %d (%d)", port, (int)*apisock);
+		else
+			applog(LOG_WARNING, "API running in local read access mode on port %d (%d)", port, (int)*apisock);
+	}
+
+	if (opt_api_mcast)
+		mcast_init();
+
+	strbufs = k_new_list("StrBufs", sizeof(SBITEM), ALLOC_SBITEMS, LIMIT_SBITEMS, false);
+
+	api_start();
+
+	if (metrics_enabled)
+		api_metrics_listen();
+
+	while (!bye) {
+		if (!api_poll(*apisock))
+			goto die;
 	}
 die:
 	/* Blank line fix for older compilers since pthread_cleanup_pop is a
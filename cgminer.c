@@ -50,6 +50,10 @@
 
 #ifndef WIN32
 #include <sys/resource.h>
+#ifdef __linux
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 #else
 #include <winsock2.h>
 #include <windows.h>
@@ -266,6 +270,10 @@ char *opt_api_mcast_code = API_MCAST_CODE;
 char *opt_api_mcast_des = "";
 int opt_api_mcast_port = 4028;
 bool opt_api_network;
+bool opt_api_keepalive;
+int opt_api_cache;
+int opt_api_metrics_port;
+int opt_api_threads = 4;
 bool opt_delaynet;
 bool opt_disable_pool;
 static bool no_work;
@@ -452,6 +460,7 @@ char *opt_minion_temp;
 
 #ifdef USE_USBUTILS
 char *opt_usb_select = NULL;
+char *opt_usb_sim = NULL;
 int opt_usbdump = -1;
 bool opt_usb_list_all;
 cgsem_t usb_resource_sem;
@@ -459,6 +468,7 @@ static pthread_t usb_poll_thread;
 static bool usb_polling;
 static bool polling_usb;
 static bool usb_reinit;
+static int usb_init_err;
 #endif
 
 char *opt_kernel_path;
@@ -542,9 +552,10 @@ pthread_mutex_t stats_lock;
 
 int hw_errors;
 int64_t total_accepted, total_rejected, total_diff1;
+static struct stats_shard stats_shards[STATS_SHARDS];
 int64_t total_getworks, total_stale, total_discarded;
 double total_diff_accepted, total_diff_rejected, total_diff_stale;
-static int staged_rollable;
+static int staged_rollable, staged_unrollable;
 unsigned int new_blocks;
 static unsigned int work_block;
 unsigned int found_blocks;
@@ -603,10 +614,62 @@ struct stratum_share {
 	int id;
 	time_t sshare_time;
 	time_t sshare_sent;
+	struct timeval tv_sent;
 };
 
 static struct stratum_share *stratum_shares = NULL;
 
+/* stratum_share structs are recycled on a free list under sshare_lock,
+ * chained through hh.next. New shares are given a unique id. */
+#define SSHARE_FREE_MAX 256
+
+static struct stratum_share *sshare_free;
+static int sshare_frees;
+
+static struct stratum_share *new_stratum_share(struct work *work)
+{
+	struct stratum_share *sshare;
+
+	int id;
+
+	mutex_lock(&sshare_lock);
+	sshare = sshare_free;
+	if (sshare) {
+		sshare_free = sshare->hh.next;
+		sshare_frees--;
+	}
+	id = swork_id++;
+	mutex_unlock(&sshare_lock);
+
+	if (sshare)
+		memset(sshare, 0, sizeof(struct stratum_share));
+	else
+		sshare = cgcalloc(sizeof(struct stratum_share), 1);
+	sshare->id = id;
+	sshare->work = work;
+	sshare->sshare_time = time(NULL);
+	return sshare;
+}
+
+/* Must be called with sshare_lock held */
+static void __free_stratum_share(struct stratum_share *sshare)
+{
+	if (sshare_frees >= SSHARE_FREE_MAX) {
+		free(sshare);
+		return;
+	}
+	sshare->hh.next = sshare_free;
+	sshare_free = sshare;
+	sshare_frees++;
+}
+
+static void free_stratum_share(struct stratum_share *sshare)
+{
+	mutex_lock(&sshare_lock);
+	__free_stratum_share(sshare);
+	mutex_unlock(&sshare_lock);
+}
+
 char *opt_socks_proxy = NULL;
 int opt_suggest_diff;
 #if defined(USE_AVALON7) || defined (USE_AVALON8) || defined(USE_AVALON9) ||defined(USE_AVALONLC3)
@@ -633,7 +696,20 @@ struct sigaction termhandler, inthandler, abrthandler;
 struct thread_q *getq;
 
 static uint32_t total_work;
-struct work *staged_work = NULL;
+
+/* Staged work is queued in tv_staged order, with rollable masters kept apart
+ * from clones and other work that can't be rolled so the latter can be handed
+ * out first without searching */
+static LIST_HEAD(staged_list);
+static LIST_HEAD(staged_rollable_list);
+
+/* Threads blocked in hash_pop, each woken individually in turn as work is
+ * staged instead of waking every waiter for each item */
+struct staged_waiter {
+	struct list_head list;
+	pthread_cond_t cond;
+};
+static LIST_HEAD(staged_waiters);
 
 struct schedtime {
 	bool enable;
@@ -733,9 +809,6 @@ static void applog_and_exit(const char *fmt, ...)
 	exit(1);
 }
 
-static pthread_mutex_t sharelog_lock;
-static FILE *sharelog_file = NULL;
-
 static struct thr_info *__get_thread(int thr_id)
 {
 	return mining_thr[thr_id];
@@ -770,48 +843,6 @@ struct cgpu_info *get_a_device(int id)
 	return cgpu;
 }
 
-static void sharelog(const char*disposition, const struct work*work)
-{
-	char *target, *hash, *data;
-	struct cgpu_info *cgpu;
-	unsigned long int t;
-	struct pool *pool;
-	int thr_id, rv;
-	char s[1024];
-	size_t ret;
-
-	if (!sharelog_file)
-		return;
-
-	thr_id = work->thr_id;
-	cgpu = get_thr_cgpu(thr_id);
-	pool = work->pool;
-	t = (unsigned long int)(work->tv_work_found.tv_sec);
-	target = bin2hex(work->target, sizeof(work->target));
-	hash = bin2hex(work->hash, sizeof(work->hash));
-	data = bin2hex(work->data, sizeof(work->data));
-
-	// timestamp,disposition,target,pool,dev,thr,sharehash,sharedata
-	rv = snprintf(s, sizeof(s), "%lu,%s,%s,%s,%s%u,%u,%s,%s\n", t, disposition, target, pool->rpc_url, cgpu->drv->name, cgpu->device_id, thr_id, hash, data);
-	free(target);
-	free(hash);
-	free(data);
-	if (rv >= (int)(sizeof(s)))
-		s[sizeof(s) - 1] = '\0';
-	else if (rv < 0) {
-		applog(LOG_ERR, "sharelog printf error");
-		return;
-	}
-
-	mutex_lock(&sharelog_lock);
-	ret = fwrite(s, rv, 1, sharelog_file);
-	fflush(sharelog_file);
-	mutex_unlock(&sharelog_lock);
-
-	if (ret != 1)
-		applog(LOG_ERR, "sharelog fwrite error");
-}
-
 static char *gbt_req = "{\"id\": 0, \"method\": \"getblocktemplate\", \"params\": [{\"capabilities\": [\"coinbasetxn\", \"workid\", \"coinbase/append\"]}]}\n";
 
 static char *gbt_solo_req = "{\"id\": 0, \"method\": \"getblocktemplate\", \"params\": [{\"rules\" : [\"segwit\"]}]}\n";
@@ -889,13 +920,38 @@ void adjust_quota_gcd(void)
 	applog(LOG_DEBUG, "Global quota greatest common denominator set to %lu", gcd);
 }
 
+/* Per pool latency metrics, pools given on the command line get them once
+ * metrics start. They're labelled by metric_id, not pool_no, since removing
+ * a pool renumbers the others */
+static void pool_metrics(struct pool *pool)
+{
+	if (!metrics_enabled || pool->m_notify_work)
+		return;
+
+	pool->m_notify_work = metric_new(METRIC_HISTOGRAM, "cgminer_notify_work_seconds",
+			"Time from a stratum notify to its first work being generated",
+			"pool=\"%d\"", pool->metric_id);
+	pool->m_share_submit = metric_new(METRIC_HISTOGRAM, "cgminer_share_submit_seconds",
+			"Time from a nonce being found to its share being sent to the pool",
+			"pool=\"%d\"", pool->metric_id);
+	pool->m_share_accepted = metric_new(METRIC_HISTOGRAM, "cgminer_share_result_seconds",
+			"Time from a share being sent to the pool replying",
+			"pool=\"%d\",result=\"accepted\"", pool->metric_id);
+	pool->m_share_rejected = metric_new(METRIC_HISTOGRAM, "cgminer_share_result_seconds",
+			"Time from a share being sent to the pool replying",
+			"pool=\"%d\",result=\"rejected\"", pool->metric_id);
+}
+
 /* Return value is ignored if not called from input_pool */
 struct pool *add_pool(void)
 {
+	static int metric_ids;
 	struct pool *pool;
 
 	pool = cgcalloc(sizeof(struct pool), 1);
+	pool->diff1_shards = cgcalloc(sizeof(struct stats_shard), STATS_SHARDS);
 	pool->pool_no = pool->prio = total_pools;
+	pool->metric_id = metric_ids++;
 	pools = cgrealloc(pools, sizeof(struct pool *) * (total_pools + 2));
 	pools[total_pools++] = pool;
 	mutex_init(&pool->pool_lock);
@@ -916,6 +972,7 @@ struct pool *add_pool(void)
 #ifdef USE_XTRANONCE
 	pool->extranonce_subscribe = false;
 #endif
+	pool_metrics(pool);
 	return pool;
 }
 
@@ -1024,6 +1081,11 @@ static char *set_int_1_to_31(const char *arg, int *i)
 }
 #endif
 
+static char *set_int_1_to_32(const char *arg, int *i)
+{
+	return set_int_range(arg, i, 1, 32);
+}
+
 static char *set_int_0_to_100(const char *arg, int *i)
 {
 	return set_int_range(arg, i, 0, 100);
@@ -1335,22 +1397,7 @@ static char *set_sched_stop(const char *arg)
 static char *opt_set_sharelog;
 static char* set_sharelog(char *arg)
 {
-	char *r = "";
-	long int i = strtol(arg, &r, 10);
-
-	if ((!*r) && i >= 0 && i <= INT_MAX) {
-		sharelog_file = fdopen((int)i, "a");
-		if (!sharelog_file)
-			applog(LOG_ERR, "Failed to open fd %u for share log", (unsigned int)i);
-	} else if (!strcmp(arg, "-")) {
-		sharelog_file = stdout;
-		if (!sharelog_file)
-			applog(LOG_ERR, "Standard output missing for share log");
-	} else {
-		sharelog_file = fopen(arg, "a");
-		if (!sharelog_file)
-			applog(LOG_ERR, "Failed to open %s for share log", arg);
-	}
+	sharelog_open(arg);
 
 	return NULL;
 }
@@ -1483,18 +1530,27 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--api-allow",
 		     opt_set_charp, NULL, &opt_api_allow,
 		     "Allow API access only to the given list of [G:]IP[/Prefix] addresses[/subnets]"),
+	OPT_WITH_ARG("--api-cache",
+		     set_int_0_to_9999, opt_show_intval, &opt_api_cache,
+		     "Milliseconds to reuse devs/pools/summary/stats/estats API replies, 0 to disable"),
 	OPT_WITH_ARG("--api-description",
 		     opt_set_charp, NULL, &opt_api_description,
 		     "Description placed in the API status header, default: cgminer version"),
 	OPT_WITH_ARG("--api-groups",
 		     opt_set_charp, NULL, &opt_api_groups,
 		     "API one letter groups G:cmd:cmd[,P:cmd:*...] defining the cmds a groups can use"),
+	OPT_WITHOUT_ARG("--api-keepalive",
+			opt_set_bool, &opt_api_keepalive,
+			"Keep API connections open for multiple newline terminated commands"),
 	OPT_WITHOUT_ARG("--api-listen",
 			opt_set_bool, &opt_api_listen,
 			"Enable API, default: disabled"),
 	OPT_WITHOUT_ARG("--api-mcast",
 			opt_set_bool, &opt_api_mcast,
 			"Enable API Multicast listener, default: disabled"),
+	OPT_WITH_ARG("--api-metrics-port",
+		     set_int_0_to_65535, opt_show_intval, &opt_api_metrics_port,
+		     "Port for a Prometheus style HTTP /metrics endpoint with --api-listen, 0 to disable"),
 	OPT_WITH_ARG("--api-mcast-addr",
 		     opt_set_charp, NULL, &opt_api_mcast_addr,
 		     "API Multicast listen address"),
@@ -1516,6 +1572,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--api-host",
 		     opt_set_charp, NULL, &opt_api_host,
 		     "Specify API listen address, default: 0.0.0.0"),
+	OPT_WITH_ARG("--api-threads",
+		     set_int_1_to_32, opt_show_intval, &opt_api_threads,
+		     "Number of API worker threads, range 1-32"),
 #ifdef USE_ICARUS
 	OPT_WITH_ARG("--au3-freq",
 		     set_float_100_to_250, &opt_show_floatval, &opt_au3_freq,
@@ -2594,6 +2653,15 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--log|-l",
 		     set_int_0_to_9999, opt_show_intval, &opt_log_interval,
 		     "Interval in seconds between log output"),
+	OPT_WITH_ARG("--log-file",
+		     opt_set_charp, NULL, &opt_log_file,
+		     "Append log messages to file, as well as to standard error"),
+	OPT_WITH_ARG("--log-file-size",
+		     set_int_0_to_9999, opt_show_intval, &opt_log_file_size,
+		     "Megabytes before the log file is rotated to <file>.1, 0 to never rotate"),
+	OPT_WITHOUT_ARG("--log-sync",
+			opt_set_bool, &opt_log_sync,
+			"Write log messages directly from the calling thread, not a background thread"),
 	OPT_WITHOUT_ARG("--lowmem",
 			opt_set_bool, &opt_lowmem,
 			"Minimise caching of shares for low memory applications"),
@@ -2731,6 +2799,15 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_CBARG("--sharelog",
 		     set_sharelog, NULL, &opt_set_sharelog,
 		     "Append share log to file"),
+	OPT_WITH_CBARG("--sharelog-format",
+		     set_sharelog_format, NULL, &opt_sharelog_format,
+		     "Share log format, csv or binary (default: csv)"),
+	OPT_WITH_ARG("--sharelog-rotate-size",
+		     set_int_0_to_9999, opt_show_intval, &opt_sharelog_rotate_size,
+		     "Megabytes before the share log file is rotated, 0 to disable"),
+	OPT_WITH_ARG("--sharelog-rotate-time",
+		     set_int_0_to_9999, opt_show_intval, &opt_sharelog_rotate_time,
+		     "Minutes before the share log file is rotated, 0 to disable"),
 	OPT_WITH_ARG("--shares",
 		     opt_set_intval, NULL, &opt_shares,
 		     "Quit after mining N shares (default: unlimited)"),
@@ -2765,6 +2842,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--usb",
 		     opt_set_charp, NULL, &opt_usb_select,
 		     "USB device selection"),
+	OPT_WITH_ARG("--usb-sim",
+		     opt_set_charp, NULL, &opt_usb_sim,
+		     "Simulated USB devices for benchmarking, comma list of TYPE:count:GH/s[:chips] (TYPE GSF, GSA1 or GSA2)"),
 	OPT_WITH_ARG("--usb-dump",
 		     set_int_0_to_10, opt_show_intval, &opt_usbdump,
 		     opt_hidden),
@@ -3104,6 +3184,49 @@ static struct opt_table opt_cmdline_table[] = {
 	OPT_ENDTABLE
 };
 
+/* Remember the host order SHA256 state after the first 64 bytes of
+ * work->data for the version currently in work->data */
+static void work_add_midstate(struct work *work, const uint32_t *state)
+{
+	struct work_midstate *mid;
+
+	if (work->mid_count && memcmp(work->mid_block, work->data + 4, 60))
+		work->mid_count = 0;
+	if (!work->mid_count) {
+		cg_memcpy(work->mid_block, work->data + 4, 60);
+		work->mid_next = 0;
+	}
+	mid = &work->mids[work->mid_next];
+	cg_memcpy(&mid->version, work->data, 4);
+	cg_memcpy(mid->state, state, 32);
+	work->mid_next = (work->mid_next + 1) % WORK_MIDSTATES;
+	if (work->mid_count < WORK_MIDSTATES)
+		work->mid_count++;
+}
+
+/* Find the SHA256 state after the first 64 bytes of work->data, calculating
+ * and caching it if the header version hasn't been seen before */
+static const uint32_t *work_midstate(struct work *work)
+{
+	unsigned char data[64];
+	uint32_t version;
+	sha256_ctx ctx;
+	int i;
+
+	if (work->mid_count && !memcmp(work->mid_block, work->data + 4, 60)) {
+		cg_memcpy(&version, work->data, 4);
+		for (i = 0; i < work->mid_count; i++) {
+			if (work->mids[i].version == version)
+				return work->mids[i].state;
+		}
+	}
+	flip64(data, work->data);
+	sha256_init(&ctx);
+	sha256_transf(&ctx, data, 1);
+	work_add_midstate(work, ctx.h);
+	return work->mids[(work->mid_next + WORK_MIDSTATES - 1) % WORK_MIDSTATES].state;
+}
+
 static void calc_midstate(struct pool *pool, struct work *work)
 {
 	unsigned char data[64];
@@ -3118,6 +3241,7 @@ static void calc_midstate(struct pool *pool, struct work *work)
 		sha256_init(&ctx);
 		sha256_update(&ctx, data, 64);
 		cg_memcpy(work->midstate1, ctx.h, 32);
+		work_add_midstate(work, ctx.h);
 		endian_flip32(work->midstate1, work->midstate1);
 
 		memcpy(work->data, &(pool->vmask_001[4]), 4);
@@ -3125,6 +3249,7 @@ static void calc_midstate(struct pool *pool, struct work *work)
 		sha256_init(&ctx);
 		sha256_update(&ctx, data, 64);
 		cg_memcpy(work->midstate2, ctx.h, 32);
+		work_add_midstate(work, ctx.h);
 		endian_flip32(work->midstate2, work->midstate2);
 
 		memcpy(work->data, &(pool->vmask_001[8]), 4);
@@ -3132,6 +3257,7 @@ static void calc_midstate(struct pool *pool, struct work *work)
 		sha256_init(&ctx);
 		sha256_update(&ctx, data, 64);
 		cg_memcpy(work->midstate3, ctx.h, 32);
+		work_add_midstate(work, ctx.h);
 		endian_flip32(work->midstate3, work->midstate3);
 
 		memcpy(work->data, &(pool->vmask_001[0]), 4);
@@ -3140,6 +3266,7 @@ static void calc_midstate(struct pool *pool, struct work *work)
 	sha256_init(&ctx);
 	sha256_update(&ctx, data, 64);
 	cg_memcpy(work->midstate, ctx.h, 32);
+	work_add_midstate(work, ctx.h);
 	endian_flip32(work->midstate, work->midstate);
 }
 
@@ -3155,22 +3282,94 @@ static int total_work_inc(void)
 	return ret;
 }
 
+/* Freed work structs are kept on per thread free lists, chained through
+ * hh.next, to avoid the heap churn of allocating hundreds of them per second.
+ * Threads that free more work than they create, such as device threads, pass
+ * batches back to a shared depot that threads generating work take from. */
+#define WORK_CACHE_MAX 32
+#define WORK_DEPOT_MAX 1024
+
+static __thread struct work *work_cache;
+static __thread int work_cached;
+static struct work *work_depot;
+static int work_depoted;
+static pthread_mutex_t work_depot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct work *alloc_work(void)
+{
+	struct work *work;
+
+	if (!work_cache) {
+		mutex_lock(&work_depot_lock);
+		while (work_depot && work_cached < WORK_CACHE_MAX / 2) {
+			work = work_depot;
+			work_depot = work->hh.next;
+			work->hh.next = work_cache;
+			work_cache = work;
+			work_cached++;
+			work_depoted--;
+		}
+		mutex_unlock(&work_depot_lock);
+	}
+	work = work_cache;
+	if (!work)
+		return cgcalloc(1, sizeof(struct work));
+	work_cache = work->hh.next;
+	work_cached--;
+	work->hh.next = NULL;
+	return work;
+}
+
+/* Takes work already zeroed by clean_work */
+static void release_work(struct work *work)
+{
+	struct work *batch = NULL;
+
+	work->hh.next = work_cache;
+	work_cache = work;
+	if (++work_cached <= WORK_CACHE_MAX)
+		return;
+
+	mutex_lock(&work_depot_lock);
+	while (work_cached > WORK_CACHE_MAX / 2) {
+		work = work_cache;
+		work_cache = work->hh.next;
+		work_cached--;
+		if (work_depoted < WORK_DEPOT_MAX) {
+			work->hh.next = work_depot;
+			work_depot = work;
+			work_depoted++;
+		} else {
+			work->hh.next = batch;
+			batch = work;
+		}
+	}
+	mutex_unlock(&work_depot_lock);
+
+	while (batch) {
+		work = batch;
+		batch = work->hh.next;
+		free(work);
+	}
+}
+
 static struct work *make_work(void)
 {
-	struct work *work = cgcalloc(1, sizeof(struct work));
+	struct work *work = alloc_work();
 
 	work->id = total_work_inc();
 	return work;
 }
 
 /* This is the central place all work that is about to be retired should be
- * cleaned to remove any dynamically allocated arrays within the struct */
+ * cleaned to remove any dynamically allocated arrays within the struct.
+ * job_id, ntime and nonce1 are shared strings. */
 void clean_work(struct work *work)
 {
-	free(work->job_id);
-	free(work->ntime);
+	shstr_unref(work->job_id);
+	shstr_unref(work->ntime);
 	free(work->coinbase);
-	free(work->nonce1);
+	shstr_unref(work->nonce1);
 	memset(work, 0, sizeof(struct work));
 }
 
@@ -3188,7 +3387,7 @@ void _free_work(struct work **workptr, const char *file, const char *func, const
 	}
 
 	clean_work(work);
-	free(work);
+	release_work(work);
 	*workptr = NULL;
 }
 
@@ -3294,7 +3493,7 @@ static void gen_gbt_work(struct pool *pool, struct work *work)
 	work->gbt_txns = pool->gbt_txns + 1;
 
 	if (pool->gbt_workid)
-		work->job_id = strdup(pool->gbt_workid);
+		work->job_id = shstr_dup(pool->gbt_workid);
 	cg_runlock(&pool->gbt_lock);
 
 	flip32(work->data + 4 + 32, merkleroot);
@@ -3379,6 +3578,8 @@ static bool gbt_decode(struct pool *pool, json_t *res_val)
 	cal_len = pool->coinbase_len + 1;
 	free(pool->coinbase);
 	pool->coinbase = cgcalloc(cal_len, 1);
+	pool->coinbase_size = cal_len;
+	pool->cb_prehashed = false;
 	hex2bin(pool->coinbase, pool->coinbasetxn, 42);
 	extra_len = (uint8_t *)(pool->coinbase + 41);
 	orig_len = *extra_len;
@@ -3749,6 +3950,8 @@ static bool gbt_solo_decode(struct pool *pool, json_t *res_val)
 
 	free(pool->coinbase);
 	pool->coinbase = cgcalloc(len, 1);
+	pool->coinbase_size = len;
+	pool->cb_prehashed = false;
 	cg_memcpy(pool->coinbase + 41, pool->scriptsig_base, ofs);
 	cg_memcpy(pool->coinbase + 41 + ofs, "\xff\xff\xff\xff", 4);
 	pool->coinbase[41 + ofs + 4] = insert_witness ? 2 : 1;
@@ -3839,9 +4042,45 @@ void decay_time(double *f, double fadd, double fsecs, double interval)
 	*f /= ftotal;
 }
 
+static bool work_rollable(struct work *work)
+{
+	return (!work->clone && work->rolltime);
+}
+
+/* Work is almost always staged in time order so finding its place from the
+ * tail of its queue is O(1). Must hold stgd_lock. */
+static void __staged_add(struct work *work)
+{
+	struct list_head *head, *pos;
+
+	if (work_rollable(work)) {
+		head = &staged_rollable_list;
+		staged_rollable++;
+	} else {
+		head = &staged_list;
+		staged_unrollable++;
+	}
+	for (pos = head->prev; pos != head; pos = pos->prev) {
+		struct work *prev = list_entry(pos, struct work, staged);
+
+		if (prev->tv_staged.tv_sec <= work->tv_staged.tv_sec)
+			break;
+	}
+	list_add(&work->staged, pos);
+}
+
+static void __staged_del(struct work *work)
+{
+	list_del(&work->staged);
+	if (work_rollable(work))
+		staged_rollable--;
+	else
+		staged_unrollable--;
+}
+
 static int __total_staged(void)
 {
-	return HASH_COUNT(staged_work);
+	return staged_rollable + staged_unrollable;
 }
 #if defined(HAVE_LIBCURL) || defined(HAVE_CURSES)
 static int total_staged(void)
@@ -4033,6 +4272,7 @@ static void curses_print_status(void)
 	struct pool *pool = current_pool();
 	int linewidth = opt_widescreen ? 100 : 80;
 
+	update_stats_totals();
 	wattron(statuswin, A_BOLD);
 	cg_mvwprintw(statuswin, 0, 0, " " PACKAGE " version " VERSION " - Started: %s", datestamp);
 	wattroff(statuswin, A_BOLD);
@@ -5251,6 +5491,7 @@ void app_restart(void)
 #endif
 
 	cg_completion_timeout(&__kill_work, NULL, 5000);
+	logging_stop();
 	clean_up(true);
 
 #if defined(unix) || defined(__APPLE__)
@@ -5280,16 +5521,20 @@ static void _stage_work(struct work *work);
 	WORK = NULL; \
 } while (0)
 
-/* Adjust an existing char ntime field with a relative noffset */
-static void modify_ntime(char *ntime, int noffset)
+/* Adjust an existing char ntime field with a relative noffset. The string
+ * may be shared with other work so it's replaced rather than edited */
+static void modify_ntime(char **ntime, int noffset)
 {
 	unsigned char bin[4];
 	uint32_t h32, *be32 = (uint32_t *)bin;
+	char hex[12];
 
-	hex2bin(bin, ntime, 4);
+	hex2bin(bin, *ntime, 4);
 	h32 = be32toh(*be32) + noffset;
 	*be32 = htobe32(h32);
-	__bin2hex(ntime, bin, 4);
+	__bin2hex(hex, bin, 4);
+	shstr_unref(*ntime);
+	*ntime = shstr_dup(hex);
 }
 
 void roll_work(struct work *work)
@@ -5307,7 +5552,7 @@ void roll_work(struct work *work)
 	applog(LOG_DEBUG, "Successfully rolled work");
 	/* Change the ntime field if this is stratum work */
 	if (work->ntime)
-		modify_ntime(work->ntime, 1);
+		modify_ntime(&work->ntime, 1);
 
 	/* This is now a different work item so it needs a different ID for the
 	 * hashtable */
@@ -5330,7 +5575,7 @@ void roll_work_ntime(struct work *work, int noffset)
 
 	/* Change the ntime field if this is stratum work */
 	if (work->ntime)
-		modify_ntime(work->ntime, noffset);
+		modify_ntime(&work->ntime, noffset);
 
 	/* This is now a different work item so it needs a different ID for the
 	 * hashtable */
@@ -5535,12 +5780,14 @@ static char *offset_ntime(const char *ntime, int noffset)
 {
 	unsigned char bin[4];
 	uint32_t h32, *be32 = (uint32_t *)bin;
+	char hex[12];
 
 	hex2bin(bin, ntime, 4);
 	h32 = be32toh(*be32) + noffset;
 	*be32 = htobe32(h32);
+	__bin2hex(hex, bin, 4);
 
-	return bin2hex(bin, 4);
+	return shstr_dup(hex);
 }
 
 /* Duplicates any dynamically allocated arrays within the work struct to
@@ -5554,10 +5801,8 @@ static void _copy_work(struct work *work, const struct work *base_work, int noff
 	/* Keep the unique new id assigned during make_work to prevent copied
 	 * work from having the same id. */
 	work->id = id;
-	if (base_work->job_id)
-		work->job_id = strdup(base_work->job_id);
-	if (base_work->nonce1)
-		work->nonce1 = strdup(base_work->nonce1);
+	work->job_id = shstr_ref(base_work->job_id);
+	work->nonce1 = shstr_ref(base_work->nonce1);
 	if (base_work->ntime) {
 		/* If we are passed an noffset the binary work->data ntime and
 		 * the work->ntime hex string need to be adjusted. */
@@ -5569,7 +5814,7 @@ static void _copy_work(struct work *work, const struct work *base_work, int noff
 			*work_ntime = htobe32(ntime);
 			work->ntime = offset_ntime(base_work->ntime, noffset);
 		} else
-			work->ntime = strdup(base_work->ntime);
+			work->ntime = shstr_ref(base_work->ntime);
 	} else if (noffset) {
 		uint32_t *work_ntime = (uint32_t *)(work->data + 68);
 		uint32_t ntime = be32toh(*work_ntime);
@@ -5590,8 +5835,11 @@ void set_work_ntime(struct work *work, int ntime)
 
 	*work_ntime = htobe32(ntime);
 	if (work->ntime) {
-		free(work->ntime);
-		work->ntime = bin2hex((unsigned char *)work_ntime, 4);
+		char hex[12];
+
+		__bin2hex(hex, (unsigned char *)work_ntime, 4);
+		shstr_unref(work->ntime);
+		work->ntime = shstr_dup(hex);
 	}
 }
 
@@ -5706,16 +5954,17 @@ uint64_t share_diff(const struct work *work)
 	return ret;
 }
 
+/* Only the 16 byte header tail is hashed, starting from the cached state of
+ * the first 64 bytes */
 static void regen_hash(struct work *work)
 {
-	uint32_t *data32 = (uint32_t *)(work->data);
-	unsigned char swap[80];
-	uint32_t *swap32 = (uint32_t *)swap;
-	unsigned char hash1[32];
+	uint32_t *data32 = (uint32_t *)(work->data + 64);
+	uint32_t swap32[4];
+	int i;
 
-	flip80(swap32, data32);
-	sha256(swap, 80, hash1);
-	sha256(hash1, 32, (unsigned char *)(work->hash));
+	for (i = 0; i < 4; i++)
+		swap32[i] = swab32(data32[i]);
+	sha256d_80_tail(work_midstate(work), (unsigned char *)swap32, work->hash);
 }
 
 static bool cnx_needed(struct pool *pool);
@@ -5849,9 +6098,16 @@ static void discard_stale(void)
 	int stale = 0;
 
 	mutex_lock(stgd_lock);
-	HASH_ITER(hh, staged_work, work, tmp) {
+	list_for_each_entry_safe(work, tmp, &staged_list, staged) {
+		if (stale_work(work, false)) {
+			__staged_del(work);
+			discard_work(work);
+			stale++;
+		}
+	}
+	list_for_each_entry_safe(work, tmp, &staged_rollable_list, staged) {
 		if (stale_work(work, false)) {
-			HASH_DEL(staged_work, work);
+			__staged_del(work);
 			discard_work(work);
 			stale++;
 		}
@@ -6061,13 +6317,17 @@ static bool test_work_current(struct work *work)
 	unsigned char bedata[32];
 	char hexstr[68];
 	bool ret = true;
-	unsigned char *bin_height = &pool->coinbase[43];
-	uint8_t cb_height_sz = bin_height[-1];
+	unsigned char *bin_height;
+	uint8_t cb_height_sz;
 	uint32_t height = 0;
 
+	// benchmark work has no pool coinbase
 	if (work->mandatory)
 		return ret;
 
+	bin_height = &pool->coinbase[43];
+	cb_height_sz = bin_height[-1];
+
 	swap256(bedata, work->data + 4);
 	__bin2hex(hexstr, bedata, 32);
 
@@ -6163,29 +6423,23 @@ out:
 	return ret;
 }
 
-static int tv_sort(struct work *worka, struct work *workb)
-{
-	return worka->tv_staged.tv_sec - workb->tv_staged.tv_sec;
-}
-
-static bool work_rollable(struct work *work)
-{
-	return (!work->clone && work->rolltime);
-}
-
 static bool hash_push(struct work *work)
 {
 	bool rc = true;
 
 	mutex_lock(stgd_lock);
-	if (work_rollable(work))
-		staged_rollable++;
 	if (likely(!getq->frozen)) {
-		HASH_ADD_INT(staged_work, id, work);
-		HASH_SORT(staged_work, tv_sort);
+		__staged_add(work);
+		/* Hand the work to the longest waiting hash_pop */
+		if (!list_empty(&staged_waiters)) {
+			struct staged_waiter *waiter;
+
+			waiter = list_entry(staged_waiters.next, struct staged_waiter, list);
+			list_del_init(&waiter->list);
+			pthread_cond_signal(&waiter->cond);
+		}
 	} else
 		rc = false;
-	pthread_cond_broadcast(&getq->cond);
 	mutex_unlock(stgd_lock);
 
 	return rc;
@@ -6266,7 +6520,7 @@ void remove_pool(struct pool *pool)
 	}
 	/* Give it an invalid number */
 	pool->pool_no = total_pools;
-	pool->removed = true;
+	__atomic_store_n(&pool->removed, true, __ATOMIC_SEQ_CST);
 	total_pools--;
 }
 
@@ -6449,7 +6703,7 @@ static time_t hashdisplay_t;
 
 void zero_stats(void)
 {
-	int i;
+	int i, j;
 #ifdef USE_BITMAIN_SOC
 	struct sysinfo sInfo;
 	if (sysinfo(&sInfo))
@@ -6478,6 +6732,10 @@ void zero_stats(void)
 	total_accepted = 0;
 	total_rejected = 0;
 	hw_errors = 0;
+	for (i = 0; i < STATS_SHARDS; i++) {
+		__atomic_store_n(&stats_shards[i].diff1, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats_shards[i].hw_errors, 0, __ATOMIC_RELAXED);
+	}
 	total_stale = 0;
 	total_discarded = 0;
 	local_work = 0;
@@ -6505,6 +6763,10 @@ void zero_stats(void)
 		pool->remotefail_occasions = 0;
 		pool->last_share_time = 0;
 		pool->diff1 = 0;
+		if (pool->diff1_shards) {
+			for (j = 0; j < STATS_SHARDS; j++)
+				__atomic_store_n(&pool->diff1_shards[j].diff1, 0, __ATOMIC_RELAXED);
+		}
 		pool->diff_accepted = 0;
 		pool->diff_rejected = 0;
 		pool->diff_stale = 0;
@@ -7323,10 +7585,18 @@ static void stratum_share_result(json_t *val, json_t *res_val, json_t *err_val,
 				 struct stratum_share *sshare)
 {
 	struct work *work = sshare->work;
+	struct pool *pool = work->pool;
 	time_t now_t = time(NULL);
+	struct timeval now;
 	char hashshow[64];
 	int srdiff;
 
+	if (pool->m_share_accepted) {
+		cgtime(&now);
+		metric_observe(json_is_true(res_val) ? pool->m_share_accepted : pool->m_share_rejected,
+			       us_tdiff(&now, &sshare->tv_sent));
+	}
+
 	srdiff = now_t - sshare->sshare_sent;
 	if (opt_debug || srdiff > 0) {
 		applog(LOG_INFO, "Pool %d stratum share result lag time %d seconds",
@@ -7417,7 +7687,7 @@ static bool parse_stratum_response(struct pool *pool, char *s)
 	}
 	stratum_share_result(val, res_val, err_val, sshare);
 	free_work(sshare->work);
-	free(sshare);
+	free_stratum_share(sshare);
 
 	ret = true;
 out:
@@ -7440,7 +7710,7 @@ void clear_stratum_shares(struct pool *pool)
 			diff_cleared += sshare->work->work_difficulty;
 			free_work(sshare->work);
 			pool->sshares--;
-			free(sshare);
+			__free_stratum_share(sshare);
 			cleared++;
 		}
 	}
@@ -7461,15 +7731,25 @@ void clear_pool_work(struct pool *pool)
 	int cleared = 0;
 
 	mutex_lock(stgd_lock);
-	HASH_ITER(hh, staged_work, work, tmp) {
+	list_for_each_entry_safe(work, tmp, &staged_list, staged) {
+		if (work->pool == pool) {
+			__staged_del(work);
+			free_work(work);
+			cleared++;
+		}
+	}
+	list_for_each_entry_safe(work, tmp, &staged_rollable_list, staged) {
 		if (work->pool == pool) {
-			HASH_DEL(staged_work, work);
+			__staged_del(work);
 			free_work(work);
 			cleared++;
 		}
 	}
 	mutex_unlock(stgd_lock);
 
+	/* Invalidate any work generated ahead for this pool */
+	__atomic_add_fetch(&pool->swork_gen, 1, __ATOMIC_RELEASE);
+
 	if (cleared)
 		applog(LOG_INFO, "Cleared %d work items due to stratum disconnect on pool %d", cleared, pool->pool_no);
 }
@@ -7525,6 +7805,7 @@ static bool cnx_needed(struct pool *pool)
 static void wait_lpcurrent(struct pool *pool);
 static void pool_resus(struct pool *pool);
 static void gen_stratum_work(struct pool *pool, struct work *work);
+static void wake_stratum_wgen(struct pool *pool);
 
 void stratum_resumed(struct pool *pool)
 {
@@ -7545,222 +7826,644 @@ static bool supports_resume(struct pool *pool)
 	return ret;
 }
 
-/* One stratum receive thread per pool that has stratum waits on the socket
- * checking for new messages and for the integrity of the socket connection. We
- * reset the connection based on the integrity of the receive side only as the
- * send side will eventually expire data it fails to send. */
-static void *stratum_rthread(void *userdata)
+/* Handles one line received from a stratum pool */
+static void stratum_line(struct pool *pool, char *s)
 {
-	struct pool *pool = (struct pool *)userdata;
-	char threadname[16];
+	unsigned int sockbuf_gen;
 
-	pthread_detach(pthread_self());
+	/* Check this pool hasn't died while being a backup pool and
+	 * has not had its idle flag cleared */
+	stratum_resumed(pool);
 
-	snprintf(threadname, sizeof(threadname), "%d/RStratum", pool->pool_no);
-	RenameThread(threadname);
+	sockbuf_gen = pool->sockbuf_gen;
+	if (!parse_method(pool, s)) {
+		/* A failed client.reconnect reads from the new socket
+		 * into the sockbuf that s points into */
+		if (sockbuf_gen != pool->sockbuf_gen)
+			return;
+		if (!parse_stratum_response(pool, s)) {
+			applog(LOG_INFO, "Unknown stratum msg: %s", s);
+			return;
+		}
+	}
+	/* Start generating work for a new notify straight away */
+	if (__atomic_load_n(&pool->wgen_started, __ATOMIC_ACQUIRE) &&
+	    pool->wgen_notified != pool->swork_gen) {
+		pool->wgen_notified = pool->swork_gen;
+		wake_stratum_wgen(pool);
+	}
+	if (pool->swork.clean) {
+		struct work *work = make_work();
 
-	while (42) {
-		struct timeval timeout;
-		int sel_ret;
-		fd_set rd;
-		char *s;
+		/* Generate a single work item to update the current
+		 * block database */
+		gen_stratum_work(pool, work);
+		/* Return value doesn't matter. We're just informing
+		 * that we may need to restart. */
+		test_work_current(work);
+		free_work(work);
+	}
+}
 
-		if (unlikely(pool->removed)) {
-			suspend_stratum(pool);
-			break;
-		}
+static void stratum_interrupted(struct pool *pool)
+{
+	applog(LOG_NOTICE, "Stratum connection to pool %d interrupted", pool->pool_no);
+	pool->getfail_occasions++;
+	total_go++;
 
-		/* Check to see whether we need to maintain this connection
-		 * indefinitely or just bring it up when we switch to this
-		 * pool */
-		if (!sock_full(pool) && !cnx_needed(pool)) {
-			suspend_stratum(pool);
-			clear_stratum_shares(pool);
-			clear_pool_work(pool);
-
-			wait_lpcurrent(pool);
-			while (!restart_stratum(pool)) {
-				pool_died(pool);
-				if (pool->removed)
-					goto out;
-				cgsleep_ms(5000);
-			}
-		}
+	/* If the socket to our stratum pool disconnects, all
+	 * tracked submitted shares are lost and we will leak
+	 * the memory if we don't discard their records. */
+	if (!supports_resume(pool) || opt_lowmem)
+		clear_stratum_shares(pool);
+	clear_pool_work(pool);
+	if (pool == current_pool())
+		restart_threads();
+}
 
-		FD_ZERO(&rd);
-		FD_SET(pool->sock, &rd);
-		timeout.tv_sec = 90;
-		timeout.tv_usec = 0;
+/* Keeps trying to reconnect, returning false if the pool is removed */
+static bool stratum_reconnect(struct pool *pool)
+{
+	while (!restart_stratum(pool)) {
+		pool_died(pool);
+		if (pool->removed)
+			return false;
+		cgsleep_ms(5000);
+	}
+	return true;
+}
 
-		/* The protocol specifies that notify messages should be sent
-		 * every minute so if we fail to receive any for 90 seconds we
-		 * assume the connection has been dropped and treat this pool
-		 * as dead */
-		if (!sock_full(pool) && (sel_ret = select(pool->sock + 1, &rd, NULL, NULL, &timeout)) < 1) {
-			applog(LOG_DEBUG, "Stratum select failed on pool %d with value %d", pool->pool_no, sel_ret);
-			s = NULL;
-		} else
-			s = recv_line(pool);
-		if (!s) {
-			applog(LOG_NOTICE, "Stratum connection to pool %d interrupted", pool->pool_no);
-			pool->getfail_occasions++;
-			total_go++;
-
-			/* If the socket to our stratum pool disconnects, all
-			 * tracked submitted shares are lost and we will leak
-			 * the memory if we don't discard their records. */
-			if (!supports_resume(pool) || opt_lowmem)
-				clear_stratum_shares(pool);
-			clear_pool_work(pool);
-			if (pool == current_pool())
-				restart_threads();
+/* Drops a connection we don't need to maintain and brings it back up when we
+ * switch to this pool */
+static bool stratum_standby(struct pool *pool)
+{
+	suspend_stratum(pool);
+	clear_stratum_shares(pool);
+	clear_pool_work(pool);
 
-			while (!restart_stratum(pool)) {
-				pool_died(pool);
-				if (pool->removed)
-					goto out;
-				cgsleep_ms(5000);
-			}
-			continue;
-		}
+	wait_lpcurrent(pool);
+	return stratum_reconnect(pool);
+}
 
-		/* Check this pool hasn't died while being a backup pool and
-		 * has not had its idle flag cleared */
-		stratum_resumed(pool);
+#ifdef __linux
+/* All stratum pools share one receive thread waiting on their sockets with
+ * epoll. Anything that blocks, reconnecting or waiting for a backup pool to be
+ * needed again, is handed to a short lived thread and the loop leaves the
+ * pool alone while pool->ev_busy is set. A pool's socket is registered while
+ * pool->ev_fd matches pool->sock and pool->ev_gen matches pool->sockbuf_gen,
+ * which changes whenever the connection is reset.
+ * Ready sockets are handled as their events arrive, everything else is left
+ * to stratum_ev_scan() once a second, or as soon as a pool is added or a
+ * worker is done with one, which writes to stratum_ev_wake. */
+#define STRATUM_EV_EVENTS 64
+#define STRATUM_EV_SCAN_MS 1000
 
-		if (!parse_method(pool, s) && !parse_stratum_response(pool, s))
-			applog(LOG_INFO, "Unknown stratum msg: %s", s);
-		else if (pool->swork.clean) {
-			struct work *work = make_work();
-
-			/* Generate a single work item to update the current
-			 * block database */
-			gen_stratum_work(pool, work);
-			/* Return value doesn't matter. We're just informing
-			 * that we may need to restart. */
-			test_work_current(work);
-			free_work(work);
-		}
-		free(s);
-	}
+static pthread_mutex_t stratum_ev_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pool **stratum_ev_new;
+static int stratum_ev_news;
+static int stratum_ev_fd = -1;
+static int stratum_ev_wake = -1;
+static pthread_t stratum_ev_thread;
 
-out:
-	return NULL;
+static void stratum_ev_rescan(void)
+{
+	uint64_t one = 1;
+
+	if (write(stratum_ev_wake, &one, sizeof(one)) != sizeof(one))
+		applog(LOG_DEBUG, "Failed to wake the stratum event loop");
 }
 
-/* Each pool has one stratum send thread for sending shares to avoid many
- * threads being created for submission since all sends need to be serialised
- * anyway. */
-static void *stratum_sthread(void *userdata)
+struct stratum_ev_task {
+	struct pool *pool;
+	bool standby;
+};
+
+static void *stratum_ev_worker(void *userdata)
 {
-	struct pool *pool = (struct pool *)userdata;
-	uint64_t last_nonce2 = 0;
-	uint32_t last_nonce = 0;
+	struct stratum_ev_task *task = (struct stratum_ev_task *)userdata;
+	struct pool *pool = task->pool;
 	char threadname[16];
 
 	pthread_detach(pthread_self());
 
-	snprintf(threadname, sizeof(threadname), "%d/SStratum", pool->pool_no);
+	snprintf(threadname, sizeof(threadname), "%d/CStratum", pool->pool_no);
 	RenameThread(threadname);
 
-	pool->stratum_q = tq_new();
-	if (!pool->stratum_q)
-		quit(1, "Failed to create stratum_q in stratum_sthread");
+	if (task->standby)
+		stratum_standby(pool);
+	else
+		stratum_reconnect(pool);
+	free(task);
 
-	while (42) {
-		char noncehex[12], nonce2hex[20], s[1024];
-		struct stratum_share *sshare;
-		uint32_t *hash32, nonce;
-		unsigned char nonce2[8];
-		uint64_t *nonce2_64;
-		struct work *work;
-		bool submitted;
+	pool->ev_last = time(NULL);
+	__atomic_store_n(&pool->ev_busy, false, __ATOMIC_RELEASE);
+	stratum_ev_rescan();
+	return NULL;
+}
 
-		if (unlikely(pool->removed))
-			break;
-#if defined (USE_AVALON2) || defined (USE_AVALON4) || defined (USE_AVALON7) || defined (USE_AVALON8) || defined (USE_AVALON9) || defined (USE_AVALON_MINER) || defined (USE_HASHRATIO)
-		work = tq_pop(pool->stratum_q, NULL);
-#else
-		work = tq_pop(pool->stratum_q);
-#endif
-		if (unlikely(!work))
-			quit(1, "Stratum q returned empty work");
+static void stratum_ev_unregister(struct pool **evpools, int count, struct pool *pool)
+{
+	int i;
 
-		if (unlikely(work->nonce2_len > 8)) {
-			applog(LOG_ERR, "Pool %d asking for inappropriately long nonce2 length %d",
-			       pool->pool_no, (int)work->nonce2_len);
-			applog(LOG_ERR, "Not attempting to submit shares");
-			free_work(work);
-			continue;
+	if (pool->ev_fd < 0)
+		return;
+	/* Don't remove a registration the fd number has been reused for */
+	for (i = 0; i < count; i++) {
+		if (evpools[i] != pool && evpools[i]->ev_fd == pool->ev_fd)
+			break;
+	}
+	if (i == count)
+		epoll_ctl(stratum_ev_fd, EPOLL_CTL_DEL, pool->ev_fd, NULL);
+	pool->ev_fd = -1;
+}
+
+static void stratum_ev_handoff(struct pool **evpools, int count, struct pool *pool, bool standby)
+{
+	struct stratum_ev_task *task = cgmalloc(sizeof(*task));
+	pthread_t pth;
+
+	stratum_ev_unregister(evpools, count, pool);
+	task->pool = pool;
+	task->standby = standby;
+	pool->ev_busy = true;
+	if (unlikely(pthread_create(&pth, NULL, stratum_ev_worker, (void *)task)))
+		quit(1, "Failed to create stratum_ev_worker");
+}
+
+static inline bool stratum_ev_ready(struct pool *pool)
+{
+	return !__atomic_load_n(&pool->ev_busy, __ATOMIC_ACQUIRE) &&
+		pool->ev_fd == pool->sock && pool->ev_gen == pool->sockbuf_gen;
+}
+
+static void stratum_ev_lines(struct pool **evpools, int count, struct pool *pool)
+{
+	char *s;
+
+	while (stratum_ev_ready(pool) && (s = sockbuf_next_line(pool))) {
+		pool->ev_last = time(NULL);
+		pool->ev_line = true;
+		stratum_line(pool, s);
+		pool->ev_line = false;
+		/* parse_reconnect() left the new connection to us */
+		if (pool->ev_reconnect) {
+			pool->ev_reconnect = false;
+			stratum_ev_handoff(evpools, count, pool, false);
+			break;
 		}
+	}
+}
 
-		nonce = *((uint32_t *)(work->data + 76));
-		nonce2_64 = (uint64_t *)nonce2;
-		*nonce2_64 = htole64(work->nonce2);
-		/* Filter out duplicate shares */
-		if (unlikely(nonce == last_nonce && *nonce2_64 == last_nonce2)) {
-			applog(LOG_INFO, "Filtering duplicate share to pool %d",
-			       pool->pool_no);
-			free_work(work);
+/* Takes care of registering sockets, buffered lines, idle connections and
+ * the 90 second notify timeout for every pool. Runs at most once a second
+ * unless woken by stratum_ev_rescan() */
+static int stratum_ev_scan(struct pool ***evpools, int count)
+{
+	struct pool **p;
+	time_t now = time(NULL);
+	int i;
+
+	mutex_lock(&stratum_ev_lock);
+	if (stratum_ev_news) {
+		*evpools = cgrealloc(*evpools, sizeof(struct pool *) * (count + stratum_ev_news));
+		memcpy(*evpools + count, stratum_ev_new, sizeof(struct pool *) * stratum_ev_news);
+		count += stratum_ev_news;
+		stratum_ev_news = 0;
+	}
+	mutex_unlock(&stratum_ev_lock);
+	p = *evpools;
+
+	/* Drop stale registrations before adding any new ones so a reused fd
+	 * number is never removed from under its new owner */
+	for (i = 0; i < count; i++) {
+		if (p[i]->ev_fd >= 0 && !stratum_ev_ready(p[i]))
+			stratum_ev_unregister(p, count, p[i]);
+	}
+
+	for (i = 0; i < count; i++) {
+		struct pool *pool = p[i];
+
+		if (__atomic_load_n(&pool->ev_busy, __ATOMIC_ACQUIRE))
+			continue;
+		if (unlikely(pool->removed)) {
+			suspend_stratum(pool);
+			stratum_ev_unregister(p, count, pool);
+			p[i--] = p[--count];
 			continue;
 		}
-		last_nonce = nonce;
-		last_nonce2 = *nonce2_64;
-		__bin2hex(noncehex, (const unsigned char *)&nonce, 4);
-		__bin2hex(nonce2hex, nonce2, work->nonce2_len);
+		if (!pool->sock) {
+			stratum_interrupted(pool);
+			stratum_ev_handoff(p, count, pool, false);
+			continue;
+		}
+		if (pool->ev_fd < 0) {
+			struct epoll_event ev;
 
-		sshare = cgcalloc(sizeof(struct stratum_share), 1);
-		hash32 = (uint32_t *)work->hash;
-		submitted = false;
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN;
+			ev.data.ptr = pool;
+			if (unlikely(epoll_ctl(stratum_ev_fd, EPOLL_CTL_ADD, pool->sock, &ev))) {
+				applog(LOG_WARNING, "Failed to add pool %d socket to epoll", pool->pool_no);
+				stratum_interrupted(pool);
+				stratum_ev_handoff(p, count, pool, false);
+				continue;
+			}
+			pool->ev_fd = pool->sock;
+			pool->ev_gen = pool->sockbuf_gen;
+		}
+
+		/* Check to see whether we need to maintain this connection
+		 * indefinitely or just bring it up when we switch to this
+		 * pool */
+		if (!sock_full(pool) && !cnx_needed(pool)) {
+			stratum_ev_handoff(p, count, pool, true);
+			continue;
+		}
+		stratum_ev_lines(p, count, pool);
 
-		sshare->sshare_time = time(NULL);
-		/* This work item is freed in parse_stratum_response */
-		sshare->work = work;
-		memset(s, 0, 1024);
+		/* The protocol specifies that notify messages should be sent
+		 * every minute so if we fail to receive any for 90 seconds we
+		 * assume the connection has been dropped and treat this pool
+		 * as dead */
+		if (stratum_ev_ready(pool) && now - pool->ev_last > 90) {
+			applog(LOG_DEBUG, "Stratum receive timed out on pool %d", pool->pool_no);
+			stratum_interrupted(pool);
+			stratum_ev_handoff(p, count, pool, false);
+		}
+	}
 
-		mutex_lock(&sshare_lock);
-		/* Give the stratum share a unique id */
-		sshare->id = swork_id++;
-		mutex_unlock(&sshare_lock);
+	return count;
+}
 
-		if (work->direct_vmask)
-		{
-			unsigned char bvb[4], bvhex[12];
-			int v;
-			for (v = 0; v < 4; v++)
-				bvb[v] = work->data[v] & ~(work->base_bv[v]);
-			__bin2hex((char *)bvhex, bvb, 4);
+static void *stratum_ev_loop(void __maybe_unused *userdata)
+{
+	struct epoll_event events[STRATUM_EV_EVENTS];
+	struct timeval last_scan, now;
+	struct pool **evpools = NULL;
+	bool scan = true;
+	int count = 0;
 
-			snprintf(s, sizeof(s),
-				 "{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
-				pool->rpc_user, work->job_id, nonce2hex, work->ntime, noncehex, bvhex, sshare->id);
+	pthread_detach(pthread_self());
+	RenameThread("StratumEv");
+	cgtime(&last_scan);
+
+	while (42) {
+		int i, n, wait;
+
+		cgtime(&now);
+		wait = ms_tdiff(&now, &last_scan);
+		if (scan || wait >= STRATUM_EV_SCAN_MS) {
+			count = stratum_ev_scan(&evpools, count);
+			copy_time(&last_scan, &now);
+			scan = false;
+			wait = 0;
 		}
-		else if (pool->vmask)
-		{
-			snprintf(s, sizeof(s),
-				 "{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
-				pool->rpc_user, work->job_id, nonce2hex, work->ntime, noncehex, pool->vmask_002[work->micro_job_id], sshare->id);
+
+		n = epoll_wait(stratum_ev_fd, events, STRATUM_EV_EVENTS, STRATUM_EV_SCAN_MS - wait);
+		for (i = 0; i < n; i++) {
+			struct pool *pool = (struct pool *)events[i].data.ptr;
+
+			if (!pool) {
+				uint64_t woken;
+
+				if (read(stratum_ev_wake, &woken, sizeof(woken)) < 0)
+					applog(LOG_DEBUG, "Failed to read the stratum event loop wake");
+				scan = true;
+				continue;
+			}
+			if (!stratum_ev_ready(pool) || pool->removed)
+				continue;
+			if (!recv_sockbuf(pool)) {
+				stratum_interrupted(pool);
+				stratum_ev_handoff(evpools, count, pool, false);
+				continue;
+			}
+			stratum_ev_lines(evpools, count, pool);
 		}
-		else
-		{
-			snprintf(s, sizeof(s),
-				"{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
-				pool->rpc_user, work->job_id, nonce2hex, work->ntime, noncehex, sshare->id);
+	}
+
+	return NULL;
+}
+
+static void stratum_ev_add(struct pool *pool)
+{
+	pool->ev_fd = -1;
+	pool->ev_last = time(NULL);
+
+	mutex_lock(&stratum_ev_lock);
+	if (stratum_ev_fd < 0) {
+		struct epoll_event ev;
+
+		stratum_ev_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (unlikely(stratum_ev_fd < 0))
+			quit(1, "Failed to epoll_create1 in stratum_ev_add");
+		stratum_ev_wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (unlikely(stratum_ev_wake < 0))
+			quit(1, "Failed to eventfd in stratum_ev_add");
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (unlikely(epoll_ctl(stratum_ev_fd, EPOLL_CTL_ADD, stratum_ev_wake, &ev)))
+			quit(1, "Failed to add the wake eventfd to epoll in stratum_ev_add");
+		if (unlikely(pthread_create(&stratum_ev_thread, NULL, stratum_ev_loop, NULL)))
+			quit(1, "Failed to create stratum_ev_loop");
+	}
+	stratum_ev_new = cgrealloc(stratum_ev_new, sizeof(struct pool *) * (stratum_ev_news + 1));
+	stratum_ev_new[stratum_ev_news++] = pool;
+	mutex_unlock(&stratum_ev_lock);
+	stratum_ev_rescan();
+}
+#else /* __linux */
+/* One stratum receive thread per pool that has stratum waits on the socket
+ * checking for new messages and for the integrity of the socket connection. We
+ * reset the connection based on the integrity of the receive side only as the
+ * send side will eventually expire data it fails to send. */
+static void *stratum_rthread(void *userdata)
+{
+	struct pool *pool = (struct pool *)userdata;
+	char threadname[16];
+
+	pthread_detach(pthread_self());
+
+	snprintf(threadname, sizeof(threadname), "%d/RStratum", pool->pool_no);
+	RenameThread(threadname);
+
+	while (42) {
+		struct timeval timeout;
+		int sel_ret;
+		fd_set rd;
+		char *s;
+
+		if (unlikely(pool->removed)) {
+			suspend_stratum(pool);
+			break;
+		}
+
+		/* Check to see whether we need to maintain this connection
+		 * indefinitely or just bring it up when we switch to this
+		 * pool */
+		if (!sock_full(pool) && !cnx_needed(pool)) {
+			if (!stratum_standby(pool))
+				break;
 		}
 
-		applog(LOG_INFO, "Submitting share %08lx to pool %d",
-					(long unsigned int)htole32(hash32[6]), pool->pool_no);
+		FD_ZERO(&rd);
+		FD_SET(pool->sock, &rd);
+		timeout.tv_sec = 90;
+		timeout.tv_usec = 0;
+
+		/* The protocol specifies that notify messages should be sent
+		 * every minute so if we fail to receive any for 90 seconds we
+		 * assume the connection has been dropped and treat this pool
+		 * as dead */
+		if (!sock_full(pool) && (sel_ret = select(pool->sock + 1, &rd, NULL, NULL, &timeout)) < 1) {
+			applog(LOG_DEBUG, "Stratum select failed on pool %d with value %d", pool->pool_no, sel_ret);
+			s = NULL;
+		} else
+			s = recv_line_view(pool);
+		if (!s) {
+			stratum_interrupted(pool);
+			if (!stratum_reconnect(pool))
+				break;
+			continue;
+		}
+
+		stratum_line(pool, s);
+	}
+
+	return NULL;
+}
+#endif /* __linux */
+
+/* Up to this many queued shares are sent to the pool in one write */
+#define STRATUM_SUBMIT_BATCH 16
+#define STRATUM_SUBMIT_LEN 1024
+
+/* The start of mining.submit that only changes with the job, len is -1 if
+ * it doesn't fit */
+struct submit_prefix {
+	char *user;
+	char *job_id;
+	int len;
+	char buf[768];
+};
+
+static void update_submit_prefix(struct pool *pool, struct submit_prefix *sp, struct work *work)
+{
+	/* job_id is shared by all work from the same notify */
+	if (sp->job_id == work->job_id && sp->user && !strcmp(sp->user, pool->rpc_user))
+		return;
+	shstr_unref(sp->job_id);
+	sp->job_id = shstr_ref(work->job_id);
+	free(sp->user);
+	sp->user = strdup(pool->rpc_user);
+	sp->len = snprintf(sp->buf, sizeof(sp->buf), "{\"params\": [\"%s\", \"%s\", \"",
+			   pool->rpc_user, work->job_id);
+	if (sp->len < 0 || sp->len >= (int)sizeof(sp->buf))
+		sp->len = -1;
+}
+
+/* Appends len bytes of s at p if they fit before end, else returns NULL */
+static char *append_mem(char *p, const char *end, const void *s, size_t len)
+{
+	if (!p || len > (size_t)(end - p))
+		return NULL;
+	memcpy(p, s, len);
+	return p + len;
+}
+
+static char *append_str(char *p, const char *end, const char *s)
+{
+	return append_mem(p, end, s, strlen(s));
+}
+
+static char *append_hex(char *p, const char *end, const void *bin, size_t len)
+{
+	if (!p || len * 2 > (size_t)(end - p))
+		return NULL;
+	__bin2hex(p, bin, len);
+	return p + len * 2;
+}
+
+/* Writes the mining.submit for work to s, which has room for size bytes,
+ * returning its length or -1 if it doesn't fit. The cached prefix is only
+ * used when everything fits, anything else takes the snprintf path */
+static int format_stratum_share(struct pool *pool, struct submit_prefix *sp,
+				struct work *work, int id, char *s, int size)
+{
+	uint32_t nonce = *((uint32_t *)(work->data + 76));
+	char nonce2hex[17], noncehex[9], bvhex[9];
+	const char *vmask = NULL;
+	const char *end = s + size;
+	unsigned char nonce2[8];
+	uint64_t *nonce2_64 = (uint64_t *)nonce2;
+	unsigned char bvb[4];
+	char *p = s;
+	int len, v;
+
+	*nonce2_64 = htole64(work->nonce2);
+	if (work->direct_vmask) {
+		for (v = 0; v < 4; v++)
+			bvb[v] = work->data[v] & ~(work->base_bv[v]);
+	} else if (pool->vmask)
+		vmask = pool->vmask_002[work->micro_job_id];
+
+	update_submit_prefix(pool, sp, work);
+	if (sp->len >= 0) {
+		p = append_mem(p, end, sp->buf, sp->len);
+		p = append_hex(p, end, nonce2, work->nonce2_len);
+		p = append_str(p, end, "\", \"");
+		p = append_str(p, end, work->ntime);
+		p = append_str(p, end, "\", \"");
+		p = append_hex(p, end, &nonce, 4);
+		if (work->direct_vmask) {
+			p = append_str(p, end, "\", \"");
+			p = append_hex(p, end, bvb, 4);
+		} else if (vmask) {
+			p = append_str(p, end, "\", \"");
+			p = append_str(p, end, vmask);
+		}
+		if (p) {
+			len = snprintf(p, end - p, "\"], \"id\": %d, \"method\": \"mining.submit\"}", id);
+			if (len >= 0 && len < end - p)
+				return p + len - s;
+		}
+	}
+
+	__bin2hex(nonce2hex, nonce2, work->nonce2_len);
+	__bin2hex(noncehex, (const unsigned char *)&nonce, 4);
+	if (work->direct_vmask) {
+		__bin2hex(bvhex, bvb, 4);
+		vmask = bvhex;
+	}
+	if (vmask) {
+		len = snprintf(s, size,
+			       "{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
+			       pool->rpc_user, work->job_id, nonce2hex, work->ntime, noncehex, vmask, id);
+	} else {
+		len = snprintf(s, size,
+			       "{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
+			       pool->rpc_user, work->job_id, nonce2hex, work->ntime, noncehex, id);
+	}
+	if (len < 0 || len >= size)
+		return -1;
+	return len;
+}
+
+/* Each pool has one stratum send thread for sending shares to avoid many
+ * threads being created for submission since all sends need to be serialised
+ * anyway. */
+static void *stratum_sthread(void *userdata)
+{
+	struct pool *pool = (struct pool *)userdata;
+	struct submit_prefix sp;
+	uint64_t last_nonce2 = 0;
+	uint32_t last_nonce = 0;
+	char threadname[16];
+
+	pthread_detach(pthread_self());
+
+	snprintf(threadname, sizeof(threadname), "%d/SStratum", pool->pool_no);
+	RenameThread(threadname);
+
+	memset(&sp, 0, sizeof(sp));
+	pool->stratum_q = tq_new();
+	if (!pool->stratum_q)
+		quit(1, "Failed to create stratum_q in stratum_sthread");
+
+	while (42) {
+		struct stratum_share *sshares[STRATUM_SUBMIT_BATCH];
+		char s[STRATUM_SUBMIT_BATCH * STRATUM_SUBMIT_LEN];
+		struct stratum_share *sshare;
+		int i, count = 0, len = 0, slen;
+		uint32_t *hash32, nonce;
+		uint64_t nonce2;
+		struct work *work;
+		time_t first_time;
+		bool submitted;
+
+		if (unlikely(pool->removed))
+			break;
+#if defined (USE_AVALON2) || defined (USE_AVALON4) || defined (USE_AVALON7) || defined (USE_AVALON8) || defined (USE_AVALON9) || defined (USE_AVALON_MINER) || defined (USE_HASHRATIO)
+		work = tq_pop(pool->stratum_q, NULL);
+#else
+		work = tq_pop(pool->stratum_q);
+#endif
+		if (unlikely(!work))
+			quit(1, "Stratum q returned empty work");
+
+		/* Format this share and any others already queued behind it
+		 * into the one buffer to send together */
+		do {
+			if (unlikely(work->nonce2_len > 8)) {
+				applog(LOG_ERR, "Pool %d asking for inappropriately long nonce2 length %d",
+				       pool->pool_no, (int)work->nonce2_len);
+				applog(LOG_ERR, "Not attempting to submit shares");
+				free_work(work);
+				continue;
+			}
+
+			nonce = *((uint32_t *)(work->data + 76));
+			nonce2 = htole64(work->nonce2);
+			/* Filter out duplicate shares */
+			if (unlikely(nonce == last_nonce && nonce2 == last_nonce2)) {
+				applog(LOG_INFO, "Filtering duplicate share to pool %d",
+				       pool->pool_no);
+				free_work(work);
+				continue;
+			}
+			last_nonce = nonce;
+			last_nonce2 = nonce2;
+
+			/* This work item is freed in parse_stratum_response */
+			sshare = new_stratum_share(work);
+
+			/* Each share gets STRATUM_SUBMIT_LEN including its '\n' */
+			slen = format_stratum_share(pool, &sp, work, sshare->id, s + len + !!count,
+						    STRATUM_SUBMIT_LEN - 1);
+			if (unlikely(slen < 0)) {
+				applog(LOG_ERR, "Pool %d share is longer than %d bytes, not submitting it",
+				       pool->pool_no, STRATUM_SUBMIT_LEN - 1);
+				free_stratum_share(sshare);
+				free_work(work);
+				continue;
+			}
+			if (count)
+				s[len++] = '\n';
+			len += slen;
+			sshares[count++] = sshare;
+
+			hash32 = (uint32_t *)work->hash;
+			applog(LOG_INFO, "Submitting share %08lx to pool %d",
+						(long unsigned int)htole32(hash32[6]), pool->pool_no);
+		} while (count < STRATUM_SUBMIT_BATCH && (work = tq_trypop(pool->stratum_q)));
+
+		if (!count)
+			continue;
+		first_time = sshares[0]->sshare_time;
+		submitted = false;
 
 		/* Try resubmitting for up to 2 minutes if we fail to submit
 		 * once and the stratum pool nonce1 still matches suggesting
 		 * we may be able to resume. */
-		while (time(NULL) < sshare->sshare_time + 120) {
+		while (time(NULL) < first_time + 120) {
 			bool sessionid_match;
 
-			if (likely(stratum_send(pool, s, strlen(s)))) {
+			if (likely(stratum_send(pool, s, len))) {
+				time_t sent = time(NULL);
+				struct timeval tv_sent;
+
+				cgtime(&tv_sent);
 				mutex_lock(&sshare_lock);
-				HASH_ADD_INT(stratum_shares, id, sshare);
-				pool->sshares++;
+				for (i = 0; i < count; i++) {
+					sshares[i]->sshare_sent = sent;
+					copy_time(&sshares[i]->tv_sent, &tv_sent);
+					if (sshares[i]->work->tv_work_found.tv_sec)
+						metric_observe(pool->m_share_submit,
+							       us_tdiff(&tv_sent, &sshares[i]->work->tv_work_found));
+					HASH_ADD_INT(stratum_shares, id, sshares[i]);
+				}
+				pool->sshares += count;
 				mutex_unlock(&sshare_lock);
 
 				if (pool_tclear(pool, &pool->submit_fail))
@@ -7781,7 +8484,7 @@ static void *stratum_sthread(void *userdata)
 			}
 
 			cg_rlock(&pool->data_lock);
-			sessionid_match = (pool->nonce1 && !strcmp(work->nonce1, pool->nonce1));
+			sessionid_match = (pool->nonce1 && !strcmp(sshares[0]->work->nonce1, pool->nonce1));
 			cg_runlock(&pool->data_lock);
 
 			if (!sessionid_match) {
@@ -7794,15 +8497,16 @@ static void *stratum_sthread(void *userdata)
 
 		if (unlikely(!submitted)) {
 			applog(LOG_DEBUG, "Failed to submit stratum share, discarding");
-			free_work(work);
-			free(sshare);
-			pool->stale_shares++;
-			total_stale++;
+			for (i = 0; i < count; i++) {
+				free_work(sshares[i]->work);
+				free_stratum_share(sshares[i]);
+			}
+			pool->stale_shares += count;
+			total_stale += count;
 		} else {
-			int ssdiff;
+			/* The shares may already have been answered and freed */
+			int ssdiff = time(NULL) - first_time;
 
-			sshare->sshare_sent = time(NULL);
-			ssdiff = sshare->sshare_sent - sshare->sshare_time;
 			if (opt_debug || ssdiff > 0) {
 				applog(LOG_INFO, "Pool %d stratum share submission lag time %d seconds",
 				       pool->pool_no, ssdiff);
@@ -7810,6 +8514,8 @@ static void *stratum_sthread(void *userdata)
 		}
 	}
 
+	shstr_unref(sp.job_id);
+	free(sp.user);
 	/* Freeze the work queue but don't free up its memory in case there is
 	 * work still trying to be submitted to the removed pool. */
 	tq_freeze(pool->stratum_q);
@@ -7823,8 +8529,12 @@ static void init_stratum_threads(struct pool *pool)
 
 	if (unlikely(pthread_create(&pool->stratum_sthread, NULL, stratum_sthread, (void *)pool)))
 		quit(1, "Failed to create stratum sthread");
+#ifdef __linux
+	stratum_ev_add(pool);
+#else
 	if (unlikely(pthread_create(&pool->stratum_rthread, NULL, stratum_rthread, (void *)pool)))
 		quit(1, "Failed to create stratum rthread");
+#endif
 }
 
 static void *longpoll_thread(void *userdata);
@@ -8155,14 +8865,18 @@ static bool work_emptied;
  * be handled. */
 static struct work *hash_pop(bool blocking)
 {
-	struct work *work = NULL, *tmp;
-	int hc;
+	struct work *work = NULL;
 
 	mutex_lock(stgd_lock);
-	if (!HASH_COUNT(staged_work)) {
+	if (!__total_staged()) {
+		struct staged_waiter waiter;
+
 		work_emptied = true;
 		if (!blocking)
 			goto out_unlock;
+		if (unlikely(pthread_cond_init(&waiter.cond, NULL)))
+			quithere(1, "Failed to pthread_cond_init staged waiter");
+		INIT_LIST_HEAD(&waiter.list);
 		do {
 			struct timespec abstime, tdiff = {10, 0};
 			int rc;
@@ -8170,7 +8884,9 @@ static struct work *hash_pop(bool blocking)
 			cgcond_time(&abstime);
 			timeraddspec(&abstime, &tdiff);
 			pthread_cond_signal(&gws_cond);
-			rc = pthread_cond_timedwait(&getq->cond, stgd_lock, &abstime);
+			if (list_empty(&waiter.list))
+				list_add_tail(&waiter.list, &staged_waiters);
+			rc = pthread_cond_timedwait(&waiter.cond, stgd_lock, &abstime);
 			/* Check again for !no_work as multiple threads may be
 				* waiting on this condition and another may set the
 				* bool separately. */
@@ -8178,7 +8894,9 @@ static struct work *hash_pop(bool blocking)
 				no_work = true;
 				applog(LOG_WARNING, "Waiting for work to be available from pools.");
 			}
-		} while (!HASH_COUNT(staged_work));
+		} while (!__total_staged());
+		list_del_init(&waiter.list);
+		pthread_cond_destroy(&waiter.cond);
 	}
 
 	if (no_work) {
@@ -8186,24 +8904,24 @@ static struct work *hash_pop(bool blocking)
 		no_work = false;
 	}
 
-	hc = HASH_COUNT(staged_work);
-	/* Find clone work if possible, to allow masters to be reused */
-	if (hc > staged_rollable) {
-		HASH_ITER(hh, staged_work, work, tmp) {
-			if (!work_rollable(work))
-				break;
-		}
-	} else
-		work = staged_work;
-	HASH_DEL(staged_work, work);
-	if (work_rollable(work))
-		staged_rollable--;
+	/* Use clone work if possible, to allow masters to be reused */
+	if (!list_empty(&staged_list))
+		work = list_entry(staged_list.next, struct work, staged);
+	else
+		work = list_entry(staged_rollable_list.next, struct work, staged);
+	__staged_del(work);
 
 	/* Signal the getwork scheduler to look for more work */
 	pthread_cond_signal(&gws_cond);
 
-	/* Signal hash_pop again in case there are mutliple hash_pop waiters */
-	pthread_cond_signal(&getq->cond);
+	/* Pass any remaining work on to the next hash_pop waiter */
+	if (__total_staged() && !list_empty(&staged_waiters)) {
+		struct staged_waiter *next;
+
+		next = list_entry(staged_waiters.next, struct staged_waiter, list);
+		list_del_init(&next->list);
+		pthread_cond_signal(&next->cond);
+	}
 
 	/* Keep track of last getwork grabbed */
 	last_getwork = time(NULL);
@@ -8378,6 +9096,88 @@ void get_work_by_nonce2(struct thr_info *thr,
 }
 #endif
 
+/* Precompute the SHA256 state of all the whole 64 byte coinbase blocks that
+ * precede nonce2 so work generation only needs to hash the coinbase tail for
+ * each new nonce2. Called on every notify with pool->data_lock write held. */
+void __gen_coinbase_midstate(struct pool *pool)
+{
+	sha256_ctx ctx;
+
+	pool->cb_prehash_len = pool->nonce2_offset - (pool->nonce2_offset % SHA256_BLOCK_SIZE);
+	sha256_init(&ctx);
+	sha256_update(&ctx, pool->coinbase, pool->cb_prehash_len);
+	cg_memcpy(pool->cb_midstate, ctx.h, 32);
+	pool->cb_prehashed = true;
+}
+
+/* Set up ctx with the hash state of the coinbase up to nonce2, starting from
+ * the precomputed midstate if there is one. Must hold pool->data_lock. */
+static void __coinbase_prefix_ctx(struct pool *pool, sha256_ctx *ctx)
+{
+	int off = 0;
+
+	if (pool->cb_prehashed) {
+		cg_memcpy(ctx->h, pool->cb_midstate, 32);
+		ctx->len = 0;
+		ctx->tot_len = off = pool->cb_prehash_len;
+	} else
+		sha256_init(ctx);
+	sha256_update(ctx, pool->coinbase + off, pool->nonce2_offset - off);
+}
+
+/* Finish the coinbase hash from prefix_ctx with nonce2 and walk the merkle
+ * branches, storing the merkle root in the byte order used in work->data */
+static void __gen_merkle_root(struct pool *pool, const sha256_ctx *prefix_ctx,
+			      uint64_t nonce2, unsigned char *merkle_root)
+{
+	unsigned char merkle_sha[64], nonce2bin[16] = {0};
+	uint64_t nonce2le;
+	sha256_ctx ctx;
+	int i, off;
+
+	/* Always use an LE encoded nonce2 to fill in values from left to
+	 * right and prevent overflow errors with small n2sizes */
+	nonce2le = htole64(nonce2);
+	cg_memcpy(nonce2bin, &nonce2le, sizeof(nonce2le));
+
+	cg_memcpy(&ctx, prefix_ctx, sizeof(ctx));
+	sha256_update(&ctx, nonce2bin, pool->n2size);
+	off = pool->nonce2_offset + pool->n2size;
+	sha256_update(&ctx, pool->coinbase + off, pool->coinbase_len - off);
+	sha256_final(&ctx, merkle_sha);
+	sha256(merkle_sha, 32, merkle_sha);
+
+	for (i = 0; i < pool->merkles; i++) {
+		cg_memcpy(merkle_sha + 32, pool->swork.merkle_bin[i], 32);
+		gen_hash(merkle_sha, merkle_sha, 64);
+	}
+	flip32(merkle_root, merkle_sha);
+}
+
+/* Generate the merkle roots for count consecutive nonce2 values starting at
+ * nonce2, 32 bytes each into merkle_roots, hashing the common coinbase prefix
+ * only once. Does not consume pool->nonce2. Must hold pool->data_lock. */
+static void __gen_stratum_merkle_roots(struct pool *pool, uint64_t nonce2, int count,
+				       unsigned char *merkle_roots)
+{
+	sha256_ctx prefix_ctx;
+	int i;
+
+	__coinbase_prefix_ctx(pool, &prefix_ctx);
+	for (i = 0; i < count; i++)
+		__gen_merkle_root(pool, &prefix_ctx, nonce2 + i, merkle_roots + i * 32);
+}
+
+void gen_stratum_merkle_roots(struct pool *pool, uint64_t nonce2, int count,
+			      unsigned char *merkle_roots)
+{
+	cg_rlock(&pool->data_lock);
+	__gen_stratum_merkle_roots(pool, nonce2, count, merkle_roots);
+	cg_runlock(&pool->data_lock);
+}
+
+static struct metric *stratum_work_metric;
+
 #if STRATUM_WORK_TIMING
 cglock_t swt_lock;
 uint64_t stratum_work_count;
@@ -8389,115 +9189,327 @@ uint64_t stratum_work_time10;
 uint64_t stratum_work_time100;
 #endif
 
-/* Generates stratum based work based on the most recent notify information
- * from the pool. This will keep generating work while a pool is down so we use
- * other means to detect when the pool has died in stratum_thread */
-static void gen_stratum_work(struct pool *pool, struct work *work)
+/* Keeps a shared copy of s in *shared, only replacing it when s changes */
+static void __pool_shstr(char **shared, const char *s)
 {
-	unsigned char merkle_root[32], merkle_sha[64];
-	uint32_t *data32, *swap32;
+	if (*shared && !strcmp(*shared, s))
+		return;
+	shstr_unref(*shared);
+	*shared = shstr_dup(s);
+}
+
+/* Most stratum work items generated from one data_lock pass */
+#define STRATUM_WORKS_MAX 64
+
+/* Generates count stratum work items with consecutive nonce2 values based on
+ * the most recent notify information from the pool, taking pool->data_lock
+ * once for the lot. This will keep generating work while a pool is down so we
+ * use other means to detect when the pool has died in stratum_thread */
+static void gen_stratum_works(struct pool *pool, struct work **works, int count)
+{
+	unsigned char merkle_roots[STRATUM_WORKS_MAX * 32];
 #if STRATUM_WORK_TIMING
 	struct timeval stt;
 	double usec;
 #endif
-	uint64_t nonce2le;
+	struct timeval tv_notify;
+	bool notify_timed = false;
+	uint64_t nonce2, nonce2le;
 	int i;
 
+	if (unlikely(count > STRATUM_WORKS_MAX))
+		quit(1, "gen_stratum_works count %d > %d", count, STRATUM_WORKS_MAX);
+
 #if STRATUM_WORK_TIMING
 	cgtime(&stt);
 #endif
 
 	cg_wlock(&pool->data_lock);
 
-	/* Update coinbase. Always use an LE encoded nonce2 to fill in values
-	 * from left to right and prevent overflow errors with small n2sizes */
-	nonce2le = htole64(pool->nonce2);
-	cg_memcpy(pool->coinbase + pool->nonce2_offset, &nonce2le, pool->n2size);
-	work->nonce2 = pool->nonce2++;
-	work->nonce2_len = pool->n2size;
-
-	/* Downgrade to a read lock to read off the pool variables */
-	cg_dwlock(&pool->data_lock);
-
-	/* Generate merkle root */
-	gen_hash(pool->coinbase, merkle_root, pool->coinbase_len);
-	cg_memcpy(merkle_sha, merkle_root, 32);
-	for (i = 0; i < pool->merkles; i++) {
-		cg_memcpy(merkle_sha + 32, pool->swork.merkle_bin[i], 32);
-		gen_hash(merkle_sha, merkle_root, 64);
-		cg_memcpy(merkle_sha, merkle_root, 32);
+	/* Reserve count nonce2 values and update coinbase with the last. Always
+	 * use an LE encoded nonce2 to fill in values from left to right and
+	 * prevent overflow errors with small n2sizes */
+	nonce2 = pool->nonce2;
+	pool->nonce2 += count;
+	nonce2le = htole64(pool->nonce2 - 1);
+	cg_memcpy(pool->coinbase + pool->nonce2_offset, &nonce2le, pool->n2size);
+
+	if (!pool->notify_timed && pool->m_notify_work) {
+		copy_time(&tv_notify, &pool->tv_notify);
+		pool->notify_timed = notify_timed = true;
 	}
-	data32 = (uint32_t *)merkle_sha;
-	swap32 = (uint32_t *)merkle_root;
-	flip32(swap32, data32);
 
-	/* Copy the data template from header_bin */
-	cg_memcpy(work->data, pool->header_bin, 112);
-	cg_memcpy(work->data + 36, merkle_root, 32);
+	/* Refresh the shared submission strings if the notify changed them */
+	__pool_shstr(&pool->work_job_id, pool->swork.job_id);
+	__pool_shstr(&pool->work_nonce1, pool->nonce1);
+	__pool_shstr(&pool->work_ntime, pool->ntime);
 
-	/* Store the stratum work diff to check it still matches the pool's
-	 * stratum diff when submitting shares */
-	work->sdiff = pool->sdiff;
+	/* Downgrade to a read lock to read off the pool variables */
+	cg_dwlock(&pool->data_lock);
 
-	/* Copy parameters required for share submission */
-	work->job_id = strdup(pool->swork.job_id);
-	work->nonce1 = strdup(pool->nonce1);
-	work->ntime = strdup(pool->ntime);
-	cg_runlock(&pool->data_lock);
+	/* Generate merkle roots */
+	__gen_stratum_merkle_roots(pool, nonce2, count, merkle_roots);
 
-	if (opt_debug) {
-		char *header, *merkle_hash;
+	for (i = 0; i < count; i++) {
+		struct work *work = works[i];
 
-		header = bin2hex(work->data, 112);
-		merkle_hash = bin2hex((const unsigned char *)merkle_root, 32);
-		applog(LOG_DEBUG, "Generated stratum merkle %s", merkle_hash);
-		applog(LOG_DEBUG, "Generated stratum header %s", header);
-		applog(LOG_DEBUG, "Work job_id %s nonce2 %"PRIu64" ntime %s", work->job_id,
-		       work->nonce2, work->ntime);
-		free(header);
-		free(merkle_hash);
+		work->nonce2 = nonce2 + i;
+		work->nonce2_len = pool->n2size;
+
+		/* Copy the data template from header_bin */
+		cg_memcpy(work->data, pool->header_bin, 112);
+		cg_memcpy(work->data + 36, merkle_roots + i * 32, 32);
+
+		/* Store the stratum work diff to check it still matches the pool's
+		 * stratum diff when submitting shares */
+		work->sdiff = pool->sdiff;
+
+		/* Copy parameters required for share submission */
+		work->job_id = shstr_ref(pool->work_job_id);
+		work->nonce1 = shstr_ref(pool->work_nonce1);
+		work->ntime = shstr_ref(pool->work_ntime);
 	}
+	cg_runlock(&pool->data_lock);
 
-	calc_midstate(pool, work);
-	set_target(work->target, work->sdiff);
+	for (i = 0; i < count; i++) {
+		struct work *work = works[i];
 
-	local_work++;
-	work->pool = pool;
-	work->stratum = true;
-	work->nonce = 0;
-	work->longpoll = false;
-	work->getwork_mode = GETWORK_MODE_STRATUM;
-	work->work_block = work_block;
-	/* Nominally allow a driver to ntime roll 60 seconds */
-	work->drv_rolllimit = 60;
-	calc_diff(work, work->sdiff);
+		if (opt_debug) {
+			char *header, *merkle_hash;
 
-	cgtime(&work->tv_staged);
+			header = bin2hex(work->data, 112);
+			merkle_hash = bin2hex(merkle_roots + i * 32, 32);
+			applog(LOG_DEBUG, "Generated stratum merkle %s", merkle_hash);
+			applog(LOG_DEBUG, "Generated stratum header %s", header);
+			applog(LOG_DEBUG, "Work job_id %s nonce2 %"PRIu64" ntime %s", work->job_id,
+			       work->nonce2, work->ntime);
+			free(header);
+			free(merkle_hash);
+		}
+
+		calc_midstate(pool, work);
+		set_target(work->target, work->sdiff);
+
+		local_work++;
+		work->pool = pool;
+		work->stratum = true;
+		work->nonce = 0;
+		work->longpoll = false;
+		work->getwork_mode = GETWORK_MODE_STRATUM;
+		work->work_block = work_block;
+		/* Nominally allow a driver to ntime roll 60 seconds */
+		work->drv_rolllimit = 60;
+		calc_diff(work, work->sdiff);
+
+		cgtime(&work->tv_staged);
+	}
+
+	if (notify_timed && tv_notify.tv_sec)
+		metric_observe(pool->m_notify_work, us_tdiff(&works[0]->tv_staged, &tv_notify));
 
 #if STRATUM_WORK_TIMING
-	usec = us_tdiff(&work->tv_staged, &stt);
+	/* Time per work item */
+	usec = us_tdiff(&works[count - 1]->tv_staged, &stt) / count;
+	metric_observe(stratum_work_metric, usec);
 	cg_wlock(&swt_lock);
-	stratum_work_count++;
-	stratum_work_time += usec;
+	stratum_work_count += count;
+	stratum_work_time += usec * count;
 	if (stratum_work_min == 0 || stratum_work_min > usec)
 		stratum_work_min = usec;
 	if (stratum_work_max < usec)
 		stratum_work_max = usec;
 	if (usec == 0)
-		stratum_work_time0++;
+		stratum_work_time0 += count;
 	else
 	{
 		if (usec >= 10)
 		{
-			stratum_work_time10++;
+			stratum_work_time10 += count;
 			if (usec >= 100)
-				stratum_work_time100++;
+				stratum_work_time100 += count;
 		}
 	}
 	cg_wunlock(&swt_lock);
 #endif
 }
 
+static void gen_stratum_work(struct pool *pool, struct work *work)
+{
+	gen_stratum_works(pool, &work, 1);
+}
+
+/* Stratum work generated ahead of the getwork scheduler. A per pool thread
+ * builds a batch of complete work items for the current notify and publishes
+ * it in pool->wbatch_next, only ever into an empty slot. The scheduler is the
+ * only consumer: it exchanges a published batch out into pool->wbatch before
+ * looking at it and stages work from it without hashing anything itself, so
+ * it also frees stale and replaced batches. Batches are tagged with
+ * pool->swork_gen so work from an older notify or difficulty is never used.
+ * Batches only change hands by atomic exchange, so when the pool is removed
+ * whichever of the scheduler and the generator thread gets one frees it. */
+#define WGEN_MIN 2
+#define WGEN_MAX STRATUM_WORKS_MAX
+
+static void free_work_batch(struct work_batch *batch)
+{
+	if (!batch)
+		return;
+	while (batch->next < batch->count)
+		free_work(batch->works[batch->next++]);
+	free(batch);
+}
+
+static void wake_stratum_wgen(struct pool *pool)
+{
+	if (__atomic_load_n(&pool->wgen_wanted, __ATOMIC_ACQUIRE))
+		return;
+	mutex_lock(&pool->wgen_lock);
+	pool->wgen_wanted = true;
+	pthread_cond_signal(&pool->wgen_cond);
+	mutex_unlock(&pool->wgen_lock);
+}
+
+/* Size batches to cover roughly a quarter of a second of the rate the
+ * scheduler has been taking work from this pool */
+static int wgen_target(struct pool *pool, struct timeval *tv_rate, int64_t *last_taken)
+{
+	struct timeval now;
+	double secs;
+	int target;
+
+	cgtime(&now);
+	secs = tdiff(&now, tv_rate);
+	if (secs >= 1) {
+		int64_t taken = __atomic_load_n(&pool->wgen_taken, __ATOMIC_RELAXED);
+
+		decay_time(&pool->wgen_rate, taken - *last_taken, secs, 10);
+		*last_taken = taken;
+		copy_time(tv_rate, &now);
+	}
+	target = pool->wgen_rate / 4;
+	if (target < WGEN_MIN)
+		target = WGEN_MIN;
+	if (target > WGEN_MAX)
+		target = WGEN_MAX;
+	__atomic_store_n(&pool->wgen_target, target, __ATOMIC_RELAXED);
+	return target;
+}
+
+static void *stratum_wgen_thread(void *userdata)
+{
+	struct pool *pool = (struct pool *)userdata;
+	struct timeval tv_rate;
+	int64_t last_taken = 0;
+	char threadname[16];
+
+	pthread_detach(pthread_self());
+
+	snprintf(threadname, sizeof(threadname), "%d/SWorkGen", pool->pool_no);
+	RenameThread(threadname);
+	cgtime(&tv_rate);
+
+	while (42) {
+		struct work_batch *batch;
+		unsigned int gen;
+		int i, target;
+		bool wanted;
+
+		mutex_lock(&pool->wgen_lock);
+		if (!pool->wgen_wanted) {
+			struct timespec abstime;
+
+			cgcond_time(&abstime);
+			abstime.tv_sec++;
+			pthread_cond_timedwait(&pool->wgen_cond, &pool->wgen_lock, &abstime);
+		}
+		wanted = pool->wgen_wanted;
+		mutex_unlock(&pool->wgen_lock);
+
+		if (unlikely(__atomic_load_n(&pool->removed, __ATOMIC_SEQ_CST)))
+			break;
+		target = wgen_target(pool, &tv_rate, &last_taken);
+		if (!wanted)
+			continue;
+
+		/* Nothing to generate from until the first notify, and nothing to
+		 * do until the scheduler has taken the last batch */
+		gen = __atomic_load_n(&pool->swork_gen, __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&pool->wbatch_next, __ATOMIC_ACQUIRE))
+			gen = 0;
+		if (gen) {
+			struct work_batch *empty = NULL;
+
+			batch = cgmalloc(sizeof(*batch) + sizeof(struct work *) * target);
+			batch->gen = gen;
+			batch->count = target;
+			batch->next = 0;
+			for (i = 0; i < target; i++)
+				batch->works[i] = make_work();
+			gen_stratum_works(pool, batch->works, target);
+			/* A notify arrived while generating so start again */
+			if (gen != __atomic_load_n(&pool->swork_gen, __ATOMIC_ACQUIRE)) {
+				free_work_batch(batch);
+				continue;
+			}
+			if (!__atomic_compare_exchange_n(&pool->wbatch_next, &empty, batch, false,
+							 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				free_work_batch(batch);
+		}
+		__atomic_store_n(&pool->wgen_wanted, false, __ATOMIC_RELEASE);
+		if (gen)
+			wake_gws();
+	}
+
+	free_work_batch(__atomic_exchange_n(&pool->wbatch_next, NULL, __ATOMIC_ACQ_REL));
+	free_work_batch(__atomic_exchange_n(&pool->wbatch, NULL, __ATOMIC_SEQ_CST));
+	return NULL;
+}
+
+/* Returns the next pregenerated work item for this pool, or NULL if there is
+ * none ready yet. Must only be called from the getwork scheduler. */
+static struct work *get_pregen_work(struct pool *pool)
+{
+	struct work_batch *batch, *next;
+	unsigned int gen = __atomic_load_n(&pool->swork_gen, __ATOMIC_ACQUIRE);
+	struct work *work = NULL;
+
+	if (unlikely(!pool->wgen_started)) {
+		pthread_t pth;
+
+		mutex_init(&pool->wgen_lock);
+		if (unlikely(pthread_cond_init(&pool->wgen_cond, NULL)))
+			quit(1, "Failed to pthread_cond_init wgen_cond");
+		__atomic_store_n(&pool->wgen_started, true, __ATOMIC_RELEASE);
+		if (unlikely(pthread_create(&pth, NULL, stratum_wgen_thread, (void *)pool)))
+			quit(1, "Failed to create stratum_wgen_thread");
+	}
+	__atomic_add_fetch(&pool->wgen_taken, 1, __ATOMIC_RELAXED);
+
+	/* Gens only increase, so a published batch is never older than a
+	 * current one and is only needed once this one is used up or stale */
+	batch = __atomic_exchange_n(&pool->wbatch, NULL, __ATOMIC_ACQ_REL);
+	if (!batch || batch->next == batch->count || batch->gen != gen) {
+		next = __atomic_exchange_n(&pool->wbatch_next, NULL, __ATOMIC_ACQ_REL);
+		if (next) {
+			free_work_batch(batch);
+			batch = next;
+		}
+	}
+	if (batch && batch->gen == gen && batch->next < batch->count)
+		work = batch->works[batch->next++];
+
+	/* Ask for more when this notify's work is running low */
+	if (!__atomic_load_n(&pool->wbatch_next, __ATOMIC_ACQUIRE) &&
+	    (!batch || batch->gen != gen ||
+	     batch->count - batch->next <= __atomic_load_n(&pool->wgen_target, __ATOMIC_RELAXED) / 2))
+		wake_stratum_wgen(pool);
+
+	__atomic_store_n(&pool->wbatch, batch, __ATOMIC_SEQ_CST);
+	if (unlikely(__atomic_load_n(&pool->removed, __ATOMIC_SEQ_CST)))
+		free_work_batch(__atomic_exchange_n(&pool->wbatch, NULL, __ATOMIC_SEQ_CST));
+	return work;
+}
+
 #ifdef HAVE_LIBCURL
 static void gen_solo_work(struct pool *pool, struct work *work);
 
@@ -8606,7 +9618,7 @@ static void gen_solo_work(struct pool *pool, struct work *work)
 	work->sdiff = pool->sdiff;
 
 	/* Copy parameters required for share submission */
-	work->ntime = strdup(pool->ntime);
+	work->ntime = shstr_dup(pool->ntime);
 	cg_memcpy(work->target, pool->gbt_target, 32);
 	cg_runlock(&pool->gbt_lock);
 
@@ -8647,6 +9659,32 @@ int share_work_tdiff(struct cgpu_info *cgpu)
 	return last_getwork - cgpu->last_device_valid_work;
 }
 
+/* The known nonce of the --benchmark work item whose data bytes 64-75, the
+ * end of the merkle root, ntime and nbits, are tail. Lets --usb-sim return
+ * nonces that meet the target */
+bool benchmark_nonce(const unsigned char *tail, uint32_t *nonce)
+{
+	uint32_t n;
+	int i;
+
+	if (!opt_benchmark)
+		return false;
+
+	for (i = 0; i < 16; i++) {
+		if (!memcmp(&bench_hidiff_bins[i][64], tail, 12)) {
+			cg_memcpy(&n, &bench_hidiff_bins[i][76], 4);
+			*nonce = le32toh(n);
+			return true;
+		}
+		if (!memcmp(&bench_lodiff_bins[i][64], tail, 12)) {
+			cg_memcpy(&n, &bench_lodiff_bins[i][76], 4);
+			*nonce = le32toh(n);
+			return true;
+		}
+	}
+	return false;
+}
+
 static void set_benchmark_work(struct cgpu_info *cgpu, struct work *work)
 {
 	cgpu->lodiff += cgpu->direction;
@@ -8757,15 +9795,18 @@ static void submit_work_async(struct work *work)
 	}
 }
 
+static inline int stats_shard(struct cgpu_info *cgpu)
+{
+	return cgpu->cgminer_id & (STATS_SHARDS - 1);
+}
+
 void inc_hw_errors_n(struct thr_info *thr, int n)
 {
 	applog(LOG_INFO, "%s %d: invalid nonce - HW error", thr->cgpu->drv->name,
 	       thr->cgpu->device_id);
 
-	mutex_lock(&stats_lock);
-	hw_errors += n;
-	thr->cgpu->hw_errors += n;
-	mutex_unlock(&stats_lock);
+	__atomic_add_fetch(&stats_shards[stats_shard(thr->cgpu)].hw_errors, n, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&thr->cgpu->hw_errors, n, __ATOMIC_RELAXED);
 
 	thr->cgpu->drv->hw_error(thr);
 }
@@ -8798,8 +9839,12 @@ bool test_nonce(struct work *work, uint32_t nonce)
 bool test_nonce_diff(struct work *work, uint32_t nonce, double diff)
 {
 	uint64_t *hash64 = (uint64_t *)(work->hash + 24), diff64;
+	uint32_t *hash_32 = (uint32_t *)(work->hash + 28);
 
 	rebuild_nonce(work, nonce);
+	/* Nothing at or above diff 1 can have the top 32 bits set */
+	if (diff >= 1.0 && *hash_32 != 0)
+		return false;
 	diff64 = 0x00000000ffff0000ULL;
 	diff64 /= diff;
 
@@ -8823,7 +9868,7 @@ double test_nonce_value(struct work *work, uint32_t nonce)
 	return ds;
 }
 
-static void update_work_stats(struct thr_info *thr, struct work *work)
+static void check_work_block(struct work *work)
 {
 	double test_diff = current_diff;
 
@@ -8836,15 +9881,60 @@ static void update_work_stats(struct thr_info *thr, struct work *work)
 		work->mandatory = true;
 		applog(LOG_NOTICE, "Found block for pool %d!", work->pool->pool_no);
 	}
+}
+
+/* Only touches the device and its shards so that devices finding nonces
+ * concurrently don't contend on stats_lock */
+static void add_diff1_stats(struct thr_info *thr, struct pool *pool, double diff1)
+{
+	struct cgpu_info *cgpu = thr->cgpu;
+	int64_t d = diff1;
+	int shard = stats_shard(cgpu);
+
+	__atomic_add_fetch(&stats_shards[shard].diff1, d, __ATOMIC_RELAXED);
+	if (likely(pool->diff1_shards))
+		__atomic_add_fetch(&pool->diff1_shards[shard].diff1, d, __ATOMIC_RELAXED);
+	else
+		__atomic_add_fetch(&pool->diff1, d, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&cgpu->diff1, d, __ATOMIC_RELAXED);
+	cgpu->last_device_valid_work = time(NULL);
+}
+
+/* Sums the sharded counters into total_diff1, hw_errors and each pool's
+ * diff1. Called before those are displayed or reported. */
+void update_stats_totals(void)
+{
+	int64_t diff1 = 0, hw = 0;
+	int i, j;
+
+	for (i = 0; i < STATS_SHARDS; i++) {
+		diff1 += __atomic_load_n(&stats_shards[i].diff1, __ATOMIC_RELAXED);
+		hw += __atomic_load_n(&stats_shards[i].hw_errors, __ATOMIC_RELAXED);
+	}
 
 	mutex_lock(&stats_lock);
-	total_diff1 += work->device_diff;
-	thr->cgpu->diff1 += work->device_diff;
-	work->pool->diff1 += work->device_diff;
-	thr->cgpu->last_device_valid_work = time(NULL);
+	total_diff1 = diff1;
+	hw_errors = hw;
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+
+		// Without shards add_diff1_stats counts pool->diff1 directly
+		if (unlikely(!pool->diff1_shards))
+			continue;
+		diff1 = 0;
+		for (j = 0; j < STATS_SHARDS; j++)
+			diff1 += __atomic_load_n(&pool->diff1_shards[j].diff1, __ATOMIC_RELAXED);
+		pool->diff1 = diff1;
+	}
 	mutex_unlock(&stats_lock);
 }
 
+static void update_work_stats(struct thr_info *thr, struct work *work)
+{
+	check_work_block(work);
+	add_diff1_stats(thr, work->pool, work->device_diff);
+}
+
 /* To be used once the work has been tested to be meet diff1 and has had its
  * nonce adjusted. Returns true if the work target is met. */
 bool submit_tested_work(struct thr_info *thr, struct work *work)
@@ -8899,6 +9989,84 @@ bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
 	return true;
 }
 
+/* For drivers that get a burst of nonces back for the one work item. Each
+ * nonce is tested as in submit_nonce but the diff1 stats are only updated once
+ * for the whole batch and only nonces meeting the work target are copied and
+ * submitted. If versions isn't NULL each nonce was found with its own rolled
+ * block version, the first 4 bytes of work->data as the driver would set them,
+ * so no midstate is shared and the whole headers are hashed NONCE_LANES at a
+ * time with sha256d_80_batch().
+ * Returns the number of valid nonces, which are the first valid of nonces[]
+ * since the invalid ones are moved to the end. */
+#define NONCE_LANES 16
+
+int submit_nonces_batch(struct thr_info *thr, struct work *work, uint32_t *nonces,
+			uint32_t *versions, int n)
+{
+	unsigned char hdrs[NONCE_LANES * 80], hashes[NONCE_LANES * 32];
+	uint32_t *work_nonce = (uint32_t *)(work->data + 64 + 12);
+	uint32_t *hash_32 = (uint32_t *)(work->hash + 28);
+	int i, j, k, lanes, valid = 0;
+	uint32_t tmp;
+
+	for (i = 0; i < n; i += lanes) {
+		lanes = n - i;
+		if (lanes > NONCE_LANES)
+			lanes = NONCE_LANES;
+		if (versions) {
+			for (j = 0; j < lanes; j++) {
+				cg_memcpy(work->data, &versions[i + j], 4);
+				*work_nonce = htole32(nonces[i + j]);
+				flip80(hdrs + j * 80, work->data);
+			}
+			sha256d_80_batch(hdrs, hashes, lanes);
+		}
+
+		for (j = 0; j < lanes; j++) {
+			k = i + j;
+			if (!new_nonce(thr, nonces[k]))
+				continue;
+			if (versions) {
+				cg_memcpy(work->data, &versions[k], 4);
+				*work_nonce = htole32(nonces[k]);
+				cg_memcpy(work->hash, hashes + j * 32, 32);
+				if (*hash_32 != 0)
+					continue;
+			} else if (!test_nonce(work, nonces[k]))
+				continue;
+
+			// keep the valid ones in order at the front
+			tmp = nonces[valid];
+			nonces[valid] = nonces[k];
+			nonces[k] = tmp;
+			if (versions) {
+				tmp = versions[valid];
+				versions[valid] = versions[k];
+				versions[k] = tmp;
+			}
+			valid++;
+			check_work_block(work);
+
+			if (opt_benchfile && opt_benchfile_display)
+				benchfile_dspwork(work, nonces[valid - 1]);
+
+			if (!fulltest(work->hash, work->target)) {
+				applog(LOG_INFO, "%s %d: Share above target", thr->cgpu->drv->name,
+				       thr->cgpu->device_id);
+				continue;
+			}
+			submit_work_async(copy_work(work));
+		}
+	}
+
+	if (valid)
+		add_diff1_stats(thr, work->pool, work->device_diff * valid);
+	if (valid < n)
+		inc_hw_errors_n(thr, n - valid);
+
+	return valid;
+}
+
 /* Allows drivers to submit work items where the driver has changed the ntime
  * value by noffset. Must be only used with a work protocol that does not ntime
  * roll itself intrinsically to generate work (eg stratum). We do not touch
@@ -9352,6 +10520,261 @@ void flush_queue(struct cgpu_info *cgpu)
 	}
 }
 
+/* The work ring is a seqlock protected table. Writers are serialised by
+ * ring->lock and bump ring->seq to an odd value while modifying the slots and
+ * the midstate index, and readers retry any lookup that overlapped a write.
+ * Readers announce themselves in ring->readers for the duration of a lookup
+ * and copy, and work removed from the ring is only freed once no readers are
+ * registered since they may still hold a pointer to it. */
+#define RING_EMPTY	(-1)
+#define RING_TOMB	(-2)
+
+static inline int ring_hash(struct work_ring *ring, const char *midstate)
+{
+	uint32_t fp;
+
+	memcpy(&fp, midstate, 4);
+	return (fp * 0x9e3779b1) & (ring->isize - 1);
+}
+
+static void __ring_index_add(struct work_ring *ring, int slotno)
+{
+	struct work_ring_slot *slot = &ring->slots[slotno];
+	int i = ring_hash(ring, (char *)slot->work->midstate);
+
+	while (ring->index[i] >= 0)
+		i = (i + 1) & (ring->isize - 1);
+	if (ring->index[i] == RING_EMPTY)
+		ring->iused++;
+	__atomic_store_n(&ring->index[i], slotno, __ATOMIC_RELAXED);
+	slot->ipos = i;
+}
+
+static void __ring_index_del(struct work_ring *ring, struct work_ring_slot *slot)
+{
+	__atomic_store_n(&ring->index[slot->ipos], RING_TOMB, __ATOMIC_RELAXED);
+	slot->ipos = -1;
+}
+
+/* Clear out tombstones once they make up too much of the index */
+static void __ring_index_rebuild(struct work_ring *ring)
+{
+	int i;
+
+	for (i = 0; i < ring->isize; i++)
+		__atomic_store_n(&ring->index[i], RING_EMPTY, __ATOMIC_RELAXED);
+	ring->iused = 0;
+	for (i = 0; i < ring->size; i++) {
+		if (ring->slots[i].work)
+			__ring_index_add(ring, i);
+	}
+}
+
+static inline void ring_write_begin(struct work_ring *ring)
+{
+	__atomic_store_n(&ring->seq, ring->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void ring_write_end(struct work_ring *ring)
+{
+	__atomic_store_n(&ring->seq, ring->seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline unsigned int ring_read_begin(struct work_ring *ring)
+{
+	unsigned int seq;
+
+	/* Let the writer, which may have been preempted, finish */
+	while ((seq = __atomic_load_n(&ring->seq, __ATOMIC_ACQUIRE)) & 1)
+		sched_yield();
+	return seq;
+}
+
+static inline bool ring_read_retry(struct work_ring *ring, unsigned int seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&ring->seq, __ATOMIC_RELAXED) != seq;
+}
+
+static bool __ring_quiescent(struct work_ring *ring)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return !__atomic_load_n(&ring->readers, __ATOMIC_SEQ_CST);
+}
+
+static void __ring_reclaim(struct work_ring *ring, bool wait)
+{
+	int i;
+
+	if (!ring->retired)
+		return;
+	while (!__ring_quiescent(ring)) {
+		if (!wait)
+			return;
+		sched_yield();
+	}
+	for (i = 0; i < ring->retired; i++)
+		free_work(ring->retire[i]);
+	ring->retired = 0;
+}
+
+static void __ring_retire(struct work_ring *ring, struct work *work)
+{
+	wr_lock(&ring->cgpu->qlock);
+	__work_completed(ring->cgpu, work);
+	wr_unlock(&ring->cgpu->qlock);
+
+	if (unlikely(ring->retired >= ring->size))
+		__ring_reclaim(ring, true);
+	ring->retire[ring->retired++] = work;
+}
+
+/* Create a work ring for cgpu with room for at least size work items. Job ids
+ * passed to work_ring_add are used modulo the rounded up size. */
+struct work_ring *work_ring_new(struct cgpu_info *cgpu, int size)
+{
+	struct work_ring *ring;
+	int i, n = 1;
+
+	while (n < size)
+		n <<= 1;
+	ring = cgcalloc(1, sizeof(struct work_ring));
+	ring->cgpu = cgpu;
+	ring->size = n;
+	ring->isize = n * 2;
+	ring->slots = cgcalloc(n, sizeof(struct work_ring_slot));
+	ring->index = cgmalloc(sizeof(int) * ring->isize);
+	ring->retire = cgcalloc(n, sizeof(struct work *));
+	for (i = 0; i < n; i++)
+		ring->slots[i].ipos = -1;
+	for (i = 0; i < ring->isize; i++)
+		ring->index[i] = RING_EMPTY;
+	mutex_init(&ring->lock);
+
+	return ring;
+}
+
+/* Place work obtained from get_queued() in the slot for id, completing any
+ * work it replaces. */
+void work_ring_add(struct work_ring *ring, uint32_t id, struct work *work)
+{
+	int slotno = id & (ring->size - 1);
+	struct work_ring_slot *slot = &ring->slots[slotno];
+	struct work *old;
+
+	mutex_lock(&ring->lock);
+	old = slot->work;
+	ring_write_begin(ring);
+	if (old)
+		__ring_index_del(ring, slot);
+	__atomic_store_n(&slot->id, id, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->work, work, __ATOMIC_RELAXED);
+	if (ring->iused >= ring->isize / 4 * 3)
+		__ring_index_rebuild(ring);
+	else
+		__ring_index_add(ring, slotno);
+	ring_write_end(ring);
+	if (old)
+		__ring_retire(ring, old);
+	__ring_reclaim(ring, false);
+	mutex_unlock(&ring->lock);
+}
+
+/* Lockless copy of the work currently in the slot for id, or NULL if the slot
+ * is empty or has been reused for a different id */
+struct work *work_ring_clone_byid(struct work_ring *ring, uint32_t id)
+{
+	struct work_ring_slot *slot = &ring->slots[id & (ring->size - 1)];
+	struct work *work, *ret = NULL;
+	unsigned int seq;
+
+	__atomic_add_fetch(&ring->readers, 1, __ATOMIC_SEQ_CST);
+	do {
+		seq = ring_read_begin(ring);
+		work = __atomic_load_n(&slot->work, __ATOMIC_RELAXED);
+		if (work && __atomic_load_n(&slot->id, __ATOMIC_RELAXED) != id)
+			work = NULL;
+	} while (ring_read_retry(ring, seq));
+	if (work)
+		ret = copy_work(work);
+	__atomic_sub_fetch(&ring->readers, 1, __ATOMIC_SEQ_CST);
+
+	return ret;
+}
+
+/* Lockless equivalent of clone_queued_work_bymidstate for work in a ring.
+ * midstatelen must be at least 4. */
+struct work *work_ring_clone_bymidstate(struct work_ring *ring, char *midstate, size_t midstatelen, char *data, int offset, size_t datalen)
+{
+	struct work *work, *ret = NULL;
+	unsigned int seq;
+	int i, probes, slotno;
+
+	__atomic_add_fetch(&ring->readers, 1, __ATOMIC_SEQ_CST);
+	do {
+		seq = ring_read_begin(ring);
+		work = NULL;
+		i = ring_hash(ring, midstate);
+		for (probes = 0; probes < ring->isize; probes++) {
+			slotno = __atomic_load_n(&ring->index[i], __ATOMIC_RELAXED);
+			if (slotno == RING_EMPTY)
+				break;
+			if (slotno >= 0) {
+				work = __atomic_load_n(&ring->slots[slotno & (ring->size - 1)].work,
+						       __ATOMIC_RELAXED);
+				if (work && memcmp(work->midstate, midstate, midstatelen) == 0 &&
+				    memcmp(work->data + offset, data, datalen) == 0)
+					break;
+				work = NULL;
+			}
+			i = (i + 1) & (ring->isize - 1);
+		}
+	} while (ring_read_retry(ring, seq));
+	if (work)
+		ret = copy_work(work);
+	__atomic_sub_fetch(&ring->readers, 1, __ATOMIC_SEQ_CST);
+
+	return ret;
+}
+
+/* Complete all work in the ring */
+void work_ring_flush(struct work_ring *ring)
+{
+	struct work *old;
+	int i;
+
+	mutex_lock(&ring->lock);
+	for (i = 0; i < ring->size; i++) {
+		struct work_ring_slot *slot = &ring->slots[i];
+
+		old = slot->work;
+		if (!old)
+			continue;
+		ring_write_begin(ring);
+		__ring_index_del(ring, slot);
+		__atomic_store_n(&slot->work, NULL, __ATOMIC_RELAXED);
+		ring_write_end(ring);
+		__ring_retire(ring, old);
+	}
+	__ring_reclaim(ring, false);
+	mutex_unlock(&ring->lock);
+}
+
+/* There must be no readers left by the time the ring is freed */
+void work_ring_free(struct work_ring *ring)
+{
+	if (!ring)
+		return;
+	work_ring_flush(ring);
+	__ring_reclaim(ring, true);
+	mutex_destroy(&ring->lock);
+	free(ring->retire);
+	free(ring->index);
+	free(ring->slots);
+	free(ring);
+}
+
 /* This version of hash work is for devices that are fast enough to always
  * perform a full nonce range and need a queue to maintain the device busy.
  * Work creation and destruction is not done from within this function
@@ -9816,7 +11239,7 @@ static void prune_stratum_shares(struct pool *pool)
 		if (sshare->work->pool == pool && current_time > sshare->sshare_time + 120) {
 			HASH_DEL(stratum_shares, sshare);
 			free_work(sshare->work);
-			free(sshare);
+			__free_stratum_share(sshare);
 			cleared++;
 		}
 	}
@@ -9849,6 +11272,7 @@ static void *watchpool_thread(void __maybe_unused *userdata)
 		if (++intervals > 120)
 			intervals = 0;
 		cgtime(&now);
+		update_stats_totals();
 
 		for (i = 0; i < total_pools; i++) {
 			struct pool *pool = pools[i];
@@ -10112,6 +11536,7 @@ void print_summary(void)
 	mins = (diff.tv_sec % 3600) / 60;
 	secs = diff.tv_sec % 60;
 
+	update_stats_totals();
 	utility = total_accepted / total_secs * 60;
 	work_util = total_diff1 / total_secs * 60;
 
@@ -10201,15 +11626,18 @@ static void clean_up(bool restarting)
 #endif
 
 #ifdef USE_USBUTILS
-	usb_polling = false;
-	pthread_join(usb_poll_thread, NULL);
-        libusb_exit(NULL);
+	if (!usb_nolibusb) {
+		usb_polling = false;
+		pthread_join(usb_poll_thread, NULL);
+		libusb_exit(NULL);
+	}
 #endif
 
 	cgtime(&total_tv_end);
 #ifdef WIN32
 	timeEndPeriod(1);
 #endif
+	sharelog_stop();
 #ifdef HAVE_CURSES
 	disable_curses();
 #endif
@@ -10242,6 +11670,7 @@ void __quit(int status, bool clean)
 	if (unlikely(pthread_create(&killall_t, NULL, killall_thread, NULL)))
 		exit(1);
 
+	logging_stop();
 	if (clean)
 		clean_up(false);
 #ifdef HAVE_CURSES
@@ -10929,12 +12358,15 @@ static void *libusb_poll_thread(void __maybe_unused *arg)
 static void initialise_usb(void) {
 	int err = libusb_init(NULL);
 
+	/* Options aren't parsed yet, so only fail once we know there are no
+	 * --usb-sim devices, which don't need libusb e.g. without usbfs */
 	if (err) {
-		fprintf(stderr, "libusb_init() failed err %d", err);
-		fflush(stderr);
-		quit(1, "libusb_init() failed");
+		usb_init_err = err;
+		usb_nolibusb = true;
 	}
 	initialise_usblocks();
+	if (usb_nolibusb)
+		return;
 	usb_polling = true;
 	pthread_create(&usb_poll_thread, NULL, libusb_poll_thread, NULL);
 }
@@ -11010,7 +12442,6 @@ int main(int argc, char *argv[])
 	mutex_init(&console_lock);
 	cglock_init(&control_lock);
 	mutex_init(&stats_lock);
-	mutex_init(&sharelog_lock);
 	cglock_init(&ch_lock);
 	mutex_init(&sshare_lock);
 	rwlock_init(&blk_lock);
@@ -11021,6 +12452,8 @@ int main(int argc, char *argv[])
 	cglock_init(&swt_lock);
 #endif
 
+	sha256_init_backend();
+
 	mutex_init(&lp_lock);
 	if (unlikely(pthread_cond_init(&lp_cond, NULL)))
 		early_quit(1, "Failed to pthread_cond_init lp_cond");
@@ -11277,6 +12710,7 @@ ASSERTbc(sizeof(test_work.hash) == (BC_MAX_BITS / HEX_BYTE));
 #endif
 
 	applog(LOG_WARNING, "Started %s", packagename);
+	applog(LOG_INFO, "Using %s SHA256 implementation", sha256_backend_name());
 	if (cnfbuf) {
 		applog(LOG_NOTICE, "Loaded configuration file %s", cnfbuf);
 		switch (fileconf_load) {
@@ -11308,6 +12742,14 @@ ASSERTbc(sizeof(test_work.hash) == (BC_MAX_BITS / HEX_BYTE));
 		setlogmask(LOG_UPTO(LOG_NOTICE));
 #endif
 
+	if (opt_api_listen && opt_api_metrics_port) {
+		metrics_init();
+		stratum_work_metric = metric_new(METRIC_HISTOGRAM, "cgminer_stratum_work_seconds",
+				"Time to generate one stratum work item", NULL);
+		for (i = 0; i < total_pools; i++)
+			pool_metrics(pools[i]);
+	}
+
 	total_control_threads = 8;
 	control_thr = cgcalloc(total_control_threads, sizeof(*thr));
 
@@ -11320,6 +12762,15 @@ ASSERTbc(sizeof(test_work.hash) == (BC_MAX_BITS / HEX_BYTE));
 	}
 #endif
 #ifdef USE_USBUTILS
+	if (usb_nolibusb) {
+		if (!opt_usb_sim || !*opt_usb_sim) {
+			fprintf(stderr, "libusb_init() failed err %d", usb_init_err);
+			fflush(stderr);
+			quit(1, "libusb_init() failed");
+		}
+		applog(LOG_WARNING, "libusb_init() failed err %d, only using --usb-sim devices",
+		       usb_init_err);
+	}
 	usb_initialise();
 
 	// before device detection
@@ -11372,6 +12823,9 @@ ASSERTbc(sizeof(test_work.hash) == (BC_MAX_BITS / HEX_BYTE));
 			fork_monitor();
 	#endif // defined(unix)
 
+	logging_start();
+	sharelog_start();
+
 	mining_thr = cgcalloc(mining_threads, sizeof(thr));
 	for (i = 0; i < mining_threads; i++)
 		mining_thr[i] = cgcalloc(1, sizeof(*thr));
@@ -11587,9 +13041,11 @@ begin_bench:
 #ifdef USE_USBUTILS
 	hotplug_thr_id = 6;
 	thr = &control_thr[hotplug_thr_id];
-	if (thr_info_create(thr, NULL, hotplug_thread, thr))
-		early_quit(1, "hotplug thread create failed");
-	pthread_detach(thr->pth);
+	if (!usb_nolibusb) {
+		if (thr_info_create(thr, NULL, hotplug_thread, thr))
+			early_quit(1, "hotplug thread create failed");
+		pthread_detach(thr->pth);
+	}
 #endif
 
 #ifdef HAVE_CURSES
@@ -11668,6 +13124,15 @@ begin_bench:
 		};
 		if (pool->has_stratum) {
 			if (opt_gen_stratum_work) {
+				struct work *pregen = get_pregen_work(pool);
+
+				if (pregen) {
+					free_work(work);
+					work = pregen;
+					applog(LOG_DEBUG, "Staging pregenerated stratum work");
+					stage_work(work);
+					continue;
+				}
 				gen_stratum_work(pool, work);
 				applog(LOG_DEBUG, "Generated stratum work");
 				stage_work(work);
@@ -913,8 +913,10 @@ static void avalon_init(struct cgpu_info *avalon)
 
 static struct work *avalon_valid_result(struct cgpu_info *avalon, struct avalon_result *ar)
 {
-	return clone_queued_work_bymidstate(avalon, (char *)ar->midstate, 32,
-					    (char *)ar->data, 64, 12);
+	struct avalon_info *info = avalon->device_data;
+
+	return work_ring_clone_bymidstate(info->ring, (char *)ar->midstate, 32,
+					  (char *)ar->data, 64, 12);
 }
 
 static void avalon_update_temps(struct cgpu_info *avalon, struct avalon_info *info,
@@ -1318,6 +1320,8 @@ static bool avalon_prepare(struct thr_info *thr)
 			       array_size);
 	if (!avalon->works)
 		quit(1, "Failed to calloc avalon works in avalon_prepare");
+	work_ring_free(info->ring);
+	info->ring = work_ring_new(avalon, info->miner_count * array_size);
 
 	info->thr = thr;
 	mutex_init(&info->lock);
@@ -1504,8 +1508,8 @@ static bool avalon_fill(struct cgpu_info *avalon)
 	subid = avalon->queued++;
 	work->subid = subid;
 	slot = avalon->work_array * mc + subid;
-	if (likely(avalon->works[slot]))
-		work_completed(avalon, avalon->works[slot]);
+	/* Completes the work previously in this slot */
+	work_ring_add(info->ring, slot, work);
 	avalon->works[slot] = work;
 	if (avalon->queued < mc)
 		ret = false;
@@ -1628,6 +1632,8 @@ static void avalon_shutdown(struct thr_info *thr)
 	cgsem_destroy(&info->qsem);
 	mutex_destroy(&info->qlock);
 	mutex_destroy(&info->lock);
+	work_ring_free(info->ring);
+	info->ring = NULL;
 	free(avalon->works);
 	avalon->works = NULL;
 }
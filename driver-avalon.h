@@ -148,6 +148,7 @@ struct avalon_info {
 	pthread_t write_thr;
 	pthread_mutex_t lock;
 	pthread_mutex_t qlock;
+	struct work_ring *ring;
 	cgsem_t qsem;
 	cgtimer_t cgsent;
 	int send_delay;
@@ -388,7 +388,13 @@ static uint64_t blockerupter_checknonce(struct cgpu_info *blockerupter, struct b
 	       board, resp->chip, resp->work_idx);
 
 	memcpy(work.data + 4 + 32 + 32, resp->ntime, 4);
-	__bin2hex(work.ntime, resp->ntime, 4);
+	/* work.ntime is shared with the queued work, so use our own copy */
+	if (work.ntime) {
+		char ntime[12];
+
+		__bin2hex(ntime, resp->ntime, 4);
+		work.ntime = shstr_dup(ntime);
+	}
 
 	info->nonces++;
 	cur_brd = &info->b_info[board];
@@ -424,6 +430,7 @@ static uint64_t blockerupter_checknonce(struct cgpu_info *blockerupter, struct b
 		cur_asic->bad++;
 		cur_asic->hwe = cur_asic->nonces ? (double)cur_asic->bad / cur_asic->nonces : 0;
 	}
+	shstr_unref(work.ntime);
 	return hashes;
 }
 
@@ -49,34 +49,11 @@ static uint32_t chip_max;
 // thus code in general ignores sleeping anything less than 200us
 #define TUNE_CODE 1
 
-static void gekko_usleep(struct COMPAC_INFO *info, int usec)
-{
-#if TUNE_CODE
-	struct timeval stt, fin;
-	double td, fac;
-#endif
-
-	// error for usleep()
-	if (usec >= 1000000)
-	{
-		cgsleep_ms(usec / 1000);
-#if TUNE_CODE
-		mutex_lock(&info->slock);
-		info->inv++;
-		mutex_unlock(&info->slock);
-#endif
-		return;
-	}
-
-#if TUNE_CODE
-	cgtime(&stt);
-#endif
-	usleep(usec);
 #if TUNE_CODE
-	cgtime(&fin);
-
-	td = us_tdiff(&fin, &stt);
-	fac = (td / (double)usec);
+// record how long a sleep of usec took (td)
+static void gekko_sleep_stats(struct COMPAC_INFO *info, int64_t usec, double td)
+{
+	double fac = (td / (double)usec);
 
 	mutex_lock(&info->slock);
 	if (td < usec)
@@ -103,6 +80,80 @@ static void gekko_usleep(struct COMPAC_INFO *info, int usec)
 		}
 	}
 	mutex_unlock(&info->slock);
+}
+#endif
+
+static void gekko_usleep(struct COMPAC_INFO *info, int usec)
+{
+#if TUNE_CODE
+	struct timeval stt, fin;
+#endif
+
+	// error for usleep()
+	if (usec >= 1000000)
+	{
+		cgsleep_ms(usec / 1000);
+#if TUNE_CODE
+		mutex_lock(&info->slock);
+		info->inv++;
+		mutex_unlock(&info->slock);
+#endif
+		return;
+	}
+
+#if TUNE_CODE
+	cgtime(&stt);
+#endif
+	usleep(usec);
+#if TUNE_CODE
+	cgtime(&fin);
+	gekko_sleep_stats(info, usec, us_tdiff(&fin, &stt));
+#endif
+}
+
+// a - b in microseconds
+static int64_t gekko_timer_us(cgtimer_t *a, cgtimer_t *b)
+{
+#ifdef WIN32
+	return (a->QuadPart - b->QuadPart) / 10LL;
+#else
+	return (int64_t)(a->tv_sec - b->tv_sec) * 1000000LL
+		+ (a->tv_nsec - b->tv_nsec) / 1000;
+#endif
+}
+
+static void gekko_timer_add_us(cgtimer_t *t, int64_t us)
+{
+#ifdef WIN32
+	t->QuadPart += us * 10LL;
+#else
+	struct timespec ts;
+
+	us_to_timespec(&ts, us);
+	timeraddspec(t, &ts);
+#endif
+}
+
+// gekko_usleep() until usec after ts_start, an absolute deadline
+static void gekko_usleep_r(struct COMPAC_INFO *info, cgtimer_t *ts_start, int64_t usec)
+{
+#if TUNE_CODE
+	struct timeval stt, fin;
+	cgtimer_t due, now;
+	int64_t req;
+
+	due = *ts_start;
+	gekko_timer_add_us(&due, usec);
+	cgtimer_time(&now);
+	req = gekko_timer_us(&due, &now);
+	if (req <= 0)
+		return;
+	cgtime(&stt);
+#endif
+	cgsleep_us_r(ts_start, usec);
+#if TUNE_CODE
+	cgtime(&fin);
+	gekko_sleep_stats(info, req, us_tdiff(&fin, &stt));
 #endif
 }
 
@@ -607,455 +658,129 @@ static void gsf_calc_nb2c(struct cgpu_info *compac)
 	}
 }
 
-static void gc_wipe(struct GEKKOCHIP *gc, struct timeval *now)
+/* info->gh, info->job and asics[].gc are rollwin's with a single writer:
+ * the nonce handler adds to gh/gc and the work thread to job. Anything else
+ * reads them with rollwin_snap() and wipes with rollwin_wipe() */
+static void gc_init(struct ASIC_INFO *asic)
 {
-	// clear out everything
-	gc->zerosec = now->tv_sec;
-	gc->offset = 0;
-	memset(gc->noncenum, 0, sizeof(gc->noncenum));
-	gc->noncesum = 0;
-	gc->last = 0;
+	rollwin_init(&(asic->gc), asic->gcslot, CHNUM, CHTIME, CHNUM);
 }
 
-static void gc_wipe_all(struct COMPAC_INFO *info, struct timeval *now, bool locked)
+static void gekko_rollwin_init(struct COMPAC_INFO *info)
 {
 	int i;
 
-	if (!locked)
-		mutex_lock(&info->ghlock);
-
-	for (i = 0; i < (int)(info->chips); i++)
-		gc_wipe(&(info->asics[i].gc), now);
-
-	if (!locked)
-		mutex_unlock(&info->ghlock);
-}
-
-// update asic->gc offset as at 'now' and correct values
-// info must be locked, wipe creates a new data set
-static void gc_offset(struct COMPAC_INFO *info, struct ASIC_INFO *asic, struct timeval *now, bool wipe, bool locked)
-{
-	struct GEKKOCHIP *gc = &(asic->gc);
-	time_t delta;
-
-	if (!locked)
-		mutex_lock(&info->ghlock);
-
-	// wipe or delta != 0
-	if (wipe || !CHCMP(gc->zerosec, now->tv_sec))
-	{
-		// clear some/all delta data
-
-		delta = CHBASE(now->tv_sec) - CHBASE(gc->zerosec);
-		// if time goes back, also reset everything
-		//  a forward jump of CHNUM will reset the whole buffer
-		if (wipe || delta < 0 || delta >= CHNUM)
-			gc_wipe(gc, now);
-		else
-		{
-			// delta is > 0, but usually always 1 unless,
-			//  due to asic failure, a 10 minutes had no nonces
-			// however the loop will total 1 iteration each
-			//  10 minutes elapsed real time e.g. if not called
-			//  for 30 minutes, it will loop 3 times
-			// there is also a CHNUM-1 limit on that
-
-			gc->zerosec = now->tv_sec;
-			// clear out the old values
-			do
-			{
-				gc->offset = CHOFF(gc->offset+1);
-
-				gc->noncesum -= gc->noncenum[CHOFF(gc->offset)];
-				gc->noncenum[CHOFF(gc->offset)] = 0;
-
-				if (gc->last < (CHNUM-1))
-					gc->last++;
-			}
-			while (--delta > 0);
-		}
-	}
-
-	// if there's been no nonces up to now, history must already be all zero
-	//  so just remove history
-	if (gc->noncesum == 0 && gc->last > 0)
-		gc->last = 0;
-
-	if (!locked)
-		mutex_unlock(&info->ghlock);
+	rollwin_init(&(info->gh), info->ghslot, GHNUM, 1, GHLIMsec);
+	rollwin_init(&(info->job), info->jobslot, JOBMIN, JOBTIME, JOBLIMn);
+	for (i = 0; i < (int)(sizeof(info->asics) / sizeof(info->asics[0])); i++)
+		gc_init(&(info->asics[i]));
 }
 
-// update info->gh offset as at 'now' and correct values
-// info must be locked, wipe creates a new data set and also wipes all asic->gc
-static void gh_offset(struct COMPAC_INFO *info, struct timeval *now, bool wipe, bool locked)
+// wipe info->gh and all asic->gc
+static void gh_wipe(struct COMPAC_INFO *info)
 {
-	struct GEKKOHASH *gh = &(info->gh);
-	time_t delta;
 	int i;
 
-	if (!locked)
-		mutex_lock(&info->ghlock);
-
-	// first time in, wipe is ignored (it's already all zero)
-	if (gh->zerosec == 0)
-	{
-		gh->zerosec = now->tv_sec;
-		for (i = 0; i < (int)(info->chips); i++)
-			info->asics[i].gc.zerosec = now->tv_sec;
-	}
-	else
-	{
-		if (wipe)
-			gc_wipe_all(info, now, true);
-
-		// wipe or delta != 0
-		if (wipe || gh->zerosec != now->tv_sec)
-		{
-			// clear some/all delta data
-
-			delta = now->tv_sec - gh->zerosec;
-			// if time goes back, also reset everything
-			//  N.B. a forward time jump between 2 and GHLIMsec
-			//  seconds will reduce the hash rate value
-			//  but GHLIMsec or more will reset the whole buffer
-			if (wipe || delta < 0 || delta >= GHLIMsec)
-			{
-				// clear out everything
-				gh->zerosec = now->tv_sec;
-				gh->offset = 0;
-				memset(gh->diff, 0, sizeof(gh->diff));
-				memset(gh->firstt, 0, sizeof(gh->firstt));
-				memset(gh->firstd, 0, sizeof(gh->firstd));
-				memset(gh->lastt, 0, sizeof(gh->lastt));
-				memset(gh->noncenum, 0, sizeof(gh->noncenum));
-				gh->diffsum = 0;
-				gh->noncesum = 0;
-				gh->last = 0;
-			}
-			else
-			{
-				// delta is > 0, but usually always 1 unless,
-				//  due to asic failure, a second had no nonces
-				// however the loop will total 1 iteration each
-				//  second elapsed real time e.g. if not called
-				//  for 3 seconds, it will loop 3 times
-				// there is also a GHLIMsec-1 limit on that
-
-				gh->zerosec = now->tv_sec;
-				// clear out the old values
-				do
-				{
-					gh->offset = GHOFF(gh->offset+1);
-
-					gh->diffsum -= gh->diff[GHOFF(gh->offset)];
-					gh->diff[GHOFF(gh->offset)] = 0;
-					gh->noncesum -= gh->noncenum[GHOFF(gh->offset)];
-					gh->noncenum[GHOFF(gh->offset)] = 0;
-
-					gh->firstt[GHOFF(gh->offset)].tv_sec = 0;
-					gh->firstt[GHOFF(gh->offset)].tv_usec = 0;
-					gh->firstd[GHOFF(gh->offset)] = 0;
-					gh->lastt[GHOFF(gh->offset)].tv_sec = 0;
-					gh->lastt[GHOFF(gh->offset)].tv_usec = 0;
-
-					if (gh->last < (GHNUM-1))
-						gh->last++;
-				}
-				while (--delta > 0);
-			}
-		}
-	}
-
-	// if there's been no nonces up to now, history must already be all zero
-	//  so just remove history
-	if (gh->noncesum == 0 && gh->last > 0)
-		gh->last = 0;
-	// this also handles the issue of a nonce-less wipe with a high
-	//  now->tv_usec and if the first nonce comes in during the next second.
-	//  without setting 'last=0' the previous empty full second(s) will
-	//   always be included in the elapsed time used to calc the hash rate
-
-	if (!locked)
-		mutex_unlock(&info->ghlock);
+	rollwin_wipe(&(info->gh));
+	for (i = 0; i < (int)(sizeof(info->asics) / sizeof(info->asics[0])); i++)
+		rollwin_wipe(&(info->asics[i].gc));
 }
 
 // update info->gh with a new nonce as at 'now' (diff=info->difficulty)
-// info must be locked, wipe creates a new data set with the single nonce
+// nonce handler only
 static void add_gekko_nonce(struct COMPAC_INFO *info, struct ASIC_INFO *asic, struct timeval *now)
 {
-	struct GEKKOHASH *gh = &(info->gh);
-
-	mutex_lock(&info->ghlock);
-
-	gh_offset(info, now, false, true);
-
-	if (gh->diff[gh->offset] == 0)
-	{
-		gh->firstt[gh->offset].tv_sec = now->tv_sec;
-		gh->firstt[gh->offset].tv_usec = now->tv_usec;
-		gh->firstd[gh->offset] = info->difficulty;
-	}
-	gh->lastt[gh->offset].tv_sec = now->tv_sec;
-	gh->lastt[gh->offset].tv_usec = now->tv_usec;
-
-	gh->diff[gh->offset] += info->difficulty;
-	gh->diffsum += info->difficulty;
-	(gh->noncenum[gh->offset])++;
-	(gh->noncesum)++;
+	rollwin_add(&(info->gh), now, info->difficulty);
 
 	if (asic != NULL)
-	{
-		struct GEKKOCHIP *gc = &(asic->gc);
-
-		gc_offset(info, asic, now, false, true);
-		(gc->noncenum[gc->offset])++;
-		(gc->noncesum)++;
-	}
-
-	mutex_unlock(&info->ghlock);
+		rollwin_add(&(asic->gc), now, 1);
 }
 
-// calculate MH/s hashrate, info must be locked
+// calculate MH/s hashrate as at 'now'
 // value is 0.0 if there's no useful data
-// caller check info->gh.last for history size used and info->gh.noncesum-1
+// if snap isn't NULL it's set to the info->gh data used, caller check
+//  snap->last for history size used and snap->num-1
 //  for the amount of data used (i.e. accuracy of the hash rate)
-static double gekko_gh_hashrate(struct COMPAC_INFO *info, struct timeval *now, bool locked)
+static double gekko_gh_hashrate(struct COMPAC_INFO *info, struct timeval *now, struct rollsnap *snap)
 {
-	struct GEKKOHASH *gh = &(info->gh);
+	// now, now-1 and the oldest used
+	struct rollslot slots[3];
+	struct rollsnap ghsnap;
 	struct timeval age, end;
-	int zero, last;
-	uint64_t delta;
+	int64_t delta;
 	double ghr, old;
 
 	ghr = 0.0;
 
-	if (!locked)
-		mutex_lock(&info->ghlock);
-
-	// can't be calculated with only one nonce
-	if (gh->diffsum > 0 && gh->noncesum > 1)
-	{
-		gh_offset(info, now, false, true);
-
-		if (gh->diffsum > 0 && gh->noncesum > 1)
-		{
-			// offset of 'now'
-			zero = gh->offset;
-			// offset of oldest nonce
-			last = GHOFF(zero - gh->last);
-
-			if (gh->diff[last] != 0)
-			{
-				// from the oldest nonce, excluding it's diff
-				delta = gh->firstd[last];
-				age.tv_sec = gh->firstt[last].tv_sec;
-				age.tv_usec = gh->firstt[last].tv_usec;
-			}
-			else
-			{
-				// if last is empty, use the start time of last
-				delta = 0;
-				age.tv_sec = gh->zerosec - (GHNUM - 1);
-				age.tv_usec = 0;
-			}
-
-			// up to the time of the newest nonce as long as it
-			//  was curr or prev second, otherwise use now
-			if (gh->diff[zero] != 0)
-			{
-				// time of the newest nonce found this second
-				end.tv_sec = gh->lastt[zero].tv_sec;
-				end.tv_usec = gh->lastt[zero].tv_usec;
-			}
-			else
-			{
-				// unexpected ... no recent nonces ...
-				if (gh->diff[GHOFF(zero-1)] == 0)
-				{
-					end.tv_sec = now->tv_sec;
-					end.tv_usec = now->tv_usec;
-				}
-				else
-				{
-					// time of the newest nonce found this second-1
-					end.tv_sec = gh->lastt[GHOFF(zero-1)].tv_sec;
-					end.tv_usec = gh->lastt[GHOFF(zero-1)].tv_usec;
-				}
-			}
-
-			old = tdiff(&end, &age);
-			if (old > 0.0)
-			{
-				ghr = (double)(gh->diffsum - delta)
-					* (pow(2.0, 32.0) / old) / 1.0e6;
-			}
-		}
-	}
-
-	if (!locked)
-		mutex_unlock(&info->ghlock);
-
-	return ghr;
-}
-
-static void job_offset(struct COMPAC_INFO *info, struct timeval *now, bool wipe, bool locked)
-{
-	struct GEKKOJOB *job = &(info->job);
-	time_t delta;
-	int jobnow;
-
-	jobnow = JOBTIME(now->tv_sec);
+	if (snap == NULL)
+		snap = &ghsnap;
 
-	if (!locked)
-		mutex_lock(&info->joblock);
+	rollwin_snap(&(info->gh), now, snap, slots, 2, true);
 
-	// first time in, wipe is ignored (it's already all zero)
-	if (job->zeromin == 0)
-		job->zeromin = jobnow;
-	else
+	// can't be calculated with only one nonce
+	if (snap->sum > 0 && snap->num > 1)
 	{
-		// wipe or delta != 0
-		if (wipe || job->zeromin != jobnow)
+		if (slots[2].sum != 0)
 		{
-			// clear some/all delta data
-
-			delta = jobnow - job->zeromin;
-			// if time goes back, also reset everything
-			//  N.B. a forward time jump between 2 and JOBLIMn
-			//  seconds will reduce the job rate value
-			//  but JOBLIMn or more will reset the whole buffer
-			if (wipe || delta < 0 || delta >= JOBLIMn)
-			{
-				// clear out everything
-				job->zeromin = jobnow;
-				job->lastjob.tv_sec = 0;
-				job->lastjob.tv_usec = 0;
-				job->offset = 0;
-				memset(job->firstj, 0, sizeof(job->firstj));
-				memset(job->lastj, 0, sizeof(job->lastj));
-				memset(job->jobnum, 0, sizeof(job->jobnum));
-				memset(job->avgms, 0, sizeof(job->avgms));
-				memset(job->minms, 0, sizeof(job->minms));
-				memset(job->maxms, 0, sizeof(job->maxms));
-				job->jobsnum = 0;
-				job->last = 0;
-			}
-			else
-			{
-				// delta is > 0, but usually always 1 unless,
-				//  due to asic or pool failure, a minute had no jobs
-				// however the loop will total 1 iteration each
-				//  minute elapsed real time e.g. if not called
-				//  for 2 minutes, it will loop 2 times
-				// there is also a JOBLIMn-1 limit on that
-
-				job->zeromin = jobnow;
-				// clear out the old values
-				do
-				{
-					job->offset = JOBOFF(job->offset+1);
-
-					job->firstj[JOBOFF(job->offset)].tv_sec = 0;
-					job->firstj[JOBOFF(job->offset)].tv_usec = 0;
-					job->lastj[JOBOFF(job->offset)].tv_sec = 0;
-					job->lastj[JOBOFF(job->offset)].tv_usec = 0;
-
-					job->jobsnum -= job->jobnum[JOBOFF(job->offset)];
-					job->jobnum[JOBOFF(job->offset)] = 0;
-					job->avgms[JOBOFF(job->offset)] = 0;
-					job->minms[JOBOFF(job->offset)] = 0;
-					job->maxms[JOBOFF(job->offset)] = 0;
-
-					if (job->last < (JOBMIN-1))
-						job->last++;
-				}
-				while (--delta > 0);
-			}
+			// from the oldest nonce, excluding it's diff
+			delta = slots[2].firstv;
+			age.tv_sec = slots[2].firstt.tv_sec;
+			age.tv_usec = slots[2].firstt.tv_usec;
 		}
-	}
-
-	// if there's been no jobs up to now, history must already be all zero
-	//  so just remove history
-	if (job->jobsnum == 0 && job->last > 0)
-		job->last = 0;
-	// this also handles the issue of a job-less wipe with a high
-	//  now->tv_usec and if the first job comes in during the next minute.
-	//  without setting 'last=0' the previous empty full minute will
-	//   always be included in the elapsed time used to calc the job rate
-
-	if (!locked)
-		mutex_unlock(&info->joblock);
-}
-
-// update info->job with a job as at 'now'
-// info must be locked, wipe creates a new empty data set
-static void add_gekko_job(struct COMPAC_INFO *info, struct timeval *now, bool wipe)
-{
-	struct GEKKOJOB *job = &(info->job);
-	bool firstjob;
-	double avg;
-	double ms;
-
-	mutex_lock(&info->joblock);
-
-	job_offset(info, now, wipe, true);
-
-	if (!wipe)
-	{
-		if (job->jobnum[job->offset] == 0)
+		else
 		{
-			job->firstj[job->offset].tv_sec = now->tv_sec;
-			job->firstj[job->offset].tv_usec = now->tv_usec;
-			firstjob = true;
+			// if last is empty, use the start time of last
+			delta = 0;
+			age.tv_sec = snap->zero - (GHNUM - 1);
+			age.tv_usec = 0;
 		}
-		else
-			firstjob = false;
 
-		job->lastj[job->offset].tv_sec = now->tv_sec;
-		job->lastj[job->offset].tv_usec = now->tv_usec;
-
-		// first job time in each offset gets ignored
-		// this is only necessary for the very first job,
-		//  but easier to do it for every offset group
-		if (firstjob)
+		// up to the time of the newest nonce as long as it
+		//  was curr or prev second, otherwise use now
+		if (slots[0].sum != 0)
 		{
-			// already true
-			// job->avgms[job->offset] = 0.0;
-			// job->minms[job->offset] = 0.0;
-			// job->maxms[job->offset] = 0.0;
+			// time of the newest nonce found this second
+			end.tv_sec = slots[0].lastt.tv_sec;
+			end.tv_usec = slots[0].lastt.tv_usec;
 		}
 		else
 		{
-			avg = job->avgms[job->offset] * (double)(job->jobnum[job->offset] - 1);
-
-			ms = (double)(now->tv_sec - job->lastjob.tv_sec) * 1000.0;
-			ms += (double)(now->tv_usec - job->lastjob.tv_usec) / 1000.0;
-
-			// jobnum[] must be > 0
-			job->avgms[job->offset] = (avg + ms) / (double)(job->jobnum[job->offset]);
-
-			if (job->minms[job->offset] == 0.0)
+			// unexpected ... no recent nonces ...
+			if (slots[1].sum == 0)
 			{
-				job->minms[job->offset] = ms;
-				job->maxms[job->offset] = ms;
+				end.tv_sec = now->tv_sec;
+				end.tv_usec = now->tv_usec;
 			}
 			else
 			{
-				if (ms < job->minms[job->offset])
-					job->minms[job->offset] = ms;
-				if (job->maxms[job->offset] < ms)
-					job->maxms[job->offset] = ms;
+				// time of the newest nonce found this second-1
+				end.tv_sec = slots[1].lastt.tv_sec;
+				end.tv_usec = slots[1].lastt.tv_usec;
 			}
 		}
 
-		(job->jobnum[job->offset])++;
-		(job->jobsnum)++;
-
-		job->lastjob.tv_sec = now->tv_sec;
-		job->lastjob.tv_usec = now->tv_usec;
+		old = tdiff(&end, &age);
+		if (old > 0.0)
+		{
+			ghr = (double)(snap->sum - delta)
+				* (pow(2.0, 32.0) / old) / 1.0e6;
+		}
 	}
 
-	mutex_unlock(&info->joblock);
+	return ghr;
+}
+
+// update info->job with a job as at 'now', work thread only
+// the value is the us since the previous job, the first in each slot
+//  is ignored for the avg/min/max (firstv)
+static void add_gekko_job(struct COMPAC_INFO *info, struct timeval *now)
+{
+	int64_t us = 0;
+
+	if (info->job.lastt.tv_sec != 0)
+		us = (int64_t)us_tdiff(now, &(info->job.lastt));
+
+	rollwin_add(&(info->job), now, us);
 }
 
 // ignore nonces for this many work items after the ticket change
@@ -1175,21 +900,21 @@ static void set_ticket(struct cgpu_info *compac, float diff, bool force, bool lo
 		compac->cgminer_id, compac->drv->name, compac->device_id,
 		new_mask, new_diff, udiff, diff);
 
-	// wipe info->gh/asic->gc
-	cgtime(&now);
-	gh_offset(info, &now, true, false);
-	job_offset(info, &now, true, false);
+	// wipe info->gh/asic->gc/info->job
+	gh_wipe(info);
+	rollwin_wipe(&(info->job));
 	// reset P:
 	info->frequency_computed = 0;
 }
 
-// expected nonces for GEKKOCHIP - MUST already be locked AND gc_offset()
+// expected nonces for asic->gc as at 'now'
 // full 50 mins + current offset in 10 mins - N.B. uses CLOCK_MONOTONIC
 // it will grow from 0% to ~100% between 50 & 60 mins if the chip
 //  is performing at 100% - random variance of course also applies
 static double noncepercent(struct COMPAC_INFO *info, int chip, struct timeval *now)
 {
 	double sec, hashpersec, noncepersec, nonceexpect;
+	struct rollsnap gcsnap;
 
 	if (info->asic_type != BM1397 && info->asic_type != BM1362
 	&&  info->asic_type != BM1370)
@@ -1212,7 +937,9 @@ static double noncepercent(struct COMPAC_INFO *info, int chip, struct timeval *n
 	if (nonceexpect == 0.0)
 		return 0.0;
 
-	return 100.0 * (double)(info->asics[chip].gc.noncesum) / nonceexpect;
+	rollwin_snap(&(info->asics[chip].gc), now, &gcsnap, NULL, 0, false);
+
+	return 100.0 * (double)(gcsnap.num) / nonceexpect;
 }
 
 // GSF/GSFM any chip count
@@ -2036,8 +1763,7 @@ static void compac_set_frequency_single(struct cgpu_info *compac, float frequenc
 		//compac_send(compac, gateblk, sizeof(gateblk), 8 * sizeof(gateblk) - 8); // chain inactive
 
 		// wipe info->gh/asic->gc
-		cgtime(&now);
-		gh_offset(info, &now, true, false);
+		gh_wipe(info);
 		// reset P:
 		info->frequency_computed = 0;
 	}
@@ -2133,8 +1859,7 @@ static void compac_set_frequency(struct cgpu_info *compac, float frequency)
 	compac_update_rates(compac);
 
 	// wipe info->gh/asic->gc
-	cgtime(&now);
-	gh_offset(info, &now, true, false);
+	gh_wipe(info);
 	// reset P:
 	info->frequency_computed = 0;
 }
@@ -2231,18 +1956,54 @@ static void compac_toggle_reset(struct cgpu_info *compac)
 	cgtime(&info->last_reset);
 }
 
-static void compac_gsf_nonce(struct cgpu_info *compac, K_ITEM *item)
+// Record that job_id was sent to the chips at *sent
+static void job_sent(struct COMPAC_INFO *info, uint32_t job_id, struct timeval *sent)
+{
+	struct GEKKOSENT *js;
+
+	mutex_lock(&info->lock);
+	js = &(info->jsent[info->jsent_n++ % JOB_SENT]);
+	js->job_id = job_id;
+	js->sent.tv_sec = sent->tv_sec;
+	js->sent.tv_usec = sent->tv_usec;
+	mutex_unlock(&info->lock);
+}
+
+/* Fill jobs[] with the job_ids that were on the chips when a nonce was
+ * received at *when, newest first - i.e. jobs[i] is the job sent i before
+ * the one that was current then. Work sent after *when can't have produced
+ * the nonce so it's skipped. Returns 0 if nothing has been sent yet.
+ * Only used to order the recovery search, an exact job_id match is always
+ * tried first whenever its work was sent.
+ * info->lock must be held */
+static int job_window(struct COMPAC_INFO *info, struct timeval *when, uint32_t *jobs, int max)
+{
+	struct GEKKOSENT *js;
+	unsigned int n = info->jsent_n, back;
+	int got = 0;
+
+	for (back = 1; back <= n && back <= JOB_SENT && got < max; back++)
+	{
+		js = &(info->jsent[(n - back) % JOB_SENT]);
+		if (got == 0 && tdiff(&(js->sent), when) > 0)
+			continue;
+		jobs[got++] = js->job_id;
+	}
+	return got;
+}
+
+static void compac_gsf_nonce(struct cgpu_info *compac, struct COMPAC_NONCE *nrec)
 {
 	struct COMPAC_INFO *info = compac->device_data;
-	unsigned char *rx = DATA_NONCE(item)->rx;
+	unsigned char *rx = nrec->rx;
 	int hwe = compac->hw_errors;
 	struct work *work = NULL;
-	uint32_t job_id = 0;
+	uint32_t job_id = 0, jobs[CUR_ATTEMPT_1397];
 	uint32_t nonce = 0, bv = 0;
 	int domid, midnum = 0;
 	double diff = 0.0;
 	bool boost, ok;
-	int asic_id, i;
+	int asic_id, i, njobs;
 
 	if (info->asic_type != BM1397)
 		return;
@@ -2326,6 +2087,8 @@ static void compac_gsf_nonce(struct cgpu_info *compac, K_ITEM *item)
 	// test the exact jobid/midnum
 	uint32_t w_job_id = job_id & 0xfc;
 
+	njobs = job_window(info, &(nrec->when), jobs, (int)CUR_ATTEMPT_1397);
+
 	if (w_job_id <= info->max_job_id)
 	{
 		work = info->work[w_job_id];
@@ -2350,10 +2113,10 @@ static void compac_gsf_nonce(struct cgpu_info *compac, K_ITEM *item)
 
 	if (!ok)
 	{
-		// not found, try each cur_attempt_1397
-		for (i = 0; !ok && i < (int)CUR_ATTEMPT_1397; i++)
+		// not found, try each job that was on the chips at the time
+		for (i = 0; !ok && i < njobs; i++)
 		{
-			w_job_id = JOB_ID_ROLL(info->job_id, cur_attempt_1397[i], info) & 0xfc;
+			w_job_id = jobs[i] & 0xfc;
 			work = info->work[w_job_id];
 			if (work)
 			{
@@ -2378,8 +2141,8 @@ static void compac_gsf_nonce(struct cgpu_info *compac, K_ITEM *item)
 
 						applog(LOG_INFO, "%d: %s %d - Nonce Recovered : %08x @ job[%02x]->fix[%02x] len %u prelen %u",
 							compac->cgminer_id, compac->drv->name, compac->device_id,
-							nonce, job_id, w_job_id, (uint32_t)(DATA_NONCE(item)->len),
-							(uint32_t)(DATA_NONCE(item)->prelen));
+							nonce, job_id, w_job_id, (uint32_t)(nrec->len),
+							(uint32_t)(nrec->prelen));
 					}
 				}
 			}
@@ -2518,9 +2281,9 @@ static void compac_gsf_nonce(struct cgpu_info *compac, K_ITEM *item)
 		mutex_unlock(&info->lock);
 
 		if (info->nb2c_setup)
-			add_gekko_nonce(info, asic, &(DATA_NONCE(item)->when));
+			add_gekko_nonce(info, asic, &(nrec->when));
 		else
-			add_gekko_nonce(info, NULL, &(DATA_NONCE(item)->when));
+			add_gekko_nonce(info, NULL, &(nrec->when));
 	}
 	else
 	{
@@ -2534,21 +2297,24 @@ static void compac_gsf_nonce(struct cgpu_info *compac, K_ITEM *item)
 	}
 }
 
-static void compac_gsa1_nonce(struct cgpu_info *compac, K_ITEM *item)
+/* Resolve a BM1362/BM1370 reply to its work and nonce, with the version the
+ * nonce was found with in work->data, or NULL if it's a dup or HW error.
+ * The caller submits it with the rest of the burst */
+static struct work *compac_gsa1_check(struct cgpu_info *compac, struct COMPAC_NONCE *nrec,
+				      uint32_t *nonce_out, uint32_t *bv_out, struct ASIC_INFO **asic_out)
 {
 	struct COMPAC_INFO *info = compac->device_data;
-	unsigned char *rx = DATA_NONCE(item)->rx;
-	int hwe = compac->hw_errors;
+	unsigned char *rx = nrec->rx;
 	struct work *work = NULL;
-	uint32_t w_job_id, job_id, cur_job_id;
+	uint32_t w_job_id, job_id, cur_job_id, jobs[CUR_ATTEMPT_MAX];
 	uint32_t version;
 	uint32_t nonce;
 	double diff = 0.0;
-	int asic_id, i, v;
+	int asic_id, i, v, lim, njobs;
 	bool ok;
 
 	if (info->asic_type != BM1362 && info->asic_type != BM1370)
-		return;
+		return NULL;
 
 	if (info->asic_type == BM1362)
 		job_id = rx[7] & JOBID_1362;
@@ -2587,7 +2353,7 @@ static void compac_gsa1_nonce(struct cgpu_info *compac, K_ITEM *item)
 			info->mining_state = MINER_MINING_DUPS;
 		mutex_unlock(&info->lock);
 
-		return;
+		return NULL;
 	}
 
 	mutex_lock(&info->lock);
@@ -2600,6 +2366,12 @@ static void compac_gsa1_nonce(struct cgpu_info *compac, K_ITEM *item)
 
 	ok = false;
 
+	if (info->asic_type == BM1362)
+		lim = (int)CUR_ATTEMPT_1362;
+	else
+		lim = (int)CUR_ATTEMPT_1370;
+	njobs = job_window(info, &(nrec->when), jobs, lim);
+
 	w_job_id = job_id;
 
 	work = info->work[w_job_id];
@@ -2618,19 +2390,10 @@ static void compac_gsa1_nonce(struct cgpu_info *compac, K_ITEM *item)
 	// this normally never happens ...
 	if (!ok)
 	{
-		int lim;
-		if (info->asic_type == BM1362)
-			lim = (int)CUR_ATTEMPT_1362;
-		else
-			lim = (int)CUR_ATTEMPT_1370;
-		// not current, so try each cur_attempt_1362/70
-		for (i = 0; !ok && i < lim; i++)
+		// if the data is corrupt, try each job that was on the chips at the time
+		for (i = 0; !ok && i < njobs; i++)
 		{
-			// if the data is corrupt, attempt based on the current job_id
-			if (info->asic_type == BM1362)
-				w_job_id = JOB_ID_ROLL(cur_job_id, cur_attempt_1362[i], info) & JOBID_1362;
-			else
-				w_job_id = JOB_ID_ROLL(cur_job_id, cur_attempt_1370[i], info);
+			w_job_id = jobs[i];
 			work = info->work[w_job_id];
 			if (work && w_job_id != job_id)
 			{
@@ -2648,8 +2411,8 @@ static void compac_gsa1_nonce(struct cgpu_info *compac, K_ITEM *item)
 					applog(LOG_INFO, "%d: %s %d - Nonce Recovered : %08x @ job[%02x]->fix[%02x] cur[%02d] len %u prelen %u nonce diff %0.1f",
 						compac->cgminer_id, compac->drv->name, compac->device_id,
 						nonce, job_id, w_job_id, cur_job_id,
-						(uint32_t)(DATA_NONCE(item)->len),
-						(uint32_t)(DATA_NONCE(item)->prelen), diff);
+						(uint32_t)(nrec->len),
+						(uint32_t)(nrec->prelen), diff);
 				}
 			}
 		}
@@ -2663,7 +2426,7 @@ static void compac_gsa1_nonce(struct cgpu_info *compac, K_ITEM *item)
 			inc_hw_errors_n(info->thr, info->difficulty);
 			cgtime(&info->last_hwerror);
 			mutex_unlock(&info->lock);
-			return;
+			return NULL;
 		}
 	}
 
@@ -2756,11 +2519,28 @@ static void compac_gsa1_nonce(struct cgpu_info *compac, K_ITEM *item)
 	}
 
 	if (work)
+	{
 		work->device_diff = info->difficulty;
+		cg_memcpy(bv_out, work->data, 4);
+	}
 
 	mutex_unlock(&info->lock);
 
-	if (work && submit_nonce(info->thr, work, nonce))
+	*nonce_out = nonce;
+	*asic_out = asic;
+	return work;
+}
+
+// Submit the checked nonces of a burst for one work item together
+static void compac_gsa1_submit(struct cgpu_info *compac, struct work *work, struct ASIC_INFO *asic,
+				struct timeval *when, uint32_t *nonces, uint32_t *versions, int n)
+{
+	struct COMPAC_INFO *info = compac->device_data;
+	int hwe = compac->hw_errors;
+	int valid;
+
+	valid = submit_nonces_batch(info->thr, work, nonces, versions, n);
+	if (valid)
 	{
 		mutex_lock(&info->lock);
 
@@ -2768,36 +2548,74 @@ static void compac_gsa1_nonce(struct cgpu_info *compac, K_ITEM *item)
 		cgtime(&asic->last_nonce);
 
 		// count of valid nonces
-		asic->nonces++; // info only
+		asic->nonces += valid; // info only
 
 		// if work diff < info->dificulty, 'accept' hash rate will be low
-		info->hashes += info->difficulty * 0xffffffffull;
-		info->xhashes += info->difficulty;
+		info->hashes += info->difficulty * 0xffffffffull * valid;
+		info->xhashes += info->difficulty * valid;
 
-		info->accepted++;
+		info->accepted += valid;
 		info->failing = false;
 		info->dups = 0;
 		asic->dups = 0;
 		mutex_unlock(&info->lock);
 
-		add_gekko_nonce(info, asic, &(DATA_NONCE(item)->when));
+		rollwin_add(&(info->gh), when, (int64_t)(info->difficulty) * valid);
+		rollwin_add(&(asic->gc), when, valid);
 	}
-	else
+
+	// shouldn't be possible since diff has already been checked
+	if (hwe != compac->hw_errors)
 	{
-		// shouldn't be possible since diff has already been checked
-		if (hwe != compac->hw_errors)
-		{
-			mutex_lock(&info->lock);
-			cgtime(&info->last_hwerror);
-			mutex_unlock(&info->lock);
+		mutex_lock(&info->lock);
+		cgtime(&info->last_hwerror);
+		mutex_unlock(&info->lock);
+	}
+}
+
+/* BM1362/BM1370 chips reply with a burst of nonces after each job, so check
+ * up to GSA1_BURST queued replies then submit them grouped by work item with
+ * submit_nonces_batch(). Returns the new ring tail */
+static unsigned int compac_gsa1_nonces(struct cgpu_info *compac, unsigned int tail, unsigned int head)
+{
+	struct COMPAC_INFO *info = compac->device_data;
+	uint32_t nonces[GSA1_BURST], versions[GSA1_BURST];
+	struct ASIC_INFO *asic, *basic = NULL;
+	struct work *work, *bwork = NULL;
+	struct COMPAC_NONCE *nrec;
+	struct timeval when;
+	uint32_t nonce, bv;
+	int i, n = 0;
+
+	for (i = 0; i < GSA1_BURST && tail != head; i++)
+	{
+		nrec = &(info->nring[tail++ & (NONCE_RING - 1)]);
+		work = compac_gsa1_check(compac, nrec, &nonce, &bv, &asic);
+		if (!work)
+			continue;
+
+		if (n && (work != bwork || asic != basic))
+		{
+			compac_gsa1_submit(compac, bwork, basic, &when, nonces, versions, n);
+			n = 0;
 		}
+		bwork = work;
+		basic = asic;
+		copy_time(&when, &(nrec->when));
+		nonces[n] = nonce;
+		versions[n++] = bv;
 	}
+	if (n)
+		compac_gsa1_submit(compac, bwork, basic, &when, nonces, versions, n);
+
+	__atomic_store_n(&info->ntail, tail, __ATOMIC_RELEASE);
+	return tail;
 }
 
-static void compac_gsk_nonce(struct cgpu_info *compac, K_ITEM *item)
+static void compac_gsk_nonce(struct cgpu_info *compac, struct COMPAC_NONCE *nrec)
 {
 	struct COMPAC_INFO *info = compac->device_data;
-	unsigned char *rx = DATA_NONCE(item)->rx;
+	unsigned char *rx = nrec->rx;
 	int hwe = compac->hw_errors;
 	struct work *work = NULL;
 	uint32_t w_job_id, job_id, cur_job_id;
@@ -2813,7 +2631,7 @@ applog(LOG_ERR, "DBG checking BF nonces");
     // multiple nonces (normally 51 bytes: 0f04 ... 12x4byte ... checksum)
     // TODO: read in reverse with task markers ... zzz
 	// doesn't task markers mean that high nonces are thrown away?!?
-    rxlen = DATA_NONCE(item)->len;
+    rxlen = nrec->len;
     for (i = 2; i < rxlen; i += 4)
     {
 	nonce = (rx[i+3] << 0) | (rx[i+2] << 8) | (rx[i+1] << 16) | (rx[i] << 24);
@@ -2913,8 +2731,8 @@ applog(LOG_ERR, "DBG submit would be: N:'%s' BV:'%s' work=%02x %02x %02x %02x",
 
 					applog(LOG_INFO, "%d: %s %d - Nonce Recovered : %08x @ job[%02x]->fix[%02x] len %u prelen %u nonce diff %0.1f",
 						compac->cgminer_id, compac->drv->name, compac->device_id,
-						nonce, job_id, w_job_id, (uint32_t)(DATA_NONCE(item)->len),
-						(uint32_t)(DATA_NONCE(item)->prelen), diff);
+						nonce, job_id, w_job_id, (uint32_t)(nrec->len),
+						(uint32_t)(nrec->prelen), diff);
 				}
 			}
 		}
@@ -3045,7 +2863,7 @@ applog(LOG_ERR, "DBG submit would be: N:'%s' BV:'%s' work=%02x %02x %02x %02x",
 		asic->dups = 0;
 		mutex_unlock(&info->lock);
 
-		add_gekko_nonce(info, asic, &(DATA_NONCE(item)->when));
+		add_gekko_nonce(info, asic, &(nrec->when));
 	}
 	else
 	{
@@ -3452,6 +3270,83 @@ static void change_freq_any(struct cgpu_info *compac, float new_freq)
 }
 
 // compac_mine() with long term adjustments
+/* A task sent with usb_write_async, the mine thread carries on and the
+ * send is accounted for when the write completes */
+struct GEKKO_TX
+{
+	uint32_t job_id;
+	int task_len;
+	bool busy;
+	struct timeval sent;
+};
+
+static void compac_task_sent(struct cgpu_info *compac, void *userdata, int err,
+			     unsigned char __maybe_unused *buf, int amount)
+{
+	struct COMPAC_INFO *info = compac->device_data;
+	struct GEKKO_TX *tx = (struct GEKKO_TX *)userdata;
+
+	if (err != LIBUSB_SUCCESS)
+	{
+		applog(LOG_WARNING, "%d: %s %d - usb failure (%d)",
+			compac->cgminer_id, compac->drv->name, compac->device_id, err);
+		if (info->mining_state != MINER_SHUTDOWN)
+		{
+			if (info->reset_reinit)
+				info->mining_state = MINER_REINIT;
+			else
+				info->mining_state = MINER_RESET;
+		}
+	}
+	else if (amount != tx->task_len)
+	{
+		if (ms_tdiff(&(tx->sent), &info->last_write_error) > (5 * 1000)) {
+			applog(LOG_WARNING, "%d: %s %d - usb write error [%d:%d] task [%02x]",
+				compac->cgminer_id, compac->drv->name, compac->device_id,
+				amount, tx->task_len, tx->job_id);
+			cgtime(&info->last_write_error);
+		}
+	}
+	else
+	{
+		applog(LOG_INFO, "%d: %s %d - Sent task [%02x] len %3u",
+			compac->cgminer_id, compac->drv->name, compac->device_id,
+			tx->job_id, tx->task_len);
+		add_gekko_job(info, &(tx->sent));
+		if (!tx->busy)
+			job_sent(info, tx->job_id, &(tx->sent));
+	}
+	free(tx);
+	__atomic_store_n(&info->tx_busy, false, __ATOMIC_RELEASE);
+}
+
+/* Only one task write is in flight so they reach the chips in order, the
+ * previous one has normally long completed by the time the next is due */
+static int compac_task_async(struct cgpu_info *compac, struct COMPAC_INFO *info,
+			     int task_len, bool busy, struct timeval *now)
+{
+	struct GEKKO_TX *tx;
+	int err;
+
+	while (__atomic_load_n(&info->tx_busy, __ATOMIC_ACQUIRE))
+		cgsleep_us(50);
+
+	tx = cgmalloc(sizeof(*tx));
+	tx->job_id = info->job_id;
+	tx->task_len = task_len;
+	tx->busy = busy;
+	copy_time(&(tx->sent), now);
+
+	__atomic_store_n(&info->tx_busy, true, __ATOMIC_RELEASE);
+	err = usb_write_async(compac, (char *)info->task, task_len, C_SENDWORK, compac_task_sent, tx);
+	if (err)
+	{
+		__atomic_store_n(&info->tx_busy, false, __ATOMIC_RELEASE);
+		free(tx);
+	}
+	return err;
+}
+
 static void *compac_mine2(void *object)
 {
 	struct cgpu_info *compac = (struct cgpu_info *)object;
@@ -3476,8 +3371,11 @@ static void *compac_mine2(void *object)
 	float frequency_computed;
 	bool frequency_updated;
 	bool has_freq;
-	bool job_added;
+	bool job_added, sent_async;
 	bool last_was_busy = false;
+	bool paced;
+	cgtimer_t task_due, task_now;
+	struct rollsnap ghsnap;
 
 	int plateau_type = 0;
 
@@ -3495,6 +3393,7 @@ static void *compac_mine2(void *object)
 	sleep_us = 100;
 
 	cgtime(&last_plateau_check);
+	cgtimer_time(&task_due);
 
 	while (info->mining_state != MINER_SHUTDOWN)
 	{
@@ -3571,15 +3470,20 @@ gekko_usleep(info, MS2US(999));
 		// don't change anything until we have 10s of data since a reset
 		if (ms_tdiff(&now, &info->last_reset) > MS_SECOND_10)
 		{
+			rollwin_snap(&(info->gh), &now, &ghsnap, NULL, 0, false);
+
 			if (ms_tdiff(&now, &last_rolling) >= MS_SECOND_1)
 			{
-				mutex_lock(&info->ghlock);
-				if (info->gh.noncesum > (GHNONCENEEDED+1))
+				struct timeval rolled;
+				double rolling;
+
+				cgtime(&rolled);
+				rolling = gekko_gh_hashrate(info, &rolled, &ghsnap);
+				if (ghsnap.num > (GHNONCENEEDED+1))
 				{
-					cgtime(&last_rolling);
-					info->rolling = gekko_gh_hashrate(info, &last_rolling, true);
+					last_rolling = rolled;
+					info->rolling = rolling;
 				}
-				mutex_unlock(&info->ghlock);
 			}
 
 			hashrate_gs = (double)info->rolling * 1000000ull;
@@ -3795,7 +3699,7 @@ gekko_usleep(info, MS2US(999));
 				if ((plateau_type == 0)
 				&&  (ms_tdiff(&now, &last_movement) > MS_SECOND_1)
 				&&  (info->frequency < info->frequency_requested)
-				&&  (info->gh.noncesum > GHNONCENEEDED))
+				&&  (ghsnap.num > GHNONCENEEDED))
 				{
 					float new_frequency = info->frequency + info->step_freq;
 
@@ -3813,7 +3717,7 @@ gekko_usleep(info, MS2US(999));
 
 				// when we have enough nonces or gh is full
 				if (!info->lock_freq
-				&&  (info->gh.last == (GHNUM-1) || info->gh.noncesum > GHNONCES)
+				&&  (ghsnap.last == (GHNUM-1) || ghsnap.num > GHNONCES)
 				&&  (ms_tdiff(&now, &info->tune_limit) >= MS_MINUTE_2))
 				{
 					float new_freq, prev_freq;
@@ -3822,13 +3726,11 @@ gekko_usleep(info, MS2US(999));
 
 					prev_freq = info->frequency;
 
-					mutex_lock(&info->ghlock);
-					curr_hr = gekko_gh_hashrate(info, &now, true);
-					nonces = info->gh.noncesum;
-					last = info->gh.last;
-					mutex_unlock(&info->ghlock);
+					curr_hr = gekko_gh_hashrate(info, &now, &ghsnap);
+					nonces = ghsnap.num;
+					last = ghsnap.last;
 
-					// verify with locked values
+					// verify with current values
 					if ((last == (GHNUM-1)) || (nonces > GHNONCES))
 					{
 						hash_for_freq = info->frequency * (double)(info->cores * info->chips);
@@ -3932,6 +3834,7 @@ gekko_usleep(info, MS2US(999));
 		double wd;
 
 		// don't delay work updates when doing busy work
+		paced = false;
 		if (info->work_usec_num > 1 && !last_was_busy)
 		{
 			// check if we got here early
@@ -3941,10 +3844,17 @@ gekko_usleep(info, MS2US(999));
 			left_us = info->max_task_wait - diff_us;
 			if (left_us > 0)
 			{
-				// allow time for get_queued() + a bit
+				/* allow time for get_queued() + a bit, then the task
+				 * is prepared and sent exactly when due below. Sleep
+				 * to an absolute monotonic deadline so any overshoot
+				 * doesn't add up across tasks */
 				left_us -= (info->work_usec_avg + USLEEPPLUS);
 				if (left_us >= USLEEPMIN)
-					gekko_usleep(info, left_us);
+				{
+					gekko_usleep_r(info, &task_due, info->max_task_wait
+							- (info->work_usec_avg + USLEEPPLUS));
+				}
+				paced = true;
 			}
 			else
 			{
@@ -3954,6 +3864,7 @@ gekko_usleep(info, MS2US(999));
 				{
 					info->over1num++;
 					info->over1amt -= left_us;
+					metric_add(info->m_work_late, 1);
 				}
 #endif
 			}
@@ -3990,6 +3901,8 @@ applog(LOG_ERR, "DBG BF got work");
 			}
 
 			info->work_usec_num++;
+			metric_observe(info->m_work_get, wd);
+			metric_set(info->m_work_avg, info->work_usec_avg / 1000000.0);
 
 			if (last_was_busy)
 				last_was_busy = false;
@@ -4095,6 +4008,20 @@ for (i = 0; i < task_len; i += 8)
 			compac->cgminer_id, compac->drv->name, compac->device_id, jid, task_len);
 #endif
 
+		/* the task is ready early, send it when it's due and advance
+		 * the deadline a whole period so the send times don't drift,
+		 * only re-anchor it when late or not pacing */
+		if (paced && work && !last_was_busy)
+		{
+			gekko_timer_add_us(&task_due, info->max_task_wait);
+			cgtimer_time(&task_now);
+			if (gekko_timer_us(&task_due, &task_now) > 0)
+				gekko_usleep_r(info, &task_due, 0);
+			else
+				task_due = task_now;
+		}
+		else
+			cgtimer_time(&task_due);
 		cgtime(&now); // set the time we actually sent it
 
 #if BFDBG
@@ -4103,11 +4030,25 @@ applog(LOG_ERR, "DBG BF sending work");
 		// lock for boolean usb/work statuses
 		if (info->ident == IDENT_GSK)
 			mutex_lock(&info->wlock);
+		sent_async = false;
 		if (info->asic_type == BFCLAR)
 			err = bf_send(compac, info->task, task_len, false, false, C_MCP_SPITRANSFER);
 		else
 		{
-			err = usb_write(compac, (char *)info->task, task_len, &sent_bytes, C_SENDWORK);
+			err = LIBUSB_ERROR_NOT_SUPPORTED;
+			if (info->tx_async)
+			{
+				err = compac_task_async(compac, info, task_len, last_was_busy, &now);
+				// e.g. --usb-sim, stay synchronous
+				if (err == LIBUSB_ERROR_NOT_SUPPORTED)
+					info->tx_async = false;
+				else
+					sent_async = true;
+			}
+			if (sent_async)
+				sent_bytes = task_len;
+			else
+				err = usb_write(compac, (char *)info->task, task_len, &sent_bytes, C_SENDWORK);
 			//dumpbuffer(compac, LOG_WARNING, "TASK.TX", info->task, task_len);
 		}
 		if (err != LIBUSB_SUCCESS)
@@ -4125,7 +4066,7 @@ applog(LOG_ERR, "DBG BF sending work");
 				info->mining_state = MINER_RESET;
 			continue;
 		}
-		else
+		else if (!sent_async)
 		{
 			applog(LOG_INFO, "%d: %s %d - Sent task [%02x] len %3u",
 				compac->cgminer_id, compac->drv->name, compac->device_id, jid, task_len);
@@ -4148,9 +4089,14 @@ applog(LOG_ERR, "DBG BF sending work");
 		}
 		else
 		{
-			// successfully sent work
-			add_gekko_job(info, &now, false);
+			// successfully sent work, compac_task_sent counts an async send
 			job_added = true;
+			if (!sent_async)
+			{
+				add_gekko_job(info, &now);
+				if (!last_was_busy)
+					job_sent(info, info->job_id, &now);
+			}
 		}
 
 		//let the usb frame propagate
@@ -4868,6 +4814,7 @@ static void *compac_handle_rx(void *object, int read_bytes, int path)
 			    (info->rx[0] == 0xaa && info->rx[1] == 0x55 && info->rx[2] == 0x13))) { // BM1397
 				struct ASIC_INFO *asic = &info->asics[info->chips];
 				memset(asic, 0, sizeof(struct ASIC_INFO));
+				gc_init(asic);
 				asic->frequency = info->frequency_default;
 				asic->frequency_attempt = 0;
 				asic->last_frequency_ping = (struct timeval){0};
@@ -4904,53 +4851,83 @@ static void *compac_handle_rx(void *object, int read_bytes, int path)
 	return NULL;
 }
 
+/* Queue a reply for the nonce thread. Only the listen path calls this so the
+ * ring needs no lock, the slot is filled before nhead is published. If the
+ * nonce thread is asleep it's woken, otherwise it will find it next loop. */
+static void compac_nonce_put(struct COMPAC_INFO *info, unsigned char *rx, int len,
+			     int prelen, struct timeval *now)
+{
+	struct COMPAC_NONCE *nrec;
+	unsigned int head, tail;
+
+	head = info->nhead;
+	tail = __atomic_load_n(&info->ntail, __ATOMIC_ACQUIRE);
+	if (head - tail >= NONCE_RING)
+	{
+		info->ndropped++;
+		return;
+	}
+
+	nrec = &(info->nring[head & (NONCE_RING - 1)]);
+	// should never be true ...
+	if (len > (int)sizeof(nrec->rx))
+		len = (int)sizeof(nrec->rx);
+	memcpy(nrec->rx, rx, len);
+	nrec->len = len;
+	nrec->prelen = prelen;
+	nrec->when.tv_sec = now->tv_sec;
+	nrec->when.tv_usec = now->tv_usec;
+	__atomic_store_n(&info->nhead, head + 1, __ATOMIC_RELEASE);
+
+	if (__atomic_exchange_n(&info->nwaiting, 0, __ATOMIC_SEQ_CST))
+		cgsem_post(&info->nsem);
+}
+
 static void *compac_gsfak_nonce_que(void *object)
 {
 	struct cgpu_info *compac = (struct cgpu_info *)object;
 	struct COMPAC_INFO *info = compac->device_data;
-	struct timespec abstime, addtime;
-	K_ITEM *item;
-	int rc;
+	struct COMPAC_NONCE *nrec;
+	unsigned int head, tail;
 
 	if (info->asic_type != BM1397 && info->asic_type != BM1362
 	&&  info->asic_type != BM1370 && info->asic_type != BFCLAR)
 		return NULL;
 
-	// wait at most 42ms for a nonce
-	ms_to_timespec(&addtime, 42);
-
+	tail = info->ntail;
 	while (info->mining_state != MINER_SHUTDOWN)
 	{
-		K_WLOCK(info->nlist);
-		item = k_unlink_head(info->nstore);
-		K_WUNLOCK(info->nlist);
-
-		if (item)
+		head = __atomic_load_n(&info->nhead, __ATOMIC_ACQUIRE);
+		if (tail != head)
 		{
+			if (info->asic_type == BM1362 || info->asic_type == BM1370)
+			{
+				tail = compac_gsa1_nonces(compac, tail, head);
+				continue;
+			}
+			nrec = &(info->nring[tail & (NONCE_RING - 1)]);
 			if (info->asic_type == BM1397)
-				compac_gsf_nonce(compac, item);
-			else if (info->asic_type == BM1362)
-				compac_gsa1_nonce(compac, item);
-			else if (info->asic_type == BM1370)
-				compac_gsa1_nonce(compac, item);
+				compac_gsf_nonce(compac, nrec);
 			else
-				compac_gsk_nonce(compac, item);
-			K_WLOCK(info->nlist);
-			k_add_head(info->nlist, item);
-			K_WUNLOCK(info->nlist);
+				compac_gsk_nonce(compac, nrec);
+			__atomic_store_n(&info->ntail, ++tail, __ATOMIC_RELEASE);
+			continue;
 		}
-		else
+
+		/* Advertise we're going to sleep then check again, so a nonce
+		 * added in between either is seen here or posts nsem */
+		__atomic_store_n(&info->nwaiting, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&info->nhead, __ATOMIC_SEQ_CST) != tail)
 		{
-			cgcond_time(&abstime);
-			timeraddspec(&abstime, &addtime);
-			mutex_lock(&info->nlock);
-			rc = pthread_cond_timedwait(&info->ncond, &info->nlock, &abstime);
-			mutex_unlock(&info->nlock);
-			if (rc == ETIMEDOUT)
-				info->ntimeout++;
-			else
-				info->ntrigger++;
+			// if the producer already cleared it, nsem has a spare post
+			__atomic_store_n(&info->nwaiting, 0, __ATOMIC_SEQ_CST);
+			continue;
 		}
+		cgsem_wait(&info->nsem);
+		if (__atomic_load_n(&info->nhead, __ATOMIC_ACQUIRE) == tail)
+			info->ntimeout++;
+		else
+			info->ntrigger++;
 	}
 	return NULL;
 }
@@ -5021,62 +4998,54 @@ applog(LOG_ERR, " DBG freq reply [ %s] chip=%d fa=0x%02x fb=0x%02x fc1=0x%02x fc
 	return used;
 }
 
-static void *compac_listen2(struct cgpu_info *compac, struct COMPAC_INFO *info)
+/* Sends anything the mining state needs before the next read and returns the
+ * timeout to use for that read */
+static int compac_listen2_prep(struct cgpu_info *compac, struct COMPAC_INFO *info)
 {
-	unsigned char rx[BUFFER_MAX];
-	struct timeval now;
-	int read_bytes, tmo, pos = 0, len, i, prelen;
-	bool okcrc, used, chipped;
-	K_ITEM *item;
+	int tmo = 20;
 
-	memset(rx, 0, sizeof(rx));
-
-	while (info->mining_state != MINER_SHUTDOWN)
+	if (info->mining_state == MINER_CHIP_COUNT)
 	{
-		tmo = 20;
-
-		if (info->mining_state == MINER_CHIP_COUNT)
+		if (info->asic_type == BM1362)
 		{
-			if (info->asic_type == BM1362)
-			{
-				// zzz version rolling limit?
-				unsigned char init0[] = {0x51, 0x09, 0x00, 0xA4, 0x90, 0x00, 0xFF, 0xFF, 0x1C};
-				compac_send2(compac, init0, sizeof(init0), 8 * sizeof(init0) - 8, "INIT0");
-			}
-			else if (info->asic_type == BM1370)
-			{
-				unsigned char init0[] = {0x51, 0x09, 0x00, 0xA4, 0x80, 0x00, 0xFF, 0xFF, 0x18};
-				compac_send2(compac, init0, sizeof(init0), 8 * sizeof(init0) - 8, "INIT0");
-			}
-
-			// same for BM1397 and BM1362 and BM1370
-			unsigned char chippy[] = {0x52, 0x05, 0x00, 0x00, 0x0A};
-			compac_send2(compac, chippy, sizeof(chippy), 8 * sizeof(chippy) - 8, "CHIPPY");
-			info->mining_state = MINER_CHIP_COUNT_XX;
-			// initial config reply allow much longer
-			tmo = 1000;
+			// zzz version rolling limit?
+			unsigned char init0[] = {0x51, 0x09, 0x00, 0xA4, 0x90, 0x00, 0xFF, 0xFF, 0x1C};
+			compac_send2(compac, init0, sizeof(init0), 8 * sizeof(init0) - 8, "INIT0");
+		}
+		else if (info->asic_type == BM1370)
+		{
+			unsigned char init0[] = {0x51, 0x09, 0x00, 0xA4, 0x80, 0x00, 0xFF, 0xFF, 0x18};
+			compac_send2(compac, init0, sizeof(init0), 8 * sizeof(init0) - 8, "INIT0");
 		}
 
-// non-zero for DBG to ignore the regular timeout when no data is available
-// N.B. it's cgminer global and not thread safe, but really that doesn't matter
-#define IGNTMO 1
-#if IGNTMO
-int prev = libusb_ign_tmo;
-libusb_ign_tmo = 1;
-#endif
-		usb_read_timeout(compac, ((char *)rx)+pos, BUFFER_MAX-pos, &read_bytes, tmo, C_GETRESULTS);
-#if IGNTMO
-libusb_ign_tmo = prev;
-#endif
-		if (read_bytes > 0)
-			dumpbuffer(compac, LOG_INFO, "RX", rx+pos, read_bytes);
-		pos += read_bytes;
+		// same for BM1397 and BM1362 and BM1370
+		unsigned char chippy[] = {0x52, 0x05, 0x00, 0x00, 0x0A};
+		compac_send2(compac, chippy, sizeof(chippy), 8 * sizeof(chippy) - 8, "CHIPPY");
+		info->mining_state = MINER_CHIP_COUNT_XX;
+		// initial config reply allow much longer
+		tmo = 1000;
+	}
 
-		cgtime(&now);
+	return tmo;
+}
 
-		// all replies should be info->rx_len
-		while (read_bytes > 0 && pos >= (int)(info->rx_len))
-		{
+/* Processes read_bytes new bytes received at rx+*ppos */
+static void compac_listen2_rx(struct cgpu_info *compac, struct COMPAC_INFO *info,
+			      unsigned char *rx, int *ppos, int read_bytes)
+{
+	struct timeval now;
+	int pos = *ppos, len, i, prelen;
+	bool okcrc, used, chipped;
+
+	if (read_bytes > 0)
+		dumpbuffer(compac, LOG_INFO, "RX", rx+pos, read_bytes);
+	pos += read_bytes;
+
+	cgtime(&now);
+
+	// all replies should be info->rx_len
+	while (read_bytes > 0 && pos >= (int)(info->rx_len))
+	{
 #if 0
 applog(LOG_ERR, "%d: %s %d - READ %3d pos %3d state %2d first 16: [%02x %02x %02x %02x %02x %02x %02x %02x]",
 	compac->cgminer_id, compac->drv->name, compac->device_id, read_bytes, pos, info->mining_state,
@@ -5085,135 +5054,136 @@ applog(LOG_ERR, " [%02x %02x %02x %02x %02x %02x %02x %02x]",
 	rx[8], rx[9], rx[10], rx[11], rx[12], rx[13], rx[14], rx[15]);
 #endif
 
-			// rubbish - skip over it to next 0xaa
-			if (rx[0] != 0xaa || rx[1] != 0x55)
+		// rubbish - skip over it to next 0xaa
+		if (rx[0] != 0xaa || rx[1] != 0x55)
+		{
+			for (i = 1; i < pos; i++)
 			{
-				for (i = 1; i < pos; i++)
+				if (rx[i] == 0xaa)
 				{
-					if (rx[i] == 0xaa)
-					{
-						// next read could be 0x55 or i+1=0x55
-						if (i == (pos - 1) || rx[i+1] == 0x55)
-							break;
-					}
+					// next read could be 0x55 or i+1=0x55
+					if (i == (pos - 1) || rx[i+1] == 0x55)
+						break;
 				}
-				// no 0xaa dump it and wait for more data
-				if (i >= pos)
-				{
+			}
+			// no 0xaa dump it and wait for more data
+			if (i >= pos)
+			{
 #if 0
 applog(LOG_ERR, " %s %d no 0xaa = dump all (%d) [%02x %02x %02x %02x ...]",
 	compac->drv->name, compac->device_id, pos, rx[0], rx[1], rx[2], rx[3]);
 #endif
-					pos = 0;
-					continue;
-				}
+				pos = 0;
+				continue;
+			}
 #if 0
 applog(LOG_ERR, " %s %d dump before %d=0xaa [%02x %02x %02x %02x ...]",
 	compac->drv->name, compac->device_id, i, rx[0], rx[1], rx[2], rx[3]);
 #endif
 
-				// i=0xaa dump up to i-1
-				memmove(rx, rx+i, pos-i);
-				pos -= i;
+			// i=0xaa dump up to i-1
+			memmove(rx, rx+i, pos-i);
+			pos -= i;
 
-				if (pos < (int)(info->rx_len))
-					continue;
-			}
+			if (pos < (int)(info->rx_len))
+				continue;
+		}
 
-			// find next 0xaa 0x55
-			for (len = info->rx_len; len < pos; len++)
-			{
-				if (rx[len] == 0xaa
-				&&  (len == (pos-1) || rx[len+1] == 0x55))
-					break;
-			}
+		// find next 0xaa 0x55
+		for (len = info->rx_len; len < pos; len++)
+		{
+			if (rx[len] == 0xaa
+			&&  (len == (pos-1) || rx[len+1] == 0x55))
+				break;
+		}
 
-			prelen = len;
-			// a reply followed by only 0xaa but no 0x55 yet
-			if (len == pos
-			&&  (len == (int)(info->rx_len - 1) || len == (int)(info->rx_len + 1))
-			&&  rx[pos-1] == 0xaa)
-				len--;
+		prelen = len;
+		// a reply followed by only 0xaa but no 0x55 yet
+		if (len == pos
+		&&  (len == (int)(info->rx_len - 1) || len == (int)(info->rx_len + 1))
+		&&  rx[pos-1] == 0xaa)
+			len--;
 
-			// try it as a nonce
-			if (len != (int)(info->rx_len))
-				len = info->rx_len;
+		// try it as a nonce
+		if (len != (int)(info->rx_len))
+			len = info->rx_len;
 
 #if 0
-			if (info->asic_type == BM1397 &&
-			    bmcrc(&rx[i+2], 8 * (info->rx_len-2) - 5) == (rx[i + info->rx_len - 1] & 0x1f)) {
-				// crc checksum is good
-				crc_match = true;
-				rx_okay = true;
-			}
-			if (info->asic_type == BM1397 && rx[0] >= 0xaa && rx[1] <= 0x55) {
-				// bm1397 response
-				rx_okay = true;
-			}
+		if (info->asic_type == BM1397 &&
+		    bmcrc(&rx[i+2], 8 * (info->rx_len-2) - 5) == (rx[i + info->rx_len - 1] & 0x1f)) {
+			// crc checksum is good
+			crc_match = true;
+			rx_okay = true;
+		}
+		if (info->asic_type == BM1397 && rx[0] >= 0xaa && rx[1] <= 0x55) {
+			// bm1397 response
+			rx_okay = true;
+		}
 #endif
 
-			if (rx[len-1] <= 0x1f
-			&&  bmcrc(rx+2, 8 * (len-2) - 5) == rx[len-1])
-				okcrc = true;
-			else
-				okcrc = false;
+		if (rx[len-1] <= 0x1f
+		&&  bmcrc(rx+2, 8 * (len-2) - 5) == rx[len-1])
+			okcrc = true;
+		else
+			okcrc = false;
 
-			switch (info->mining_state)
+		switch (info->mining_state)
+		{
+		 case MINER_CHIP_COUNT:
+		 case MINER_CHIP_COUNT_XX:
+			chipped = false;
+			if ((info->asic_type == BM1397 && rx[2] == 0x13 && rx[3] == 0x97)
+			||  (info->asic_type == BM1362 && rx[2] == 0x13 && rx[3] == 0x62)
+			||  (info->asic_type == BM1370 && rx[2] == 0x13 && rx[3] == 0x70)
+			||  (info->asic_type == BM1370 && rx[2] == 0x13 && rx[3] == 0x68))
 			{
-			 case MINER_CHIP_COUNT:
-			 case MINER_CHIP_COUNT_XX:
-				chipped = false;
-				if ((info->asic_type == BM1397 && rx[2] == 0x13 && rx[3] == 0x97)
-				||  (info->asic_type == BM1362 && rx[2] == 0x13 && rx[3] == 0x62)
-				||  (info->asic_type == BM1370 && rx[2] == 0x13 && rx[3] == 0x70)
-				||  (info->asic_type == BM1370 && rx[2] == 0x13 && rx[3] == 0x68))
+				if (info->asic_type == BM1370 && rx[2] == 0x13 && rx[3] == 0x68)
+					info->cores = 1280;
+
+				struct ASIC_INFO *asic = &info->asics[info->chips];
+				memset(asic, 0, sizeof(struct ASIC_INFO));
+				gc_init(asic);
+				asic->frequency = info->frequency_default;
+				asic->frequency_attempt = 0;
+				asic->last_frequency_ping = (struct timeval){0};
+				asic->frequency_reply = -1;
+				asic->last_frequency_reply = (struct timeval){0};
+				cgtime(&asic->last_nonce);
+				info->chips++;
+				info->mining_state = MINER_CHIP_COUNT_XX;
+				compac_update_rates(compac);
+				chipped = true;
+			}
+			// ignore all data until we get at least 1 chip reply
+		 	if (!chipped && info->mining_state == MINER_CHIP_COUNT_XX)
+			{
+				// we found some chips then it replied with other data ...
+				if (info->chips > 0)
 				{
-					if (info->asic_type == BM1370 && rx[2] == 0x13 && rx[3] == 0x68)
-						info->cores = 1280;
-
-					struct ASIC_INFO *asic = &info->asics[info->chips];
-					memset(asic, 0, sizeof(struct ASIC_INFO));
-					asic->frequency = info->frequency_default;
-					asic->frequency_attempt = 0;
-					asic->last_frequency_ping = (struct timeval){0};
-					asic->frequency_reply = -1;
-					asic->last_frequency_reply = (struct timeval){0};
-					cgtime(&asic->last_nonce);
-					info->chips++;
-					info->mining_state = MINER_CHIP_COUNT_XX;
-					compac_update_rates(compac);
-					chipped = true;
+					info->mining_state = MINER_CHIP_COUNT_OK;
+					mutex_lock(&static_lock);
+					(*init_count) = 0;
+					info->init_count = 0;
+					mutex_unlock(&static_lock);
+
+					// don't discard the data
+					if (len == (int)(info->rx_len) && okcrc)
+						gsfa_reply(info, rx, info->rx_len, &now);
 				}
-				// ignore all data until we get at least 1 chip reply
-			 	if (!chipped && info->mining_state == MINER_CHIP_COUNT_XX)
+				else
 				{
-					// we found some chips then it replied with other data ...
-					if (info->chips > 0)
-					{
-						info->mining_state = MINER_CHIP_COUNT_OK;
-						mutex_lock(&static_lock);
-						(*init_count) = 0;
-						info->init_count = 0;
-						mutex_unlock(&static_lock);
-
-						// don't discard the data
-						if (len == (int)(info->rx_len) && okcrc)
-							gsfa_reply(info, rx, info->rx_len, &now);
-					}
+					if (info->reset_reinit)
+						info->mining_state = MINER_REINIT;
 					else
-					{
-						if (info->reset_reinit)
-							info->mining_state = MINER_REINIT;
-						else
-							info->mining_state = MINER_RESET;
-					}
+						info->mining_state = MINER_RESET;
 				}
-				break;
-			 case MINER_MINING:
-				used = false;
-				if (len == (int)(info->rx_len) && okcrc)
-				{
-					used = gsfa_reply(info, rx, info->rx_len, &now);
+			}
+			break;
+		 case MINER_MINING:
+			used = false;
+			if (len == (int)(info->rx_len) && okcrc)
+			{
+				used = gsfa_reply(info, rx, info->rx_len, &now);
 #if 0
 if (!used)
 {
@@ -5223,35 +5193,18 @@ applog(LOG_ERR, " [%02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x]"
 	rx[0], rx[1], rx[2], rx[3], rx[4], rx[5], rx[6], rx[7], rx[8], rx[9], rx[10], rx[11]);
 }
 #endif
-				}
+			}
 
-				// also try unidentifed crc's as a nonce
-				if (!used)
-				{
-					K_WLOCK(info->nlist);
-					item = k_unlink_head(info->nlist);
-					K_WUNLOCK(info->nlist);
-					DATA_NONCE(item)->asic = 0;
-					// should never be true ...
-					if (len > (int)sizeof(DATA_NONCE(item)->rx))
-						len = (int)sizeof(DATA_NONCE(item)->rx);
-					memcpy(DATA_NONCE(item)->rx, rx, len);
-					DATA_NONCE(item)->len = len;
-					DATA_NONCE(item)->prelen = prelen;
-					DATA_NONCE(item)->when.tv_sec = now.tv_sec;
-					DATA_NONCE(item)->when.tv_usec = now.tv_usec;
-					K_WLOCK(info->nlist);
-					k_add_tail(info->nstore, item);
-					K_WUNLOCK(info->nlist);
-					mutex_lock(&info->nlock);
-					pthread_cond_signal(&info->ncond);
-					mutex_unlock(&info->nlock);
-				}
-				break;
-			 default:
-				used = false;
-				if (len == (int)(info->rx_len) && okcrc)
-					used = gsfa_reply(info, rx, info->rx_len, &now);
+			// also try unidentifed crc's as a nonce
+			if (!used)
+			{
+				compac_nonce_put(info, rx, len, prelen, &now);
+			}
+			break;
+		 default:
+			used = false;
+			if (len == (int)(info->rx_len) && okcrc)
+				used = gsfa_reply(info, rx, info->rx_len, &now);
 #if 0
 if (!used)
 {
@@ -5261,46 +5214,72 @@ applog(LOG_ERR, " [%02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x]"
 	rx[0], rx[1], rx[2], rx[3], rx[4], rx[5], rx[6], rx[7], rx[8], rx[9], rx[10], rx[11]);
 }
 #endif
-				break;
-			}
-			// we've used up 0..len-1
-			if (pos > len)
-				memmove(rx, rx+len, pos-len);
-			pos -= len;
+			break;
 		}
+		// we've used up 0..len-1
+		if (pos > len)
+			memmove(rx, rx+len, pos-len);
+		pos -= len;
+	}
 
-		if (read_bytes == 0 || pos < 6)
+	if (read_bytes == 0 || pos < 6)
+	{
+		if (info->mining_state == MINER_CHIP_COUNT_XX)
 		{
-			if (info->mining_state == MINER_CHIP_COUNT_XX)
+			if (info->chips < info->expected_chips)
 			{
-				if (info->chips < info->expected_chips)
+				if (info->reset_reinit)
+					info->mining_state = MINER_REINIT;
+				else
+					info->mining_state = MINER_RESET;
+			}
+			else
+			{
+				if (info->chips > 0)
 				{
-					if (info->reset_reinit)
-						info->mining_state = MINER_REINIT;
-					else
-						info->mining_state = MINER_RESET;
+					info->mining_state = MINER_CHIP_COUNT_OK;
+					mutex_lock(&static_lock);
+					(*init_count) = 0;
+					info->init_count = 0;
+					mutex_unlock(&static_lock);
 				}
 				else
 				{
-					if (info->chips > 0)
-					{
-						info->mining_state = MINER_CHIP_COUNT_OK;
-						mutex_lock(&static_lock);
-						(*init_count) = 0;
-						info->init_count = 0;
-						mutex_unlock(&static_lock);
-					}
+					if (info->reset_reinit)
+						info->mining_state = MINER_REINIT;
 					else
-					{
-						if (info->reset_reinit)
-							info->mining_state = MINER_REINIT;
-						else
-							info->mining_state = MINER_RESET;
-					}
+						info->mining_state = MINER_RESET;
 				}
 			}
 		}
 	}
+	*ppos = pos;
+}
+
+static void *compac_listen2(struct cgpu_info *compac, struct COMPAC_INFO *info)
+{
+	unsigned char rx[BUFFER_MAX];
+	int read_bytes, tmo, pos = 0;
+
+	memset(rx, 0, sizeof(rx));
+
+	while (info->mining_state != MINER_SHUTDOWN)
+	{
+		tmo = compac_listen2_prep(compac, info);
+
+// non-zero for DBG to ignore the regular timeout when no data is available
+// N.B. it's cgminer global and not thread safe, but really that doesn't matter
+#define IGNTMO 1
+#if IGNTMO
+int prev = libusb_ign_tmo;
+libusb_ign_tmo = 1;
+#endif
+		usb_read_timeout(compac, ((char *)rx)+pos, BUFFER_MAX-pos, &read_bytes, tmo, C_GETRESULTS);
+#if IGNTMO
+libusb_ign_tmo = prev;
+#endif
+		compac_listen2_rx(compac, info, rx, &pos, read_bytes);
+	}
 	return NULL;
 }
 
@@ -5321,7 +5300,6 @@ static void *compac_listengsk(struct cgpu_info *compac, struct COMPAC_INFO *info
 	struct timeval now;
 	int read_bytes, tmo, pos = 0, len, i, prelen = 0, thislen;
 	bool okcrc, used, chipped, isnon;
-	K_ITEM *item;
 
 	memset(rx, 0, sizeof(rx));
 
@@ -5515,24 +5493,7 @@ applog(LOG_ERR, " [%02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x]"
 				// also try unidentifed crc's as a nonce
 				if (!used)
 				{
-					K_WLOCK(info->nlist);
-					item = k_unlink_head(info->nlist);
-					K_WUNLOCK(info->nlist);
-					DATA_NONCE(item)->asic = 0;
-					// should never be true ...
-					if (len > (int)sizeof(DATA_NONCE(item)->rx))
-						len = (int)sizeof(DATA_NONCE(item)->rx);
-					memcpy(DATA_NONCE(item)->rx, rx, len);
-					DATA_NONCE(item)->len = len;
-					DATA_NONCE(item)->prelen = prelen;
-					DATA_NONCE(item)->when.tv_sec = now.tv_sec;
-					DATA_NONCE(item)->when.tv_usec = now.tv_usec;
-					K_WLOCK(info->nlist);
-					k_add_tail(info->nstore, item);
-					K_WUNLOCK(info->nlist);
-					mutex_lock(&info->nlock);
-					pthread_cond_signal(&info->ncond);
-					mutex_unlock(&info->nlock);
+					compac_nonce_put(info, rx, len, prelen, &now);
 				}
 				break;
 			 default:
@@ -5592,6 +5553,68 @@ applog(LOG_ERR, " [%02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x]"
 	return NULL;
 }
 
+/* BM1397/BM1362/BM1370 listening without a thread of its own. Each completed
+ * async read is processed by compac_listen2_rx on a shared usb worker which
+ * then starts the next read, so there is only ever one read in flight. */
+static void *compac_listen(void *object);
+static bool compac_listen2_next(struct cgpu_info *compac, struct COMPAC_INFO *info, bool fallback);
+
+static void compac_listen2_cb(struct cgpu_info *compac, void __maybe_unused *userdata,
+			      int __maybe_unused err, unsigned char *buf, int amount)
+{
+	struct COMPAC_INFO *info = compac->device_data;
+
+	if (amount > 0)
+		memcpy(info->arx + info->arx_pos, buf, amount);
+	compac_listen2_rx(compac, info, info->arx, &info->arx_pos, amount);
+	compac_listen2_next(compac, info, true);
+}
+
+/* Start the next async read. If that fails while the device is still there
+ * and fallback is set, keep listening with a compac_listen thread instead */
+static bool compac_listen2_next(struct cgpu_info *compac, struct COMPAC_INFO *info, bool fallback)
+{
+	int err, tmo;
+
+	if (info->mining_state != MINER_SHUTDOWN)
+	{
+		tmo = compac_listen2_prep(compac, info);
+		err = usb_read_async(compac, BUFFER_MAX - info->arx_pos, tmo, C_GETRESULTS,
+				     compac_listen2_cb, NULL);
+		if (!err)
+			return true;
+
+		if (fallback && !compac->usbinfo.nodev && info->mining_state != MINER_SHUTDOWN)
+		{
+			if (thr_info_create(&(info->rthr), NULL, compac_listen, (void *)compac))
+			{
+				applog(LOG_ERR, "%d: %s %d - async read failed (%d) and read thread create failed",
+					compac->cgminer_id, compac->drv->name, compac->device_id, err);
+			}
+			else
+			{
+				applog(LOG_WARNING, "%d: %s %d - async read failed (%d) read thread created",
+					compac->cgminer_id, compac->drv->name, compac->device_id, err);
+				pthread_detach(info->rthr.pth);
+			}
+		}
+	}
+	__atomic_store_n(&info->rx_async, false, __ATOMIC_RELEASE);
+	return false;
+}
+
+static bool compac_listen_async(struct cgpu_info *compac, struct COMPAC_INFO *info)
+{
+	if (info->asic_type != BM1397 && info->asic_type != BM1362
+	&&  info->asic_type != BM1370)
+		return false;
+
+	memset(info->arx, 0, sizeof(info->arx));
+	info->arx_pos = 0;
+	info->rx_async = true;
+	return compac_listen2_next(compac, info, false);
+}
+
 static void *compac_listen(void *object)
 {
 	struct cgpu_info *compac = (struct cgpu_info *)object;
@@ -5836,8 +5859,9 @@ static bool compac_init(struct thr_info *thr)
 		info->active_work[i] = false;
 		info->work[i] = NULL;
 	}
+	info->jsent_n = 0;
 
-	memset(&(info->gh), 0, sizeof(info->gh));
+	gh_wipe(info);
 
 	cgtime(&info->last_write_error);
 	cgtime(&info->last_frequency_adjust);
@@ -5992,25 +6016,31 @@ static bool compac_init(struct thr_info *thr)
 	info->frequency = info->frequency_start;
 	info->frequency_default = info->frequency_start;
 
-	if (!info->rthr.pth)
+	if (!info->wthr.pth)
 	{
 		pthread_mutex_init(&info->lock, NULL);
 		pthread_mutex_init(&info->wlock, NULL);
 		pthread_mutex_init(&info->rlock, NULL);
 
-		pthread_mutex_init(&info->ghlock, NULL);
-		pthread_mutex_init(&info->joblock, NULL);
-
 		if (info->ident == IDENT_GSF || info->ident == IDENT_GSFM
 		||  info->ident == IDENT_GSA1 || info->ident == IDENT_GSA2
 		||  info->ident == IDENT_GSK)
 		{
-			info->nlist = k_new_list("GekkoNonces", sizeof(struct COMPAC_NONCE),
-						ALLOC_NLIST_ITEMS, LIMIT_NLIST_ITEMS, true);
-			info->nstore = k_new_store(info->nlist);
+			info->nhead = info->ntail = 0;
+			info->nwaiting = 0;
+			cgsem_init(&info->nsem);
 		}
 
-		if (thr_info_create(&(info->rthr), NULL, compac_listen, (void *)compac))
+		info->tx_async = (info->asic_type == BM1397 || info->asic_type == BM1362
+				  || info->asic_type == BM1370);
+		info->tx_busy = false;
+
+		if (compac_listen_async(compac, info))
+		{
+			applog(LOG_INFO, "%d: %s %d - async read started",
+				compac->cgminer_id, compac->drv->name, compac->device_id);
+		}
+		else if (thr_info_create(&(info->rthr), NULL, compac_listen, (void *)compac))
 		{
 			applog(LOG_ERR, "%d: %s %d - read thread create failed",
 				compac->cgminer_id, compac->drv->name, compac->device_id);
@@ -6020,8 +6050,8 @@ static bool compac_init(struct thr_info *thr)
 		{
 			applog(LOG_INFO, "%d: %s %d - read thread created",
 				compac->cgminer_id, compac->drv->name, compac->device_id);
+			pthread_detach(info->rthr.pth);
 		}
-		pthread_detach(info->rthr.pth);
 
 		gekko_usleep(info, MS2US(100));
 
@@ -6062,18 +6092,6 @@ static bool compac_init(struct thr_info *thr)
 		{
 			gekko_usleep(info, MS2US(10));
 
-			if (pthread_mutex_init(&info->nlock, NULL))
-			{
-				applog(LOG_ERR, "%d: %s %d - nonce mutex create failed",
-					compac->cgminer_id, compac->drv->name, compac->device_id);
-				return false;
-			}
-			if (pthread_cond_init(&info->ncond, NULL))
-			{
-				applog(LOG_ERR, "%d: %s %d - nonce cond create failed",
-					compac->cgminer_id, compac->drv->name, compac->device_id);
-				return false;
-			}
 			if (thr_info_create(&(info->nthr), NULL, compac_gsfak_nonce_que, (void *)compac))
 			{
 				applog(LOG_ERR, "%d: %s %d - nonce thread create failed",
@@ -6293,9 +6311,9 @@ static int64_t compac_scanwork(struct thr_info *thr)
 		cgtime(&info->tune_limit);
 
 		// wipe info->gh/asic->gc
-		gh_offset(info, &now, true, false);
+		gh_wipe(info);
 		// wipe info->job
-		job_offset(info, &now, true, false);
+		rollwin_wipe(&(info->job));
 		// reset P:
 		info->frequency_computed = 0;
 		// force retry setup if miner should have telemetry
@@ -6342,6 +6360,7 @@ static struct cgpu_info *compac_detect_one(struct libusb_device *dev, struct usb
 
 	// all zero
 	info = cgcalloc(1, sizeof(struct COMPAC_INFO));
+	gekko_rollwin_init(info);
 	// less than minimum possible
 	info->telem_temp_max = TELEM_INVTEMP;
 	// start fan at 100% if telem V1.2
@@ -6580,6 +6599,19 @@ static bool compac_prepare(struct thr_info *thr)
 	}
 
 	info->thr = thr;
+
+	if (metrics_enabled && !info->m_work_get) {
+		info->m_work_get = metric_new(METRIC_HISTOGRAM, "cgminer_gekko_get_work_seconds",
+				"Time for get_queued() to return work for a task",
+				"device=\"%s%d\"", compac->drv->name, compac->device_id);
+		info->m_work_avg = metric_new(METRIC_GAUGE, "cgminer_gekko_work_gen_avg_seconds",
+				"Smoothed get_queued() time allowed for before each task (WorkGenAvg)",
+				"device=\"%s%d\"", compac->drv->name, compac->device_id);
+		info->m_work_late = metric_new(METRIC_COUNTER, "cgminer_gekko_task_late_total",
+				"Tasks that were already 10us or more overdue (Over1N)",
+				"device=\"%s%d\"", compac->drv->name, compac->device_id);
+	}
+
 	info->bauddiv = 0x19; // 115200
 	//info->bauddiv = 0x0D; // 214286
 	//info->bauddiv = 0x07; // 375000
@@ -6841,11 +6873,13 @@ static struct api_data *compac_api_stats(struct cgpu_info *compac)
 	struct COMPAC_INFO *info = compac->device_data;
 	struct api_data *root = NULL;
 	struct timeval now;
+	struct rollsnap ghsnap, jobsnap, gcsnap;
+	struct rollslot jobslots[JOBMIN], gcslots[CHNUM];
 	char nambuf[64], buf256[256];
 	double taskdiff, tps, ghs, off;
 	time_t secs;
 	size_t len;
-	int i, j, k;
+	int i, j;
 
 	if (!compac->usbdev)
 		return root;
@@ -6877,35 +6911,30 @@ static struct api_data *compac_api_stats(struct cgpu_info *compac)
 	root = api_add_float(root, "NonceExpect", &info->nonce_expect, false);
 	root = api_add_float(root, "NonceLimit", &info->nonce_limit, false);
 
-	// info->gh access must be under lock
-	mutex_lock(&info->ghlock);
-	ghs = gekko_gh_hashrate(info, &now, true) / 1.0e3;
-	secs = now.tv_sec - info->gh.zerosec;
+	ghs = gekko_gh_hashrate(info, &now, &ghsnap) / 1.0e3;
+	secs = now.tv_sec - ghsnap.zero;
 	root = api_add_time(root, "GHZeroDelta", &secs, true);
-	root = api_add_int(root, "GHLast", &info->gh.last, true);
-	root = api_add_int(root, "GHNonces", &info->gh.noncesum, true);
-	root = api_add_int64(root, "GHDiff", &info->gh.diffsum, true);
+	root = api_add_int(root, "GHLast", &ghsnap.last, true);
+	root = api_add_int(root, "GHNonces", &ghsnap.num, true);
+	root = api_add_int64(root, "GHDiff", &ghsnap.sum, true);
 	root = api_add_double(root, "GHGHs", &ghs, true);
-	mutex_unlock(&info->ghlock);
 	root = api_add_float(root, "Require", &info->ghrequire, true);
 	ghs = info->frequency * (double)(info->cores * info->chips) * info->ghrequire / 1.0e3;
 	root = api_add_double(root, "RequireGH", &ghs, true);
 
-	// info->job access must be under lock
 	// N.B. this is as at the last job sent, not 'now'
-	mutex_lock(&info->joblock);
-	off = tdiff(&now, &(info->job.lastjob));
+	rollwin_snap(&(info->job), NULL, &jobsnap, jobslots, JOBMIN, false);
+	off = tdiff(&now, &(jobsnap.lastt));
 	root = api_add_double(root, "JobDataAge", &off, true);
 
 	buf256[0] = '\0';
 	for (i = 0; i < JOBMIN; i++)
 	{
-		j = JOBOFF(info->job.offset - i);
 		len = strlen(buf256);
 		// /, digit, null = 3
 		if ((len - sizeof(buf256)) < 3)
 			break;
-		snprintf(buf256+len, sizeof(buf256)-len, "/%d", info->job.jobnum[j]);
+		snprintf(buf256+len, sizeof(buf256)-len, "/%d", jobslots[i].num);
 	}
 	root = api_add_string(root, "Jobs", buf256+1, true);
 
@@ -6913,8 +6942,7 @@ static struct api_data *compac_api_stats(struct cgpu_info *compac)
 	for (i = 0; i < JOBMIN; i++)
 	{
 		double elap;
-		j = JOBOFF(info->job.offset - i);
-		elap = tdiff(&(info->job.lastj[j]), &(info->job.firstj[j]));
+		elap = tdiff(&(jobslots[i].lastt), &(jobslots[i].firstt));
 		len = strlen(buf256);
 		// /, digit, null = 3
 		if ((len - sizeof(buf256)) < 3)
@@ -6927,12 +6955,11 @@ static struct api_data *compac_api_stats(struct cgpu_info *compac)
 	for (i = 0; i < JOBMIN; i++)
 	{
 		double jps, elap;
-		j = JOBOFF(info->job.offset - i);
-		elap = tdiff(&(info->job.lastj[j]), &(info->job.firstj[j]));
+		elap = tdiff(&(jobslots[i].lastt), &(jobslots[i].firstt));
 		if (elap == 0)
 			jps = 0;
 		else
-			jps = (double)(info->job.jobnum[j] - 1) / elap;
+			jps = (double)(jobslots[i].num - 1) / elap;
 		len = strlen(buf256);
 		// /, digit, null = 3
 		if ((len - sizeof(buf256)) < 3)
@@ -6944,30 +6971,34 @@ static struct api_data *compac_api_stats(struct cgpu_info *compac)
 	buf256[0] = '\0';
 	for (i = 0; i < JOBMIN; i++)
 	{
-		j = JOBOFF(info->job.offset - i);
+		double avgms = 0.0;
+		// the first job in each isn't an interval
+		if (jobslots[i].num > 1)
+		{
+			avgms = (double)(jobslots[i].sum - jobslots[i].firstv)
+				/ (double)(jobslots[i].num - 1) / 1000.0;
+		}
 		len = strlen(buf256);
 		// /, digit, null = 3
 		if ((len - sizeof(buf256)) < 3)
 			break;
-		snprintf(buf256+len, sizeof(buf256)-len, "/%.2f", info->job.avgms[j]);
+		snprintf(buf256+len, sizeof(buf256)-len, "/%.2f", avgms);
 	}
 	root = api_add_string(root, "JobsAvgms", buf256+1, true);
 
 	buf256[0] = '\0';
 	for (i = 0; i < JOBMIN; i++)
 	{
-		j = JOBOFF(info->job.offset - i);
 		len = strlen(buf256);
 		// /, digit, null = 3
 		if ((len - sizeof(buf256)) < 3)
 			break;
 		snprintf(buf256+len, sizeof(buf256)-len, "/%.2f:%.2f",
-				info->job.minms[j], info->job.maxms[j]);
+				(double)(jobslots[i].minv) / 1000.0,
+				(double)(jobslots[i].maxv) / 1000.0);
 	}
 	root = api_add_string(root, "JobsMinMaxms", buf256+1, true);
 
-	mutex_unlock(&info->joblock);
-
 	if (info->asic_type == BM1397)
 	{
 		for (i = 0; i < (int)CUR_ATTEMPT_1397; i++)
@@ -7023,7 +7054,6 @@ static struct api_data *compac_api_stats(struct cgpu_info *compac)
 		root = api_add_bool(root, "CoolDown", &info->cooldown, false);
 		root = api_add_int(root, "CoolDownCount", &info->cooldown_count, false);
 	}
-	mutex_lock(&info->ghlock);
 	for (i = 0; i < (int)info->chips; i++)
 	{
 		struct ASIC_INFO *asic = &info->asics[i];
@@ -7037,7 +7067,7 @@ static struct api_data *compac_api_stats(struct cgpu_info *compac)
 			snprintf(nambuf, sizeof(nambuf), "Chip%dDups", i);
 			root = api_add_uint(root, nambuf, &asic->dupsall, true);
 
-			gc_offset(info, asic, &now, false, true);
+			rollwin_snap(&(asic->gc), &now, &gcsnap, gcslots, CHNUM, false);
 			snprintf(nambuf, sizeof(nambuf), "Chip%dRanges", i);
 			buf256[0] = '\0';
 			for (j = 0; j < CHNUM; j++)
@@ -7046,12 +7076,11 @@ static struct api_data *compac_api_stats(struct cgpu_info *compac)
 				// slash, digit, null = 3
 				if ((len - sizeof(buf256)) < 3)
 					break;
-				k = CHOFF(asic->gc.offset - j);
-				snprintf(buf256+len, sizeof(buf256)-len, "/%d", asic->gc.noncenum[k]);
+				snprintf(buf256+len, sizeof(buf256)-len, "/%d", gcslots[j].num);
 			}
 			len = strlen(buf256);
 			if ((len - sizeof(buf256)) >= 3)
-				snprintf(buf256+len, sizeof(buf256)-len, "/%d", asic->gc.noncesum);
+				snprintf(buf256+len, sizeof(buf256)-len, "/%d", gcsnap.num);
 			len = strlen(buf256);
 			if ((len - sizeof(buf256)) >= 3)
 				snprintf(buf256+len, sizeof(buf256)-len, "/%.2f%%", noncepercent(info, i, &now));
@@ -7063,7 +7092,6 @@ static struct api_data *compac_api_stats(struct cgpu_info *compac)
 		snprintf(nambuf, sizeof(nambuf), "Chip%dFreqReply", i);
 		root = api_add_float(root, nambuf, &asic->frequency_reply, true);
 	}
-	mutex_unlock(&info->ghlock);
 
 	if (info->asic_type == BM1397)
 	{
@@ -7100,6 +7128,7 @@ static struct api_data *compac_api_stats(struct cgpu_info *compac)
 
 	root = api_add_uint64(root, "NTimeout", &info->ntimeout, false);
 	root = api_add_uint64(root, "NTrigger", &info->ntrigger, false);
+	root = api_add_uint64(root, "NDropped", &info->ndropped, false);
 
 #if TUNE_CODE
 	mutex_lock(&info->slock);
@@ -7241,14 +7270,23 @@ static void compac_shutdown(struct thr_info *thr)
 		}
 	}
 	info->mining_state = MINER_SHUTDOWN;
-	// Let threads close
-	pthread_join(info->rthr.pth, NULL);
+	// Let threads close, and any async transfers finish, the last async
+	// read may have handed over to a read thread
+	while (__atomic_load_n(&info->rx_async, __ATOMIC_ACQUIRE))
+		cgsleep_ms(1);
+	if (info->rthr.pth)
+		pthread_join(info->rthr.pth, NULL);
 	pthread_join(info->wthr.pth, NULL);
+	while (__atomic_load_n(&info->tx_busy, __ATOMIC_ACQUIRE))
+		cgsleep_ms(1);
 	if (info->ident == IDENT_GSA1 || info->ident == IDENT_GSA2)
 		pthread_join(info->tthr.pth, NULL);
 	if (info->asic_type == BM1397 || info->asic_type == BM1362
 	||  info->asic_type == BM1370 || info->asic_type == BFCLAR)
+	{
+		cgsem_post(&info->nsem);
 		pthread_join(info->nthr.pth, NULL);
+	}
 	PTH(thr) = 0L;
 }
 
@@ -96,26 +96,8 @@ enum asic_state {
 // number of ranges thus total 1hr
 #define CHNUM 6
 
-#define CHOFF(n) (((n) + CHNUM) % CHNUM)
-
 // N.B. uses CLOCK_MONOTONIC
-#define CHBASE(_t1) ((int)((_t1) / CHTIME))
-
-#define CHCMP(_t1, _t2) (CHBASE(_t1) == CHBASE(_t2))
-
-struct GEKKOCHIP
-{
-	// seconds time of [offset]
-	time_t zerosec;
-	// the position of [0]
-	int offset;
-	// number of nonces in each range
-	int noncenum[CHNUM];
-	// number of nonces in 0..last-1
-	int noncesum;
-	// last used offset 0 based
-	int last;
-};
+// asic->gc is a rollwin of CHNUM slots each CHTIME seconds
 
 struct ASIC_INFO {
 	struct timeval last_nonce;              // Last time nonce was found
@@ -138,21 +120,35 @@ struct ASIC_INFO {
 	float frequency_reply;
 	
 	int nonces;
-	struct GEKKOCHIP gc;	// running nonce buffer
+	struct rollwin gc;	// running nonce buffer
+	struct rollslot gcslot[CHNUM];
 };
 
+// largest reply queued as a nonce (BFCL_NONCERX)
+#define NONCE_RX_MAX 64
+
 struct COMPAC_NONCE
 {
-	int asic;
-	unsigned char rx[BUFFER_MAX];
+	unsigned char rx[NONCE_RX_MAX];
 	size_t len;
 	size_t prelen;
 	struct timeval when;
 };
 
-#define DATA_NONCE(_item) ((struct COMPAC_NONCE *)(_item->data))
-#define ALLOC_NLIST_ITEMS 256
-#define LIMIT_NLIST_ITEMS 0
+// single producer (listen) single consumer (nonce thread) ring, power of 2
+#define NONCE_RING 512
+// max BM1362/BM1370 replies checked then submitted as one burst
+#define GSA1_BURST 32
+
+// which job was sent when, newest last, to resolve a nonce to its work
+struct GEKKOSENT
+{
+	uint32_t job_id;
+	struct timeval sent;
+};
+
+// must be more than CUR_ATTEMPT_MAX
+#define JOB_SENT 8
 
 // BM1397 info->job_id offsets to check (when job_id is wrong)
 static int cur_attempt_1397[] = { 0, -4, -8, -12 };
@@ -249,8 +245,7 @@ static int cur_attempt_1370[] = { 0, -24, -48, -72 };
 #define BFCL_XOR4 0xAAAAAAAA
 
 #define GHNUM (60*5)
-#define GHOFF(n) (((n) + GHNUM) % GHNUM)
-// a time jump without any nonces will reset the GEKKOHASH data
+// a time jump without any nonces will reset the info->gh data
 //  this would normally be a miner failure, so should reset anyway,
 //  however under normal mining operation, using 10sec,
 //   a 6GH/s asic will have this happen, on average, about once every 10 days
@@ -271,71 +266,18 @@ static int cur_attempt_1370[] = { 0, -24, -48, -72 };
 #define GHNONCENEEDED 8
 
 // running 5min nonce diff buffer (for GH/s)
-// offset = current second, GHOFF(offset-1) = previous second
-// GHOFF(offset-(GHNUM-1)) = GHOFF(offset+1) = oldest possible
-// GHOFF(offset-last) = oldest used
-// code is all linear except one loop that is almost always only
-//  one interation or total max one interation per second elapsed real time
-struct GEKKOHASH
-{
-	// seconds time of [offset]
-	time_t zerosec;
-	// the position of [0]
-	int offset;
-	// total diff in each second
-	int64_t diff[GHNUM];
-	// time of the first nonce in each second
-	struct timeval firstt[GHNUM];
-	// diff of first nonce in each second
-	int64_t firstd[GHNUM];
-	// time of the last nonce in each second
-	struct timeval lastt[GHNUM];
-	// number of nonces in each second
-	int noncenum[GHNUM];
-	// sum of diff[0..last-1]
-	int64_t diffsum;
-	// number of nonces in 0..last-1
-	int noncesum;
-	// last used offset 0 based
-	int last;
-};
+// info->gh is a rollwin of GHNUM 1 second slots, the value is the nonce diff
+// so the first nonce's diff (firstv) is excluded from the H/s calc
 
 #define JOBMIN 5
-#define JOBOFF(n) (((n) + JOBMIN) % JOBMIN)
-// a time jump without any work will reset the GEKKOJOB data
+// a time jump without any work will reset the info->job data
 //  this would normally be all pool failure or power down due to heat
 //  3 = 3 minutes so should never happen
 #define JOBLIMn 3
 
-// the arrays are minutes of data
+// the slots are minutes of data, the value is the us since the previous job
 // N.B. uses CLOCK_MONOTONIC
-#define JOBTIME(_sec) ((int)((int)(_sec)/(int)60))
-
-struct GEKKOJOB
-{
-	// JOBTIME of [offset]
-	time_t zeromin;
-	// time of last job added
-	struct timeval lastjob;
-	// the position of [0]
-	int offset;
-	// time of the first job in each
-	struct timeval firstj[JOBMIN];
-	// time of the last job in each
-	struct timeval lastj[JOBMIN];
-	// number of job items in each
-	int jobnum[JOBMIN];
-	// average ms between jobs
-	double avgms[JOBMIN];
-	// min ms
-	double minms[JOBMIN];
-	// max ms
-	double maxms[JOBMIN];
-	// number of jobs in 0..last-1
-	int jobsnum;
-	// last used offset 0 based
-	int last;
-};
+#define JOBTIME 60
 
 struct COMPAC_INFO {
 
@@ -344,7 +286,12 @@ struct COMPAC_INFO {
 	enum miner_asic asic_type;	// ASIC Type
 	struct thr_info *thr;		// Running Thread
 	struct thr_info rthr;		// Listening Thread
+	bool rx_async;			// Listening via async usb reads
+	unsigned char arx[BUFFER_MAX];	// Async read buffer
+	int arx_pos;			// Async bytes in arx
 	struct thr_info wthr;		// Miner Work Thread
+	bool tx_async;			// Sending tasks via async usb writes
+	bool tx_busy;			// An async task write is in flight
 	struct thr_info tthr;		// Miner Telemetry Thread
 
 	pthread_mutex_t lock;		// Mutex
@@ -352,12 +299,14 @@ struct COMPAC_INFO {
 	pthread_mutex_t rlock;		// Mutex Serialize Reads
 
 	struct thr_info nthr;		// GSF Nonce Thread
-	K_LIST *nlist;			// GSF Nonce list
-	K_LIST *nstore;			// GSF Nonce store
-	pthread_mutex_t nlock;		// GSF lock
-	pthread_cond_t ncond;		// GSF wait
-	uint64_t ntimeout;		// GSF number of cond timeouts
-	uint64_t ntrigger;		// GSF number of cond tiggered
+	struct COMPAC_NONCE nring[NONCE_RING]; // GSF Nonce ring
+	unsigned int nhead;		// GSF next ring slot to fill (listen only)
+	unsigned int ntail;		// GSF next ring slot to use (nonce thread only)
+	int nwaiting;			// GSF nonce thread is asleep on nsem
+	cgsem_t nsem;			// GSF wake the nonce thread
+	uint64_t ntimeout;		// GSF number of wakes with nothing to do
+	uint64_t ntrigger;		// GSF number of wakes with nonces
+	uint64_t ndropped;		// GSF nonces lost to a full ring
 
 	int telemetry;			// USB telemetry interface
 	int fail_telem;			// number of times init failed (reset will zero it)
@@ -507,6 +456,9 @@ struct COMPAC_INFO {
 	uint64_t cur_off[CUR_ATTEMPT_MAX];
 	double work_usec_avg;
 	uint64_t work_usec_num;
+	struct metric *m_work_get;		// --api-metrics-port, NULL if disabled
+	struct metric *m_work_avg;
+	struct metric *m_work_late;
 
 	double last_work_diff;			// Diff of last work sent
 	struct timeval last_ticket_attempt;	// List attempt to set ticket
@@ -525,12 +477,14 @@ struct COMPAC_INFO {
 	uint16_t nb2chip[256];			// BM1397 map nonce byte to: chip that produced it
 	bool active_work[JOB_MAX+1];            // Tag good and stale work
 	struct work *work[JOB_MAX+1];           // Work ring buffer
+	struct GEKKOSENT jsent[JOB_SENT];	// Work sent history (under lock)
+	unsigned int jsent_n;			// Count of work sent (under lock)
 
-	pthread_mutex_t ghlock;			// Mutex for all access to gh
-	struct GEKKOHASH gh;			// running hash rate buffer
+	struct rollwin gh;			// running hash rate buffer (nonce thread)
+	struct rollslot ghslot[GHNUM];
 	float ghrequire;			// Ratio of expected HR required (GHREQUIRE) 0.0-0.8
-	pthread_mutex_t joblock;		// Mutex for all access to jb
-	struct GEKKOJOB job;			// running job rate buffer
+	struct rollwin job;			// running job rate buffer (work thread)
+	struct rollslot jobslot[JOBMIN];
 
 	pthread_mutex_t slock;			// usleep() stats
 	uint64_t num0;
@@ -21,6 +21,10 @@ bool opt_log_output = false;
 /* per default priorities higher than LOG_NOTICE are logged */
 int opt_log_level = LOG_NOTICE;
 
+char *opt_log_file;
+int opt_log_file_size = 32;
+bool opt_log_sync;
+
 static void my_log_curses(int prio, const char *datetime, const char *str, bool force)
 {
 	if (opt_quiet && prio != LOG_ERR)
@@ -45,65 +49,429 @@ static void my_log_curses(int prio, const char *datetime, const char *str, bool
 	}
 }
 
-/* high-level logging function, based on global opt_log_level */
+/* Asynchronous logging
+ * Each thread that logs gets its own single producer ring of variable
+ * length records, and the log thread is the only consumer. It merges the
+ * rings in time order and batches the lines out to stderr, syslog, the
+ * --log-file and the console. A full ring drops the message and counts it
+ * rather than block the hashing or usb threads.
+ * Forced messages (quit etc.) and anything before logging_start() or after
+ * logging_stop() are written directly by the caller as before */
 
-/*
- * log function
- */
-void _applog(int prio, const char *str, bool force)
-{
-#ifdef HAVE_SYSLOG_H
-	if (use_syslog) {
-		syslog(LOG_LOCAL0 | prio, "%s", str);
-	}
-#else
-	if (0) {}
-#endif
-	else {
-		char datetime[64];
-		struct timeval tv = {0, 0};
-		struct tm *tm;
+#define LOG_RING_SIZE 16384		// must be a power of 2
+#define LOG_ALIGN 8
+#define LOG_MAXSTR (LOG_RING_SIZE / 4)
+#define LOG_BATCH 65536
+#define LOG_IDLE_MS 10
+
+struct log_rec {
+	uint32_t len;			// whole record, 0 = wrap to ring start
+	int prio;
+	bool simple;
+	struct timeval tv;
+	char str[];
+};
+
+struct log_ring {
+	struct log_ring *next;
+	bool owned;
+	uint64_t head;			// only written by the owning thread
+	int64_t dropped;
+	char pad[64];
+	uint64_t tail;			// only written by the log thread
+	char buf[LOG_RING_SIZE] __attribute__ ((aligned (LOG_ALIGN)));
+};
+
+struct log_time {
+	time_t sec;
+	char prefix[48];
+};
+
+static bool log_async;
+static bool log_stopping;
+static bool log_stderr;
+static pthread_t log_thr;
+static pthread_key_t log_ring_key;
+static struct log_ring *log_rings;
+static __thread struct log_ring *log_ring;
+static __thread struct log_time log_sync_time;
+
+// Held by whoever is draining the rings or writing the log file
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
 
-		cgtime_real(&tv);
+static FILE *log_file;
+static size_t log_file_len;
 
-		const time_t tmp_time = tv.tv_sec;
-		int ms = (int)(tv.tv_usec / 1000);
-		tm = localtime(&tmp_time);
+static char log_batch[LOG_BATCH];
+static size_t log_batch_len;
 
-		snprintf(datetime, sizeof(datetime), " [%d-%02d-%02d %02d:%02d:%02d.%03d] ",
+// localtime() and the date are only redone when the second changes
+static void log_datetime(struct log_time *lt, char *buf, size_t siz, const struct timeval *tv)
+{
+	if (tv->tv_sec != lt->sec || !lt->prefix[0]) {
+		const time_t tmp_time = tv->tv_sec;
+		struct tm *tm = localtime(&tmp_time);
+
+		snprintf(lt->prefix, sizeof(lt->prefix), " [%d-%02d-%02d %02d:%02d:%02d",
 			tm->tm_year + 1900,
 			tm->tm_mon + 1,
 			tm->tm_mday,
 			tm->tm_hour,
 			tm->tm_min,
-			tm->tm_sec, ms);
+			tm->tm_sec);
+		lt->sec = tv->tv_sec;
+	}
+	snprintf(buf, siz, "%s.%03d] ", lt->prefix, (int)(tv->tv_usec / 1000));
+}
 
-		/* Only output to stderr if it's not going to the screen as well */
-		if (!isatty(fileno((FILE *)stderr))) {
-			fprintf(stderr, "%s%s\n", datetime, str);	/* atomic write to stderr */
-			fflush(stderr);
-		}
+// Call with log_lock held
+static void log_file_write(const char *buf, size_t len)
+{
+	char old[PATH_MAX];
+
+	if (!log_file || !len)
+		return;
 
-		my_log_curses(prio, datetime, str, force);
+	fwrite(buf, 1, len, log_file);
+	fflush(log_file);
+	log_file_len += len;
+
+	if (opt_log_file_size && log_file_len >= (size_t)opt_log_file_size * 1024 * 1024) {
+		snprintf(old, sizeof(old), "%s.1", opt_log_file);
+		fclose(log_file);
+		remove(old);
+		rename(opt_log_file, old);
+		log_file = fopen(opt_log_file, "a");
+		if (!log_file)
+			fprintf(stderr, "Failed to reopen log file %s\n", opt_log_file);
+		log_file_len = 0;
 	}
 }
 
-void _simplelog(int prio, const char *str, bool force)
+static void log_batch_flush(void)
 {
+	if (!log_batch_len)
+		return;
+
+	if (log_stderr) {
+		fwrite(log_batch, 1, log_batch_len, stderr);
+		fflush(stderr);
+	}
+	log_file_write(log_batch, log_batch_len);
+	log_batch_len = 0;
+}
+
+/* Write one message to all the outputs, batching the stderr/file lines when
+ * called from the log thread. Call with log_lock held if batch or log_file */
+static void log_output(struct log_time *lt, int prio, const struct timeval *tv,
+		       const char *str, bool simple, bool force, bool batch)
+{
+	char datetime[64];
+	size_t len;
+
 #ifdef HAVE_SYSLOG_H
 	if (use_syslog) {
 		syslog(LOG_LOCAL0 | prio, "%s", str);
+		return;
 	}
-#else
-	if (0) {}
 #endif
-	else {
+
+	if (simple)
+		datetime[0] = '\0';
+	else
+		log_datetime(lt, datetime, sizeof(datetime), tv);
+
+	if (batch) {
+		len = strlen(datetime) + strlen(str) + 1;
+		if (log_batch_len + len >= sizeof(log_batch))
+			log_batch_flush();
+		log_batch_len += snprintf(log_batch + log_batch_len, sizeof(log_batch) - log_batch_len,
+					  "%s%s\n", datetime, str);
+	} else {
 		/* Only output to stderr if it's not going to the screen as well */
 		if (!isatty(fileno((FILE *)stderr))) {
-			fprintf(stderr, "%s\n", str);	/* atomic write to stderr */
+			fprintf(stderr, "%s%s\n", datetime, str);	/* atomic write to stderr */
 			fflush(stderr);
 		}
+		if (log_file) {
+			char line[LOGBUFSIZ + 64];
 
-		my_log_curses(prio, "", str, force);
+			len = snprintf(line, sizeof(line), "%s%s\n", datetime, str);
+			if (len >= sizeof(line))
+				len = sizeof(line) - 1;
+			log_file_write(line, len);
+		}
 	}
+
+	my_log_curses(prio, datetime, str, force);
+}
+
+static void log_ring_release(void *arg)
+{
+	struct log_ring *ring = arg;
+
+	log_ring = NULL;
+	__atomic_store_n(&ring->owned, false, __ATOMIC_RELEASE);
+}
+
+// The calling thread's ring, reusing one left by an exited thread if possible
+static struct log_ring *log_my_ring(void)
+{
+	struct log_ring *ring = log_ring;
+	bool owned;
+
+	if (likely(ring))
+		return ring;
+
+	for (ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+		owned = false;
+		if (__atomic_compare_exchange_n(&ring->owned, &owned, true, false,
+						__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+	if (!ring) {
+		ring = cgcalloc(1, sizeof(*ring));
+		ring->owned = true;
+		ring->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&log_rings, &ring->next, ring, false,
+						    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+	pthread_setspecific(log_ring_key, ring);
+	log_ring = ring;
+	return ring;
+}
+
+static void log_push(int prio, const char *str, bool simple)
+{
+	struct log_ring *ring = log_my_ring();
+	uint64_t head, tail;
+	size_t off, room, need, skip, len;
+	struct log_rec *rec;
+
+	len = strlen(str);
+	if (len > LOG_MAXSTR)
+		len = LOG_MAXSTR;
+	need = (sizeof(*rec) + len + 1 + LOG_ALIGN - 1) & ~(size_t)(LOG_ALIGN - 1);
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	off = head & (LOG_RING_SIZE - 1);
+	room = LOG_RING_SIZE - off;
+	skip = (room < need) ? room : 0;
+	if (head + skip + need - tail > LOG_RING_SIZE) {
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if (skip) {
+		*(uint32_t *)(ring->buf + off) = 0;
+		head += skip;
+		off = 0;
+	}
+
+	rec = (struct log_rec *)(ring->buf + off);
+	rec->len = need;
+	rec->prio = prio;
+	rec->simple = simple;
+	cgtime_real(&rec->tv);
+	memcpy(rec->str, str, len);
+	rec->str[len] = '\0';
+
+	__atomic_store_n(&ring->head, head + need, __ATOMIC_RELEASE);
+}
+
+struct log_pos {
+	struct log_ring *ring;
+	uint64_t head;
+	uint64_t tail;
+};
+
+static struct log_rec *log_peek(struct log_pos *pos)
+{
+	struct log_rec *rec;
+	size_t off;
+
+	while (pos->tail < pos->head) {
+		off = pos->tail & (LOG_RING_SIZE - 1);
+		rec = (struct log_rec *)(pos->ring->buf + off);
+		if (rec->len)
+			return rec;
+		pos->tail += LOG_RING_SIZE - off;
+	}
+	return NULL;
+}
+
+/* Write out everything in the rings up to now in timestamp order.
+ * Call with log_lock held. Returns the number of messages written */
+static int log_drain(struct log_time *lt)
+{
+	static struct log_pos *pos;
+	static int allocpos;
+	struct log_ring *ring;
+	struct log_rec *rec, *best;
+	int i, n, bestn, count = 0;
+	int64_t dropped = 0;
+	struct timeval now;
+
+	n = 0;
+	for (ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+		if (n >= allocpos) {
+			allocpos += 16;
+			pos = cgrealloc(pos, sizeof(*pos) * allocpos);
+		}
+		pos[n].ring = ring;
+		pos[n].head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		pos[n].tail = ring->tail;
+		dropped += __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+		n++;
+	}
+
+	while (42) {
+		best = NULL;
+		bestn = 0;
+		for (i = 0; i < n; i++) {
+			rec = log_peek(&pos[i]);
+			if (rec && (!best || tdiff(&best->tv, &rec->tv) > 0)) {
+				best = rec;
+				bestn = i;
+			}
+		}
+		if (!best)
+			break;
+
+		log_output(lt, best->prio, &best->tv, best->str, best->simple, false, true);
+		pos[bestn].tail += best->len;
+		__atomic_store_n(&pos[bestn].ring->tail, pos[bestn].tail, __ATOMIC_RELEASE);
+		count++;
+	}
+
+	if (dropped) {
+		char tmp42[64];
+
+		snprintf(tmp42, sizeof(tmp42), "Logging too fast, dropped %"PRId64" message%s",
+			 dropped, dropped == 1 ? "" : "s");
+		cgtime_real(&now);
+		log_output(lt, LOG_WARNING, &now, tmp42, false, false, true);
+	}
+
+	log_batch_flush();
+	return count;
+}
+
+static void *log_thread(void __maybe_unused *userdata)
+{
+	struct log_time lt;
+
+	RenameThread("Logger");
+
+	memset(&lt, 0, sizeof(lt));
+	while (42) {
+		bool stopping = __atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE);
+		int count;
+
+		mutex_lock(&log_lock);
+		count = log_drain(&lt);
+		mutex_unlock(&log_lock);
+
+		if (!count) {
+			if (stopping)
+				break;
+			cgsleep_ms(LOG_IDLE_MS);
+		}
+	}
+	return NULL;
+}
+
+/* Open the --log-file and start the log thread, after the options are
+ * parsed and stderr is where it will stay */
+void logging_start(void)
+{
+	if (opt_log_file) {
+		log_file = fopen(opt_log_file, "a");
+		if (!log_file)
+			applog(LOG_ERR, "Failed to open %s for log file", opt_log_file);
+		else {
+			fseek(log_file, 0, SEEK_END);
+			log_file_len = ftell(log_file);
+		}
+	}
+
+	if (opt_log_sync)
+		return;
+
+	log_stderr = !isatty(fileno((FILE *)stderr));
+	if (unlikely(pthread_key_create(&log_ring_key, log_ring_release)))
+		return;
+	if (unlikely(pthread_create(&log_thr, NULL, log_thread, NULL))) {
+		applog(LOG_ERR, "Failed to create log thread, logging synchronously");
+		return;
+	}
+	__atomic_store_n(&log_async, true, __ATOMIC_RELEASE);
+}
+
+/* Write out what's queued and go back to logging directly, so nothing is
+ * lost on the way out */
+void logging_stop(void)
+{
+	struct log_time lt;
+
+	if (!__atomic_exchange_n(&log_async, false, __ATOMIC_ACQ_REL))
+		return;
+
+	if (pthread_equal(pthread_self(), log_thr))
+		return;
+
+	__atomic_store_n(&log_stopping, true, __ATOMIC_RELEASE);
+	pthread_join(log_thr, NULL);
+
+	// Anything pushed while the thread was exiting
+	memset(&lt, 0, sizeof(lt));
+	mutex_lock(&log_lock);
+	log_drain(&lt);
+	mutex_unlock(&log_lock);
+}
+
+/* A forced message is written directly, after whatever is queued, and
+ * without waiting on a log_lock that a dead thread may hold */
+static void log_direct(int prio, const char *str, bool simple, bool force)
+{
+	struct timeval tv = {0, 0};
+	bool locked;
+
+	if (force)
+		locked = !mutex_trylock(&log_lock);
+	else {
+		mutex_lock(&log_lock);
+		locked = true;
+	}
+
+	if (locked && __atomic_load_n(&log_async, __ATOMIC_ACQUIRE))
+		log_drain(&log_sync_time);
+
+	cgtime_real(&tv);
+	log_output(&log_sync_time, prio, &tv, str, simple, force, false);
+
+	if (locked)
+		mutex_unlock(&log_lock);
+}
+
+/* high-level logging function, based on global opt_log_level */
+
+/*
+ * log function
+ */
+void _applog(int prio, const char *str, bool force)
+{
+	if (likely(!force && __atomic_load_n(&log_async, __ATOMIC_ACQUIRE)))
+		log_push(prio, str, false);
+	else
+		log_direct(prio, str, false, force);
+}
+
+void _simplelog(int prio, const char *str, bool force)
+{
+	if (likely(!force && __atomic_load_n(&log_async, __ATOMIC_ACQUIRE)))
+		log_push(prio, str, true);
+	else
+		log_direct(prio, str, true, force);
 }
@@ -31,6 +31,11 @@ extern int opt_log_level;
 #else
 #define LOGBUFSIZ 256
 #endif
+extern char *opt_log_file;
+extern int opt_log_file_size;
+extern bool opt_log_sync;
+extern void logging_start(void);
+extern void logging_stop(void);
 extern void _applog(int prio, const char *str, bool force);
 extern void _simplelog(int prio, const char *str, bool force);
 
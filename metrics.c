@@ -0,0 +1,196 @@
+/*
+ * Copyright 2026 cgminer developers
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <stdarg.h>
+
+#include "miner.h"
+#include "metrics.h"
+
+bool metrics_enabled;
+
+// 50us .. 60s, about 2.5x apart
+const int64_t metric_bucket_us[METRIC_BUCKETS - 1] = {
+	50, 100, 250, 500,
+	1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+	1000000, 2500000, 5000000, 10000000, 30000000, 60000000
+};
+
+/* Series are grouped into families by name since the text format wants
+ * the HELP and TYPE once before all of a family's series.
+ * Both lists are only ever added to, so updates need no lock */
+struct metric_family {
+	struct metric_family *next;
+	char *name;
+	char *help;
+	enum metric_type type;
+	struct metric *head;
+	struct metric *tail;
+};
+
+static struct metric_family *families;
+static struct metric_family *families_tail;
+static pthread_mutex_t metrics_lock;
+
+void metrics_init(void)
+{
+	mutex_init(&metrics_lock);
+	metrics_enabled = true;
+}
+
+struct metric *metric_new(enum metric_type type, const char *name, const char *help,
+			  const char *labelfmt, ...)
+{
+	struct metric_family *family;
+	struct metric *metric;
+	char labels[256];
+	va_list ap;
+
+	if (!metrics_enabled)
+		return NULL;
+
+	labels[0] = '\0';
+	if (labelfmt) {
+		va_start(ap, labelfmt);
+		vsnprintf(labels, sizeof(labels), labelfmt, ap);
+		va_end(ap);
+	}
+
+	metric = cgcalloc(1, sizeof(*metric));
+	metric->labels = strdup(labels);
+
+	mutex_lock(&metrics_lock);
+	for (family = families; family; family = family->next) {
+		if (strcmp(family->name, name) == 0)
+			break;
+	}
+	if (!family) {
+		family = cgcalloc(1, sizeof(*family));
+		family->name = strdup(name);
+		family->help = strdup(help);
+		family->type = type;
+		if (families_tail)
+			families_tail->next = family;
+		else
+			families = family;
+		families_tail = family;
+	}
+	if (family->tail)
+		family->tail->next = metric;
+	else
+		family->head = metric;
+	family->tail = metric;
+	mutex_unlock(&metrics_lock);
+
+	return metric;
+}
+
+struct metrics_buf {
+	char *buf;
+	size_t siz;
+	size_t len;
+};
+
+static void __attribute__ ((format (printf, 2, 3))) mbuf_add(struct metrics_buf *mbuf, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	while (42) {
+		va_start(ap, fmt);
+		n = vsnprintf(mbuf->buf + mbuf->len, mbuf->siz - mbuf->len, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			return;
+		if ((size_t)n < mbuf->siz - mbuf->len)
+			break;
+		mbuf->siz += n + 4096;
+		mbuf->buf = cgrealloc(mbuf->buf, mbuf->siz);
+	}
+	mbuf->len += n;
+}
+
+// Labels for a series, with an extra one appended, in {} or nothing if none
+static void mbuf_labels(struct metrics_buf *mbuf, struct metric *metric, const char *extra)
+{
+	bool both = (*(metric->labels) && extra);
+
+	if (!*(metric->labels) && !extra)
+		return;
+
+	mbuf_add(mbuf, "{%s%s%s}", metric->labels, both ? "," : "", extra ? extra : "");
+}
+
+static const char *metric_types[] = { "counter", "gauge", "histogram" };
+
+/* Render all the metrics in Prometheus text format, histograms are
+ * cumulative buckets in seconds. Returns a malloced string */
+char *metrics_text(size_t *len)
+{
+	struct metrics_buf mbuf;
+	struct metric_family *family;
+	struct metric *metric;
+	char le[32];
+	int64_t cum;
+	double gauge;
+	int i;
+
+	mbuf.siz = 16384;
+	mbuf.buf = cgmalloc(mbuf.siz);
+	mbuf.buf[0] = '\0';
+	mbuf.len = 0;
+
+	mutex_lock(&metrics_lock);
+	for (family = families; family; family = family->next) {
+		mbuf_add(&mbuf, "# HELP %s %s\n# TYPE %s %s\n", family->name, family->help,
+			 family->name, metric_types[family->type]);
+		for (metric = family->head; metric; metric = metric->next) {
+			switch (family->type) {
+				case METRIC_COUNTER:
+					mbuf_add(&mbuf, "%s", family->name);
+					mbuf_labels(&mbuf, metric, NULL);
+					mbuf_add(&mbuf, " %"PRId64"\n",
+						 __atomic_load_n(&metric->count, __ATOMIC_RELAXED));
+					break;
+				case METRIC_GAUGE:
+					__atomic_load(&metric->gauge, &gauge, __ATOMIC_RELAXED);
+					mbuf_add(&mbuf, "%s", family->name);
+					mbuf_labels(&mbuf, metric, NULL);
+					mbuf_add(&mbuf, " %g\n", gauge);
+					break;
+				case METRIC_HISTOGRAM:
+					cum = 0;
+					for (i = 0; i < METRIC_BUCKETS; i++) {
+						cum += __atomic_load_n(&metric->bucket[i], __ATOMIC_RELAXED);
+						if (i < METRIC_BUCKETS - 1)
+							snprintf(le, sizeof(le), "le=\"%g\"", (double)metric_bucket_us[i] / 1000000.0);
+						else
+							snprintf(le, sizeof(le), "le=\"+Inf\"");
+						mbuf_add(&mbuf, "%s_bucket", family->name);
+						mbuf_labels(&mbuf, metric, le);
+						mbuf_add(&mbuf, " %"PRId64"\n", cum);
+					}
+					mbuf_add(&mbuf, "%s_sum", family->name);
+					mbuf_labels(&mbuf, metric, NULL);
+					mbuf_add(&mbuf, " %.6f\n",
+						 (double)__atomic_load_n(&metric->sum, __ATOMIC_RELAXED) / 1000000.0);
+					// The count is the +Inf bucket so the two always agree
+					mbuf_add(&mbuf, "%s_count", family->name);
+					mbuf_labels(&mbuf, metric, NULL);
+					mbuf_add(&mbuf, " %"PRId64"\n", cum);
+					break;
+			}
+		}
+	}
+	mutex_unlock(&metrics_lock);
+
+	*len = mbuf.len;
+	return mbuf.buf;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2026 cgminer developers
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Counters, gauges and fixed bucket latency histograms for the
+ * --api-metrics-port HTTP endpoint in Prometheus text format.
+ * Updates are lock free atomics so they can be fed from the mining and
+ * usb hot paths. metric_new() returns NULL when metrics aren't enabled
+ * and all the update functions ignore a NULL metric */
+
+enum metric_type {
+	METRIC_COUNTER,
+	METRIC_GAUGE,
+	METRIC_HISTOGRAM,
+};
+
+// Histogram bucket upper bounds are in microseconds, the last is +Inf
+#define METRIC_BUCKETS 20
+
+extern const int64_t metric_bucket_us[METRIC_BUCKETS - 1];
+
+struct metric {
+	struct metric *next;	// next in the same family
+	char *labels;
+	int64_t count;		// counter
+	double gauge;
+	int64_t sum;		// histogram total us
+	int64_t bucket[METRIC_BUCKETS];
+};
+
+extern bool metrics_enabled;
+
+extern void metrics_init(void);
+extern struct metric *metric_new(enum metric_type type, const char *name, const char *help,
+				 const char *labelfmt, ...) __attribute__ ((format (printf, 4, 5)));
+extern char *metrics_text(size_t *len);
+
+static inline void metric_add(struct metric *m, int64_t n)
+{
+	if (m)
+		__atomic_add_fetch(&m->count, n, __ATOMIC_RELAXED);
+}
+
+static inline void metric_set(struct metric *m, double value)
+{
+	if (m)
+		__atomic_store(&m->gauge, &value, __ATOMIC_RELAXED);
+}
+
+// Record one latency of us microseconds
+static inline void metric_observe(struct metric *m, int64_t us)
+{
+	int i;
+
+	if (!m)
+		return;
+
+	if (us < 0)
+		us = 0;
+	for (i = 0; i < METRIC_BUCKETS - 1; i++) {
+		if (us <= metric_bucket_us[i])
+			break;
+	}
+	__atomic_add_fetch(&m->bucket[i], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&m->sum, us, __ATOMIC_RELAXED);
+}
+
+#endif /* METRICS_H */
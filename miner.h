@@ -37,6 +37,7 @@
 
 #include "logging.h"
 #include "util.h"
+#include "metrics.h"
 #include <sys/types.h>
 #ifndef WIN32
 # include <sys/socket.h>
@@ -1049,6 +1050,10 @@ extern int opt_api_port;
 extern char *opt_api_host;
 extern bool opt_api_listen;
 extern bool opt_api_network;
+extern bool opt_api_keepalive;
+extern int opt_api_cache;
+extern int opt_api_metrics_port;
+extern int opt_api_threads;
 extern bool opt_delaynet;
 extern time_t last_getwork;
 extern bool opt_restart;
@@ -1171,6 +1176,7 @@ extern char *opt_minion_temp;
 #endif
 #ifdef USE_USBUTILS
 extern char *opt_usb_select;
+extern char *opt_usb_sim;
 extern int opt_usbdump;
 extern bool opt_usb_list_all;
 extern cgsem_t usb_resource_sem;
@@ -1227,6 +1233,9 @@ extern pthread_cond_t restart_cond;
 extern void clear_stratum_shares(struct pool *pool);
 extern void clear_pool_work(struct pool *pool);
 extern void set_target(unsigned char *dest_target, double diff);
+extern void __gen_coinbase_midstate(struct pool *pool);
+extern void gen_stratum_merkle_roots(struct pool *pool, uint64_t nonce2, int count,
+				     unsigned char *merkle_roots);
 #if defined (USE_AVALON2) || defined (USE_AVALON4) || defined (USE_AVALON7) || defined (USE_AVALON8) || defined (USE_AVALON9) || defined (USE_AVALONLC3) || defined (USE_AVALON_MINER) || defined (USE_HASHRATIO)
 bool submit_nonce2_nonce(struct thr_info *thr, struct pool *pool, struct pool *real_pool,
 			 uint32_t nonce2, uint32_t nonce, uint32_t ntime);
@@ -1266,6 +1275,7 @@ extern struct list_head scan_devices;
 extern int nDevs;
 extern int num_processors;
 extern int hw_errors;
+extern void update_stats_totals(void);
 extern bool use_syslog;
 extern bool opt_quiet;
 extern struct thr_info *control_thr;
@@ -1329,6 +1339,14 @@ enum pool_enable {
 	POOL_REJECTING,
 };
 
+/* Stratum work generated ahead of time from one notify */
+struct work_batch {
+	unsigned int gen;
+	int count;
+	int next;
+	struct work *works[];
+};
+
 struct stratum_work {
 	char *job_id;
 	unsigned char **merkle_bin;
@@ -1340,6 +1358,15 @@ struct stratum_work {
 #define RBUFSIZE 8192
 #define RECVSIZE (RBUFSIZE - 4)
 
+/* Counters bumped for every nonce are spread over shards chosen by device,
+ * each on its own cacheline, and only summed for display */
+#define STATS_SHARDS 64
+
+struct stats_shard {
+	int64_t diff1;
+	int64_t hw_errors;
+} __attribute__((aligned(64)));
+
 struct pool {
 	int pool_no;
 	int prio;
@@ -1348,6 +1375,7 @@ struct pool {
 	int seq_getfails;
 	int solved;
 	int64_t diff1;
+	struct stats_shard *diff1_shards;
 	char diff[8];
 	int quota;
 	int quota_gcd;
@@ -1427,6 +1455,19 @@ struct pool {
 	SOCKETTYPE sock;
 	char *sockbuf;
 	size_t sockbuf_size;
+	size_t sockbuf_start;
+	size_t sockbuf_end;
+	size_t sockbuf_scan;
+	unsigned int sockbuf_gen;
+#ifdef __linux
+	/* Stratum event loop state */
+	bool ev_busy;
+	int ev_fd;
+	unsigned int ev_gen;
+	time_t ev_last;
+	bool ev_line;		// in stratum_line(), so don't block
+	bool ev_reconnect;	// client.reconnect for a worker to finish
+#endif
 	char *sockaddr_url; /* stripped url used for sockaddr */
 	char *sockaddr_proxy_url;
 	char *sockaddr_proxy_port;
@@ -1476,9 +1517,35 @@ struct pool {
 	/* Shared by both stratum & GBT */
 	size_t n1_len;
 	unsigned char *coinbase;
+	size_t coinbase_size;
 	int coinbase_len;
 	int nonce2_offset;
+	/* SHA256 state of the stratum coinbase blocks preceding nonce2 */
+	bool cb_prehashed;
+	int cb_prehash_len;
+	uint32_t cb_midstate[8];
+	/* Shared copies of the current job_id, nonce1 and ntime for work */
+	char *work_job_id;
+	char *work_nonce1;
+	char *work_ntime;
 	unsigned char header_bin[128];
+	/* Bumped for every notify or disconnect to expire pregenerated work */
+	unsigned int swork_gen;
+	/* Pregenerated stratum work, see get_pregen_work */
+	struct work_batch *wbatch_next;
+	struct work_batch *wbatch;
+	bool wgen_started;
+	bool wgen_wanted;
+	unsigned int wgen_notified;
+	int wgen_target;
+	int64_t wgen_taken;
+	double wgen_rate;
+	pthread_mutex_t wgen_lock;
+	pthread_cond_t wgen_cond;
+	/* Stratum merkle branches, reused and only grown by parse_notify */
+	unsigned char *merkle_store;
+	int merkle_size;
+	size_t job_id_size;
 	int merkles;
 	char prev_hash[68];
 	char bbversion[12];
@@ -1490,6 +1557,14 @@ struct pool {
 	uint32_t current_height;
 
 	struct timeval tv_lastwork;
+
+	struct timeval tv_notify;		// When the last notify arrived
+	bool notify_timed;			// First work since then is in m_notify_work
+	int metric_id;				// never reused, unlike pool_no
+	struct metric *m_notify_work;		// --api-metrics-port, NULL if disabled
+	struct metric *m_share_submit;
+	struct metric *m_share_accepted;
+	struct metric *m_share_rejected;
 #ifdef USE_BITMAIN_SOC
     bool support_vil;
     int version_num;
@@ -1497,6 +1572,14 @@ struct pool {
 #endif
 };
 
+/* Number of header versions a work item caches the SHA256 midstate for */
+#define WORK_MIDSTATES 4
+
+struct work_midstate {
+	uint32_t	version;
+	uint32_t	state[8];
+};
+
 #define GETWORK_MODE_TESTPOOL 'T'
 #define GETWORK_MODE_POOL 'P'
 #define GETWORK_MODE_LP 'L'
@@ -1514,6 +1597,13 @@ struct work {
 	unsigned char	target[32];
 	unsigned char	hash[32];
 
+	/* Host order SHA256 states after the first 64 bytes of data for
+	 * recently tested versions, valid while data + 4 matches mid_block */
+	unsigned char	mid_block[60];
+	int		mid_count;
+	int		mid_next;
+	struct work_midstate mids[WORK_MIDSTATES];
+
 	uint16_t        micro_job_id;
 	bool		direct_vmask;
 	unsigned char	base_bv[4];
@@ -1531,6 +1621,7 @@ struct work {
 	int		thr_id;
 	struct pool	*pool;
 	struct timeval	tv_staged;
+	struct list_head staged;
 
 	bool		mined;
 	bool		clone;
@@ -1579,6 +1670,31 @@ struct work {
 #endif
 };
 
+/* Fixed size table of queued work indexed by a driver chosen job id with a
+ * secondary index on the midstate. Work is added and replaced by one thread
+ * at a time while any number of result reading threads look up clones of it
+ * without taking a lock. Replaced work is only freed once no reader can still
+ * be looking at it. */
+struct work_ring_slot {
+	struct work	*work;
+	uint32_t	id;
+	int		ipos;
+};
+
+struct work_ring {
+	struct cgpu_info *cgpu;
+	pthread_mutex_t	lock;
+	unsigned int	seq;
+	int		readers;
+	int		size;
+	struct work_ring_slot *slots;
+	int		isize;
+	int		iused;
+	int		*index;
+	int		retired;
+	struct work	**retire;
+};
+
 // enable grossly global stratum work stats
 #define STRATUM_WORK_TIMING 1
 
@@ -1641,9 +1757,12 @@ extern bool test_nonce_diff(struct work *work, uint32_t nonce, double diff);
 extern double test_nonce_value(struct work *work, uint32_t nonce);
 extern bool submit_tested_work(struct thr_info *thr, struct work *work);
 extern bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce);
+extern int submit_nonces_batch(struct thr_info *thr, struct work *work, uint32_t *nonces,
+			       uint32_t *versions, int n);
 extern bool submit_noffset_nonce(struct thr_info *thr, struct work *work, uint32_t nonce,
 			  int noffset);
 extern int share_work_tdiff(struct cgpu_info *cgpu);
+extern bool benchmark_nonce(const unsigned char *tail, uint32_t *nonce);
 extern struct work *get_work(struct thr_info *thr, const int thr_id);
 extern void __add_queued(struct cgpu_info *cgpu, struct work *work);
 extern struct work *get_queued(struct cgpu_info *cgpu);
@@ -1661,6 +1780,12 @@ extern int age_queued_work(struct cgpu_info *cgpu, double secs);
 extern void work_completed(struct cgpu_info *cgpu, struct work *work);
 extern struct work *take_queued_work_bymidstate(struct cgpu_info *cgpu, char *midstate, size_t midstatelen, char *data, int offset, size_t datalen);
 extern void flush_queue(struct cgpu_info *cgpu);
+extern struct work_ring *work_ring_new(struct cgpu_info *cgpu, int size);
+extern void work_ring_add(struct work_ring *ring, uint32_t id, struct work *work);
+extern struct work *work_ring_clone_byid(struct work_ring *ring, uint32_t id);
+extern struct work *work_ring_clone_bymidstate(struct work_ring *ring, char *midstate, size_t midstatelen, char *data, int offset, size_t datalen);
+extern void work_ring_flush(struct work_ring *ring);
+extern void work_ring_free(struct work_ring *ring);
 extern void hash_driver_work(struct thr_info *mythr);
 extern void hash_queued_work(struct thr_info *mythr);
 extern void _wlog(const char *str);
@@ -1690,6 +1815,7 @@ extern void *tq_pop(struct thread_q *tq, const struct timespec *abstime);
 #else
 extern void *tq_pop(struct thread_q *tq);
 #endif
+extern void *tq_trypop(struct thread_q *tq);
 extern void tq_freeze(struct thread_q *tq);
 extern void tq_thaw(struct thread_q *tq);
 extern bool successful_connect;
@@ -1706,6 +1832,14 @@ extern struct work *copy_work_noffset(struct work *base_work, int noffset);
 #define copy_work(work_in) copy_work_noffset(work_in, 0)
 extern uint64_t share_diff(const struct work *work);
 extern struct thr_info *get_thread(int thr_id);
+extern char *opt_sharelog_format;
+extern int opt_sharelog_rotate_size;
+extern int opt_sharelog_rotate_time;
+extern char *set_sharelog_format(char *arg);
+extern void sharelog_open(const char *arg);
+extern void sharelog_start(void);
+extern void sharelog_stop(void);
+extern void sharelog(const char *disposition, const struct work *work);
 extern struct cgpu_info *get_a_device(int id);
 
 enum api_data_type {
@@ -8,40 +8,131 @@
  */
 
 #include "miner.h"
-#include "klist.h"
 
-// Nonce
-typedef struct nitem {
-	uint32_t work_id;
-	uint32_t nonce;
-	struct timeval when;
-} NITEM;
+/* Nonces are remembered in a time wheel of one second buckets, each an open
+ * addressed hash of (work_id, nonce) keys, so checking a nonce costs one
+ * probe per bucket in the time limit and expiry is clearing a whole bucket
+ * when the wheel comes back round to it. Keys are split across DUP_STRIPES
+ * wheels by hash, each with its own lock, so a check only waits for another
+ * check of the same stripe, and that for at most one probe per bucket and
+ * an insert. */
+#define DUP_MIN_BITS 6
+#define DUP_STRIPE_BITS 4
+#define DUP_STRIPES (1 << DUP_STRIPE_BITS)
 
-#define DATAN(_item) ((NITEM *)(_item->data))
+struct dupbucket {
+	time_t sec;
+	int count;
+	int bits;
+	uint64_t *keys; // 0 is empty
+};
+
+struct dupwheel {
+	pthread_mutex_t lock;
+	struct dupbucket *buckets;
+};
 
 struct dupdata {
 	int timelimit;
-	K_LIST *nfree_list;
-	K_STORE *nonce_list;
+	int nbuckets;
+	struct dupwheel wheels[DUP_STRIPES];
 	uint64_t checked;
 	uint64_t dups;
 };
 
+static inline uint64_t dupkey(struct work *work, uint32_t nonce)
+{
+	uint64_t key = ((uint64_t)(work->id) << 32) | nonce;
+
+	return key ? key : ~key;
+}
+
+static inline int duphash(uint64_t key, int bits)
+{
+	return (int)((key * 0x9e3779b97f4a7c15ULL) >> (64 - bits));
+}
+
+/* Uses different hash bits to duphash() so a stripe's keys still spread
+ * across its buckets */
+static inline int dupstripe(uint64_t key)
+{
+	return (int)((key * 0x9e3779b97f4a7c15ULL) >> 24) & (DUP_STRIPES - 1);
+}
+
+static bool dupfind(struct dupbucket *b, uint64_t key)
+{
+	int mask = (1 << b->bits) - 1;
+	int i = duphash(key, b->bits);
+
+	while (b->keys[i]) {
+		if (b->keys[i] == key)
+			return true;
+		i = (i + 1) & mask;
+	}
+	return false;
+}
+
+static void __dupinsert(struct dupbucket *b, uint64_t key)
+{
+	int mask = (1 << b->bits) - 1;
+	int i = duphash(key, b->bits);
+
+	while (b->keys[i])
+		i = (i + 1) & mask;
+	b->keys[i] = key;
+	b->count++;
+}
+
+static void dupinsert(struct dupbucket *b, uint64_t key)
+{
+	/* Keep the load factor under a half */
+	if ((b->count + 1) * 2 > (1 << b->bits)) {
+		uint64_t *old = b->keys;
+		int i, oldsize = 1 << b->bits;
+
+		b->bits++;
+		b->keys = cgcalloc(1 << b->bits, sizeof(uint64_t));
+		b->count = 0;
+		for (i = 0; i < oldsize; i++) {
+			if (old[i])
+				__dupinsert(b, old[i]);
+		}
+		free(old);
+	}
+	__dupinsert(b, key);
+}
+
+/* Expiry is in whole seconds of cgtime(): there are timelimit+1 buckets, the
+ * current second and the timelimit before it, so a nonce is remembered for
+ * between timelimit and timelimit+1 seconds depending on where in its second
+ * it was first seen */
 void dupalloc(struct cgpu_info *cgpu, int timelimit)
 {
 	struct dupdata *dup;
+	int i, j;
 
 	dup = calloc(1, sizeof(*dup));
 	if (unlikely(!dup))
 		quithere(1, "Failed to calloc dupdata");
 
 	dup->timelimit = timelimit;
-	dup->nfree_list = k_new_list("Nonces", sizeof(NITEM), 1024, 0, true);
-	dup->nonce_list = k_new_store(dup->nfree_list);
+	dup->nbuckets = timelimit + 1;
+	for (j = 0; j < DUP_STRIPES; j++) {
+		struct dupwheel *w = &dup->wheels[j];
+
+		mutex_init(&w->lock);
+		w->buckets = cgcalloc(dup->nbuckets, sizeof(struct dupbucket));
+		for (i = 0; i < dup->nbuckets; i++) {
+			w->buckets[i].sec = -1;
+			w->buckets[i].bits = DUP_MIN_BITS;
+			w->buckets[i].keys = cgcalloc(1 << DUP_MIN_BITS, sizeof(uint64_t));
+		}
+	}
 
 	cgpu->dup_data = dup;
 }
 
+/* Lockless, the counters are only ever updated atomically */
 void dupcounters(struct cgpu_info *cgpu, uint64_t *checked, uint64_t *dups)
 {
 	struct dupdata *dup = (struct dupdata *)(cgpu->dup_data);
@@ -50,50 +141,54 @@ void dupcounters(struct cgpu_info *cgpu, uint64_t *checked, uint64_t *dups)
 		*checked = 0;
 		*dups = 0;
 	} else {
-		*checked = dup->checked;
-		*dups = dup->dups;
+		*checked = __atomic_load_n(&dup->checked, __ATOMIC_RELAXED);
+		*dups = __atomic_load_n(&dup->dups, __ATOMIC_RELAXED);
 	}
 }
 
 bool isdupnonce(struct cgpu_info *cgpu, struct work *work, uint32_t nonce)
 {
 	struct dupdata *dup = (struct dupdata *)(cgpu->dup_data);
+	struct dupwheel *w;
+	struct dupbucket *b;
 	struct timeval now;
 	bool unique = true;
-	K_ITEM *item;
+	uint64_t key;
+	time_t sec;
+	int i;
 
 	if (!dup)
 		return false;
 
 	cgtime(&now);
-	dup->checked++;
-	K_WLOCK(dup->nfree_list);
-	item = dup->nonce_list->tail;
-	while (unique && item) {
-		if (DATAN(item)->work_id == work->id && DATAN(item)->nonce == nonce) {
+	sec = now.tv_sec;
+	key = dupkey(work, nonce);
+	__atomic_add_fetch(&dup->checked, 1, __ATOMIC_RELAXED);
+	w = &dup->wheels[dupstripe(key)];
+	mutex_lock(&w->lock);
+	for (i = 0; unique && i < dup->nbuckets; i++) {
+		b = &w->buckets[(sec - i) % dup->nbuckets];
+		if (b->sec == sec - i && dupfind(b, key))
 			unique = false;
-			applog(LOG_WARNING, "%s%d: Duplicate nonce %08x",
-					    cgpu->drv->name, cgpu->device_id, nonce);
-		} else
-			item = item->prev;
 	}
 	if (unique) {
-		item = k_unlink_head(dup->nfree_list);
-		DATAN(item)->work_id = work->id;
-		DATAN(item)->nonce = nonce;
-		memcpy(&(DATAN(item)->when), &now, sizeof(now));
-		k_add_head(dup->nonce_list, item);
-	}
-	item = dup->nonce_list->tail;
-	while (item && tdiff(&(DATAN(item)->when), &now) > dup->timelimit) {
-		item = k_unlink_tail(dup->nonce_list);
-		k_add_head(dup->nfree_list, item);
-		item = dup->nonce_list->tail;
+		b = &w->buckets[sec % dup->nbuckets];
+		if (b->sec != sec) {
+			/* Expire everything left from the last time round */
+			if (b->count)
+				memset(b->keys, 0, sizeof(uint64_t) << b->bits);
+			b->count = 0;
+			b->sec = sec;
+		}
+		dupinsert(b, key);
 	}
-	K_WUNLOCK(dup->nfree_list);
+	mutex_unlock(&w->lock);
 
-	if (!unique)
-		dup->dups++;
+	if (!unique) {
+		applog(LOG_WARNING, "%s%d: Duplicate nonce %08x",
+				    cgpu->drv->name, cgpu->device_id, nonce);
+		__atomic_add_fetch(&dup->dups, 1, __ATOMIC_RELAXED);
+	}
 
 	return !unique;
 }
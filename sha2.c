@@ -36,6 +36,22 @@
 
 #include "sha2.h"
 
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define SHA2_HAVE_SHANI 1
+#define SHA2_HAVE_AVX2 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__linux) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 6))
+#define SHA2_HAVE_ARMCE 1
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
 #define UNPACK32(x, str)                      \
 {                                             \
     *((str) + 3) = (uint8_t) ((x)      );       \
@@ -82,8 +98,8 @@ uint32_t sha256_k[64] =
 
 /* SHA-256 functions */
 
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
+static void sha256_transf_generic(sha256_ctx *ctx, const unsigned char *message,
+                                  unsigned int block_nb)
 {
     uint32_t w[64];
     uint32_t wv[8];
@@ -128,6 +144,364 @@ void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
     }
 }
 
+#ifdef SHA2_HAVE_SHANI
+/* x86 SHA extensions, 4 rounds per pair of sha256rnds2 with the message
+ * schedule kept in four registers. The state is held as ABEF/CDGH. */
+#define SHANI_ROUNDS(g, cur, prev, next)                                  \
+{                                                                         \
+    msg = _mm_add_epi32(cur, _mm_loadu_si128((const __m128i *)            \
+                                             &sha256_k[(g) << 2]));       \
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);                  \
+    if ((g) >= 3 && (g) <= 14) {                                          \
+        tmp = _mm_alignr_epi8(cur, prev, 4);                              \
+        next = _mm_add_epi32(next, tmp);                                  \
+        next = _mm_sha256msg2_epu32(next, cur);                           \
+    }                                                                     \
+    msg = _mm_shuffle_epi32(msg, 0x0E);                                   \
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);                  \
+    if ((g) >= 1 && (g) <= 12)                                            \
+        prev = _mm_sha256msg1_epu32(prev, cur);                           \
+}
+
+__attribute__((target("sha,sse4.1")))
+static void sha256_transf_shani(sha256_ctx *ctx, const unsigned char *message,
+                                unsigned int block_nb)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                        0x0405060700010203ULL);
+    __m128i state0, state1, abef_save, cdgh_save;
+    __m128i msg, tmp, m0, m1, m2, m3;
+
+    tmp = _mm_loadu_si128((const __m128i *)&ctx->h[0]);
+    state1 = _mm_loadu_si128((const __m128i *)&ctx->h[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);
+    state1 = _mm_shuffle_epi32(state1, 0x1B);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    while (block_nb--) {
+        abef_save = state0;
+        cdgh_save = state1;
+
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)message), mask);
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(message + 16)), mask);
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(message + 32)), mask);
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(message + 48)), mask);
+
+        SHANI_ROUNDS( 0, m0, m3, m1);
+        SHANI_ROUNDS( 1, m1, m0, m2);
+        SHANI_ROUNDS( 2, m2, m1, m3);
+        SHANI_ROUNDS( 3, m3, m2, m0);
+        SHANI_ROUNDS( 4, m0, m3, m1);
+        SHANI_ROUNDS( 5, m1, m0, m2);
+        SHANI_ROUNDS( 6, m2, m1, m3);
+        SHANI_ROUNDS( 7, m3, m2, m0);
+        SHANI_ROUNDS( 8, m0, m3, m1);
+        SHANI_ROUNDS( 9, m1, m0, m2);
+        SHANI_ROUNDS(10, m2, m1, m3);
+        SHANI_ROUNDS(11, m3, m2, m0);
+        SHANI_ROUNDS(12, m0, m3, m1);
+        SHANI_ROUNDS(13, m1, m0, m2);
+        SHANI_ROUNDS(14, m2, m1, m3);
+        SHANI_ROUNDS(15, m3, m2, m0);
+
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+        message += SHA256_BLOCK_SIZE;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+    _mm_storeu_si128((__m128i *)&ctx->h[0], state0);
+    _mm_storeu_si128((__m128i *)&ctx->h[4], state1);
+}
+
+static bool sha256_cpu_shani(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid_max(0, NULL) < 7)
+        return false;
+    __cpuid(1, eax, ebx, ecx, edx);
+    if (!(ecx & (1 << 19)) || !(ecx & (1 << 9)))
+        return false;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1 << 29)) != 0;
+}
+#endif /* SHA2_HAVE_SHANI */
+
+#ifdef SHA2_HAVE_ARMCE
+/* ARMv8 cryptography extensions, the state is held as ABCD/EFGH */
+#define ARMCE_ROUNDS(g, m0, m1, m2, m3)                                   \
+{                                                                         \
+    tmp0 = vaddq_u32(m0, vld1q_u32(&sha256_k[(g) << 2]));                 \
+    if ((g) < 12)                                                         \
+        m0 = vsha256su0q_u32(m0, m1);                                     \
+    tmp1 = state0;                                                        \
+    state0 = vsha256hq_u32(state0, state1, tmp0);                         \
+    state1 = vsha256h2q_u32(state1, tmp1, tmp0);                          \
+    if ((g) < 12)                                                         \
+        m0 = vsha256su1q_u32(m0, m2, m3);                                 \
+}
+
+__attribute__((target("+crypto")))
+static void sha256_transf_armce(sha256_ctx *ctx, const unsigned char *message,
+                                unsigned int block_nb)
+{
+    uint32x4_t state0, state1, abcd_save, efgh_save;
+    uint32x4_t tmp0, tmp1, m0, m1, m2, m3;
+
+    state0 = vld1q_u32(&ctx->h[0]);
+    state1 = vld1q_u32(&ctx->h[4]);
+
+    while (block_nb--) {
+        abcd_save = state0;
+        efgh_save = state1;
+
+        m0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(message)));
+        m1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(message + 16)));
+        m2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(message + 32)));
+        m3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(message + 48)));
+
+        ARMCE_ROUNDS( 0, m0, m1, m2, m3);
+        ARMCE_ROUNDS( 1, m1, m2, m3, m0);
+        ARMCE_ROUNDS( 2, m2, m3, m0, m1);
+        ARMCE_ROUNDS( 3, m3, m0, m1, m2);
+        ARMCE_ROUNDS( 4, m0, m1, m2, m3);
+        ARMCE_ROUNDS( 5, m1, m2, m3, m0);
+        ARMCE_ROUNDS( 6, m2, m3, m0, m1);
+        ARMCE_ROUNDS( 7, m3, m0, m1, m2);
+        ARMCE_ROUNDS( 8, m0, m1, m2, m3);
+        ARMCE_ROUNDS( 9, m1, m2, m3, m0);
+        ARMCE_ROUNDS(10, m2, m3, m0, m1);
+        ARMCE_ROUNDS(11, m3, m0, m1, m2);
+        ARMCE_ROUNDS(12, m0, m1, m2, m3);
+        ARMCE_ROUNDS(13, m1, m2, m3, m0);
+        ARMCE_ROUNDS(14, m2, m3, m0, m1);
+        ARMCE_ROUNDS(15, m3, m0, m1, m2);
+
+        state0 = vaddq_u32(state0, abcd_save);
+        state1 = vaddq_u32(state1, efgh_save);
+        message += SHA256_BLOCK_SIZE;
+    }
+
+    vst1q_u32(&ctx->h[0], state0);
+    vst1q_u32(&ctx->h[4], state1);
+}
+
+static bool sha256_cpu_armce(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+}
+#endif /* SHA2_HAVE_ARMCE */
+
+static void (*sha256_transf_fn)(sha256_ctx *ctx, const unsigned char *message,
+                                unsigned int block_nb) = sha256_transf_generic;
+static const char *sha256_backend = "generic";
+static bool sha256_hw;
+#ifdef SHA2_HAVE_AVX2
+static bool sha256_avx2;
+#endif
+
+/* Select the fastest block transform the CPU supports. Call once at startup
+ * before any hashing threads are started. */
+void sha256_init_backend(void)
+{
+#ifdef SHA2_HAVE_SHANI
+    if (sha256_cpu_shani()) {
+        sha256_transf_fn = sha256_transf_shani;
+        sha256_backend = "x86 SHA-NI";
+        sha256_hw = true;
+        return;
+    }
+#endif
+#ifdef SHA2_HAVE_ARMCE
+    if (sha256_cpu_armce()) {
+        sha256_transf_fn = sha256_transf_armce;
+        sha256_backend = "ARMv8 CE";
+        sha256_hw = true;
+        return;
+    }
+#endif
+#ifdef SHA2_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        sha256_avx2 = true;
+        sha256_backend = "generic 8-way AVX2";
+        return;
+    }
+#endif
+    sha256_backend = "generic 4-way";
+}
+
+const char *sha256_backend_name(void)
+{
+    return sha256_backend;
+}
+
+void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
+                   unsigned int block_nb)
+{
+    sha256_transf_fn(ctx, message, block_nb);
+}
+
+/* Multi-buffer transforms used for batches when there is no hardware SHA256,
+ * hashing one block for each of N independent messages per call. The GCC
+ * vector extensions map the 4-way one onto SSE2 on x86 and NEON on ARM, and
+ * the 8-way one onto AVX2 when the CPU has it. */
+typedef uint32_t sha256_v4 __attribute__ ((vector_size (16)));
+#ifdef SHA2_HAVE_AVX2
+typedef uint32_t sha256_v8 __attribute__ ((vector_size (32)));
+#endif
+
+#define V_ROTR(x, n)   ((x >> n) | (x << (32 - n)))
+#define V_F1(x) (V_ROTR(x,  2) ^ V_ROTR(x, 13) ^ V_ROTR(x, 22))
+#define V_F2(x) (V_ROTR(x,  6) ^ V_ROTR(x, 11) ^ V_ROTR(x, 25))
+#define V_F3(x) (V_ROTR(x,  7) ^ V_ROTR(x, 18) ^ (x >>  3))
+#define V_F4(x) (V_ROTR(x, 17) ^ V_ROTR(x, 19) ^ (x >> 10))
+
+#define SHA256D_80_NWAY(n, vec, attr)                                      \
+attr static void sha256_transf_##n##way(vec *state, vec *w)               \
+{                                                                         \
+    vec wv[8];                                                            \
+    vec t1, t2;                                                           \
+    int j;                                                                \
+                                                                          \
+    for (j = 16; j < 64; j++)                                             \
+        w[j] = V_F4(w[j - 2]) + w[j - 7] + V_F3(w[j - 15]) + w[j - 16];   \
+                                                                          \
+    for (j = 0; j < 8; j++)                                               \
+        wv[j] = state[j];                                                 \
+                                                                          \
+    for (j = 0; j < 64; j++) {                                            \
+        t1 = wv[7] + V_F2(wv[4]) + CH(wv[4], wv[5], wv[6])                \
+            + sha256_k[j] + w[j];                                         \
+        t2 = V_F1(wv[0]) + MAJ(wv[0], wv[1], wv[2]);                      \
+        wv[7] = wv[6];                                                    \
+        wv[6] = wv[5];                                                    \
+        wv[5] = wv[4];                                                    \
+        wv[4] = wv[3] + t1;                                               \
+        wv[3] = wv[2];                                                    \
+        wv[2] = wv[1];                                                    \
+        wv[1] = wv[0];                                                    \
+        wv[0] = t1 + t2;                                                  \
+    }                                                                     \
+                                                                          \
+    for (j = 0; j < 8; j++)                                               \
+        state[j] += wv[j];                                                \
+}                                                                         \
+                                                                          \
+attr static void sha256d_80_##n##way(const unsigned char *data,           \
+                                     unsigned char *digest)               \
+{                                                                         \
+    vec state[8], w[64], zero = {0};                                      \
+    uint32_t word;                                                        \
+    int i, j;                                                             \
+                                                                          \
+    for (j = 0; j < 8; j++)                                               \
+        state[j] = zero + sha256_h0[j];                                   \
+    for (i = 0; i < n; i++) {                                             \
+        for (j = 0; j < 16; j++) {                                        \
+            PACK32(&data[i * 80 + (j << 2)], &word);                      \
+            w[j][i] = word;                                               \
+        }                                                                 \
+    }                                                                     \
+    sha256_transf_##n##way(state, w);                                     \
+                                                                          \
+    for (i = 0; i < n; i++) {                                             \
+        for (j = 0; j < 4; j++) {                                         \
+            PACK32(&data[i * 80 + 64 + (j << 2)], &word);                 \
+            w[j][i] = word;                                               \
+        }                                                                 \
+    }                                                                     \
+    for (j = 4; j < 16; j++)                                              \
+        w[j] = zero;                                                      \
+    w[4] = zero + 0x80000000;                                             \
+    w[15] = zero + 640;                                                   \
+    sha256_transf_##n##way(state, w);                                     \
+                                                                          \
+    for (j = 0; j < 8; j++) {                                             \
+        w[j] = state[j];                                                  \
+        state[j] = zero + sha256_h0[j];                                   \
+    }                                                                     \
+    for (j = 8; j < 16; j++)                                              \
+        w[j] = zero;                                                      \
+    w[8] = zero + 0x80000000;                                             \
+    w[15] = zero + 256;                                                   \
+    sha256_transf_##n##way(state, w);                                     \
+                                                                          \
+    for (i = 0; i < n; i++) {                                             \
+        for (j = 0; j < 8; j++)                                           \
+            UNPACK32(state[j][i], &digest[i * 32 + (j << 2)]);            \
+    }                                                                     \
+}
+
+SHA256D_80_NWAY(4, sha256_v4, )
+#ifdef SHA2_HAVE_AVX2
+SHA256D_80_NWAY(8, sha256_v8, __attribute__((target("avx2"))))
+#endif
+
+/* Double SHA256 of an 80 byte block header */
+void sha256d_80(const unsigned char *data, unsigned char *digest)
+{
+    sha256_ctx ctx;
+
+    sha256_init(&ctx);
+    sha256_transf_fn(&ctx, data, 1);
+    sha256d_80_tail(ctx.h, data + SHA256_BLOCK_SIZE, digest);
+}
+
+/* Finish the double SHA256 of an 80 byte block header from midstate, the
+ * state after its first 64 bytes, so only the 16 byte tail is hashed */
+void sha256d_80_tail(const uint32_t *midstate, const unsigned char *tail,
+                     unsigned char *digest)
+{
+    unsigned char block[SHA256_BLOCK_SIZE];
+    sha256_ctx ctx;
+    int i;
+
+    memcpy(ctx.h, midstate, sizeof(ctx.h));
+    memcpy(block, tail, 16);
+    memset(block + 16, 0, SHA256_BLOCK_SIZE - 16);
+    block[16] = 0x80;
+    UNPACK32(640, block + 60);
+    sha256_transf_fn(&ctx, block, 1);
+
+    for (i = 0; i < 8; i++)
+        UNPACK32(ctx.h[i], &block[i << 2]);
+    memset(block + 32, 0, SHA256_BLOCK_SIZE - 32);
+    block[32] = 0x80;
+    UNPACK32(256, block + 60);
+
+    sha256_init(&ctx);
+    sha256_transf_fn(&ctx, block, 1);
+    for (i = 0; i < 8; i++)
+        UNPACK32(ctx.h[i], &digest[i << 2]);
+}
+
+/* Double SHA256 of count independent 80 byte headers at data, 32 bytes of
+ * digest each to digest. Uses the 8-way or 4-way transforms in the absence
+ * of hardware SHA256 support. */
+void sha256d_80_batch(const unsigned char *data, unsigned char *digest, int count)
+{
+    int i = 0;
+
+    if (!sha256_hw) {
+#ifdef SHA2_HAVE_AVX2
+        if (sha256_avx2) {
+            for (; i + 8 <= count; i += 8)
+                sha256d_80_8way(data + i * 80, digest + i * 32);
+        }
+#endif
+        for (; i + 4 <= count; i += 4)
+            sha256d_80_4way(data + i * 80, digest + i * 32);
+    }
+    for (; i < count; i++)
+        sha256d_80(data + i * 80, digest + i * 32);
+}
+
 void sha256(const unsigned char *message, unsigned int len, unsigned char *digest)
 {
     sha256_ctx ctx;
@@ -170,8 +544,8 @@ void sha256_update(sha256_ctx *ctx, const unsigned char *message,
 
     shifted_message = message + rem_len;
 
-    sha256_transf(ctx, ctx->block, 1);
-    sha256_transf(ctx, shifted_message, block_nb);
+    sha256_transf_fn(ctx, ctx->block, 1);
+    sha256_transf_fn(ctx, shifted_message, block_nb);
 
     rem_len = new_len % SHA256_BLOCK_SIZE;
 
@@ -200,7 +574,7 @@ void sha256_final(sha256_ctx *ctx, unsigned char *digest)
     ctx->block[ctx->len] = 0x80;
     UNPACK32(len_b, ctx->block + pm_len - 4);
 
-    sha256_transf(ctx, ctx->block, block_nb);
+    sha256_transf_fn(ctx, ctx->block, block_nb);
 
     for (i = 0 ; i < 8; i++) {
         UNPACK32(ctx->h[i], &digest[i << 2]);
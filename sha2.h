@@ -60,11 +60,20 @@ typedef struct {
 
 extern uint32_t sha256_k[64];
 
+void sha256_init_backend(void);
+const char *sha256_backend_name(void);
+void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
+                   unsigned int block_nb);
 void sha256_init(sha256_ctx * ctx);
 void sha256_update(sha256_ctx *ctx, const unsigned char *message,
                    unsigned int len);
 void sha256_final(sha256_ctx *ctx, unsigned char *digest);
 void sha256(const unsigned char *message, unsigned int len,
             unsigned char *digest);
+void sha256d_80(const unsigned char *data, unsigned char *digest);
+void sha256d_80_tail(const uint32_t *midstate, const unsigned char *tail,
+                     unsigned char *digest);
+void sha256d_80_batch(const unsigned char *data, unsigned char *digest,
+                      int count);
 
 #endif /* !SHA2_H */
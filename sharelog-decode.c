@@ -0,0 +1,121 @@
+/*
+ * Copyright 2026 cgminer developers
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Decode --sharelog-format binary files to the same csv that
+ * --sharelog-format csv writes, in order, one file after another
+ *
+ * Compile:
+ *   gcc sharelog-decode.c -o sharelog-decode
+ * Use:
+ *   ./sharelog-decode sharelog.bin.20260101-000000 sharelog.bin > shares.csv
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "sharelog.h"
+
+#define MAXPOOLS 1024
+
+static void hex(char *s, const unsigned char *p, size_t len)
+{
+	static const char hexchars[] = "0123456789abcdef";
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		*s++ = hexchars[p[i] >> 4];
+		*s++ = hexchars[p[i] & 0xf];
+	}
+	*s = '\0';
+}
+
+static int decode(const char *name, FILE *f)
+{
+	static char *urls[MAXPOOLS];
+	char target[65], hash[65], data[257];
+	struct sharelog_header header;
+	struct sharelog_rec rec;
+	const char *url;
+	long n = 0;
+	int i;
+
+	// Pool numbers are per file
+	for (i = 0; i < MAXPOOLS; i++) {
+		free(urls[i]);
+		urls[i] = NULL;
+	}
+
+	if (fread(&header, sizeof(header), 1, f) != 1) {
+		fprintf(stderr, "%s: no header\n", name);
+		return 1;
+	}
+	if (memcmp(header.magic, SHARELOG_MAGIC, sizeof(header.magic)) ||
+	    header.version != SHARELOG_VERSION || header.rec_size != sizeof(rec)) {
+		fprintf(stderr, "%s: not a version %d share log in this byte order\n",
+			name, SHARELOG_VERSION);
+		return 1;
+	}
+
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		n++;
+		switch (rec.type) {
+			case SHARELOG_POOL:
+				if (rec.pool < MAXPOOLS) {
+					rec.url[sizeof(rec.url) - 1] = '\0';
+					free(urls[rec.pool]);
+					urls[rec.pool] = strdup(rec.url);
+				}
+				break;
+			case SHARELOG_SHARE:
+				url = (rec.pool < MAXPOOLS && urls[rec.pool]) ? urls[rec.pool] : "?";
+				rec.drv[sizeof(rec.drv) - 1] = '\0';
+				rec.disposition[sizeof(rec.disposition) - 1] = '\0';
+				hex(target, rec.share.target, sizeof(rec.share.target));
+				hex(hash, rec.share.hash, sizeof(rec.share.hash));
+				hex(data, rec.share.data, sizeof(rec.share.data));
+				// timestamp,disposition,target,pool,dev,thr,sharehash,sharedata
+				printf("%lu,%s,%s,%s,%s%u,%u,%s,%s\n", (unsigned long int)(rec.tv_sec),
+				       rec.disposition, target, url, rec.drv, rec.device_id,
+				       rec.thr_id, hash, data);
+				break;
+			default:
+				fprintf(stderr, "%s: unknown record type %d at record %ld\n",
+					name, (int)rec.type, n);
+				break;
+		}
+	}
+	if (ferror(f)) {
+		fprintf(stderr, "%s: read error\n", name);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	FILE *f;
+	int i, ret = 0;
+
+	if (argc < 2)
+		return decode("stdin", stdin);
+
+	for (i = 1; i < argc; i++) {
+		f = fopen(argv[i], "rb");
+		if (!f) {
+			fprintf(stderr, "%s: can't open\n", argv[i]);
+			ret = 1;
+			continue;
+		}
+		ret |= decode(argv[i], f);
+		fclose(f);
+	}
+	return ret;
+}
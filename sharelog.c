@@ -0,0 +1,396 @@
+/*
+ * Copyright 2026 cgminer developers
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "miner.h"
+#include "sharelog.h"
+
+/* The share log
+ * sharelog() only copies the raw share into a queue and signals the
+ * sharelog thread, which writes out everything queued since its last pass
+ * with a single fflush (a group commit) as csv or binary records, and
+ * rotates the file by size or age. Nothing is ever dropped, the queue
+ * grows if the disk falls behind. */
+
+char *opt_sharelog_format;
+int opt_sharelog_rotate_size;
+int opt_sharelog_rotate_time;
+
+static bool sharelog_binary;
+
+static pthread_mutex_t sharelog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sharelog_cond = PTHREAD_COND_INITIALIZER;
+static FILE *sharelog_file;
+static char *sharelog_path;		// NULL for an fd or stdout, which don't rotate
+static pthread_t sharelog_thr;
+static bool sharelog_async;
+static bool sharelog_stopping;
+
+struct sharelog_item {
+	struct pool *pool;
+	struct sharelog_rec rec;
+};
+
+// Swapped between the producers and the sharelog thread each pass
+static struct sharelog_item *sl_queue, *sl_batch;
+static int sl_queued, sl_queue_siz, sl_batch_siz;
+
+// Only used by whoever is writing: the thread, or a caller after it stops
+static size_t sl_file_len;
+static time_t sl_file_opened;
+static struct pool **sl_pools;
+static int sl_npools, sl_pools_siz;
+
+char *set_sharelog_format(char *arg)
+{
+	if (!strcasecmp(arg, "csv"))
+		sharelog_binary = false;
+	else if (!strcasecmp(arg, "binary"))
+		sharelog_binary = true;
+	else
+		return "Invalid value passed to sharelog-format, use csv or binary";
+
+	opt_sharelog_format = arg;
+	return NULL;
+}
+
+void sharelog_open(const char *arg)
+{
+	char *r = "";
+	long int i = strtol(arg, &r, 10);
+
+	if ((!*r) && i >= 0 && i <= INT_MAX) {
+		sharelog_file = fdopen((int)i, "a");
+		if (!sharelog_file)
+			applog(LOG_ERR, "Failed to open fd %u for share log", (unsigned int)i);
+	} else if (!strcmp(arg, "-")) {
+		sharelog_file = stdout;
+		if (!sharelog_file)
+			applog(LOG_ERR, "Standard output missing for share log");
+	} else {
+		// a+ so sharelog_newfile() can check the header of an existing file
+		sharelog_file = fopen(arg, "a+");
+		if (!sharelog_file)
+			applog(LOG_ERR, "Failed to open %s for share log", arg);
+		else {
+			free(sharelog_path);
+			sharelog_path = strdup(arg);
+		}
+	}
+}
+
+/* Rename the file to file.YYYYMMDD-HHMMSS, never replacing an earlier one,
+ * and reopen an empty file in its place */
+static bool sharelog_moveaway(char *name, size_t siz)
+{
+	struct stat st;
+	struct tm *tm;
+	time_t now;
+	int i, len;
+
+	now = time(NULL);
+	tm = localtime(&now);
+	len = snprintf(name, siz, "%s.%d%02d%02d-%02d%02d%02d", sharelog_path,
+		       tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
+		       tm->tm_hour, tm->tm_min, tm->tm_sec);
+	for (i = 1; stat(name, &st) == 0; i++)
+		snprintf(name + len, siz - len, "-%d", i);
+
+	fclose(sharelog_file);
+	if (rename(sharelog_path, name))
+		applog(LOG_ERR, "Failed to rename share log %s to %s", sharelog_path, name);
+	sharelog_file = fopen(sharelog_path, "a+");
+	if (!sharelog_file) {
+		applog(LOG_ERR, "Failed to reopen %s for share log", sharelog_path);
+		return false;
+	}
+	return true;
+}
+
+/* Whether the len bytes already in the file are a binary share log that
+ * the new records can be appended to. A file that can't be read (an fd
+ * opened write only) is trusted */
+static bool sharelog_header_ok(size_t len)
+{
+	struct sharelog_header header;
+	bool ok = true;
+
+	if (len < sizeof(header) || (len - sizeof(header)) % sizeof(struct sharelog_rec))
+		return false;
+
+	if (fseek(sharelog_file, 0, SEEK_SET) == 0) {
+		if (fread(&header, sizeof(header), 1, sharelog_file) == 1) {
+			if (memcmp(header.magic, SHARELOG_MAGIC, sizeof(header.magic)) ||
+			    header.version != SHARELOG_VERSION ||
+			    header.rec_size != sizeof(struct sharelog_rec))
+				ok = false;
+		} else
+			clearerr(sharelog_file);
+	}
+	fseek(sharelog_file, 0, SEEK_END);
+	return ok;
+}
+
+// A new or rotated file starts with the header and its own pool numbers
+static void sharelog_newfile(void)
+{
+	struct sharelog_header header;
+	char name[PATH_MAX];
+
+	if (fseek(sharelog_file, 0, SEEK_END) == 0 && ftell(sharelog_file) > 0)
+		sl_file_len = ftell(sharelog_file);
+	else
+		sl_file_len = 0;
+	sl_file_opened = time(NULL);
+	sl_npools = 0;
+
+	// Never append binary records to a csv log or another version's
+	if (sharelog_binary && sl_file_len > 0 && !sharelog_header_ok(sl_file_len)) {
+		if (!sharelog_path) {
+			applog(LOG_ERR, "Share log output isn't a version %d binary share log, not logging shares",
+			       SHARELOG_VERSION);
+			if (sharelog_file != stdout)
+				fclose(sharelog_file);
+			sharelog_file = NULL;
+			return;
+		}
+		if (!sharelog_moveaway(name, sizeof(name)))
+			return;
+		applog(LOG_WARNING, "Share log %s isn't a version %d binary share log, moved it to %s",
+		       sharelog_path, SHARELOG_VERSION, name);
+		sl_file_len = 0;
+	}
+
+	if (sharelog_binary && sl_file_len == 0) {
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, SHARELOG_MAGIC, sizeof(header.magic));
+		header.version = SHARELOG_VERSION;
+		header.rec_size = sizeof(struct sharelog_rec);
+		header.created = (int64_t)sl_file_opened;
+		if (fwrite(&header, sizeof(header), 1, sharelog_file) != 1)
+			applog(LOG_ERR, "sharelog fwrite error");
+		fflush(sharelog_file);
+		sl_file_len = sizeof(header);
+	}
+}
+
+// Move the full or old file aside and start a new one
+static void sharelog_rotate(void)
+{
+	char name[PATH_MAX];
+
+	if (!sharelog_moveaway(name, sizeof(name)))
+		return;
+	sharelog_newfile();
+	applog(LOG_NOTICE, "Share log rotated to %s", name);
+}
+
+static void sharelog_check_rotate(void)
+{
+	size_t empty = sharelog_binary ? sizeof(struct sharelog_header) : 0;
+
+	if (!sharelog_path || !sharelog_file || sl_file_len <= empty)
+		return;
+
+	if ((opt_sharelog_rotate_size && sl_file_len >= (size_t)opt_sharelog_rotate_size * 1024 * 1024) ||
+	    (opt_sharelog_rotate_time && time(NULL) - sl_file_opened >= opt_sharelog_rotate_time * 60))
+		sharelog_rotate();
+}
+
+// The file's number for the pool, writing its url record the first time
+static uint32_t sharelog_pool(struct pool *pool)
+{
+	struct sharelog_rec rec;
+	int i;
+
+	for (i = 0; i < sl_npools; i++) {
+		if (sl_pools[i] == pool)
+			return i;
+	}
+	if (sl_npools >= sl_pools_siz) {
+		sl_pools_siz += 8;
+		sl_pools = cgrealloc(sl_pools, sizeof(*sl_pools) * sl_pools_siz);
+	}
+	sl_pools[sl_npools] = pool;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = SHARELOG_POOL;
+	rec.pool = sl_npools;
+	strncpy(rec.url, pool->rpc_url, sizeof(rec.url) - 1);
+	if (fwrite(&rec, sizeof(rec), 1, sharelog_file) != 1)
+		applog(LOG_ERR, "sharelog fwrite error");
+	sl_file_len += sizeof(rec);
+
+	return sl_npools++;
+}
+
+static void sharelog_write(struct sharelog_item *items, int count)
+{
+	char target[65], hash[65], data[257];
+	struct sharelog_rec *rec;
+	char s[1024];
+	int i, rv;
+
+	if (!sharelog_file)
+		return;
+
+	for (i = 0; i < count; i++) {
+		rec = &items[i].rec;
+		if (sharelog_binary) {
+			rec->pool = sharelog_pool(items[i].pool);
+			if (fwrite(rec, sizeof(*rec), 1, sharelog_file) != 1) {
+				applog(LOG_ERR, "sharelog fwrite error");
+				continue;
+			}
+			sl_file_len += sizeof(*rec);
+			continue;
+		}
+
+		__bin2hex(target, rec->share.target, sizeof(rec->share.target));
+		__bin2hex(hash, rec->share.hash, sizeof(rec->share.hash));
+		__bin2hex(data, rec->share.data, sizeof(rec->share.data));
+
+		// timestamp,disposition,target,pool,dev,thr,sharehash,sharedata
+		rv = snprintf(s, sizeof(s), "%lu,%s,%s,%s,%s%u,%u,%s,%s\n", (unsigned long int)(rec->tv_sec),
+			      rec->disposition, target, items[i].pool->rpc_url, rec->drv, rec->device_id,
+			      rec->thr_id, hash, data);
+		if (rv >= (int)(sizeof(s)))
+			rv = sizeof(s) - 1;
+		else if (rv < 0) {
+			applog(LOG_ERR, "sharelog printf error");
+			continue;
+		}
+		if (fwrite(s, rv, 1, sharelog_file) != 1) {
+			applog(LOG_ERR, "sharelog fwrite error");
+			continue;
+		}
+		sl_file_len += rv;
+	}
+	fflush(sharelog_file);
+}
+
+static void *sharelog_thread(void __maybe_unused *userdata)
+{
+	struct timespec abstime, tdiff;
+	struct sharelog_item *tmp;
+	bool stopping;
+	int count, siz;
+
+	RenameThread("ShareLog");
+
+	while (42) {
+		mutex_lock(&sharelog_lock);
+		if (!sl_queued && !sharelog_stopping) {
+			// Wake at least each second for time based rotation
+			cgcond_time(&abstime);
+			ms_to_timespec(&tdiff, 1000);
+			timeraddspec(&abstime, &tdiff);
+			pthread_cond_timedwait(&sharelog_cond, &sharelog_lock, &abstime);
+		}
+		tmp = sl_batch;
+		sl_batch = sl_queue;
+		sl_queue = tmp;
+		siz = sl_batch_siz;
+		sl_batch_siz = sl_queue_siz;
+		sl_queue_siz = siz;
+		count = sl_queued;
+		sl_queued = 0;
+		stopping = sharelog_stopping;
+		mutex_unlock(&sharelog_lock);
+
+		if (count)
+			sharelog_write(sl_batch, count);
+		sharelog_check_rotate();
+
+		if (stopping && !count)
+			break;
+	}
+	return NULL;
+}
+
+void sharelog(const char *disposition, const struct work *work)
+{
+	struct sharelog_item *item, direct;
+	struct cgpu_info *cgpu;
+	int thr_id;
+
+	if (!sharelog_file)
+		return;
+
+	thr_id = work->thr_id;
+	cgpu = get_thread(thr_id)->cgpu;
+
+	mutex_lock(&sharelog_lock);
+	if (sharelog_async) {
+		if (sl_queued >= sl_queue_siz) {
+			sl_queue_siz += 64;
+			sl_queue = cgrealloc(sl_queue, sizeof(*sl_queue) * sl_queue_siz);
+		}
+		item = &sl_queue[sl_queued];
+	} else
+		item = &direct;
+
+	memset(item, 0, sizeof(*item));
+	item->pool = work->pool;
+	item->rec.type = SHARELOG_SHARE;
+	item->rec.tv_sec = work->tv_work_found.tv_sec;
+	item->rec.tv_usec = work->tv_work_found.tv_usec;
+	item->rec.device_id = cgpu->device_id;
+	item->rec.thr_id = thr_id;
+	strncpy(item->rec.drv, cgpu->drv->name, sizeof(item->rec.drv) - 1);
+	strncpy(item->rec.disposition, disposition, sizeof(item->rec.disposition) - 1);
+	cg_memcpy(item->rec.share.target, work->target, sizeof(work->target));
+	cg_memcpy(item->rec.share.hash, work->hash, sizeof(work->hash));
+	cg_memcpy(item->rec.share.data, work->data, sizeof(work->data));
+
+	if (sharelog_async) {
+		sl_queued++;
+		pthread_cond_signal(&sharelog_cond);
+	} else {
+		sharelog_write(item, 1);
+		sharelog_check_rotate();
+	}
+	mutex_unlock(&sharelog_lock);
+}
+
+void sharelog_start(void)
+{
+	if (!sharelog_file)
+		return;
+
+	sharelog_newfile();
+	if (!sharelog_file)
+		return;
+
+	if (unlikely(pthread_create(&sharelog_thr, NULL, sharelog_thread, NULL))) {
+		applog(LOG_ERR, "Failed to create sharelog thread, writing shares directly");
+		return;
+	}
+	sharelog_async = true;
+}
+
+// Write out everything queued, shares after this are written directly
+void sharelog_stop(void)
+{
+	mutex_lock(&sharelog_lock);
+	if (!sharelog_async) {
+		mutex_unlock(&sharelog_lock);
+		return;
+	}
+	sharelog_async = false;
+	sharelog_stopping = true;
+	pthread_cond_signal(&sharelog_cond);
+	mutex_unlock(&sharelog_lock);
+
+	pthread_join(sharelog_thr, NULL);
+}
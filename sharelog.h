@@ -0,0 +1,61 @@
+/*
+ * Copyright 2026 cgminer developers
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef SHARELOG_H
+#define SHARELOG_H
+
+#include <stdint.h>
+
+/* The --sharelog-format binary file layout, shared with sharelog-decode.c
+ * A file is one sharelog_header then fixed size sharelog_rec records, all
+ * in the byte order of the miner that wrote it (the header magic and
+ * version won't match if it differs).
+ * Pools are numbered per file, a SHARELOG_POOL record with the url comes
+ * before the first share from each pool, so every rotated file stands alone */
+
+#define SHARELOG_MAGIC "CGSHRLOG"
+#define SHARELOG_VERSION 1
+
+struct sharelog_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t rec_size;		// sizeof(struct sharelog_rec)
+	int64_t created;		// unix time
+	char reserved[40];
+};
+
+enum sharelog_type {
+	SHARELOG_SHARE = 1,
+	SHARELOG_POOL = 2,
+};
+
+#define SHARELOG_URLSIZ 192
+
+struct sharelog_rec {
+	uint8_t type;
+	uint8_t reserved[3];
+	uint32_t pool;			// per file pool number
+	int64_t tv_sec;			// when the share was found
+	uint32_t tv_usec;
+	uint32_t device_id;
+	int32_t thr_id;
+	char drv[12];			// driver name e.g. GSA
+	char disposition[36];		// accept, discard, reject[:reason]
+	union {
+		struct {
+			unsigned char target[32];
+			unsigned char hash[32];
+			unsigned char data[128];
+		} share;
+		char url[SHARELOG_URLSIZ];	// SHARELOG_POOL
+	};
+	uint32_t reserved2;
+};
+
+#endif /* SHARELOG_H */
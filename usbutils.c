@@ -11,8 +11,12 @@
 #include "config.h"
 
 #include <ctype.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdbool.h>
+#ifndef WIN32
+#include <sys/resource.h>
+#endif
 
 #include "logging.h"
 #include "miner.h"
@@ -25,6 +29,8 @@ static cgtimer_t usb11_cgt;
 
 // allow debugging to ignore timeouts
 int libusb_ign_tmo = 0;
+/* libusb_init() failed, only --usb-sim devices are available */
+bool usb_nolibusb;
 
 #define NODEV(err) ((err) != LIBUSB_SUCCESS && (err) != LIBUSB_ERROR_TIMEOUT)
 
@@ -1767,6 +1773,9 @@ void usb_all(int level)
 	char *buf;
 	size_t len, off;
 
+	if (usb_nolibusb)
+		return;
+
 	count = libusb_get_device_list(NULL, &list);
 	if (count < 0) {
 		applog(LOG_ERR, "USB all: failed, err:(%d) %s", (int)count, libusb_error_name((int)count));
@@ -2042,6 +2051,11 @@ void usb_list(void)
 	ssize_t count, i, j;
 	int err, total = 0;
 
+	if (usb_nolibusb) {
+		simplelog(LOG_WARNING, "USB list: libusb not initialised");
+		return;
+	}
+
 	count = libusb_get_device_list(NULL, &list);
 	if (count < 0) {
 		applog(LOG_ERR, "USB list: failed, err:(%d) %s", (int)count, libusb_error_name((int)count));
@@ -2253,6 +2267,612 @@ static void cgminer_usb_unlock(struct device_drv *drv, libusb_device *dev)
 	cgminer_usb_unlock_bd(drv, libusb_get_bus_number(dev), libusb_get_device_address(dev));
 }
 
+/*
+ * Simulated BM1397/BM1362/BM1370 chains selected with --usb-sim so that
+ * drivers can be benchmarked without hardware.
+ * Each simulated device answers the chip register commands like a chain of
+ * chips and emits nonces at the requested hashrate scaled by the ticket
+ * mask. The nonces are random, so the driver counts them as hardware errors,
+ * but each one still goes through the driver's receive, job and verify code.
+ */
+#define USB_SIM_MAX 64
+#define USB_SIM_CHIPS 64
+#define USB_SIM_REGS 256
+// reply frames the device can hold before it loses replies
+#define USB_SIM_REPLIES 64
+#define USB_SIM_REPLY_LEN 11
+#define USB_SIM_REPORT_S 10
+// bus 0 isn't a real libusb bus number
+#define USB_SIM_BUS 0
+
+#define USB_SIM_FREQREG 0x08
+#define USB_SIM_TICKETREG 0x14
+
+struct usb_sim_type {
+	const char *name;
+	enum sub_ident ident;
+	unsigned char chipid[4];
+	int rx_len;
+};
+
+static struct usb_sim_type usb_sim_types[] = {
+	{ "GSF",	IDENT_GSF,	{ 0x13, 0x97, 0x18, 0x00 }, 9 },
+	{ "GSA1",	IDENT_GSA1,	{ 0x13, 0x62, 0x03, 0x00 }, 11 },
+	{ "GSA2",	IDENT_GSA2,	{ 0x13, 0x70, 0x00, 0x00 }, 11 },
+	{ NULL, IDENT_UNK, { 0 }, 0 }
+};
+
+struct usb_sim_reply {
+	unsigned char data[USB_SIM_REPLY_LEN];
+	int len;
+	bool nonce;
+	struct timeval due;
+};
+
+struct usb_sim {
+	int id;
+	struct usb_sim_type *type;
+	double ghs;
+	int chips;
+	bool inuse;
+	bool ftdi;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	unsigned char regs[USB_SIM_CHIPS][USB_SIM_REGS][4];
+	unsigned char addr[USB_SIM_CHIPS];
+	int addressed;
+
+	bool mining;
+	unsigned char job_id;
+	bool known;		// the job has a known nonce not yet returned
+	uint32_t known_nonce;
+	struct timeval next_nonce;
+	uint64_t rnd;
+
+	struct usb_sim_reply reply[USB_SIM_REPLIES];
+	int rhead, rcount, roff;
+
+	uint64_t emitted, nonces, dropped;
+	double latency, latency_max;
+};
+
+static struct usb_sim *usb_sims[USB_SIM_MAX];
+static int usb_sim_count;
+static struct usb_sim *usb_sim_pending;
+
+static pthread_mutex_t usb_sim_lock;
+static time_t usb_sim_next_report;
+static struct timeval usb_sim_start, usb_sim_last;
+static uint64_t usb_sim_last_nonces;
+static double usb_sim_start_cpu, usb_sim_last_cpu, usb_sim_latency_max;
+
+static uint64_t usb_sim_rand(struct usb_sim *sim)
+{
+	uint64_t x = sim->rnd;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return (sim->rnd = x);
+}
+
+// BM13xx 5 bit crc
+static unsigned char usb_sim_crc5(unsigned char *ptr, int bits)
+{
+	unsigned char c[5] = {1, 1, 1, 1, 1};
+	unsigned char c1;
+	int i;
+
+	for (i = 0; i < bits; i++) {
+		c1 = c[1];
+		c[1] = c[0];
+		c[0] = c[4] ^ ((ptr[i / 8] & (0x80 >> (i % 8))) ? 1 : 0);
+		c[4] = c[3];
+		c[3] = c[2];
+		c[2] = c1 ^ c[0];
+	}
+	return (c[4] << 4) | (c[3] << 3) | (c[2] << 2) | (c[1] << 1) | c[0];
+}
+
+// the ticket register holds (diff-1) bit reversed in each byte
+static double usb_sim_ticket_diff(struct usb_sim *sim)
+{
+	unsigned char *reg = sim->regs[0][USB_SIM_TICKETREG];
+	uint32_t diff = 0;
+	int i, b;
+
+	for (i = 0; i < 4; i++)
+		for (b = 0; b < 8; b++)
+			if (reg[3-i] & (0x80 >> b))
+				diff |= 1 << (i * 8 + b);
+	return (double)diff + 1.0;
+}
+
+// exponential nonce spacing at ghs/diff for the whole chain
+static void usb_sim_next(struct usb_sim *sim)
+{
+	double rate, u;
+	int64_t us;
+
+	rate = sim->ghs * 1e9 / (4294967296.0 * usb_sim_ticket_diff(sim));
+	u = ((double)(usb_sim_rand(sim) >> 11) + 1.0) / 9007199254740993.0;
+	us = (int64_t)(-log(u) / rate * 1e6);
+	us += sim->next_nonce.tv_usec;
+	sim->next_nonce.tv_sec += us / 1000000;
+	sim->next_nonce.tv_usec = us % 1000000;
+}
+
+static struct usb_sim_reply *usb_sim_reply(struct usb_sim *sim, bool nonce)
+{
+	struct usb_sim_reply *rep;
+
+	if (sim->rcount >= USB_SIM_REPLIES) {
+		sim->dropped++;
+		return NULL;
+	}
+	rep = &(sim->reply[(sim->rhead + sim->rcount) % USB_SIM_REPLIES]);
+	sim->rcount++;
+	memset(rep, 0, sizeof(*rep));
+	rep->len = sim->type->rx_len;
+	rep->nonce = nonce;
+	rep->data[0] = 0xaa;
+	rep->data[1] = 0x55;
+	return rep;
+}
+
+static void usb_sim_crc(struct usb_sim_reply *rep)
+{
+	rep->data[rep->len-1] = usb_sim_crc5(rep->data+2, 8 * (rep->len-2) - 5);
+}
+
+static void usb_sim_reg_reply(struct usb_sim *sim, int chip, unsigned char reg)
+{
+	struct usb_sim_reply *rep = usb_sim_reply(sim, false);
+
+	if (!rep)
+		return;
+	cg_memcpy(rep->data+2, sim->regs[chip][reg], 4);
+	rep->data[6] = sim->addr[chip];
+	rep->data[7] = reg;
+	usb_sim_crc(rep);
+	cgtime(&(rep->due));
+}
+
+// queue any nonces due by now
+static void usb_sim_nonces(struct usb_sim *sim, struct timeval *now)
+{
+	struct usb_sim_reply *rep;
+	uint64_t r;
+	int chip, step;
+
+	if (!sim->mining)
+		return;
+
+	while (!time_more(&(sim->next_nonce), now)) {
+		sim->emitted++;
+		rep = usb_sim_reply(sim, true);
+		if (rep) {
+			r = usb_sim_rand(sim);
+			chip = (int)(r % sim->chips);
+			step = 0x100 / sim->chips;
+			r >>= 8;
+			if (sim->known) {
+				// a real share, with no rolled version bits
+				rep->data[2] = (sim->known_nonce >> 24) & 0xff;
+				rep->data[3] = (sim->known_nonce >> 16) & 0xff;
+				rep->data[4] = (sim->known_nonce >> 8) & 0xff;
+				rep->data[5] = sim->known_nonce & 0xff;
+				r &= ~(0xffffULL << 44);
+				sim->known = false;
+			} else {
+				rep->data[2] = r & 0xff;
+				rep->data[3] = (r >> 8) & 0xff;
+				// the nonce range of the chip that found it
+				rep->data[4] = sim->addr[chip] + (r >> 16) % step;
+				rep->data[5] = (r >> 24) & 0xff;
+			}
+			rep->data[6] = (r >> 32) & 0xff;
+			switch (sim->type->ident) {
+				case IDENT_GSA1:
+					rep->data[7] = (sim->job_id & 0xf8) | ((r >> 40) & 0x07);
+					break;
+				case IDENT_GSA2:
+					rep->data[7] = ((sim->job_id << 1) & 0xf0) | ((r >> 40) & 0x0f);
+					break;
+				default:
+					rep->data[7] = sim->job_id;
+					break;
+			}
+			if (rep->len > 9) {
+				// rolled version bits
+				rep->data[8] = (r >> 44) & 0xff;
+				rep->data[9] = (r >> 52) & 0xff;
+			}
+			usb_sim_crc(rep);
+			copy_time(&(rep->due), &(sim->next_nonce));
+		}
+		usb_sim_next(sim);
+	}
+}
+
+/* Finds the nonce of a --benchmark task, from the end of its merkle root,
+ * ntime and nbits (byte reversed in the task), so the next nonce from the
+ * chain is a real share rather than a HW error */
+static void usb_sim_task(struct usb_sim *sim, unsigned char *task, int len)
+{
+	unsigned char tail[12];
+	int i;
+
+	sim->known = false;
+	switch (sim->type->ident) {
+		case IDENT_GSA1:
+		case IDENT_GSA2:
+			// nbits, ntime, then the merkle root one reversed word at a time
+			if (len < 20)
+				return;
+			for (i = 0; i < 4; i++) {
+				tail[i] = task[19 - i];
+				tail[4 + i] = task[15 - i];
+				tail[8 + i] = task[11 - i];
+			}
+			break;
+		default:
+			if (len < 20)
+				return;
+			for (i = 0; i < 12; i++)
+				tail[i] = task[19 - i];
+			break;
+	}
+	sim->known = benchmark_nonce(tail, &(sim->known_nonce));
+}
+
+// power on state of the chain
+static void usb_sim_reset(struct usb_sim *sim)
+{
+	int chip;
+
+	mutex_lock(&sim->lock);
+	memset(sim->regs, 0, sizeof(sim->regs));
+	for (chip = 0; chip < sim->chips; chip++) {
+		cg_memcpy(sim->regs[chip][0], sim->type->chipid, 4);
+		sim->regs[chip][USB_SIM_FREQREG][0] = 0x40;
+		sim->regs[chip][USB_SIM_FREQREG][1] = 0xa0;
+		sim->regs[chip][USB_SIM_FREQREG][2] = 0x02;
+		sim->regs[chip][USB_SIM_FREQREG][3] = 0x41;
+	}
+	memset(sim->addr, 0, sizeof(sim->addr));
+	sim->addressed = 0;
+	sim->mining = false;
+	sim->rhead = sim->rcount = sim->roff = 0;
+	mutex_unlock(&sim->lock);
+}
+
+/* Decode the 55 aa command frames written to the chain
+ * 0x4N is to one chip address, 0x5N is to all chips
+ * N: 0 set address, 1 write register, 2 read register, 3 chain inactive
+ * 0x21 is a task */
+static void usb_sim_write(struct usb_sim *sim, unsigned char *buf, int len)
+{
+	unsigned char cmd, *frame;
+	struct timeval now;
+	int i, chip, flen;
+	bool all;
+
+	mutex_lock(&sim->lock);
+	for (i = 0; i + 4 < len; i += flen) {
+		if (buf[i] != 0x55 || buf[i+1] != 0xaa) {
+			flen = 1;
+			continue;
+		}
+		frame = buf + i + 2;
+		cmd = frame[0];
+		if (cmd == 0x21) {
+			if (!sim->mining) {
+				cgtime(&(sim->next_nonce));
+				usb_sim_next(sim);
+				sim->mining = true;
+			}
+			sim->job_id = frame[2];
+			usb_sim_task(sim, frame, len - i - 2);
+			break;
+		}
+		flen = 2 + frame[1];
+		if (frame[1] < 5 || i + flen > len)
+			break;
+
+		all = ((cmd & 0xf0) == 0x50);
+		switch (cmd & 0x0f) {
+			case 0x00:
+				if (sim->addressed < sim->chips)
+					sim->addr[sim->addressed++] = frame[2];
+				break;
+			case 0x01:
+				if (frame[1] < 9)
+					break;
+				for (chip = 0; chip < sim->chips; chip++)
+					if (all || sim->addr[chip] == frame[2])
+						cg_memcpy(sim->regs[chip][frame[3]], frame+4, 4);
+				// a new ticket changes the nonce rate
+				if (frame[3] == USB_SIM_TICKETREG && sim->mining) {
+					cgtime(&(sim->next_nonce));
+					usb_sim_next(sim);
+				}
+				break;
+			case 0x02:
+				for (chip = 0; chip < sim->chips; chip++)
+					if (all || sim->addr[chip] == frame[2])
+						usb_sim_reg_reply(sim, chip, frame[3]);
+				break;
+			case 0x03:
+				sim->addressed = 0;
+				break;
+		}
+	}
+	cgtime(&now);
+	usb_sim_nonces(sim, &now);
+	if (sim->rcount)
+		pthread_cond_signal(&sim->cond);
+	mutex_unlock(&sim->lock);
+}
+
+/* Returns whatever replies are waiting, or waits up to timeout for the next
+ * one, like a bulk read from the UART bridge */
+static int usb_sim_read(struct usb_sim *sim, unsigned char *buf, int len, int *transferred, unsigned int timeout)
+{
+	struct timespec abstime, tdiff;
+	struct usb_sim_reply *rep;
+	struct timeval now, end;
+	int got = 0, n;
+	double lat;
+
+	cgtime(&now);
+	copy_time(&end, &now);
+	end.tv_sec += timeout / 1000;
+	end.tv_usec += (timeout % 1000) * 1000;
+	if (end.tv_usec >= 1000000) {
+		end.tv_sec++;
+		end.tv_usec -= 1000000;
+	}
+
+	if (sim->ftdi) {
+		// FTDI modem status prefix
+		if (len < 3) {
+			*transferred = 0;
+			return LIBUSB_ERROR_TIMEOUT;
+		}
+		buf[got++] = 0x01;
+		buf[got++] = 0x60;
+	}
+
+	mutex_lock(&sim->lock);
+	while (42) {
+		usb_sim_nonces(sim, &now);
+		if (sim->rcount || !time_less(&now, &end))
+			break;
+
+		cgcond_time(&abstime);
+		if (sim->mining && time_less(&(sim->next_nonce), &end))
+			us_to_timespec(&tdiff, (int64_t)us_tdiff(&(sim->next_nonce), &now) + 1);
+		else
+			us_to_timespec(&tdiff, (int64_t)us_tdiff(&end, &now) + 1);
+		timeraddspec(&abstime, &tdiff);
+		pthread_cond_timedwait(&sim->cond, &sim->lock, &abstime);
+		cgtime(&now);
+	}
+
+	while (sim->rcount && got < len) {
+		rep = &(sim->reply[sim->rhead]);
+		n = MIN(rep->len - sim->roff, len - got);
+		cg_memcpy(buf + got, rep->data + sim->roff, n);
+		got += n;
+		sim->roff += n;
+		if (sim->roff < rep->len)
+			break;
+		if (rep->nonce) {
+			sim->nonces++;
+			lat = us_tdiff(&now, &(rep->due));
+			sim->latency += lat;
+			if (sim->latency_max < lat)
+				sim->latency_max = lat;
+		}
+		sim->roff = 0;
+		sim->rhead = (sim->rhead + 1) % USB_SIM_REPLIES;
+		sim->rcount--;
+	}
+	mutex_unlock(&sim->lock);
+
+	if (sim->ftdi && got == 2)
+		got = 0;
+	*transferred = got;
+	return got ? LIBUSB_SUCCESS : LIBUSB_ERROR_TIMEOUT;
+}
+
+static double usb_sim_cpu(void)
+{
+#ifndef WIN32
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (double)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6 +
+		(double)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+#else
+	return 0.0;
+#endif
+}
+
+/* Log nonces/s processed, CPU per nonce, queue latency and dropped replies
+ * across all simulated devices since the last report, or in total.
+ * CPU is whole process usage, so it includes pool/benchmark work generation
+ * as well as the driver threads */
+static void usb_sim_report(bool final)
+{
+	uint64_t emitted = 0, nonces = 0, dropped = 0;
+	double latency = 0.0, latency_max = 0.0, cpu, secs;
+	struct timeval now;
+	int i, devs = 0;
+
+	mutex_lock(&usb_sim_lock);
+	for (i = 0; i < usb_sim_count; i++) {
+		struct usb_sim *sim = usb_sims[i];
+
+		mutex_lock(&sim->lock);
+		devs += sim->inuse;
+		emitted += sim->emitted;
+		nonces += sim->nonces;
+		dropped += sim->dropped;
+		latency += sim->latency;
+		if (latency_max < sim->latency_max)
+			latency_max = sim->latency_max;
+		if (!final)
+			sim->latency_max = 0.0;
+		mutex_unlock(&sim->lock);
+	}
+
+	if (usb_sim_latency_max < latency_max)
+		usb_sim_latency_max = latency_max;
+
+	cgtime(&now);
+	cpu = usb_sim_cpu();
+	if (final) {
+		secs = tdiff(&now, &usb_sim_start);
+		applog(LOG_WARNING, "USB sim total %d dev %.1fs: %"PRIu64" nonces %.1f/s"
+			" process CPU %.1fus/nonce latency avg %.0fus max %.0fus"
+			" emitted %"PRIu64" dropped %"PRIu64,
+			devs, secs, nonces, secs > 0 ? (double)nonces / secs : 0.0,
+			nonces ? (cpu - usb_sim_start_cpu) / (double)nonces : 0.0,
+			nonces ? latency / (double)nonces : 0.0, usb_sim_latency_max,
+			emitted, dropped);
+	} else {
+		secs = tdiff(&now, &usb_sim_last);
+		applog(LOG_WARNING, "USB sim %d dev: %.1f nonces/s process CPU %.1fus/nonce"
+			" latency avg %.0fus max %.0fus emitted %"PRIu64" dropped %"PRIu64,
+			devs, secs > 0 ? (double)(nonces - usb_sim_last_nonces) / secs : 0.0,
+			nonces > usb_sim_last_nonces ?
+				(cpu - usb_sim_last_cpu) / (double)(nonces - usb_sim_last_nonces) : 0.0,
+			nonces ? latency / (double)nonces : 0.0, latency_max,
+			emitted, dropped);
+		copy_time(&usb_sim_last, &now);
+		usb_sim_last_nonces = nonces;
+		usb_sim_last_cpu = cpu;
+	}
+	mutex_unlock(&usb_sim_lock);
+}
+
+static int usb_sim_transfer(struct usb_sim *sim, int intinfo, unsigned char endpoint,
+			    unsigned char *data, int length, int *transferred, unsigned int timeout)
+{
+	time_t next;
+	int err;
+
+	*transferred = 0;
+
+	// only the chip UART is simulated, other interfaces stay silent
+	if (intinfo != 0) {
+		if ((endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT) {
+			*transferred = length;
+			return LIBUSB_SUCCESS;
+		}
+		cgsleep_ms(timeout);
+		return LIBUSB_ERROR_TIMEOUT;
+	}
+
+	if ((endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT) {
+		usb_sim_write(sim, data, length);
+		*transferred = length;
+		return LIBUSB_SUCCESS;
+	}
+
+	err = usb_sim_read(sim, data, length, transferred, timeout);
+
+	next = __atomic_load_n(&usb_sim_next_report, __ATOMIC_RELAXED);
+	if (time(NULL) >= next &&
+	    __atomic_compare_exchange_n(&usb_sim_next_report, &next, next + USB_SIM_REPORT_S,
+					false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		usb_sim_report(false);
+
+	return err;
+}
+
+// --usb-sim TYPE:count:GH/s[:chips][,...]
+static void usb_sim_initialise(void)
+{
+	char *fre, *ptr, *comma, *colon;
+	struct usb_sim_type *type;
+	int count, chips, i;
+	double ghs;
+
+	mutex_init(&usb_sim_lock);
+
+	fre = ptr = strdup(opt_usb_sim);
+	do {
+		comma = strchr(ptr, ',');
+		if (comma)
+			*(comma++) = '\0';
+
+		colon = strchr(ptr, ':');
+		if (!colon)
+			quit(1, "Invalid --usb-sim TYPE:count:GH/s missing ':'");
+		*(colon++) = '\0';
+
+		for (type = usb_sim_types; type->name; type++)
+			if (strcasecmp(ptr, type->name) == 0)
+				break;
+		if (!type->name)
+			quit(1, "Invalid --usb-sim TYPE:count:GH/s - unknown TYPE='%s'", ptr);
+
+		count = atoi(colon);
+		colon = strchr(colon, ':');
+		if (count < 1 || !colon)
+			quit(1, "Invalid --usb-sim TYPE:count:GH/s - count must be > 0");
+		colon++;
+
+		ghs = atof(colon);
+		if (ghs <= 0.0)
+			quit(1, "Invalid --usb-sim TYPE:count:GH/s - GH/s must be > 0");
+
+		chips = 1;
+		colon = strchr(colon, ':');
+		if (colon) {
+			chips = atoi(colon+1);
+			if (chips < 1 || chips > USB_SIM_CHIPS)
+				quit(1, "Invalid --usb-sim TYPE:count:GH/s:chips - chips must be 1..%d",
+					USB_SIM_CHIPS);
+		}
+
+		for (i = 0; i < count; i++) {
+			struct usb_sim *sim;
+
+			if (usb_sim_count >= USB_SIM_MAX)
+				quit(1, "Invalid --usb-sim - more than %d devices", USB_SIM_MAX);
+
+			sim = cgcalloc(1, sizeof(*sim));
+			sim->id = usb_sim_count;
+			sim->type = type;
+			sim->ghs = ghs;
+			sim->chips = chips;
+			sim->rnd = 0x9e3779b97f4a7c15ULL * (uint64_t)(usb_sim_count + 1) ^ (uint64_t)time(NULL);
+			mutex_init(&sim->lock);
+			if (unlikely(pthread_cond_init(&sim->cond, NULL)))
+				quit(1, "Failed to pthread_cond_init usb sim");
+			usb_sim_reset(sim);
+			usb_sims[usb_sim_count++] = sim;
+		}
+
+		ptr = comma;
+	} while (ptr);
+	free(fre);
+
+	cgtime(&usb_sim_start);
+	copy_time(&usb_sim_last, &usb_sim_start);
+	usb_sim_start_cpu = usb_sim_last_cpu = usb_sim_cpu();
+	usb_sim_next_report = time(NULL) + USB_SIM_REPORT_S;
+
+	applog(LOG_WARNING, "USB sim %d simulated device%s", usb_sim_count,
+		usb_sim_count == 1 ? "" : "s");
+}
+
 static struct cg_usb_device *free_cgusb(struct cg_usb_device *cgusb)
 {
 	applog(LOG_DEBUG, "USB free %s", cgusb->found->name);
@@ -2269,6 +2889,12 @@ static struct cg_usb_device *free_cgusb(struct cg_usb_device *cgusb)
 	if (cgusb->descriptor)
 		free(cgusb->descriptor);
 
+	if (cgusb->sim) {
+		mutex_lock(&cgusb->sim->lock);
+		cgusb->sim->inuse = false;
+		mutex_unlock(&cgusb->sim->lock);
+	}
+
 	free(cgusb->found);
 
 	free(cgusb);
@@ -2276,6 +2902,8 @@ static struct cg_usb_device *free_cgusb(struct cg_usb_device *cgusb)
 	return NULL;
 }
 
+static void usb_async_drain(struct cg_usb_device *usbdev);
+
 static void _usb_uninit(struct cgpu_info *cgpu)
 {
 	int ifinfo;
@@ -2289,6 +2917,7 @@ static void _usb_uninit(struct cgpu_info *cgpu)
 			cgpu->drv->name, cgpu->device_id);
 
 	if (cgpu->usbdev->handle) {
+		usb_async_drain(cgpu->usbdev);
 		for (ifinfo = cgpu->usbdev->found->intinfo_count - 1; ifinfo >= 0; ifinfo--) {
 			libusb_release_interface(cgpu->usbdev->handle,
 						 THISIF(cgpu->usbdev->found, ifinfo));
@@ -2365,19 +2994,23 @@ static bool __release_cgpu(struct cgpu_info *cgpu)
 
 static void release_cgpu(struct cgpu_info *cgpu)
 {
-	if (__release_cgpu(cgpu))
+	bool sim = (cgpu->usbdev && cgpu->usbdev->sim);
+
+	if (__release_cgpu(cgpu) && !sim)
 		cgminer_usb_unlock_bd(cgpu->drv, cgpu->usbinfo.bus_number, cgpu->usbinfo.device_address);
 }
 
 void blacklist_cgpu(struct cgpu_info *cgpu)
 {
+	bool sim = (cgpu->usbdev && cgpu->usbdev->sim);
+
 	if (cgpu->blacklisted) {
 		applog(LOG_WARNING, "Device already blacklisted");
 		return;
 	}
 	cgpu->blacklisted = true;
 	add_in_use(cgpu->usbinfo.bus_number, cgpu->usbinfo.device_address, true);
-	if (__release_cgpu(cgpu))
+	if (__release_cgpu(cgpu) && !sim)
 		cgminer_usb_unlock_bd(cgpu->drv, cgpu->usbinfo.bus_number, cgpu->usbinfo.device_address);
 }
 
@@ -2464,6 +3097,71 @@ struct cgpu_info *usb_free_cgpu(struct cgpu_info *cgpu)
 #define USB_INIT_OK 1
 #define USB_INIT_IGNORE 2
 
+// A simulated device needs no libusb, only what drivers look at
+static int usb_sim_init(struct cgpu_info *cgpu, struct usb_find_devices *found)
+{
+	struct usb_sim *sim = usb_sim_pending;
+	struct cg_usb_device *cgusb;
+	char buf[STRBUFLEN+1];
+	int pstate;
+
+	if (found->ident != sim->type->ident) {
+		free(found);
+		return USB_INIT_IGNORE;
+	}
+
+	DEVWLOCK(cgpu, pstate);
+
+	cgpu->usbinfo.bus_number = USB_SIM_BUS;
+	cgpu->usbinfo.device_address = sim->id + 1;
+
+	snprintf(buf, sizeof(buf), "sim:%d", sim->id + 1);
+	cgpu->device_path = strdup(buf);
+
+	cgusb = cgcalloc(1, sizeof(*cgusb));
+	cgusb->found = found;
+
+	if (found->idVendor == IDVENDOR_FTDI)
+		cgusb->usb_type = USB_TYPE_FTDI;
+
+	cgusb->ident = found->ident;
+
+	cgusb->descriptor = cgcalloc(1, sizeof(*(cgusb->descriptor)));
+	cgusb->descriptor->bcdUSB = 0x0200;
+	cgusb->descriptor->idVendor = found->idVendor;
+	cgusb->descriptor->idProduct = found->idProduct;
+	cgusb->usbver = cgusb->descriptor->bcdUSB;
+
+	cgusb->prod_string = found->iProduct ? strdup(found->iProduct) : (char *)BLANK;
+	cgusb->manuf_string = found->iManufacturer ? strdup(found->iManufacturer) : (char *)BLANK;
+	snprintf(buf, sizeof(buf), "SIM%04d", sim->id + 1);
+	cgusb->serial_string = strdup(buf);
+
+	mutex_lock(&sim->lock);
+	sim->inuse = true;
+	sim->ftdi = (cgusb->usb_type == USB_TYPE_FTDI);
+	mutex_unlock(&sim->lock);
+	cgusb->sim = sim;
+
+	applog(LOG_DEBUG,
+		"USB init - %s device %s prod='%s' manuf='%s' serial='%s'",
+		found->name, cgpu->device_path, cgusb->prod_string,
+		cgusb->manuf_string, cgusb->serial_string);
+
+	cgpu->usbdev = cgusb;
+	cgpu->usbinfo.nodev = false;
+
+	if (strcasecmp(cgpu->drv->name, found->name)) {
+		if (!cgpu->drv->copy)
+			cgpu->drv = copy_drv(cgpu->drv);
+		cgpu->drv->name = (char *)(found->name);
+	}
+
+	DEVWUNLOCK(cgpu, pstate);
+
+	return USB_INIT_OK;
+}
+
 static int _usb_init(struct cgpu_info *cgpu, struct libusb_device *dev, struct usb_find_devices *found)
 {
 	unsigned char man[STRBUFLEN+1], prod[STRBUFLEN+1];
@@ -2478,6 +3176,9 @@ static int _usb_init(struct cgpu_info *cgpu, struct libusb_device *dev, struct u
 	int bad = USB_INIT_FAIL;
 	int cfg, claimed = 0, i;
 
+	if (usb_sim_pending && !dev)
+		return usb_sim_init(cgpu, found);
+
 	DEVWLOCK(cgpu, pstate);
 
 	cgpu->usbinfo.bus_number = libusb_get_bus_number(dev);
@@ -2947,6 +3648,56 @@ static struct usb_find_devices *usb_check(__maybe_unused struct device_drv *drv,
 	return NULL;
 }
 
+/* Simulated devices are offered to the driver before any real ones and
+ * come back through hotplug after a release like real devices */
+static bool usb_sim_detect(struct device_drv *drv, struct cgpu_info *(*device_detect)(struct libusb_device *, struct usb_find_devices *),
+			   bool single)
+{
+	struct usb_find_devices *found;
+	struct cgpu_info *cgpu;
+	struct usb_sim *sim;
+	bool inuse;
+	int i, j;
+
+	for (i = 0; i < usb_sim_count; i++) {
+		if (total_count >= total_limit
+		||  drv_count[drv->drv_id].count >= drv_count[drv->drv_id].limit)
+			break;
+
+		sim = usb_sims[i];
+		mutex_lock(&sim->lock);
+		inuse = sim->inuse;
+		mutex_unlock(&sim->lock);
+		if (inuse || is_in_use_bd(USB_SIM_BUS, sim->id + 1))
+			continue;
+
+		for (j = 0; find_dev[j].drv != DRIVER_MAX; j++)
+			if (find_dev[j].drv == drv->drv_id && find_dev[j].ident == sim->type->ident)
+				break;
+		if (find_dev[j].drv == DRIVER_MAX)
+			continue;
+
+		found = cgmalloc(sizeof(*found));
+		cg_memcpy(found, &(find_dev[j]), sizeof(*found));
+
+		usb_sim_reset(sim);
+		usb_sim_pending = sim;
+		cgpu = device_detect(NULL, found);
+		usb_sim_pending = NULL;
+		free(found);
+
+		if (cgpu) {
+			cgpu->usbinfo.initialised = true;
+			total_count++;
+			drv_count[drv->drv_id].count++;
+			if (single)
+				return true;
+		}
+	}
+
+	return false;
+}
+
 void __usb_detect(struct device_drv *drv, struct cgpu_info *(*device_detect)(struct libusb_device *, struct usb_find_devices *),
 		  bool single)
 {
@@ -2969,6 +3720,12 @@ void __usb_detect(struct device_drv *drv, struct cgpu_info *(*device_detect)(str
 		return;
 	}
 
+	if (usb_sim_count && usb_sim_detect(drv, device_detect, single))
+		return;
+
+	if (usb_nolibusb)
+		return;
+
 	count = libusb_get_device_list(NULL, &list);
 	if (count < 0) {
 		applog(LOG_DEBUG, "USB scan devices: failed, err %d", (int)count);
@@ -3172,6 +3929,21 @@ void update_usb_stats(__maybe_unused struct cgpu_info *cgpu)
 
 	// we don't know the device_id until after add_cgpu()
 	usb_stats[cgpu->usbinfo.usbstat - 1].device_id = cgpu->device_id;
+
+	if (metrics_enabled && !cgpu->usbinfo.m_read) {
+		cgpu->usbinfo.m_read = metric_new(METRIC_HISTOGRAM, "cgminer_usb_transfer_seconds",
+				"Successful USB transfer times",
+				"device=\"%s%d\",dir=\"read\"", cgpu->drv->name, cgpu->device_id);
+		cgpu->usbinfo.m_write = metric_new(METRIC_HISTOGRAM, "cgminer_usb_transfer_seconds",
+				"Successful USB transfer times",
+				"device=\"%s%d\",dir=\"write\"", cgpu->drv->name, cgpu->device_id);
+		cgpu->usbinfo.m_timeouts = metric_new(METRIC_COUNTER, "cgminer_usb_timeouts_total",
+				"USB transfers that timed out",
+				"device=\"%s%d\"", cgpu->drv->name, cgpu->device_id);
+		cgpu->usbinfo.m_errors = metric_new(METRIC_COUNTER, "cgminer_usb_errors_total",
+				"USB transfers that failed",
+				"device=\"%s%d\"", cgpu->drv->name, cgpu->device_id);
+	}
 #endif
 }
 
@@ -3223,12 +3995,18 @@ static void stats(struct cgpu_info *cgpu, struct timeval *tv_start, struct timev
 	switch (err) {
 		case LIBUSB_SUCCESS:
 			item = CMD_CMD;
+			if (mode & (MODE_CTRL_READ | MODE_BULK_READ))
+				metric_observe(cgpu->usbinfo.m_read, (int64_t)(diff * 1000000.0));
+			else
+				metric_observe(cgpu->usbinfo.m_write, (int64_t)(diff * 1000000.0));
 			break;
 		case LIBUSB_ERROR_TIMEOUT:
 			item = CMD_TIMEOUT;
+			metric_add(cgpu->usbinfo.m_timeouts, 1);
 			break;
 		default:
 			item = CMD_ERROR;
+			metric_add(cgpu->usbinfo.m_errors, 1);
 			break;
 	}
 
@@ -3267,6 +4045,8 @@ struct usb_transfer {
 	struct libusb_transfer *transfer;
 	bool cancellable;
 	struct list_head list;
+	/* Only set for async transfers */
+	struct cg_usb_device *usbdev;
 };
 
 bool async_usb_transfers(void)
@@ -3311,6 +4091,7 @@ static void init_usb_transfer(struct usb_transfer *ut)
 		quit(1, "Failed to libusb_alloc_transfer");
 	ut->transfer->user_data = ut;
 	ut->cancellable = false;
+	ut->usbdev = NULL;
 }
 
 static void complete_usb_transfer(struct usb_transfer *ut)
@@ -3444,6 +4225,8 @@ usb_perform_transfer(struct cgpu_info *cgpu, struct cg_usb_device *usbdev, int i
 		err = LIBUSB_ERROR_IO;
 		goto out_fail;
 	}
+	if (usbdev->sim)
+		return usb_sim_transfer(usbdev->sim, intinfo, endpoint, data, length, transferred, timeout);
 	/* Avoid any async transfers during shutdown to allow the polling
 	 * thread to be shut down after all existing transfers are complete */
 	if (opt_lowmem || cgpu->shutdown)
@@ -3531,7 +4314,9 @@ void usb_reset(struct cgpu_info *cgpu)
 	int pstate, err = 0;
 
 	DEVWLOCK(cgpu, pstate);
-	if (!cgpu->usbinfo.nodev)
+	if (!cgpu->usbinfo.nodev && cgpu->usbdev->sim)
+		usb_sim_reset(cgpu->usbdev->sim);
+	else if (!cgpu->usbinfo.nodev)
 	{
 		err = libusb_reset_device(cgpu->usbdev->handle);
 		if (err == LIBUSB_SUCCESS)
@@ -3831,6 +4616,315 @@ out_noerrmsg:
 	return err;
 }
 
+/* Asynchronous bulk transfers. The libusb event thread (USBPoll) only moves
+ * data and, for reads, keeps resubmitting like _usb_read until the buffer is
+ * full or the timeout expires. Finished transfers are queued to a small pool of
+ * worker threads shared by every device which run the driver's callback, so a
+ * callback may block, do sync usb I/O and submit its next async transfer. */
+#define USB_ASYNC_WORKERS 4
+
+struct usb_async {
+	struct usb_transfer ut;
+	struct cgpu_info *cgpu;
+	struct cg_usb_device *usbdev;
+	usb_async_cb cb;
+	void *userdata;
+	bool read;
+	bool ftdi;
+	bool cancellable;
+	int err;
+	int tot;
+	int bufsiz;
+	struct timeval start;
+	struct timeval deadline;
+	struct list_head done;
+	unsigned char xfer[512];
+	unsigned char buf[];
+};
+
+static pthread_mutex_t usb_async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t usb_async_cond = PTHREAD_COND_INITIALIZER;
+static struct list_head usb_async_done = LIST_HEAD_INIT(usb_async_done);
+static bool usb_async_started;
+
+/* The device whose callback this worker is running. Its transfer stays in
+ * async_pending until the callback returns, so usb_async_drain() from here
+ * allows for it and clears this to say the device has gone */
+static __thread struct cg_usb_device *usb_async_self;
+
+static void *usb_async_worker(void __maybe_unused *arg)
+{
+	RenameThread("USBAsync");
+
+	while (42) {
+		struct timeval now;
+		struct usb_async *ua;
+
+		mutex_lock(&usb_async_lock);
+		while (list_empty(&usb_async_done))
+			pthread_cond_wait(&usb_async_cond, &usb_async_lock);
+		ua = list_entry(usb_async_done.next, struct usb_async, done);
+		list_del(&ua->done);
+		mutex_unlock(&usb_async_lock);
+
+		usb_async_self = ua->usbdev;
+		complete_usb_transfer(&ua->ut);
+		// The same metrics stats() keeps for sync transfers
+		cgtime(&now);
+		switch (ua->err) {
+			case LIBUSB_SUCCESS:
+				metric_observe(ua->read ? ua->cgpu->usbinfo.m_read : ua->cgpu->usbinfo.m_write,
+					       (int64_t)us_tdiff(&now, &ua->start));
+				break;
+			case LIBUSB_ERROR_TIMEOUT:
+				metric_add(ua->cgpu->usbinfo.m_timeouts, 1);
+				break;
+			default:
+				metric_add(ua->cgpu->usbinfo.m_errors, 1);
+				break;
+		}
+		/* As with the sync calls, anything but a timeout drops the device */
+		if (NODEV(ua->err)) {
+			applog(LOG_WARNING, "%s %i async usb %s err:(%d) %s", ua->cgpu->drv->name,
+			       ua->cgpu->device_id, ua->read ? "read" : "write", ua->err,
+			       libusb_error_name(ua->err));
+			usb_nodev(ua->cgpu);
+		}
+		ua->cb(ua->cgpu, ua->userdata, ua->err, ua->buf, ua->tot);
+		if (usb_async_self)
+			__atomic_sub_fetch(&usb_async_self->async_pending, 1, __ATOMIC_RELEASE);
+		usb_async_self = NULL;
+		free(ua);
+	}
+
+	return NULL;
+}
+
+static void LIBUSB_CALL async_transfer_callback(struct libusb_transfer *transfer)
+{
+	struct usb_async *ua = transfer->user_data;
+	int got = transfer->actual_length;
+
+	ua->ut.cancellable = false;
+	ua->err = usb_transfer_toerr(transfer->status);
+	if (ua->read) {
+		unsigned char *data = ua->xfer;
+
+		// first 2 bytes returned are an FTDI status
+		if (ua->ftdi) {
+			got -= 2;
+			data += 2;
+		}
+		if (got > ua->bufsiz - ua->tot)
+			got = ua->bufsiz - ua->tot;
+		if (got > 0) {
+			cg_memcpy(ua->buf + ua->tot, data, got);
+			ua->tot += got;
+		}
+		ua->buf[ua->tot] = '\0';
+
+		/* Keep reading until the buffer is full or time runs out */
+		if (!ua->err && ua->tot < ua->bufsiz && !ua->cgpu->shutdown &&
+		    !__atomic_load_n(&ua->usbdev->async_closing, __ATOMIC_ACQUIRE)) {
+			struct timeval now;
+
+			cgtime(&now);
+			if (timercmp(&ua->deadline, &now, >)) {
+				int left = ms_tdiff(&ua->deadline, &now);
+
+				transfer->length = MIN(ua->bufsiz - ua->tot + (ua->ftdi ? 2 : 0),
+						       (int)sizeof(ua->xfer));
+				transfer->timeout = MAX(left, 1);
+				if (!libusb_submit_transfer(transfer)) {
+					ua->ut.cancellable = ua->cancellable;
+					return;
+				}
+			}
+		}
+		/* Timing out is how a read normally ends */
+		if (ua->err == LIBUSB_ERROR_TIMEOUT || ua->tot == ua->bufsiz)
+			ua->err = ua->tot == ua->bufsiz ? LIBUSB_SUCCESS : LIBUSB_ERROR_TIMEOUT;
+	} else
+		ua->tot = got;
+
+	mutex_lock(&usb_async_lock);
+	list_add_tail(&ua->done, &usb_async_done);
+	pthread_cond_signal(&usb_async_cond);
+	mutex_unlock(&usb_async_lock);
+}
+
+static int usb_submit_async(struct cgpu_info *cgpu, int intinfo, int epinfo, bool read,
+			    const char *buf, size_t bufsiz, int timeout, bool cancellable,
+			    usb_async_cb cb, void *userdata)
+{
+	struct cg_usb_device *usbdev;
+	struct usb_epinfo *usb_epinfo;
+	struct usb_async *ua;
+	unsigned char *data;
+	int err, pstate = 0, len;
+	bool own;
+
+	/* Like usb_perform_transfer, no async transfers during shutdown */
+	if (opt_lowmem || cgpu->shutdown)
+		return LIBUSB_ERROR_BUSY;
+
+	if (unlikely(!usb_async_started)) {
+		mutex_lock(&usb_async_lock);
+		if (!usb_async_started) {
+			pthread_t pth;
+			int i;
+
+			for (i = 0; i < USB_ASYNC_WORKERS; i++) {
+				if (unlikely(pthread_create(&pth, NULL, usb_async_worker, NULL)))
+					quit(1, "Failed to create usb_async_worker");
+				pthread_detach(pth);
+			}
+			usb_async_started = true;
+		}
+		mutex_unlock(&usb_async_lock);
+	}
+
+	/* From the device's own callback it can't be released until we return,
+	 * and usb_async_drain() may hold the device lock waiting for us */
+	own = (usb_async_self && usb_async_self == cgpu->usbdev);
+	if (own) {
+		if (__atomic_load_n(&usb_async_self->async_closing, __ATOMIC_SEQ_CST))
+			return LIBUSB_ERROR_NO_DEVICE;
+	} else
+		DEVRLOCK(cgpu, pstate);
+	if (cgpu->usbinfo.nodev) {
+		USB_REJECT(cgpu, read ? MODE_BULK_READ : MODE_BULK_WRITE);
+		err = LIBUSB_ERROR_NO_DEVICE;
+		goto out_unlock;
+	}
+	usbdev = cgpu->usbdev;
+	// the caller falls back to synchronous transfers
+	if (usbdev->sim) {
+		err = LIBUSB_ERROR_NOT_SUPPORTED;
+		goto out_unlock;
+	}
+	if (timeout == DEVTIMEOUT)
+		timeout = usbdev->found->timeout;
+	/* A libusb timeout of 0 would never expire */
+	if (timeout < 1)
+		timeout = 1;
+	if (bufsiz > USB_MAX_READ)
+		quit(1, "%s USB async request %d too large (max=%d)", cgpu->drv->name, (int)bufsiz, USB_MAX_READ);
+
+	ua = cgcalloc(1, sizeof(*ua) + bufsiz + 1);
+	init_usb_transfer(&ua->ut);
+	INIT_LIST_HEAD(&ua->ut.list);
+	ua->ut.usbdev = usbdev;
+	ua->ut.transfer->user_data = ua;
+	ua->cgpu = cgpu;
+	ua->usbdev = usbdev;
+	ua->cb = cb;
+	ua->userdata = userdata;
+	ua->read = read;
+	ua->ftdi = (usbdev->usb_type == USB_TYPE_FTDI);
+	ua->cancellable = cancellable;
+	ua->bufsiz = bufsiz;
+
+	cgtime(&ua->start);
+	if (read) {
+		struct timeval tdiff = {timeout / 1000, (timeout % 1000) * 1000};
+
+		timeradd(&ua->start, &tdiff, &ua->deadline);
+		/* Never ask for more than is wanted so nothing needs buffering */
+		len = MIN(bufsiz + (ua->ftdi ? 2 : 0), sizeof(ua->xfer));
+		data = ua->xfer;
+	} else {
+		cg_memcpy(ua->buf, buf, bufsiz);
+		len = bufsiz;
+		data = ua->buf;
+	}
+
+	usb_epinfo = &(usbdev->found->intinfos[intinfo].epinfos[epinfo]);
+	if (usb_epinfo->att == LIBUSB_TRANSFER_TYPE_INTERRUPT) {
+		libusb_fill_interrupt_transfer(ua->ut.transfer, usbdev->handle, usb_epinfo->ep,
+					       data, len, async_transfer_callback, ua, timeout);
+	} else {
+		libusb_fill_bulk_transfer(ua->ut.transfer, usbdev->handle, usb_epinfo->ep,
+					  data, len, async_transfer_callback, ua, timeout);
+#ifndef HAVE_LIBUSB
+		if (!read && !cgpu->nozlp)
+			ua->ut.transfer->flags |= LIBUSB_TRANSFER_ADD_ZERO_PACKET;
+#endif
+	}
+
+	/* Either usb_async_drain() sees this pending or we see it closing */
+	__atomic_add_fetch(&usbdev->async_pending, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&usbdev->async_closing, __ATOMIC_SEQ_CST))
+		err = LIBUSB_ERROR_NO_DEVICE;
+	else {
+		cg_wlock(&cgusb_fd_lock);
+		err = libusb_submit_transfer(ua->ut.transfer);
+		if (likely(!err)) {
+			ua->ut.cancellable = cancellable;
+			list_add(&ua->ut.list, &ut_list);
+		}
+		cg_wunlock(&cgusb_fd_lock);
+	}
+	if (unlikely(err)) {
+		__atomic_sub_fetch(&usbdev->async_pending, 1, __ATOMIC_RELEASE);
+		cgsem_destroy(&ua->ut.cgsem);
+		libusb_free_transfer(ua->ut.transfer);
+		free(ua);
+	}
+out_unlock:
+	if (!own)
+		DEVRUNLOCK(cgpu, pstate);
+
+	return err;
+}
+
+/* Starts a read of up to bufsiz bytes that behaves like usb_read_timeout, but
+ * returns at once and calls cb from a usb async worker thread with what was
+ * read. Returns non zero, and never calls cb, if the read can't be started. */
+int _usb_read_async(struct cgpu_info *cgpu, int intinfo, int epinfo, size_t bufsiz, int timeout,
+		    enum usb_cmds __maybe_unused cmd, bool cancellable, usb_async_cb cb, void *userdata)
+{
+	return usb_submit_async(cgpu, intinfo, epinfo, true, NULL, bufsiz, timeout,
+				cancellable, cb, userdata);
+}
+
+/* Starts a single write of buf, calling cb with the amount sent. */
+int _usb_write_async(struct cgpu_info *cgpu, int intinfo, int epinfo, const char *buf, size_t bufsiz,
+		     int timeout, enum usb_cmds __maybe_unused cmd, usb_async_cb cb, void *userdata)
+{
+	return usb_submit_async(cgpu, intinfo, epinfo, false, buf, bufsiz, timeout,
+				false, cb, userdata);
+}
+
+/* Stop any async transfers on usbdev and wait for them, and their driver
+ * callbacks, to complete so the handle can be closed and usbdev freed.
+ * Must not be called from the libusb event thread. */
+static void usb_async_drain(struct cg_usb_device *usbdev)
+{
+	struct usb_transfer *ut;
+	int self = 0;
+
+	// Called from one of usbdev's own callbacks, which can't wait for itself
+	if (usb_async_self == usbdev) {
+		usb_async_self = NULL;
+		self = 1;
+	}
+
+	__atomic_store_n(&usbdev->async_closing, true, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&usbdev->async_pending, __ATOMIC_SEQ_CST) <= self)
+		return;
+
+	cg_rlock(&cgusb_fd_lock);
+	list_for_each_entry(ut, &ut_list, list) {
+		if (ut->usbdev == usbdev)
+			libusb_cancel_transfer(ut->transfer);
+	}
+	cg_runlock(&cgusb_fd_lock);
+
+	while (__atomic_load_n(&usbdev->async_pending, __ATOMIC_ACQUIRE) > self)
+		cgsleep_ms(1);
+}
+
 /* As we do for bulk reads, emulate a sync function for control transfers using
  * our own timeouts that takes the same parameters as libusb_control_transfer.
  */
@@ -3843,6 +4937,14 @@ static int usb_control_transfer(struct cgpu_info *cgpu, libusb_device_handle *de
 	int err, transferred;
 	bool tt = false;
 
+	/* control requests only configure the bridge chip, anything read
+	 * back from it is zeros */
+	if (cgpu->usbdev->sim) {
+		if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN && wLength)
+			memset(buffer, 0, wLength);
+		return wLength;
+	}
+
 	if (unlikely(cgpu->shutdown))
 		return libusb_control_transfer(dev_handle, bmRequestType, bRequest, wValue, wIndex, buffer, wLength, timeout);
 
@@ -4155,6 +5257,9 @@ void usb_cleanup(void)
 
 	cgsleep_ms(10);
 
+	if (usb_sim_count)
+		usb_sim_report(true);
+
 	count = 0;
 	for (i = 0; i < total_devices; i++) {
 		cgpu = devices[i];
@@ -4237,6 +5342,9 @@ void usb_initialise(void)
 
 	cgusb_check_init();
 
+	if (opt_usb_sim && *opt_usb_sim)
+		usb_sim_initialise();
+
 	if (opt_usb_select && *opt_usb_select) {
 		// Absolute device limit
 		if (*opt_usb_select == ':') {
@@ -342,6 +342,9 @@ struct cg_usb_device {
 	uint32_t bufamt;
 	bool usb11; // USB 1.1 flag for convenience
 	bool tt; // Enable the transaction translator
+	int async_pending; // Async transfers in flight
+	bool async_closing;
+	struct usb_sim *sim; // Simulated device, there's no libusb handle
 };
 
 #define USB_NOSTAT 0
@@ -394,6 +397,12 @@ struct cg_usb_info {
 
 	uint64_t tmo_count;
 	struct cg_usb_tmo usb_tmo[USB_TMOS];
+
+	// --api-metrics-port, NULL if disabled
+	struct metric *m_read;
+	struct metric *m_write;
+	struct metric *m_timeouts;
+	struct metric *m_errors;
 };
 
 #define ENUMERATION(a,b) a,
@@ -600,8 +609,15 @@ enum usb_cmds {
 struct device_drv;
 struct cgpu_info;
 
+/* Called from a usb async worker thread when an async transfer completes.
+ * err is LIBUSB_ERROR_TIMEOUT when a read ran out of time, with whatever
+ * arrived before then in buf, \0 terminated. */
+typedef void (*usb_async_cb)(struct cgpu_info *cgpu, void *userdata, int err, unsigned char *buf, int amount);
+
 bool async_usb_transfers(void);
 void cancel_usb_transfers(void);
+extern bool usb_nolibusb;
+
 void usb_all(int level);
 void usb_list(void);
 const char *usb_cmdname(enum usb_cmds cmd);
@@ -623,6 +639,8 @@ void update_usb_stats(struct cgpu_info *cgpu);
 void usb_reset(struct cgpu_info *cgpu);
 int _usb_read(struct cgpu_info *cgpu, int intinfo, int epinfo, char *buf, size_t bufsiz, int *processed, int timeout, const char *end, enum usb_cmds cmd, bool readonce, bool cancellable);
 int _usb_write(struct cgpu_info *cgpu, int intinfo, int epinfo, char *buf, size_t bufsiz, int *processed, int timeout, enum usb_cmds);
+int _usb_read_async(struct cgpu_info *cgpu, int intinfo, int epinfo, size_t bufsiz, int timeout, enum usb_cmds cmd, bool cancellable, usb_async_cb cb, void *userdata);
+int _usb_write_async(struct cgpu_info *cgpu, int intinfo, int epinfo, const char *buf, size_t bufsiz, int timeout, enum usb_cmds cmd, usb_async_cb cb, void *userdata);
 int _usb_transfer(struct cgpu_info *cgpu, uint8_t request_type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint32_t *data, int siz, unsigned int timeout, enum usb_cmds cmd);
 int _usb_transfer_read(struct cgpu_info *cgpu, uint8_t request_type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, char *buf, int bufsiz, int *amount, unsigned int timeout, enum usb_cmds cmd);
 int usb_ftdi_cts(struct cgpu_info *cgpu);
@@ -693,6 +711,15 @@ void initialise_usblocks(void);
 #define usb_read_ep_timeout(cgpu, ep, buf, bufsiz, read, timeout, cmd) \
 	_usb_read(cgpu, DEFAULT_INTINFO, ep, buf, bufsiz, read, timeout, NULL, cmd, false, false)
 
+#define usb_read_async(cgpu, bufsiz, timeout, cmd, cb, userdata) \
+	_usb_read_async(cgpu, DEFAULT_INTINFO, DEFAULT_EP_IN, bufsiz, timeout, cmd, false, cb, userdata)
+
+#define usb_read_async_cancellable(cgpu, bufsiz, timeout, cmd, cb, userdata) \
+	_usb_read_async(cgpu, DEFAULT_INTINFO, DEFAULT_EP_IN, bufsiz, timeout, cmd, true, cb, userdata)
+
+#define usb_write_async(cgpu, buf, bufsiz, cmd, cb, userdata) \
+	_usb_write_async(cgpu, DEFAULT_INTINFO, DEFAULT_EP_OUT, buf, bufsiz, DEVTIMEOUT, cmd, cb, userdata)
+
 #define usb_write(cgpu, buf, bufsiz, wrote, cmd) \
 	_usb_write(cgpu, DEFAULT_INTINFO, DEFAULT_EP_OUT, buf, bufsiz, wrote, DEVTIMEOUT, cmd)
 
@@ -22,6 +22,7 @@
 #endif
 #include <time.h>
 #include <errno.h>
+#include <math.h>
 #include <unistd.h>
 #include <sys/types.h>
 #ifndef WIN32
@@ -302,6 +303,39 @@ void *_cgrealloc(void *ptr, size_t size, const char *file, const char *func, con
 	return ret;
 }
 
+/* Reference counted strings for values shared by many work items. The count
+ * lives in front of the string so the result can be used as a plain char *
+ * but must only be released with shstr_unref. */
+struct shstr {
+	int refs;
+	char str[];
+};
+
+#define shstr_of(S) ((struct shstr *)((S) - offsetof(struct shstr, str)))
+
+char *shstr_dup(const char *s)
+{
+	size_t len = strlen(s) + 1;
+	struct shstr *sh = cgmalloc(sizeof(struct shstr) + len);
+
+	sh->refs = 1;
+	memcpy(sh->str, s, len);
+	return sh->str;
+}
+
+char *shstr_ref(char *s)
+{
+	if (s)
+		__atomic_add_fetch(&shstr_of(s)->refs, 1, __ATOMIC_RELAXED);
+	return s;
+}
+
+void shstr_unref(char *s)
+{
+	if (s && !__atomic_sub_fetch(&shstr_of(s)->refs, 1, __ATOMIC_ACQ_REL))
+		free(shstr_of(s));
+}
+
 struct tq_ent {
 	void			*data;
 	struct list_head	q_node;
@@ -957,34 +991,6 @@ static bool _valid_hex(char *s, const char *file, const char *func, const int li
 
 #define valid_hex(s) _valid_hex(s, __FILE__, __func__, __LINE__)
 
-static bool _valid_ascii(char *s, const char *file, const char *func, const int line)
-{
-	bool ret = false;
-	int i, len;
-
-	if (unlikely(!s)) {
-		applog(LOG_ERR, "Null string passed to valid_ascii from"IN_FMT_FFL, file, func, line);
-		return ret;
-	}
-	len = strlen(s);
-	if (unlikely(!len)) {
-		applog(LOG_ERR, "Zero length string passed to valid_ascii from"IN_FMT_FFL, file, func, line);
-		return ret;
-	}
-	for (i = 0; i < len; i++) {
-		unsigned char idx = s[i];
-
-		if (unlikely(idx < 32 || idx > 126)) {
-			applog(LOG_ERR, "Invalid char 0x%x passed to valid_ascii from"IN_FMT_FFL, idx, file, func, line);
-			return ret;
-		}
-	}
-	ret = true;
-	return ret;
-}
-
-#define valid_ascii(s) _valid_ascii(s, __FILE__, __func__, __LINE__)
-
 static const int b58tobin_tbl[] = {
 	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
 	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
@@ -1237,6 +1243,24 @@ out:
 	return rval;
 }
 
+/* Pops the head of the queue if there is one without waiting */
+void *tq_trypop(struct thread_q *tq)
+{
+	struct tq_ent *ent;
+	void *rval = NULL;
+
+	mutex_lock(&tq->mutex);
+	if (!list_empty(&tq->q)) {
+		ent = list_entry(tq->q.next, struct tq_ent, q_node);
+		rval = ent->data;
+		list_del(&ent->q_node);
+		free(ent);
+	}
+	mutex_unlock(&tq->mutex);
+
+	return rval;
+}
+
 int thr_info_create(struct thr_info *thr, pthread_attr_t *attr, void *(*start) (void *), void *arg)
 {
 	cgsem_init(&thr->sem);
@@ -1914,16 +1938,20 @@ static bool socket_full(struct pool *pool, int wait)
 /* Check to see if Santa's been good to you */
 bool sock_full(struct pool *pool)
 {
-	if (strlen(pool->sockbuf))
+	if (pool->sockbuf_end > pool->sockbuf_start)
 		return true;
 
 	return (socket_full(pool, 0));
 }
 
+/* Received data lives in pool->sockbuf between sockbuf_start and sockbuf_end.
+ * sockbuf_scan marks how far it has been searched for a newline so each byte
+ * is only scanned once, and sockbuf_gen changes whenever data already handed
+ * out as a line may have been overwritten. */
 static void clear_sockbuf(struct pool *pool)
 {
-	if (likely(pool->sockbuf))
-		strcpy(pool->sockbuf, "");
+	pool->sockbuf_start = pool->sockbuf_end = pool->sockbuf_scan = 0;
+	pool->sockbuf_gen++;
 }
 
 static void clear_sock(struct pool *pool)
@@ -1952,36 +1980,71 @@ void ckrecalloc(void **ptr, size_t old, size_t new, const char *file, const char
 		memset(*ptr + old, 0, new - old);
 }
 
-/* Make sure the pool sockbuf is large enough to cope with any coinbase size
- * by reallocing it to a large enough size rounded up to a multiple of RBUFSIZE
- * and zeroing the new memory */
-static void recalloc_sock(struct pool *pool, size_t len)
+/* Make room for a recv of RECVSIZE and a terminating \0 at the end of the
+ * pool sockbuf, first by moving unconsumed data back to the start and then by
+ * growing it to a multiple of RBUFSIZE to cope with any coinbase size. */
+static void reserve_sockbuf(struct pool *pool)
 {
-	size_t old, new;
+	size_t len, new;
 
-	old = strlen(pool->sockbuf);
-	new = old + len + 1;
-	if (new < pool->sockbuf_size)
+	if (pool->sockbuf_size - pool->sockbuf_end > RECVSIZE)
 		return;
-	new = new + (RBUFSIZE - (new % RBUFSIZE));
+
+	len = pool->sockbuf_end - pool->sockbuf_start;
+	if (pool->sockbuf_start) {
+		memmove(pool->sockbuf, pool->sockbuf + pool->sockbuf_start, len);
+		pool->sockbuf_scan -= pool->sockbuf_start;
+		pool->sockbuf_start = 0;
+		pool->sockbuf_end = len;
+		if (pool->sockbuf_size - len > RECVSIZE)
+			return;
+	}
+	new = len + RECVSIZE + 1;
+	new += RBUFSIZE - (new % RBUFSIZE);
 	// Avoid potentially recursive locking
-	// applog(LOG_DEBUG, "Recallocing pool sockbuf to %d", new);
+	// applog(LOG_DEBUG, "Reallocing pool sockbuf to %d", new);
 	pool->sockbuf = cgrealloc(pool->sockbuf, new);
-	memset(pool->sockbuf + old, 0, new - old);
 	pool->sockbuf_size = new;
 }
 
-/* Peeks at a socket to find the first end of line and then reads just that
- * from the socket and returns that as a malloced char */
-char *recv_line(struct pool *pool)
+/* Returns the next complete line in the sockbuf, \0 terminated in place of
+ * its \n, or NULL if there isn't one yet. Empty lines are skipped. */
+static char *sockbuf_line(struct pool *pool, size_t *len)
+{
+	char *buf = pool->sockbuf, *nl;
+
+	while (pool->sockbuf_start < pool->sockbuf_end && buf[pool->sockbuf_start] == '\n')
+		pool->sockbuf_start++;
+	if (pool->sockbuf_scan < pool->sockbuf_start)
+		pool->sockbuf_scan = pool->sockbuf_start;
+
+	nl = memchr(buf + pool->sockbuf_scan, '\n', pool->sockbuf_end - pool->sockbuf_scan);
+	if (!nl) {
+		pool->sockbuf_scan = pool->sockbuf_end;
+		return NULL;
+	}
+	*nl = '\0';
+	buf += pool->sockbuf_start;
+	*len = nl - buf;
+	pool->sockbuf_start = pool->sockbuf_scan = nl - pool->sockbuf + 1;
+	return buf;
+}
+
+/* Reads from the socket until there is a complete line in the pool sockbuf and
+ * returns it in place, without the \n. The line stays valid until the next
+ * read from this pool or until sockbuf_gen changes. */
+char *recv_line_view(struct pool *pool)
 {
-	char *tok, *sret = NULL;
-	ssize_t len, buflen;
+	char *sret = NULL;
+	size_t len = 0;
 	int waited = 0;
 
-	if (!strstr(pool->sockbuf, "\n")) {
+	sret = sockbuf_line(pool, &len);
+	if (!sret) {
 		struct timeval rstart, now;
 
+		/* Data may move so lines handed out before are now invalid */
+		pool->sockbuf_gen++;
 		cgtime(&rstart);
 		if (!socket_full(pool, DEFAULT_SOCKWAIT)) {
 			applog(LOG_DEBUG, "Timed out waiting for data on socket_full");
@@ -1989,12 +2052,10 @@ char *recv_line(struct pool *pool)
 		}
 
 		do {
-			char s[RBUFSIZE];
-			size_t slen;
 			ssize_t n;
 
-			memset(s, 0, RBUFSIZE);
-			n = recv(pool->sock, s, RECVSIZE, 0);
+			reserve_sockbuf(pool);
+			n = recv(pool->sock, pool->sockbuf + pool->sockbuf_end, RECVSIZE, 0);
 			if (!n) {
 				applog(LOG_DEBUG, "Socket closed waiting in recv_line");
 				suspend_stratum(pool);
@@ -2009,28 +2070,16 @@ char *recv_line(struct pool *pool)
 					break;
 				}
 			} else {
-				slen = strlen(s);
-				recalloc_sock(pool, slen);
-				strcat(pool->sockbuf, s);
+				pool->sockbuf_end += n;
+				sret = sockbuf_line(pool, &len);
 			}
-		} while (waited < DEFAULT_SOCKWAIT && !strstr(pool->sockbuf, "\n"));
+		} while (!sret && waited < DEFAULT_SOCKWAIT);
 	}
 
-	buflen = strlen(pool->sockbuf);
-	tok = strtok(pool->sockbuf, "\n");
-	if (!tok) {
+	if (!sret) {
 		applog(LOG_DEBUG, "Failed to parse a \\n terminated string in recv_line");
 		goto out;
 	}
-	sret = strdup(tok);
-	len = strlen(sret);
-
-	/* Copy what's left in the buffer after the \n, including the
-	 * terminating \0 */
-	if (buflen > len + 1)
-		memmove(pool->sockbuf, pool->sockbuf + len + 1, buflen - len + 1);
-	else
-		strcpy(pool->sockbuf, "");
 
 	pool->cgminer_pool_stats.times_received++;
 	pool->cgminer_pool_stats.bytes_received += len;
@@ -2043,6 +2092,56 @@ out:
 	return sret;
 }
 
+/* Reads whatever is waiting on a readable socket into the pool sockbuf
+ * without blocking. Returns false if the connection has gone, in which case
+ * the pool is suspended and its sockbuf cleared. Lines previously returned
+ * by sockbuf_next_line may be moved so must be finished with first. */
+bool recv_sockbuf(struct pool *pool)
+{
+	ssize_t n;
+
+	reserve_sockbuf(pool);
+	n = recv(pool->sock, pool->sockbuf + pool->sockbuf_end, RECVSIZE, MSG_DONTWAIT);
+	if (n > 0) {
+		pool->sockbuf_end += n;
+		return true;
+	}
+	if (n < 0 && sock_blocks())
+		return true;
+
+	applog(LOG_DEBUG, "Socket closed or failed in recv_sockbuf");
+	suspend_stratum(pool);
+	clear_sockbuf(pool);
+	return false;
+}
+
+/* Returns the next complete line already in the pool sockbuf without reading
+ * from the socket, or NULL if there isn't one. */
+char *sockbuf_next_line(struct pool *pool)
+{
+	size_t len;
+	char *sret = sockbuf_line(pool, &len);
+
+	if (!sret)
+		return NULL;
+	pool->cgminer_pool_stats.times_received++;
+	pool->cgminer_pool_stats.bytes_received += len;
+	pool->cgminer_pool_stats.net_bytes_received += len;
+	if (opt_protocol)
+		applog(LOG_DEBUG, "RECVD: %s", sret);
+	return sret;
+}
+
+/* Returns the next line received from the pool as a malloced string */
+char *recv_line(struct pool *pool)
+{
+	char *sret = recv_line_view(pool);
+
+	if (sret)
+		sret = strdup(sret);
+	return sret;
+}
+
 /* Extracts a string value from a json array with error checking. To be used
  * when the value of the string returned is only examined and not to be stored.
  * See json_array_string below */
@@ -2073,8 +2172,6 @@ static char *json_array_string(json_t *val, unsigned int entry)
 	return NULL;
 }
 
-static char *blank_merkle = "0000000000000000000000000000000000000000000000000000000000000000";
-
 #ifdef HAVE_LIBCURL
 static void decode_exit(struct pool *pool, char *cb)
 {
@@ -2328,160 +2425,66 @@ static inline bool configure_stratum_mining(struct pool __maybe_unused *pool)
 }
 #endif
 
-static bool parse_notify(struct pool *pool, json_t *val)
-{
-#ifdef USE_AVALON7
-	static int32_t th_clean_jobs;
-	static struct timeval last_notify;
-	struct timeval current;
-#endif
-	char *job_id, *prev_hash, *coinbase1, *coinbase2, *bbversion, *nbit,
-	     *ntime, header[260];
-	unsigned char *cb1 = NULL, *cb2 = NULL;
-	size_t cb1_len, cb2_len, alloc_len;
-	bool clean, ret = false;
-	int merkles, i;
-	json_t *arr;
-
-	arr = json_array_get(val, 4);
-	if (!arr || !json_is_array(arr))
-		goto out;
-
-	merkles = json_array_size(arr);
-
-	job_id = json_array_string(val, 0);
-	prev_hash = __json_array_string(val, 1);
-	coinbase1 = json_array_string(val, 2);
-	coinbase2 = json_array_string(val, 3);
-	bbversion = __json_array_string(val, 5);
-	nbit = __json_array_string(val, 6);
-	ntime = __json_array_string(val, 7);
-	clean = json_is_true(json_array_get(val, 8));
+/* No pool will ever send a merkle branch anywhere near this deep */
+#define MAX_NOTIFY_MERKLES 64
+
+/* The fields of a mining.notify. Each string has its length alongside as it
+ * may point straight into the received line rather than being \0 terminated */
+struct notify_fields {
+	const char *job_id, *prev_hash, *coinbase1, *coinbase2, *bbversion,
+		   *nbit, *ntime;
+	size_t job_id_len, prev_hash_len, cb1_len, cb2_len, bbversion_len,
+	       nbit_len, ntime_len;
+	const char *merkle[MAX_NOTIFY_MERKLES];
+	size_t merkle_len[MAX_NOTIFY_MERKLES];
+	int merkles;
+	bool clean;
+};
 
-	get_vmask(pool, bbversion);
+static bool hex_view(const char *s, size_t len)
+{
+	size_t i;
 
-	if (!valid_ascii(job_id) || !valid_hex(prev_hash) || !valid_hex(coinbase1) ||
-	    !valid_hex(coinbase2) || !valid_hex(bbversion) || !valid_hex(nbit) ||
-	    !valid_hex(ntime)) {
-		/* Annoying but we must not leak memory */
-		free(job_id);
-		free(coinbase1);
-		free(coinbase2);
-		goto out;
+	if (len % 2)
+		return false;
+	for (i = 0; i < len; i++) {
+		if (unlikely(hex2bin_tbl[(unsigned char)s[i]] < 0))
+			return false;
 	}
+	return true;
+}
 
-	cg_wlock(&pool->data_lock);
-	free(pool->swork.job_id);
-	pool->swork.job_id = job_id;
-	if (memcmp(pool->prev_hash, prev_hash, 64)) {
-		pool->swork.clean = true;
-	} else {
-		pool->swork.clean = clean;
-	}
-	snprintf(pool->prev_hash, 65, "%s", prev_hash);
-	cb1_len = strlen(coinbase1) / 2;
-	cb2_len = strlen(coinbase2) / 2;
-	snprintf(pool->bbversion, 9, "%s", bbversion);
-	snprintf(pool->nbit, 9, "%s", nbit);
-	snprintf(pool->ntime, 9, "%s", ntime);
-	if (pool->next_diff > 0) {
-		pool->sdiff = pool->next_diff;
-		pool->next_diff = pool->diff_after;
-		pool->diff_after = 0;
-	}
-	alloc_len = pool->coinbase_len = cb1_len + pool->n1_len + pool->n2size + cb2_len;
-	pool->nonce2_offset = cb1_len + pool->n1_len;
+static bool ascii_view(const char *s, size_t len)
+{
+	size_t i;
 
-	for (i = 0; i < pool->merkles; i++)
-		free(pool->swork.merkle_bin[i]);
-	if (merkles) {
-		pool->swork.merkle_bin = cgrealloc(pool->swork.merkle_bin,
-						   sizeof(char *) * merkles + 1);
-		for (i = 0; i < merkles; i++) {
-			char *merkle = json_array_string(arr, i);
-
-			pool->swork.merkle_bin[i] = cgmalloc(32);
-			if (opt_protocol)
-				applog(LOG_DEBUG, "merkle %d: %s", i, merkle);
-			ret = hex2bin(pool->swork.merkle_bin[i], merkle, 32);
-			free(merkle);
-			if (unlikely(!ret)) {
-				applog(LOG_ERR, "Failed to convert merkle to merkle_bin in parse_notify");
-				goto out_unlock;
-			}
-		}
+	if (!len)
+		return false;
+	for (i = 0; i < len; i++) {
+		if (unlikely(s[i] < 32 || s[i] > 126))
+			return false;
 	}
-	pool->merkles = merkles;
-	if (pool->merkles < 2)
-		pool->bad_work++;
-	if (clean)
-		pool->nonce2 = 0;
-#if 0
-	header_len = 		 strlen(pool->bbversion) +
-				 strlen(pool->prev_hash);
-	/* merkle_hash */	 32 +
-				 strlen(pool->ntime) +
-				 strlen(pool->nbit) +
-	/* nonce */		 8 +
-	/* workpadding */	 96;
-#endif
-	snprintf(header, 257,
-		"%s%s%s%s%s%s%s",
-		pool->bbversion,
-		pool->prev_hash,
-		blank_merkle,
-		pool->ntime,
-		pool->nbit,
-		"00000000", /* nonce */
-		workpadding);
-
-	ret = hex2bin(pool->header_bin, header, 128);
-	if (unlikely(!ret)) {
-		applog(LOG_ERR, "Failed to convert header to header_bin in parse_notify");
-		goto out_unlock;
-	}
-
-	cb1 = alloca(cb1_len);
-	ret = hex2bin(cb1, coinbase1, cb1_len);
-	if (unlikely(!ret)) {
-		applog(LOG_ERR, "Failed to convert cb1 to cb1_bin in parse_notify");
-		goto out_unlock;
-	}
-	cb2 = alloca(cb2_len);
-	ret = hex2bin(cb2, coinbase2, cb2_len);
-	if (unlikely(!ret)) {
-		applog(LOG_ERR, "Failed to convert cb2 to cb2_bin in parse_notify");
-		goto out_unlock;
-	}
-	free(pool->coinbase);
-	pool->coinbase = cgcalloc(alloc_len, 1);
-	cg_memcpy(pool->coinbase, cb1, cb1_len);
-	if (pool->n1_len)
-		cg_memcpy(pool->coinbase + cb1_len, pool->nonce1bin, pool->n1_len);
-	cg_memcpy(pool->coinbase + cb1_len + pool->n1_len + pool->n2size, cb2, cb2_len);
-	if (opt_debug || opt_decode) {
-		char *cb = bin2hex(pool->coinbase, pool->coinbase_len);
+	return true;
+}
 
-		if (opt_decode)
-			decode_exit(pool, cb);
-		applog(LOG_DEBUG, "Pool %d coinbase %s", pool->pool_no, cb);
-		free(cb);
+/* Like hex2bin but for exactly len bytes of a string already checked with
+ * hex_view so it needs no \0 termination */
+static void hex2bin_view(unsigned char *p, const char *hexstr, size_t len)
+{
+	while (len--) {
+		*p++ = (hex2bin_tbl[(unsigned char)hexstr[0]] << 4) |
+			hex2bin_tbl[(unsigned char)hexstr[1]];
+		hexstr += 2;
 	}
-out_unlock:
-	cg_wunlock(&pool->data_lock);
+}
 
-	if (opt_protocol) {
-		applog(LOG_DEBUG, "job_id: %s", job_id);
-		applog(LOG_DEBUG, "prev_hash: %s", prev_hash);
-		applog(LOG_DEBUG, "coinbase1: %s", coinbase1);
-		applog(LOG_DEBUG, "coinbase2: %s", coinbase2);
-		applog(LOG_DEBUG, "bbversion: %s", bbversion);
-		applog(LOG_DEBUG, "nbit: %s", nbit);
-		applog(LOG_DEBUG, "ntime: %s", ntime);
-		applog(LOG_DEBUG, "clean: %s", clean ? "yes" : "no");
-	}
-	free(coinbase1);
-	free(coinbase2);
+static void notify_post(struct pool *pool, bool clean)
+{
+#ifdef USE_AVALON7
+	static int32_t th_clean_jobs;
+	static struct timeval last_notify;
+	struct timeval current;
+#endif
 
 	/* A notify message is the closest stratum gets to a getwork */
 	pool->getwork_requested++;
@@ -2519,18 +2522,183 @@ out_unlock:
 				th_clean_jobs = 0;
 			}
 		}
+#else
+		(void)clean;
 #endif
 	}
-out:
-	return ret;
 }
 
-static bool parse_diff(struct pool *pool, json_t *val)
+/* Installs a new stratum job. All the hex is decoded straight into buffers
+ * owned by the pool which are only reallocated when they need to grow. */
+static bool __parse_notify(struct pool *pool, struct notify_fields *nf)
+{
+	char bbversion[9];
+	size_t alloc_len;
+	int i;
+
+	if (!ascii_view(nf->job_id, nf->job_id_len) ||
+	    nf->prev_hash_len != 64 || !hex_view(nf->prev_hash, 64) ||
+	    !hex_view(nf->coinbase1, nf->cb1_len) || !hex_view(nf->coinbase2, nf->cb2_len) ||
+	    nf->bbversion_len != 8 || !hex_view(nf->bbversion, 8) ||
+	    nf->nbit_len != 8 || !hex_view(nf->nbit, 8) ||
+	    nf->ntime_len != 8 || !hex_view(nf->ntime, 8)) {
+		applog(LOG_INFO, "Invalid field in mining.notify from pool %d", pool->pool_no);
+		return false;
+	}
+	for (i = 0; i < nf->merkles; i++) {
+		if (nf->merkle_len[i] != 64 || !hex_view(nf->merkle[i], 64)) {
+			applog(LOG_ERR, "Failed to convert merkle to merkle_bin in parse_notify");
+			return false;
+		}
+	}
+
+	if (opt_protocol) {
+		applog(LOG_DEBUG, "job_id: %.*s", (int)nf->job_id_len, nf->job_id);
+		applog(LOG_DEBUG, "prev_hash: %.64s", nf->prev_hash);
+		applog(LOG_DEBUG, "coinbase1: %.*s", (int)nf->cb1_len, nf->coinbase1);
+		applog(LOG_DEBUG, "coinbase2: %.*s", (int)nf->cb2_len, nf->coinbase2);
+		for (i = 0; i < nf->merkles; i++)
+			applog(LOG_DEBUG, "merkle %d: %.64s", i, nf->merkle[i]);
+		applog(LOG_DEBUG, "bbversion: %.8s", nf->bbversion);
+		applog(LOG_DEBUG, "nbit: %.8s", nf->nbit);
+		applog(LOG_DEBUG, "ntime: %.8s", nf->ntime);
+		applog(LOG_DEBUG, "clean: %s", nf->clean ? "yes" : "no");
+	}
+
+	cg_memcpy(bbversion, nf->bbversion, 8);
+	bbversion[8] = '\0';
+	get_vmask(pool, bbversion);
+
+	cg_wlock(&pool->data_lock);
+	__atomic_add_fetch(&pool->swork_gen, 1, __ATOMIC_RELEASE);
+	cgtime(&pool->tv_notify);
+	pool->notify_timed = false;
+	pool->cb_prehashed = false;
+	if (!pool->swork.job_id || nf->job_id_len > pool->job_id_size) {
+		free(pool->swork.job_id);
+		pool->swork.job_id = cgmalloc(nf->job_id_len + 1);
+		pool->job_id_size = nf->job_id_len;
+	}
+	cg_memcpy(pool->swork.job_id, nf->job_id, nf->job_id_len);
+	pool->swork.job_id[nf->job_id_len] = '\0';
+	if (memcmp(pool->prev_hash, nf->prev_hash, 64)) {
+		pool->swork.clean = true;
+	} else {
+		pool->swork.clean = nf->clean;
+	}
+	cg_memcpy(pool->prev_hash, nf->prev_hash, 64);
+	pool->prev_hash[64] = '\0';
+	snprintf(pool->bbversion, 9, "%s", bbversion);
+	cg_memcpy(pool->nbit, nf->nbit, 8);
+	pool->nbit[8] = '\0';
+	cg_memcpy(pool->ntime, nf->ntime, 8);
+	pool->ntime[8] = '\0';
+	if (pool->next_diff > 0) {
+		pool->sdiff = pool->next_diff;
+		pool->next_diff = pool->diff_after;
+		pool->diff_after = 0;
+	}
+	alloc_len = pool->coinbase_len = nf->cb1_len / 2 + pool->n1_len + pool->n2size + nf->cb2_len / 2;
+	pool->nonce2_offset = nf->cb1_len / 2 + pool->n1_len;
+
+	if (nf->merkles > pool->merkle_size) {
+		pool->merkle_store = cgrealloc(pool->merkle_store, 32 * nf->merkles);
+		pool->swork.merkle_bin = cgrealloc(pool->swork.merkle_bin,
+						   sizeof(char *) * nf->merkles);
+		pool->merkle_size = nf->merkles;
+		for (i = 0; i < nf->merkles; i++)
+			pool->swork.merkle_bin[i] = pool->merkle_store + 32 * i;
+	}
+	for (i = 0; i < nf->merkles; i++)
+		hex2bin_view(pool->swork.merkle_bin[i], nf->merkle[i], 32);
+	pool->merkles = nf->merkles;
+	if (pool->merkles < 2)
+		pool->bad_work++;
+	if (nf->clean)
+		pool->nonce2 = 0;
+
+	/* version, prev_hash, blank merkle, ntime, nbit, nonce, workpadding */
+	hex2bin_view(pool->header_bin, nf->bbversion, 4);
+	hex2bin_view(pool->header_bin + 4, nf->prev_hash, 32);
+	memset(pool->header_bin + 36, 0, 32);
+	hex2bin_view(pool->header_bin + 68, nf->ntime, 4);
+	hex2bin_view(pool->header_bin + 72, nf->nbit, 4);
+	memset(pool->header_bin + 76, 0, 4);
+	hex2bin_view(pool->header_bin + 80, workpadding, 48);
+
+	if (alloc_len > pool->coinbase_size) {
+		free(pool->coinbase);
+		pool->coinbase = cgcalloc(alloc_len, 1);
+		pool->coinbase_size = alloc_len;
+	}
+	hex2bin_view(pool->coinbase, nf->coinbase1, nf->cb1_len / 2);
+	if (pool->n1_len)
+		cg_memcpy(pool->coinbase + nf->cb1_len / 2, pool->nonce1bin, pool->n1_len);
+	memset(pool->coinbase + pool->nonce2_offset, 0, pool->n2size);
+	hex2bin_view(pool->coinbase + pool->nonce2_offset + pool->n2size, nf->coinbase2,
+		     nf->cb2_len / 2);
+	__gen_coinbase_midstate(pool);
+	if (opt_debug || opt_decode) {
+		char *cb = bin2hex(pool->coinbase, pool->coinbase_len);
+
+		if (opt_decode)
+			decode_exit(pool, cb);
+		applog(LOG_DEBUG, "Pool %d coinbase %s", pool->pool_no, cb);
+		free(cb);
+	}
+	cg_wunlock(&pool->data_lock);
+
+	notify_post(pool, nf->clean);
+	return true;
+}
+
+static bool parse_notify(struct pool *pool, json_t *val)
+{
+	struct notify_fields nf;
+	json_t *arr;
+	int i;
+
+	arr = json_array_get(val, 4);
+	if (!arr || !json_is_array(arr))
+		return false;
+
+	nf.merkles = json_array_size(arr);
+	if (nf.merkles > MAX_NOTIFY_MERKLES)
+		return false;
+	for (i = 0; i < nf.merkles; i++) {
+		nf.merkle[i] = __json_array_string(arr, i);
+		if (!nf.merkle[i])
+			return false;
+		nf.merkle_len[i] = strlen(nf.merkle[i]);
+	}
+
+	nf.job_id = __json_array_string(val, 0);
+	nf.prev_hash = __json_array_string(val, 1);
+	nf.coinbase1 = __json_array_string(val, 2);
+	nf.coinbase2 = __json_array_string(val, 3);
+	nf.bbversion = __json_array_string(val, 5);
+	nf.nbit = __json_array_string(val, 6);
+	nf.ntime = __json_array_string(val, 7);
+	nf.clean = json_is_true(json_array_get(val, 8));
+	if (!nf.job_id || !nf.prev_hash || !nf.coinbase1 || !nf.coinbase2 ||
+	    !nf.bbversion || !nf.nbit || !nf.ntime)
+		return false;
+	nf.job_id_len = strlen(nf.job_id);
+	nf.prev_hash_len = strlen(nf.prev_hash);
+	nf.cb1_len = strlen(nf.coinbase1);
+	nf.cb2_len = strlen(nf.coinbase2);
+	nf.bbversion_len = strlen(nf.bbversion);
+	nf.nbit_len = strlen(nf.nbit);
+	nf.ntime_len = strlen(nf.ntime);
+
+	return __parse_notify(pool, &nf);
+}
+
+static bool __parse_diff(struct pool *pool, double diff)
 {
-	double old_diff, diff;
+	double old_diff;
 
-	diff = json_number_value(json_array_get(val, 0));
-	if (diff <= 0)
+	if (!isfinite(diff) || diff <= 0)
 		return false;
 
 	/* We can only change one diff per notify so assume diffs are being
@@ -2541,6 +2709,10 @@ static bool parse_diff(struct pool *pool, json_t *val)
 	else
 		pool->next_diff = diff;
 	old_diff = pool->sdiff;
+	/* Work generated ahead carries the old sdiff, a gen of 0 still means
+	 * there's been no notify */
+	if (old_diff != diff && pool->swork_gen)
+		__atomic_add_fetch(&pool->swork_gen, 1, __ATOMIC_RELEASE);
 	cg_wunlock(&pool->data_lock);
 
 	if (old_diff != diff) {
@@ -2559,6 +2731,221 @@ static bool parse_diff(struct pool *pool, json_t *val)
 	return true;
 }
 
+static bool parse_diff(struct pool *pool, json_t *val)
+{
+	return __parse_diff(pool, json_number_value(json_array_get(val, 0)));
+}
+
+/* A minimal single pass scanner for the messages a pool sends most often,
+ * mining.notify and mining.set_difficulty, which picks the fields out of the
+ * line in place without building a jansson tree. Anything it doesn't expect,
+ * including escaped strings and non null errors, is left to parse_method. */
+static inline const char *scan_ws(const char *p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+		p++;
+	return p;
+}
+
+static const char *scan_string(const char *p, const char **str, size_t *len)
+{
+	const char *end;
+
+	p = scan_ws(p);
+	if (*p != '"')
+		return NULL;
+	end = strpbrk(++p, "\"\\");
+	if (!end || *end != '"')
+		return NULL;
+	*str = p;
+	*len = end - p;
+	return end + 1;
+}
+
+static const char *scan_value(const char *p)
+{
+	int depth = 0;
+
+	p = scan_ws(p);
+	do {
+		switch (*p) {
+			case '\0':
+				return NULL;
+			case '"':
+				for (p++; *p != '"'; p++) {
+					if (!*p)
+						return NULL;
+					if (*p == '\\' && !*++p)
+						return NULL;
+				}
+				p++;
+				break;
+			case '[':
+			case '{':
+				depth++;
+				p++;
+				break;
+			case ']':
+			case '}':
+				if (--depth < 0)
+					return NULL;
+				p++;
+				break;
+			default:
+				if (!depth) {
+					size_t len = strcspn(p, ",]} \t\r\n");
+
+					/* Bare number or literal */
+					if (!len)
+						return NULL;
+					p += len;
+					break;
+				}
+				p++;
+				break;
+		}
+	} while (depth);
+	return p;
+}
+
+static bool scan_literal(const char *p, const char *lit)
+{
+	size_t len = strlen(lit);
+
+	return !strncmp(p, lit, len) && !isalnum((unsigned char)p[len]);
+}
+
+static const char *scan_notify(const char *p, struct notify_fields *nf)
+{
+	const char **str[] = { &nf->job_id, &nf->prev_hash, &nf->coinbase1, &nf->coinbase2 };
+	size_t *len[] = { &nf->job_id_len, &nf->prev_hash_len, &nf->cb1_len, &nf->cb2_len };
+	int i;
+
+	p = scan_ws(p);
+	if (*p++ != '[')
+		return NULL;
+	for (i = 0; i < 4; i++) {
+		if (!(p = scan_string(p, str[i], len[i])) || *(p = scan_ws(p)) != ',')
+			return NULL;
+		p++;
+	}
+
+	p = scan_ws(p);
+	if (*p++ != '[')
+		return NULL;
+	nf->merkles = 0;
+	p = scan_ws(p);
+	if (*p == ']')
+		p++;
+	else while (42) {
+		if (nf->merkles == MAX_NOTIFY_MERKLES)
+			return NULL;
+		p = scan_string(p, &nf->merkle[nf->merkles], &nf->merkle_len[nf->merkles]);
+		if (!p)
+			return NULL;
+		nf->merkles++;
+		p = scan_ws(p);
+		if (*p == ']') {
+			p++;
+			break;
+		}
+		if (*p++ != ',')
+			return NULL;
+	}
+
+	if (*(p = scan_ws(p)) != ',' ||
+	    !(p = scan_string(p + 1, &nf->bbversion, &nf->bbversion_len)) ||
+	    *(p = scan_ws(p)) != ',' ||
+	    !(p = scan_string(p + 1, &nf->nbit, &nf->nbit_len)) ||
+	    *(p = scan_ws(p)) != ',' ||
+	    !(p = scan_string(p + 1, &nf->ntime, &nf->ntime_len)) ||
+	    *(p = scan_ws(p)) != ',')
+		return NULL;
+	p = scan_ws(p + 1);
+	if (scan_literal(p, "true"))
+		nf->clean = true;
+	else if (scan_literal(p, "false"))
+		nf->clean = false;
+	else
+		return NULL;
+	/* Skip anything a pool appends after clean */
+	p = scan_value(p);
+	while (p && *(p = scan_ws(p)) == ',')
+		p = scan_value(p + 1);
+	if (!p || *p != ']')
+		return NULL;
+	return p + 1;
+}
+
+/* Returns true if it handled the method in s, setting *ret to the result */
+static bool fast_parse_method(struct pool *pool, const char *s, bool *ret)
+{
+	const char *p = s, *key, *method = NULL, *params = NULL;
+	size_t keylen, method_len = 0;
+
+	p = scan_ws(p);
+	if (*p++ != '{')
+		return false;
+	p = scan_ws(p);
+	if (*p == '}')
+		return false;
+	while (42) {
+		if (!(p = scan_string(p, &key, &keylen)))
+			return false;
+		p = scan_ws(p);
+		if (*p++ != ':')
+			return false;
+		p = scan_ws(p);
+		if (keylen == 6 && !strncmp(key, "method", 6)) {
+			if (!(p = scan_string(p, &method, &method_len)))
+				return false;
+		} else {
+			if (keylen == 6 && !strncmp(key, "params", 6))
+				params = p;
+			else if (keylen == 5 && !strncmp(key, "error", 5) && !scan_literal(p, "null"))
+				return false;
+			if (!(p = scan_value(p)))
+				return false;
+		}
+		p = scan_ws(p);
+		if (*p == '}')
+			break;
+		if (*p++ != ',')
+			return false;
+	}
+	if (!method || !params)
+		return false;
+
+	if (method_len == 13 && !strncasecmp(method, "mining.notify", 13)) {
+		struct notify_fields nf;
+
+		if (!scan_notify(params, &nf))
+			return false;
+		*ret = pool->stratum_notify = __parse_notify(pool, &nf);
+		return true;
+	}
+	if (method_len == 21 && !strncasecmp(method, "mining.set_difficulty", 21)) {
+		double diff;
+		char *end;
+
+		p = scan_ws(params);
+		if (*p++ != '[')
+			return false;
+		/* Leave anything but a plain JSON number, e.g. inf, nan or hex
+		 * floats that strtod also takes, to jansson */
+		p = scan_ws(p);
+		if (*p != '-' && !isdigit((unsigned char)*p))
+			return false;
+		diff = strtod(p, &end);
+		if (end == p || *scan_ws(end) != ']' || memchr(p, 'x', end - p) ||
+		    memchr(p, 'X', end - p) || !isfinite(diff))
+			return false;
+		*ret = __parse_diff(pool, diff);
+		return true;
+	}
+	return false;
+}
+
 #ifdef USE_XTRANONCE
 static bool parse_extranonce(struct pool *pool, json_t *val)
 {
@@ -2665,6 +3052,13 @@ static bool parse_reconnect(struct pool *pool, json_t *val)
 	free(tmp);
 	mutex_unlock(&pool->stratum_lock);
 
+#ifdef __linux
+	/* The stratum event loop hands connecting to a worker thread */
+	if (pool->ev_line) {
+		pool->ev_reconnect = true;
+		return true;
+	}
+#endif
 	return restart_stratum(pool);
 }
 
@@ -2747,6 +3141,9 @@ bool parse_method(struct pool *pool, char *s)
 	if (!s)
 		goto out;
 
+	if (fast_parse_method(pool, s, &ret))
+		goto out;
+
 	val = JSON_LOADS(s, &err);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
@@ -3890,6 +4287,176 @@ bool cg_completion_timeout(void *fn, void *fnarg, int timeout)
 	return !ret;
 }
 
+/* The window must not be in use yet, slot is size entries. A time jump of
+ * limit or more intervals, or backwards, empties the window */
+void rollwin_init(struct rollwin *rw, struct rollslot *slot, int size, int width, int limit)
+{
+	memset(rw, 0, sizeof(*rw));
+	memset(slot, 0, sizeof(*slot) * size);
+	rw->slot = slot;
+	rw->size = size;
+	rw->width = width;
+	rw->limit = limit;
+}
+
+/* Any thread: empty the window before the next add. Readers see it empty
+ * from now on */
+void rollwin_wipe(struct rollwin *rw)
+{
+	__atomic_add_fetch(&rw->wipes, 1, __ATOMIC_RELEASE);
+}
+
+static inline void rollwin_write(struct rollwin *rw, bool begin)
+{
+	__atomic_store_n(&rw->seq, rw->seq + 1, begin ? __ATOMIC_RELAXED : __ATOMIC_RELEASE);
+	if (begin)
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void rollwin_clear(struct rollwin *rw, time_t zero)
+{
+	memset(rw->slot, 0, sizeof(*(rw->slot)) * rw->size);
+	rw->zero = zero;
+	rw->offset = 0;
+	rw->last = 0;
+	rw->sum = 0;
+	rw->num = 0;
+	rw->lastt.tv_sec = rw->lastt.tv_usec = 0;
+}
+
+/* Writer only: add value at now, first moving the window along to now and
+ * dropping intervals that fall out of it */
+void rollwin_add(struct rollwin *rw, struct timeval *now, int64_t value)
+{
+	unsigned int wipes = __atomic_load_n(&rw->wipes, __ATOMIC_ACQUIRE);
+	time_t zero, delta;
+	struct rollslot *rs;
+
+	if (unlikely(!rw->size))
+		return;
+
+	zero = now->tv_sec / rw->width;
+
+	rollwin_write(rw, true);
+
+	if (wipes != rw->wiped) {
+		rollwin_clear(rw, zero);
+		rw->wiped = wipes;
+	} else if (rw->zero == 0)
+		rw->zero = zero;
+	else if (rw->zero != zero) {
+		delta = zero - rw->zero;
+		if (delta < 0 || delta >= rw->limit)
+			rollwin_clear(rw, zero);
+		else {
+			/* Usually 1, one iteration per interval of real time
+			 * that passed without an add */
+			rw->zero = zero;
+			do {
+				rw->offset = (rw->offset + 1) % rw->size;
+				rs = &(rw->slot[rw->offset]);
+				rw->sum -= rs->sum;
+				rw->num -= rs->num;
+				memset(rs, 0, sizeof(*rs));
+				if (rw->last < (rw->size - 1))
+					rw->last++;
+			} while (--delta > 0);
+		}
+	}
+
+	rs = &(rw->slot[rw->offset]);
+	if (rs->num == 0) {
+		rs->firstv = value;
+		rs->firstt = *now;
+	} else if (rs->num == 1)
+		rs->minv = rs->maxv = value;
+	else {
+		if (value < rs->minv)
+			rs->minv = value;
+		if (value > rs->maxv)
+			rs->maxv = value;
+	}
+	rs->lastt = *now;
+	rs->sum += value;
+	rs->num++;
+	rw->sum += value;
+	rw->num++;
+	rw->lastt = *now;
+
+	rollwin_write(rw, false);
+}
+
+/* Any thread: a consistent copy of the window as it would be at now, or as at
+ * the last add if now is NULL. slots[0..nslots-1] get the newest intervals,
+ * slots[0] is now's interval. If oldest is set, slots[nslots] also gets the
+ * oldest interval in use */
+void rollwin_snap(struct rollwin *rw, struct timeval *now, struct rollsnap *snap,
+		  struct rollslot *slots, int nslots, int oldest)
+{
+	unsigned int seq;
+	time_t delta;
+	int i, back;
+
+	while (42) {
+		seq = __atomic_load_n(&rw->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+
+		memset(snap, 0, sizeof(*snap));
+		if (slots)
+			memset(slots, 0, sizeof(*slots) * (nslots + (oldest ? 1 : 0)));
+		snap->zero = now ? now->tv_sec / rw->width : rw->zero;
+		if (!rw->size || rw->zero == 0
+		||  __atomic_load_n(&rw->wipes, __ATOMIC_ACQUIRE) != rw->wiped)
+			goto done;
+
+		delta = now ? snap->zero - rw->zero : 0;
+		// an earlier now than the last add is the same interval
+		if (delta < 0) {
+			delta = 0;
+			snap->zero = rw->zero;
+		}
+		if (delta >= rw->limit)
+			goto done;
+
+		/* Drop what would fall out of the window by now without
+		 * touching it, slots up to delta-1 back are still empty */
+		snap->sum = rw->sum;
+		snap->num = rw->num;
+		for (i = 1; i <= delta; i++) {
+			struct rollslot *rs = &(rw->slot[(rw->offset + i) % rw->size]);
+
+			snap->sum -= rs->sum;
+			snap->num -= rs->num;
+		}
+		snap->last = rw->last + delta;
+		if (snap->last > rw->size - 1)
+			snap->last = rw->size - 1;
+		if (snap->num == 0)
+			snap->last = 0;
+		snap->lastt = rw->lastt;
+
+		for (i = 0; slots && i <= nslots; i++) {
+			if (i == nslots) {
+				if (!oldest)
+					break;
+				back = snap->last;
+			} else
+				back = i;
+			if (back < delta || back >= rw->size)
+				continue;
+			back -= delta;
+			slots[i] = rw->slot[(rw->offset - back + rw->size) % rw->size];
+		}
+done:
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (seq == __atomic_load_n(&rw->seq, __ATOMIC_RELAXED))
+			break;
+	}
+}
+
 void _cg_memcpy(void *dest, const void *src, unsigned int n, const char *file, const char *func, const int line)
 {
 	if (unlikely(n < 1 || n > (1ul << 31))) {
@@ -111,6 +111,9 @@ void *_cgrealloc(void *ptr, size_t size, const char *file, const char *func, con
 #define cgmalloc(_size) _cgmalloc(_size, __FILE__, __func__, __LINE__)
 #define cgcalloc(_memb, _size) _cgcalloc(_memb, _size, __FILE__, __func__, __LINE__)
 #define cgrealloc(_ptr, _size) _cgrealloc(_ptr, _size, __FILE__, __func__, __LINE__)
+char *shstr_dup(const char *s);
+char *shstr_ref(char *s);
+void shstr_unref(char *s);
 struct thr_info;
 struct pool;
 enum dev_reason;
@@ -157,11 +160,55 @@ bool stratum_send(struct pool *pool, char *s, ssize_t len);
 bool sock_full(struct pool *pool);
 void ckrecalloc(void **ptr, size_t old, size_t new, const char *file, const char *func, const int line);
 #define recalloc(ptr, old, new) ckrecalloc((void *)&(ptr), old, new, __FILE__, __func__, __LINE__)
+char *recv_line_view(struct pool *pool);
+bool recv_sockbuf(struct pool *pool);
+char *sockbuf_next_line(struct pool *pool);
 char *recv_line(struct pool *pool);
 bool parse_method(struct pool *pool, char *s);
 #ifdef USE_XTRANONCE
 bool subscribe_extranonce(struct pool *pool);
 #endif
+/* Rolling window of per interval totals e.g. nonce diff per second over the
+ * last 5 minutes. Only one thread may add to a window, any thread may wipe
+ * it or read it without a lock, readers retry if they overlap an update */
+struct rollslot {
+	int64_t sum;		// total of the values added
+	int num;		// number of values added
+	int64_t firstv;		// value of the first add
+	int64_t minv, maxv;	// range of the values after the first
+	struct timeval firstt;	// time of the first add
+	struct timeval lastt;	// time of the last add
+};
+
+struct rollwin {
+	unsigned int seq;	// odd while the writer is updating
+	unsigned int wipes;	// wipes requested
+	unsigned int wiped;	// wipes done by the writer
+	int size;		// number of slots
+	int width;		// seconds per slot
+	int limit;		// a time jump of this many slots empties it
+	time_t zero;		// time/width of [offset], 0 = nothing yet
+	int offset;		// slot of the current interval
+	int last;		// number of older slots in use
+	int64_t sum;		// total of all slots
+	int num;
+	struct timeval lastt;	// time of the last add
+	struct rollslot *slot;
+};
+
+struct rollsnap {
+	time_t zero;		// time/width of slots[0]
+	int last;		// number of older slots in use
+	int64_t sum;
+	int num;
+	struct timeval lastt;
+};
+
+void rollwin_init(struct rollwin *rw, struct rollslot *slot, int size, int width, int limit);
+void rollwin_add(struct rollwin *rw, struct timeval *now, int64_t value);
+void rollwin_wipe(struct rollwin *rw);
+void rollwin_snap(struct rollwin *rw, struct timeval *now, struct rollsnap *snap,
+		  struct rollslot *slots, int nslots, int oldest);
 bool extract_sockaddr(char *url, char **sockaddr_url, char **sockaddr_port);
 bool auth_stratum(struct pool *pool);
 bool initiate_stratum(struct pool *pool);